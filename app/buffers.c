@@ -0,0 +1,1165 @@
+//
+// Buffer list: every file open in the editor, and which of them are kept in memory.
+//
+
+#include <sys/stat.h>
+
+#define MAX_OPEN_BUFFERS 64
+#define MAX_RESIDENT_BUFFERS 8
+
+// Kinds of anchors (see anchor.h) kept in a buffer's text
+#define ANCHOR_MARK 0
+#define ANCHOR_BOOKMARK 1
+#define ANCHOR_MACRO 2       // the next line a macro is played on
+
+// Bookmarks looked at in one go when clearing a line's
+#define BOOKMARKS_BATCH 16
+
+// Most changed lines buffer_modified compares with the saved ones; past that, the buffer is taken as modified
+#define MODIFIED_CHECK_LINES 4096
+
+
+/*
+ * OpenBuffer
+ * An entry in the buffer list. Each buffer keeps its own cursor (inside the TextBuffer) and view position.
+ *
+ * Resident buffers hold a TextBuffer. Buffers that were clean and idle the longest get evicted: their TextBuffer
+ * is destroyed and only a line offset index into the file is kept, along with the cursor and view position,
+ * so the buffer can be rebuilt from disk without scanning for newlines when it's switched to again.
+ *
+ * file_path: path to the file
+ * file_name: name displayed in the status line
+ * text: the buffer's contents, or NULL if evicted
+ * saved_version: version of the TextBuffer that was last loaded from or saved to disk, or that has the same lines.
+ *                The buffer is modified when its version is different
+ * modified_version: a version buffer_modified found different from the saved lines
+ * saved_inode, saved_size, saved_mtime: the file as it was when it held the lines of saved_version, so a save can
+ *                                       tell whether anything else changed it since. saved_inode is 0 if unknown
+ * render_start_line, render_start_col: first buffer line (and column, when not wrapping) shown on the screen
+ * last_used: value of the list's clock when the buffer was last active. Used to find the least recently used buffer
+ * mark: anchor at the other end of the region between the mark and the cursor, or NULL. Bookmarks are anchors too,
+ *       found by kind, so they move with the text the same way
+ * compacted, compacted_version: whether idle compaction went over the buffer, and the version it last saw
+ * loader: the loader still reading the file into text, or NULL once the buffer is fully loaded
+ * saver: the saver writing a snapshot of text to the file, or NULL when the buffer isn't being saved
+ * replace: the replace-all searching a snapshot of text, or NULL when there's none running
+ * undo: undoes the last replace-all, while text is still at the version it left
+ * filter: the filter piping lines of text through a command, or NULL when there's none running
+ * cache_current, cache_version: the file's index cache (see cache.c) has the offsets of text's lines as they were
+ *                               at cache_version, so only the position needs updating while text is at that version
+ * index_writer: the job rebuilding the file's index cache, or NULL
+ *
+ * Diffs against the file (see diffs.c):
+ * diff: the diff running in the background, or NULL
+ * hunks: changes from the file to text as it was at hunks_version, hunk_count of them
+ * diffed: hunks has the results of a diff against the file
+ * file_hashes: line hashes of the file from the last diff, reused by the next one if the file hasn't changed
+ * saved_hashes: line hashes of text at saved_hashes_version, saved_line_count of them, taken by a diff that started
+ *               while the buffer was unmodified. buffer_modified compares edited lines with them
+ *
+ * Find (see search.c):
+ * searched: the buffer was searched, so it's worth indexing if it's large
+ * indexer: the job building search_index, or NULL
+ * search_index: trigram index of text as it was at search_version, or NULL
+ *
+ * Grep (see grep.c):
+ * grep_results: the buffer holds the results of a grep rather than a file, so Enter opens the result on its line
+ *               and it isn't saved
+ * grep: the grep whose results are still coming in, or NULL
+ *
+ * Follow mode (see follow.c):
+ * following: whether the buffer picks up what's appended to its file
+ * follow_fd: the file being followed. Kept open so the end of a rotated file can still be read
+ * follow_watch: inotify watch on the file path, -1 if the file was moved or deleted
+ * follow_inode: inode of follow_fd, to tell when the file at the path was replaced
+ * follow_offset: file offset up to which the buffer has the file's contents
+ * follow_partial: the file's last line has no newline yet, so new bytes continue the buffer's last line
+ * follow_changed: an inotify event came in for the file since it was last checked
+ *
+ * Eviction index (only valid when text is NULL):
+ * line_offsets: file offset of the start of each line, line_count + 1 entries. NULL if the buffer was never loaded
+ * line_count: number of lines in line_offsets
+ * cursor_row, cursor_col: cursor position to restore
+ * */
+struct OpenBuffer {
+    char* file_path;
+    char* file_name;
+    TextBuffer* text;
+    unsigned long saved_version;
+    int64_t render_start_line;
+    int64_t render_start_col;
+    unsigned long last_used;
+    Anchor* mark;
+    bool compacted;
+    unsigned long compacted_version;
+    struct Loader* loader;
+    struct Saver* saver;
+    struct Replace* replace;
+    struct LineUndo undo;
+    struct Filter* filter;
+    bool cache_current;
+    unsigned long cache_version;
+    struct IndexWriter* index_writer;
+    unsigned long modified_version;
+    ino_t saved_inode;
+    off_t saved_size;
+    struct timespec saved_mtime;
+
+    struct FileDiff* diff;
+    DiffHunk* hunks;
+    int64_t hunk_count;
+    unsigned long hunks_version;
+    bool diffed;
+    struct FileHashes file_hashes;
+    uint64_t* saved_hashes;
+    int64_t saved_line_count;
+    unsigned long saved_hashes_version;
+
+    bool searched;
+    struct SearchIndexer* indexer;
+    TrigramIndex* search_index;
+    unsigned long search_version;
+
+    bool grep_results;
+    struct Grep* grep;
+
+    bool following;
+    int follow_fd;
+    int follow_watch;
+    ino_t follow_inode;
+    off_t follow_offset;
+    bool follow_partial;
+    bool follow_changed;
+
+    int64_t* line_offsets;
+    int64_t line_count;
+    int64_t cursor_row;
+    int64_t cursor_col;
+};
+
+
+struct BufferList {
+    struct OpenBuffer buffers[MAX_OPEN_BUFFERS];
+    int count;
+    int active;
+    unsigned long clock;
+};
+
+
+/*
+ * Adds a file to the buffer list without loading it. The buffer is loaded when it is first activated.
+ * Returns the index of the buffer, or -1 if the list is full.
+ * If the file is already open, returns the index of the existing buffer.
+ * */
+int buffer_list_add(struct BufferList* list, const char* file_path) {
+
+    for (int i = 0; i < list->count; i++) {
+        if (strcmp(list->buffers[i].file_path, file_path) == 0) {
+            return i;
+        }
+    }
+
+    if (list->count == MAX_OPEN_BUFFERS) {
+        return -1;
+    }
+
+    struct OpenBuffer* ob = &list->buffers[list->count];
+    memset(ob, 0, sizeof(struct OpenBuffer));
+
+    ob->file_path = strdup(file_path);
+    if (ob->file_path == NULL) {
+        return -1;
+    }
+
+    // basename may modify its argument, so give it its own copy
+    char* path_copy = strdup(file_path);
+    if (path_copy == NULL) {
+        free(ob->file_path);
+        return -1;
+    }
+    ob->file_name = strdup(basename(path_copy));
+    free(path_copy);
+
+    if (ob->file_name == NULL) {
+        free(ob->file_path);
+        return -1;
+    }
+
+    return list->count++;
+}
+
+
+/*
+ * Returns whether the buffer changed since it was last loaded or saved. Evicted buffers are never modified.
+ * Edits that were all undone by hand don't count: once a diff has hashed the saved lines, the lines changed since
+ * are compared with them, and a buffer that's back to its saved lines is unmodified again.
+ * */
+bool buffer_modified(struct OpenBuffer* ob) {
+    TextBuffer* text = ob->text;
+    TextBufferChanges changes;
+
+    if (text == NULL || text->version == ob->saved_version) {
+        return false;
+    }
+
+    if (ob->modified_version == text->version) {
+        return true;
+    }
+
+    ob->modified_version = text->version;
+
+    // Lines added or removed since can't be back to the saved lines
+    if (ob->saved_hashes == NULL || ob->saved_hashes_version != ob->saved_version ||
+        TextBufferChangesSince(text, ob->saved_version, &changes) != CHANGES_RANGE || changes.line_delta != 0 ||
+        text->last_line_loc + 1 != ob->saved_line_count || changes.last_row - changes.first_row >= MODIFIED_CHECK_LINES) {
+        return true;
+    }
+
+    for (int64_t row = changes.first_row; row <= changes.last_row && row <= text->last_line_loc; row++) {
+        if (GapBufferHash(text->lines[row]) != ob->saved_hashes[row]) {
+            return true;
+        }
+    }
+
+    ob->saved_version = text->version;
+    ob->saved_hashes_version = text->version;
+    return false;
+}
+
+
+/*
+ * Records st as the buffer's file as it is with the lines of saved_version, or forgets it if st is NULL.
+ * */
+void buffer_set_saved_file(struct OpenBuffer* ob, const struct stat* st) {
+    ob->saved_inode = st != NULL ? st->st_ino : 0;
+    ob->saved_size = st != NULL ? st->st_size : 0;
+    ob->saved_mtime = st != NULL ? st->st_mtim : (struct timespec) {0, 0};
+}
+
+
+/*
+ * Returns whether st is the buffer's file as it was with the lines of saved_version.
+ * */
+bool buffer_file_unchanged(struct OpenBuffer* ob, const struct stat* st) {
+    return ob->saved_inode != 0 && st->st_ino == ob->saved_inode && st->st_size == ob->saved_size &&
+           st->st_mtim.tv_sec == ob->saved_mtime.tv_sec && st->st_mtim.tv_nsec == ob->saved_mtime.tv_nsec;
+}
+
+
+/*
+ * Returns how many lines at the start of the buffer the file open as fd already has as they are: those before the
+ * first line changed since the buffer was loaded or saved. 0 if the file was changed by anything else since, or the
+ * changes can't be told apart.
+ * */
+int64_t buffer_saved_lines(struct OpenBuffer* ob, int fd) {
+    TextBufferChanges changes;
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !buffer_file_unchanged(ob, &st)) {
+        return 0;
+    }
+
+    switch (TextBufferChangesSince(ob->text, ob->saved_version, &changes)) {
+        case CHANGES_NONE: return ob->text->last_line_loc + 1;
+        case CHANGES_RANGE: return changes.first_row;
+        default: return 0;
+    }
+}
+
+
+/*
+ * Frees the results of the buffer's diffs, for when its text goes.
+ * */
+void buffer_clear_diff(struct OpenBuffer* ob) {
+    free(ob->hunks);
+    ob->hunks = NULL;
+    ob->hunk_count = 0;
+    ob->diffed = false;
+    file_hashes_clear(&ob->file_hashes);
+    free(ob->saved_hashes);
+    ob->saved_hashes = NULL;
+    ob->saved_line_count = 0;
+}
+
+
+/*
+ * Starts loading fp on a loader thread and returns as soon as the first batch of lines is in, so the time until
+ * the buffer can be drawn doesn't depend on the size of the file. The rest is appended by buffer_poll_loader.
+ * With the file's cached index, the buffer's position is restored from it, and loading goes on until the lines
+ * around the restored cursor and view are in. The loader takes the index.
+ * Returns the TextBuffer, or NULL if loading couldn't be started (fp is still open then) or failed.
+ * */
+TextBuffer* buffer_load_in_background(struct OpenBuffer* ob, FILE* fp, struct IndexCache* index) {
+    TextBuffer* text = CreateTextBuffer(DEFAULT_CAPACITY, DEFAULT_GAP_BUF_CAP);
+    int64_t wanted = LOADER_FIRST_LINES;
+
+    if (text == NULL) {
+        if (index != NULL) {
+            index_cache_close(index);
+        }
+        return NULL;
+    }
+
+    if (index != NULL) {
+        struct IndexCachePosition* position = &index->header->position;
+
+        ob->cursor_row = position->cursor_row;
+        ob->cursor_col = position->cursor_col;
+        ob->render_start_line = position->render_start_line;
+        ob->render_start_col = position->render_start_col;
+        wanted += position->cursor_row > position->render_start_line ? position->cursor_row
+                                                                     : position->render_start_line;
+    }
+
+    ob->loader = loader_start(fp, index);
+
+    if (ob->loader == NULL) {
+        if (index != NULL) {
+            index_cache_close(index);
+        }
+        DestroyTextBuffer(text);
+        return NULL;
+    }
+
+    loader_wait(ob->loader, wanted);
+
+    int64_t count = loader_take(ob->loader, text);
+
+    // The new buffer's blank line stands in for an empty file; otherwise the file's lines replace it
+    if (count > 0) {
+        TextBufferDeleteLines(text, 0, 1);
+    }
+
+    if (count < 0) {
+        loader_destroy(ob->loader);
+        ob->loader = NULL;
+        DestroyTextBuffer(text);
+        return NULL;
+    }
+
+    return text;
+}
+
+
+/*
+ * Gets where the buffer was left, for its index cache. The view of the active buffer is only up to date in the
+ * buffer once it's been switched away from, or the editor stores it before quitting.
+ * */
+void buffer_position(struct OpenBuffer* ob, struct IndexCachePosition* position) {
+    position->cursor_row = ob->text != NULL ? ob->text->cursorRow : ob->cursor_row;
+    position->cursor_col = ob->text != NULL ? ob->text->cursorCol : ob->cursor_col;
+    position->render_start_line = ob->render_start_line;
+    position->render_start_col = ob->render_start_col;
+}
+
+
+/*
+ * Completion of an index writer job: the cache now matches the buffer as it was when the job started.
+ * */
+void buffer_index_written(struct Job* job) {
+    struct IndexWriter* writer = job->arg;
+    struct OpenBuffer* ob = writer->owner;
+    unsigned long version = writer->version;
+
+    if (index_writer_finish(writer) == 0) {
+        ob->cache_current = true;
+        ob->cache_version = version;
+    }
+
+    ob->index_writer = NULL;
+}
+
+
+/*
+ * Rebuilds the buffer's index cache in the background if the cache is on and the cache file doesn't match the
+ * buffer. Only a fully loaded buffer that matches its file has an index worth keeping.
+ * */
+void buffer_update_index(struct OpenBuffer* ob) {
+    struct IndexCachePosition position;
+
+    if (index_cache_dir == NULL || ob->text == NULL || ob->loader != NULL || ob->index_writer != NULL ||
+        buffer_modified(ob) || (ob->cache_current && ob->cache_version == ob->text->version)) {
+        return;
+    }
+
+    buffer_position(ob, &position);
+    ob->index_writer = index_writer_start(ob->text, ob->file_path, &position, buffer_index_written, ob);
+}
+
+
+/*
+ * Writes the buffer's index cache before it's closed: just the position if the cache file is current, the whole
+ * index otherwise. Buffers that don't match their file are skipped.
+ * */
+void buffer_write_index(struct OpenBuffer* ob) {
+    struct IndexCachePosition position;
+
+    if (index_cache_dir == NULL) {
+        return;
+    }
+
+    if (ob->index_writer != NULL) {
+        buffer_index_written(&ob->index_writer->job);
+    }
+
+    buffer_position(ob, &position);
+
+    if (ob->text == NULL) {
+        if (ob->cache_current) {
+            index_cache_write_position(ob->file_path, &position);
+        } else if (ob->line_offsets != NULL) {
+            index_cache_write(ob->file_path, ob->line_offsets, ob->line_count, &position);
+        }
+        return;
+    }
+
+    if (ob->loader != NULL || buffer_modified(ob)) {
+        return;
+    }
+
+    if (ob->cache_current && ob->cache_version == ob->text->version) {
+        index_cache_write_position(ob->file_path, &position);
+        return;
+    }
+
+    int64_t line_count = ob->text->last_line_loc + 1;
+    int64_t* offsets = malloc(sizeof(int64_t) * (line_count + 1));
+
+    if (offsets != NULL) {
+        TextBufferLineOffsets(ob->text, offsets);
+        index_cache_write(ob->file_path, offsets, line_count, &position);
+        free(offsets);
+    }
+}
+
+
+/*
+ * Takes the lines the buffer's loader built since it was last polled. The buffer stays unmodified if it was.
+ * The loader is destroyed once every line is in.
+ * Returns the number of lines added, or MEM_ERROR if loading failed.
+ * */
+int64_t buffer_poll_loader(struct OpenBuffer* ob) {
+
+    if (ob->loader == NULL) {
+        return 0;
+    }
+
+    bool modified = buffer_modified(ob);
+    int64_t count = loader_take(ob->loader, ob->text);
+
+    if (count >= 0 && !modified) {
+        ob->saved_version = ob->text->version;
+    }
+
+    if (count < 0 || ob->loader->finished) {
+        // A file loaded from an index that held up still has a good index in its cache
+        ob->cache_current = count >= 0 && ob->loader->index != NULL && !ob->loader->stale && !modified;
+        ob->cache_version = ob->text->version;
+
+        loader_destroy(ob->loader);
+        ob->loader = NULL;
+
+        if (count >= 0) {
+            buffer_update_index(ob);
+        }
+    }
+
+    return count;
+}
+
+
+/*
+ * Waits for the buffer's loader to read the rest of the file. Returns 0 or MEM_ERROR.
+ * */
+int buffer_finish_load(struct OpenBuffer* ob) {
+    int64_t count = 0;
+
+    while (ob->loader != NULL && count >= 0) {
+        loader_wait(ob->loader, INT64_MAX);
+        count = buffer_poll_loader(ob);
+    }
+
+    return count < 0 ? MEM_ERROR : 0;
+}
+
+
+/*
+ * Starts saving the buffer to its file in the background (see saver.c); the buffer stays modified until the save
+ * is finished by buffer_finish_save. complete is run on the UI thread when the file is written, and should call
+ * buffer_finish_save; the saver's owner is the buffer.
+ * The file is opened here, so a file that can't be written is reported right away.
+ * Returns 0, -1 if the file can't be opened, or MEM_ERROR.
+ * */
+int buffer_save(struct OpenBuffer* ob, void (*complete)(struct Job*)) {
+
+    // The whole file has to be in before it's written back
+    if (buffer_finish_load(ob) != 0) {
+        return MEM_ERROR;
+    }
+
+    // The file is about to change under the diff
+    if (ob->diff != NULL) {
+        file_diff_destroy(ob->diff);
+        ob->diff = NULL;
+    }
+
+    // Not truncated yet; the saver cuts the file to size once it's written. It's read to check where the lines it
+    // skips end, so a file that can only be written is written in full
+    int fd = open(ob->file_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    bool readable = fd != -1;
+
+    if (fd == -1 && errno == EACCES) {
+        fd = open(ob->file_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    }
+
+    FILE* fp = fd != -1 ? fdopen(fd, "w") : NULL;
+
+    if (fp == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    ob->saver = saver_start(fp, ob->text, readable ? buffer_saved_lines(ob, fd) : 0, complete, ob);
+
+    if (ob->saver == NULL) {
+        fclose(fp);
+        return MEM_ERROR;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Waits for the buffer's save to finish. The buffer is unmodified afterwards unless it was edited during the save:
+ * saved_version is the version that was written, not the current one.
+ * Returns 0, or -2 if the file couldn't be written.
+ * */
+int buffer_finish_save(struct OpenBuffer* ob) {
+
+    if (ob->saver == NULL) {
+        return 0;
+    }
+
+    unsigned long version = ob->saver->version;
+    int64_t size = ob->saver->size;
+    struct stat st = ob->saver->st;
+    int result = saver_finish(ob->saver);
+    ob->saver = NULL;
+
+    // Part of the file may have been written, so it's no longer known to hold any version of the buffer
+    if (result != 0) {
+        buffer_set_saved_file(ob, NULL);
+        return result;
+    }
+
+    ob->saved_version = version;
+    buffer_set_saved_file(ob, &st);
+
+    // The file now holds the buffer; a followed buffer picks up from its end
+    if (ob->following) {
+        ob->follow_offset = size;
+        ob->follow_partial = false;
+    }
+
+    // The file changed, so its index cache is out of date
+    ob->cache_current = false;
+    buffer_update_index(ob);
+
+    return 0;
+}
+
+
+/*
+ * Starts diffing the buffer against its file in the background (see diffs.c), or with against_file false, just
+ * hashing its lines for buffer_modified. complete is run on the UI thread once the diff is done, and should call
+ * buffer_finish_diff; the diff's owner is the buffer.
+ * Returns 0, -1 if the buffer is being saved, or MEM_ERROR.
+ * */
+int buffer_diff(struct OpenBuffer* ob, bool against_file, void (*complete)(struct Job*)) {
+
+    if (ob->saver != NULL) {
+        return -1;
+    }
+
+    // Every line has to be in to be diffed
+    if (buffer_finish_load(ob) != 0) {
+        return MEM_ERROR;
+    }
+
+    ob->diff = file_diff_start(ob->text, against_file ? ob->file_path : NULL, &ob->file_hashes, complete, ob);
+
+    return ob->diff == NULL ? MEM_ERROR : 0;
+}
+
+
+/*
+ * Takes the results of the buffer's diff and frees it. The hunks of a diff against the file replace the last
+ * ones. If the buffer wasn't modified when the diff started, the hashes of its lines become the saved lines
+ * buffer_modified compares with.
+ * Returns the number of hunks, or MEM_ERROR if the diff failed.
+ * */
+int64_t buffer_finish_diff(struct OpenBuffer* ob) {
+    struct FileDiff* diff = ob->diff;
+    int64_t result = MEM_ERROR;
+
+    if (!diff->failed && diff->path != NULL) {
+        free(ob->hunks);
+        ob->hunks = diff->hunks;
+        ob->hunk_count = diff->hunk_count;
+        ob->hunks_version = diff->version;
+        diff->hunks = NULL;
+        ob->diffed = true;
+    }
+
+    // The file's hashes go back to the buffer for the next diff
+    ob->file_hashes = diff->file;
+    memset(&diff->file, 0, sizeof(struct FileHashes));
+
+    if (!diff->failed) {
+        if (diff->version == ob->saved_version) {
+            free(ob->saved_hashes);
+            ob->saved_hashes = diff->lines;
+            ob->saved_line_count = diff->line_count;
+            ob->saved_hashes_version = diff->version;
+            diff->lines = NULL;
+        }
+
+        result = ob->hunk_count;
+    }
+
+    file_diff_destroy(diff);
+    ob->diff = NULL;
+
+    return result;
+}
+
+
+/*
+ * Frees the buffer's search index, for when its text goes or is replaced.
+ * */
+void buffer_clear_search(struct OpenBuffer* ob) {
+
+    if (ob->indexer != NULL) {
+        search_index_destroy(ob->indexer);
+        ob->indexer = NULL;
+    }
+
+    DestroyTrigramIndex(ob->search_index);
+    ob->search_index = NULL;
+}
+
+
+/*
+ * Starts building a search index of the buffer in the background (see search.c), of at most max_bytes. complete is
+ * run on the UI thread once it's built, and should call buffer_finish_index; the indexer's owner is the buffer.
+ * Returns 0, or MEM_ERROR.
+ * */
+int buffer_index(struct OpenBuffer* ob, int64_t max_bytes, void (*complete)(struct Job*)) {
+    ob->indexer = search_index_start(ob->text, max_bytes, complete, ob);
+
+    return ob->indexer == NULL ? MEM_ERROR : 0;
+}
+
+
+/*
+ * Takes the index the buffer's indexer built in place of the last one, and frees the indexer.
+ * Returns the memory the index takes up, -1 if it didn't fit in its limit, or MEM_ERROR.
+ * */
+int64_t buffer_finish_index(struct OpenBuffer* ob) {
+    struct SearchIndexer* indexer = ob->indexer;
+    int64_t result = indexer->full ? -1 : MEM_ERROR;
+
+    if (indexer->index != NULL) {
+        DestroyTrigramIndex(ob->search_index);
+        ob->search_index = indexer->index;
+        ob->search_version = indexer->version;
+        indexer->index = NULL;
+        result = TrigramIndexMemoryUsage(ob->search_index);
+    }
+
+    search_index_destroy(indexer);
+    ob->indexer = NULL;
+
+    return result;
+}
+
+
+/*
+ * Finds the next occurrence of find in the buffer after (row, col), wrapping around, and sets (row, col) to it.
+ * Only the lines the buffer's index can't rule out are searched. *searched is set to the number of lines searched.
+ * Returns 1 if find was found, 0 if it wasn't, or MEM_ERROR.
+ * */
+int buffer_find(struct OpenBuffer* ob, const char* find, int64_t* row, int64_t* col, int64_t* searched) {
+    struct SearchRange* ranges;
+    int64_t len = strlen(find);
+
+    // Every line has to be in to be searched
+    if (buffer_finish_load(ob) != 0) {
+        return MEM_ERROR;
+    }
+
+    ob->searched = true;
+
+    int64_t count = search_ranges(ob->text, ob->search_index, ob->search_version, find, len, &ranges);
+
+    if (count == -1) {
+        return MEM_ERROR;
+    }
+
+    *searched = 0;
+    for (int64_t i = 0; i < count; i++) {
+        *searched += ranges[i].last - ranges[i].first + 1;
+    }
+
+    int result = search_next(ob->text, ranges, count, find, len, row, col);
+    free(ranges);
+
+    return result;
+}
+
+
+/*
+ * Starts searching every file under root for find in the background (see grep.c), with the buffer emptied to take
+ * the results; its name becomes its path, so the search shows in full. done is run on the UI thread once every file
+ * has been searched, and should call buffer_finish_grep; the grep's owner is the buffer.
+ * Returns 0, or MEM_ERROR.
+ * */
+int buffer_grep(struct OpenBuffer* ob, const char* root, const char* find, void (*done)(struct Grep*)) {
+    char* name = strdup(ob->file_path);
+
+    if (name == NULL || TextBufferSpliceLines(ob->text, 0, ob->text->last_line_loc + 1, NULL, 0) != 0) {
+        free(name);
+        return MEM_ERROR;
+    }
+
+    if (ob->grep != NULL) {
+        grep_destroy(ob->grep);
+    }
+
+    free(ob->file_name);
+    ob->file_name = name;
+    ob->grep_results = true;
+    ob->saved_version = ob->text->version;
+    ob->grep = grep_start(root, find, ob->text, done, ob);
+
+    return ob->grep == NULL ? MEM_ERROR : 0;
+}
+
+
+/*
+ * Merges the results the buffer's grep found since it was last polled into the buffer. The buffer stays unmodified
+ * if it was, and a cursor left on the blank last line is taken to the first result.
+ * Returns the number of lines added, or MEM_ERROR if some results were lost.
+ * */
+int64_t buffer_poll_grep(struct OpenBuffer* ob) {
+
+    if (ob->grep == NULL) {
+        return 0;
+    }
+
+    bool unmodified = ob->text->version == ob->saved_version;
+    bool at_end = ob->text->cursorRow == ob->text->last_line_loc;
+    int64_t result = grep_take(ob->grep, ob->text);
+
+    if (result > 0 && unmodified) {
+        ob->saved_version = ob->text->version;
+    }
+
+    if (result > 0 && at_end) {
+        TextBufferMoveCursor(ob->text, 0, 0);
+    }
+
+    return result;
+}
+
+
+/*
+ * Merges the last results of the buffer's grep into it, and frees the grep. *files and *searched are set to the
+ * number of files with a match, and the number searched.
+ * Returns the number of matches, or MEM_ERROR if some results were lost.
+ * */
+int64_t buffer_finish_grep(struct OpenBuffer* ob, int64_t* files, int64_t* searched) {
+    int64_t result = buffer_poll_grep(ob);
+
+    *files = ob->grep->files_matched;
+    *searched = ob->grep->files_searched;
+    result = result == MEM_ERROR || ob->grep->failed ? MEM_ERROR : ob->grep->matches;
+
+    grep_destroy(ob->grep);
+    ob->grep = NULL;
+
+    return result;
+}
+
+
+/*
+ * Starts replacing every occurrence of find in the buffer with `with` in the background (see replace.c).
+ * done is run on the UI thread once the buffer has been searched, and should call buffer_finish_replace; the
+ * replace's owner is the buffer.
+ * Returns 0, or MEM_ERROR.
+ * */
+int buffer_replace(struct OpenBuffer* ob, const char* find, const char* with, void (*done)(struct Replace*)) {
+
+    // Every line has to be in to be searched
+    if (buffer_finish_load(ob) != 0) {
+        return MEM_ERROR;
+    }
+
+    ob->replace = replace_start(ob->text, find, with, done, ob);
+
+    return ob->replace == NULL ? MEM_ERROR : 0;
+}
+
+
+/*
+ * Commits the buffer's replace, as a single change that buffer_undo can undo, and frees it.
+ * Returns the number of matches replaced, or the error of replace_commit.
+ * */
+int64_t buffer_finish_replace(struct OpenBuffer* ob) {
+    int64_t result = replace_commit(ob->replace, ob->text, &ob->undo);
+
+    replace_destroy(ob->replace);
+    ob->replace = NULL;
+
+    return result;
+}
+
+
+/*
+ * Undoes the buffer's last replace-all. Returns 0, or -1 if there's nothing to undo, or the buffer was edited since.
+ * */
+int buffer_undo(struct OpenBuffer* ob) {
+    return line_undo_apply(&ob->undo, ob->text);
+}
+
+
+/*
+ * Starts piping count lines of the buffer, starting at row first, through a shell command in the background (see
+ * filter.c). complete is run on the UI thread once the command has finished, and should call buffer_finish_filter;
+ * the filter's owner is the buffer.
+ * Returns 0, or MEM_ERROR.
+ * */
+int buffer_filter(struct OpenBuffer* ob, int64_t first, int64_t count, const char* command,
+                  void (*complete)(struct Job*)) {
+
+    // The command is given the lines as they are now, so the rest of the file has to be in
+    if (buffer_finish_load(ob) != 0) {
+        return MEM_ERROR;
+    }
+
+    ob->filter = filter_start(ob->text, first, count, command, complete, ob);
+
+    return ob->filter == NULL ? MEM_ERROR : 0;
+}
+
+
+/*
+ * Puts the output of the buffer's filter in place of the lines it was given, and frees it.
+ * Returns the number of lines the command wrote, or the error of filter_commit. *status is set to the command's
+ * exit status.
+ * */
+int64_t buffer_finish_filter(struct OpenBuffer* ob, int* status) {
+    int64_t result = filter_commit(ob->filter, ob->text);
+
+    *status = ob->filter->status;
+    filter_destroy(ob->filter);
+    ob->filter = NULL;
+
+    return result;
+}
+
+
+/*
+ * Loads (or rebuilds) the TextBuffer of an evicted buffer. If the buffer has an eviction index and the file
+ * hasn't changed since the index was taken, the index is used to skip the newline scan. Otherwise the file
+ * is loaded in the background, see buffer_load_in_background.
+ * Returns 0 on success, or MEM_ERROR. A file that can't be opened gives a blank buffer.
+ * */
+int buffer_load(struct OpenBuffer* ob) {
+
+    if (ob->text != NULL) {
+        return 0;
+    }
+
+    // We'll open all files in read mode. If there's no file, we'll just have a blank buffer.
+    // Only when writing to file, will we rewrite or create + write to the file.
+    FILE* fp = fopen(ob->file_path, "r");
+    struct stat st;
+    bool has_stat = fp != NULL && fstat(fileno(fp), &st) == 0;
+
+    // The index is only good for the file as it was when the buffer's lines were loaded or saved
+    bool unchanged = has_stat && buffer_file_unchanged(ob, &st);
+
+    buffer_set_saved_file(ob, has_stat ? &st : NULL);
+
+    if (unchanged && ob->line_offsets != NULL) {
+
+        ob->text = CreateTextBufferFromIndex(fp, ob->line_offsets, ob->line_count);
+
+        // A file changed in a way its stat didn't show. Fall back to reading it from the start.
+        if (ob->text == NULL) {
+            rewind(fp);
+        }
+    }
+
+    // The lines are the same as when the buffer was evicted, so its index cache is as good as it was then. Any other
+    // way of loading finds out once the loader is done
+    if (ob->text != NULL) {
+        ob->cache_version = ob->text->version;
+    } else {
+        ob->cache_current = false;
+    }
+
+    if (ob->text == NULL && fp != NULL) {
+        struct IndexCache* index = ob->line_offsets == NULL ? index_cache_open(ob->file_path, fileno(fp)) : NULL;
+
+        ob->text = buffer_load_in_background(ob, fp, index);
+
+        // The loader owns the file now
+        if (ob->loader != NULL) {
+            fp = NULL;
+        }
+    }
+
+    if (ob->text == NULL) {
+        // CreateTextBufferFromFile handles NULL values so we can just pass fp and check the return
+        ob->text = CreateTextBufferFromFile(fp);
+    }
+
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    free(ob->line_offsets);
+    ob->line_offsets = NULL;
+    ob->line_count = 0;
+
+    if (ob->text == NULL) {
+        return MEM_ERROR;
+    }
+
+    TextBufferMoveCursor(ob->text, ob->cursor_row, ob->cursor_col);
+    ob->saved_version = ob->text->version;
+    ob->modified_version = ob->saved_version;
+    ob->compacted = false;
+    return 0;
+}
+
+
+/*
+ * Sets the mark at the cursor, replacing the one already set.
+ * Returns 0 or MEM_ERROR.
+ * */
+int buffer_set_mark(struct OpenBuffer* ob) {
+
+    if (ob->mark != NULL) {
+        TextBufferRemoveAnchor(ob->text, ob->mark);
+    }
+
+    ob->mark = TextBufferAddAnchor(ob->text, ob->text->cursorRow, ob->text->cursorCol, ANCHOR_MARK);
+
+    return ob->mark != NULL ? 0 : MEM_ERROR;
+}
+
+
+/*
+ * Gets where the mark has moved to and clears it, for commands that use up the region.
+ * Returns false if there's no mark.
+ * */
+bool buffer_take_mark(struct OpenBuffer* ob, int64_t* row, int64_t* col) {
+
+    if (ob->mark == NULL) {
+        return false;
+    }
+
+    TextBufferAnchorPosition(ob->text, ob->mark, row, col);
+    TextBufferRemoveAnchor(ob->text, ob->mark);
+    ob->mark = NULL;
+
+    return true;
+}
+
+
+/*
+ * Bookmarks the cursor's line, or clears its bookmarks if it has any.
+ * Returns 1 if a bookmark was set, 0 if the line's bookmarks were cleared, or MEM_ERROR.
+ * */
+int buffer_toggle_bookmark(struct OpenBuffer* ob) {
+    TextBuffer* text = ob->text;
+    AnchorInfo found[BOOKMARKS_BATCH];
+    int64_t count;
+    bool cleared = false;
+
+    while ((count = TextBufferFindAnchors(text, text->cursorRow, text->cursorRow, ANCHOR_BOOKMARK, found,
+                                          BOOKMARKS_BATCH)) > 0) {
+        for (int64_t i = 0; i < count; i++) {
+            TextBufferRemoveAnchor(text, found[i].anchor);
+        }
+        cleared = true;
+    }
+
+    if (cleared) {
+        return 0;
+    }
+
+    if (TextBufferAddAnchor(text, text->cursorRow, text->cursorCol, ANCHOR_BOOKMARK) == NULL) {
+        return MEM_ERROR;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Finds the first bookmark below the cursor's line, wrapping around to the top of the buffer.
+ * Returns 0 and its position, or -1 if there are no bookmarks.
+ * */
+int buffer_next_bookmark(struct OpenBuffer* ob, int64_t* row, int64_t* col) {
+    TextBuffer* text = ob->text;
+    AnchorInfo found;
+
+    if (TextBufferFindAnchors(text, text->cursorRow + 1, ANCHOR_END_ROW, ANCHOR_BOOKMARK, &found, 1) == 0 &&
+        TextBufferFindAnchors(text, 0, text->cursorRow, ANCHOR_BOOKMARK, &found, 1) == 0) {
+        return -1;
+    }
+
+    *row = found.row;
+    *col = found.col;
+    return 0;
+}
+
+
+/*
+ * Evicts a clean, resident buffer down to its line offset index.
+ * Returns 0 on success, -1 if the buffer can't be evicted (dirty, not resident, still loading, saving, replacing,
+ * filtering, diffing, indexing, grepping or writing its index cache,
+ * followed, holding a mark or bookmarks that would go with its text, or no file on disk) or MEM_ERROR.
+ * */
+int buffer_evict(struct OpenBuffer* ob) {
+    struct stat st;
+
+    if (ob->text == NULL || buffer_modified(ob) || ob->loader != NULL || ob->saver != NULL || ob->replace != NULL ||
+        ob->filter != NULL || ob->diff != NULL || ob->indexer != NULL || ob->index_writer != NULL || ob->grep != NULL ||
+        ob->following || TextBufferCountAnchors(ob->text, 0, ANCHOR_END_ROW) > 0 || stat(ob->file_path, &st) != 0) {
+        return -1;
+    }
+
+    int64_t line_count = ob->text->last_line_loc + 1;
+    int64_t* offsets = malloc(sizeof(int64_t) * (line_count + 1));
+
+    if (offsets == NULL) {
+        return MEM_ERROR;
+    }
+
+    TextBufferLineOffsets(ob->text, offsets);
+
+    // The buffer's lines are the file's while it's as it was when they were loaded or saved. The file's last line may
+    // not end in a newline; any other size means the buffer doesn't match the file
+    if (!buffer_file_unchanged(ob, &st) ||
+        (offsets[line_count] != st.st_size && offsets[line_count] - 1 != st.st_size)) {
+        free(offsets);
+        offsets = NULL;
+        line_count = 0;
+    }
+
+    ob->line_offsets = offsets;
+    ob->line_count = line_count;
+    ob->cursor_row = ob->text->cursorRow;
+    ob->cursor_col = ob->text->cursorCol;
+    ob->cache_current = ob->cache_current && ob->cache_version == ob->text->version;
+
+    DestroyTextBuffer(ob->text);
+    ob->text = NULL;
+    line_undo_clear(&ob->undo);
+    buffer_clear_diff(ob);
+    buffer_clear_search(ob);
+
+    return 0;
+}
+
+
+/*
+ * Evicts the least recently used clean buffers until at most MAX_RESIDENT_BUFFERS are in memory.
+ * Dirty buffers and the active buffer are never evicted, so the limit can be exceeded.
+ * */
+void buffer_list_evict_idle(struct BufferList* list) {
+    int resident = 0;
+
+    for (int i = 0; i < list->count; i++) {
+        resident += list->buffers[i].text != NULL;
+    }
+
+    while (resident > MAX_RESIDENT_BUFFERS) {
+        int lru = -1;
+
+        for (int i = 0; i < list->count; i++) {
+            struct OpenBuffer* ob = &list->buffers[i];
+
+            if (i == list->active || ob->text == NULL || buffer_modified(ob)) {
+                continue;
+            }
+
+            if (lru == -1 || ob->last_used < list->buffers[lru].last_used) {
+                lru = i;
+            }
+        }
+
+        if (lru == -1 || buffer_evict(&list->buffers[lru]) != 0) {
+            break;
+        }
+
+        resident--;
+    }
+}
+
+
+void buffer_list_destroy(struct BufferList* list) {
+
+    for (int i = 0; i < list->count; i++) {
+        struct OpenBuffer* ob = &list->buffers[i];
+
+        // Saves are finished rather than cut short, so quitting doesn't leave half written files
+        buffer_finish_save(ob);
+        buffer_write_index(ob);
+
+        if (ob->loader != NULL) {
+            loader_destroy(ob->loader);
+        }
+
+        if (ob->replace != NULL) {
+            replace_destroy(ob->replace);
+        }
+        line_undo_clear(&ob->undo);
+
+        if (ob->filter != NULL) {
+            filter_destroy(ob->filter);
+        }
+
+        if (ob->diff != NULL) {
+            file_diff_destroy(ob->diff);
+        }
+        buffer_clear_diff(ob);
+        buffer_clear_search(ob);
+
+        if (ob->grep != NULL) {
+            grep_destroy(ob->grep);
+        }
+
+        if (ob->following) {
+            close(ob->follow_fd);
+        }
+
+        if (ob->text != NULL) {
+            DestroyTextBuffer(ob->text);
+        }
+
+        free(ob->line_offsets);
+        free(ob->file_path);
+        free(ob->file_name);
+    }
+
+    list->count = 0;
+}
@@ -0,0 +1,476 @@
+//
+// Index cache: with --index-cache, the line offsets of a file are kept in a sidecar file when the editor quits,
+// along with the cursor and view, so the next time the file is opened it can be loaded without scanning it for
+// newlines, and shows up where it was left. Cache files live in $XDG_CACHE_HOME/ted (~/.cache/ted by default),
+// named after a hash of the file's full path, and are only used while the file's size, mtime, inode and device
+// still match.
+//
+// A cache file is a header, the file's path (padded to 8 bytes), then line_count + 1 offsets as written by
+// TextBufferLineOffsets. It's mapped rather than read, so opening a file with millions of lines costs nothing up
+// front; the loader checks each offset against the file as it goes (see loader_run_indexed).
+//
+
+#include <limits.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_CACHE_MAGIC "tedidx01"
+
+
+/*
+ * IndexCachePosition
+ * Where a buffer was left: its cursor, and the first line (and column) shown.
+ * */
+struct IndexCachePosition {
+    int64_t cursor_row;
+    int64_t cursor_col;
+    int64_t render_start_line;
+    int64_t render_start_col;
+};
+
+
+/*
+ * IndexCacheHeader
+ * The start of a cache file.
+ * checksum: FNV-1a hash of the rest of the header and the path, to catch a truncated or corrupted header
+ * file_size, mtime_sec, mtime_nsec, inode, device: the file the offsets were taken from
+ * line_count: number of lines; there's one more offset than lines
+ * path_len: length of the path that follows the header
+ * */
+struct IndexCacheHeader {
+    char magic[8];
+    uint64_t checksum;
+    int64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t inode;
+    uint64_t device;
+    int64_t line_count;
+    struct IndexCachePosition position;
+    int64_t path_len;
+};
+
+
+/*
+ * IndexCache
+ * A cache file mapped into memory, see index_cache_open.
+ * */
+struct IndexCache {
+    void* map;
+    size_t map_len;
+    struct IndexCacheHeader* header;
+    const int64_t* offsets;
+};
+
+
+// Directory cache files go in, or NULL when the cache is off
+char* index_cache_dir = NULL;
+
+
+/*
+ * Turns the cache on. Cache files go in $XDG_CACHE_HOME/ted, or ~/.cache/ted, which is created if needed.
+ * Returns 0, or -1 if there's no cache directory to use.
+ * */
+int index_cache_init() {
+    const char* base = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    char parent[PATH_MAX];
+
+    if (base != NULL && base[0] == '/') {
+        snprintf(parent, sizeof parent, "%s", base);
+    } else if (home != NULL) {
+        snprintf(parent, sizeof parent, "%s/.cache", home);
+    } else {
+        return -1;
+    }
+
+    size_t len = strlen(parent) + strlen("/ted") + 1;
+    index_cache_dir = malloc(len);
+
+    if (index_cache_dir == NULL) {
+        return -1;
+    }
+
+    snprintf(index_cache_dir, len, "%s/ted", parent);
+    mkdir(parent, 0700);
+
+    if (mkdir(index_cache_dir, 0700) != 0 && errno != EEXIST) {
+        free(index_cache_dir);
+        index_cache_dir = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+uint64_t index_cache_hash(uint64_t hash, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+uint64_t index_cache_checksum(struct IndexCacheHeader* header, const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t skip = offsetof(struct IndexCacheHeader, file_size);
+
+    hash = index_cache_hash(hash, (char*) header + skip, sizeof(struct IndexCacheHeader) - skip);
+    return index_cache_hash(hash, path, header->path_len);
+}
+
+
+/*
+ * Returns the size of the header and path, which is where the offsets start.
+ * */
+size_t index_cache_offsets_start(int64_t path_len) {
+    return sizeof(struct IndexCacheHeader) + ((path_len + 7) & ~7);
+}
+
+
+/*
+ * Returns the full path of file_path (or file_path itself if it can't be resolved), and the path of its cache file
+ * in *cache_path. Both are allocated. Returns NULL if they couldn't be allocated.
+ * */
+char* index_cache_paths(const char* file_path, char** cache_path) {
+    char* full_path = realpath(file_path, NULL);
+
+    if (full_path == NULL && (full_path = strdup(file_path)) == NULL) {
+        return NULL;
+    }
+
+    uint64_t hash = index_cache_hash(14695981039346656037ULL, full_path, strlen(full_path));
+    size_t len = strlen(index_cache_dir) + 32;
+
+    if ((*cache_path = malloc(len)) == NULL) {
+        free(full_path);
+        return NULL;
+    }
+
+    snprintf(*cache_path, len, "%s/%016" PRIx64 ".idx", index_cache_dir, hash);
+    return full_path;
+}
+
+
+/*
+ * Returns whether the header describes the file st is of.
+ * */
+bool index_cache_matches(struct IndexCacheHeader* header, struct stat* st) {
+    return header->file_size == st->st_size && header->mtime_sec == st->st_mtim.tv_sec &&
+           header->mtime_nsec == st->st_mtim.tv_nsec && header->inode == st->st_ino &&
+           header->device == st->st_dev;
+}
+
+
+/*
+ * Maps the cache file of file_path, whose contents are open as fd. A cache file that's for a different version of
+ * the file, or doesn't hold together, is deleted, so it's rebuilt when the file is next closed.
+ * Returns the cache, or NULL if there's no cache file to use.
+ * */
+struct IndexCache* index_cache_open(const char* file_path, int fd) {
+    struct stat file_st;
+    struct stat cache_st;
+    char* cache_path;
+
+    if (index_cache_dir == NULL || fstat(fd, &file_st) != 0 || !S_ISREG(file_st.st_mode)) {
+        return NULL;
+    }
+
+    char* full_path = index_cache_paths(file_path, &cache_path);
+
+    if (full_path == NULL) {
+        return NULL;
+    }
+
+    int cache_fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    void* map = MAP_FAILED;
+
+    if (cache_fd != -1 && fstat(cache_fd, &cache_st) == 0 && cache_st.st_size >= (off_t) sizeof(struct IndexCacheHeader)) {
+        map = mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, cache_fd, 0);
+    }
+
+    if (cache_fd != -1) {
+        close(cache_fd);
+    }
+
+    struct IndexCache* cache = NULL;
+    bool valid = false;
+
+    if (map != MAP_FAILED) {
+        struct IndexCacheHeader* header = map;
+        const char* path = (char*) map + sizeof(struct IndexCacheHeader);
+        size_t len = cache_st.st_size;
+
+        // Checked in an order that never reads past the end of the mapping
+        valid = memcmp(header->magic, INDEX_CACHE_MAGIC, sizeof header->magic) == 0 &&
+                header->path_len == (int64_t) strlen(full_path) &&
+                index_cache_offsets_start(header->path_len) <= len &&
+                header->line_count > 0 &&
+                (size_t) header->line_count < (len - index_cache_offsets_start(header->path_len)) / sizeof(int64_t) &&
+                index_cache_offsets_start(header->path_len) + (header->line_count + 1) * sizeof(int64_t) == len &&
+                header->checksum == index_cache_checksum(header, path) &&
+                memcmp(path, full_path, header->path_len) == 0 &&
+                index_cache_matches(header, &file_st);
+
+        if (valid && (cache = malloc(sizeof(struct IndexCache))) != NULL) {
+            cache->map = map;
+            cache->map_len = len;
+            cache->header = header;
+            cache->offsets = (const int64_t*) ((char*) map + index_cache_offsets_start(header->path_len));
+
+            // Read front to back by the loader
+            madvise(map, len, MADV_SEQUENTIAL);
+        } else {
+            munmap(map, len);
+        }
+    }
+
+    if (!valid) {
+        unlink(cache_path);
+    }
+
+    free(full_path);
+    free(cache_path);
+    return cache;
+}
+
+
+void index_cache_close(struct IndexCache* cache) {
+    munmap(cache->map, cache->map_len);
+    free(cache);
+}
+
+
+/*
+ * Fills in a header for the file at full_path, as it is now. Returns false if the file can't be found, or isn't
+ * line_count lines with the given offsets.
+ * */
+bool index_cache_header(struct IndexCacheHeader* header, const char* full_path, const int64_t* offsets,
+                        int64_t line_count, struct IndexCachePosition* position) {
+    struct stat st;
+
+    if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    // The file's last line may not end in a newline; anything else means the offsets aren't for this file
+    if (offsets[line_count] != st.st_size && offsets[line_count] - 1 != st.st_size) {
+        return false;
+    }
+
+    memset(header, 0, sizeof(struct IndexCacheHeader));
+    memcpy(header->magic, INDEX_CACHE_MAGIC, sizeof header->magic);
+    header->file_size = st.st_size;
+    header->mtime_sec = st.st_mtim.tv_sec;
+    header->mtime_nsec = st.st_mtim.tv_nsec;
+    header->inode = st.st_ino;
+    header->device = st.st_dev;
+    header->line_count = line_count;
+    header->position = *position;
+    header->path_len = strlen(full_path);
+    header->checksum = index_cache_checksum(header, full_path);
+    return true;
+}
+
+
+/*
+ * Writes the cache file of file_path: its line_count lines start at offsets, and it was left at position.
+ * The cache file is written next to the old one and renamed over it, so it's never seen half written.
+ * Returns 0, or -1 if the cache is off, the offsets don't match the file, or the cache file couldn't be written.
+ * */
+int index_cache_write(const char* file_path, const int64_t* offsets, int64_t line_count,
+                      struct IndexCachePosition* position) {
+    struct IndexCacheHeader header;
+    char* cache_path;
+    static const char padding[8] = {0};
+
+    if (index_cache_dir == NULL || line_count <= 0) {
+        return -1;
+    }
+
+    char* full_path = index_cache_paths(file_path, &cache_path);
+
+    if (full_path == NULL) {
+        return -1;
+    }
+
+    size_t temp_len = strlen(cache_path) + 5;
+    char* temp_path = malloc(temp_len);
+    FILE* fp = NULL;
+    bool failed = true;
+
+    if (temp_path != NULL && index_cache_header(&header, full_path, offsets, line_count, position)) {
+        snprintf(temp_path, temp_len, "%s.tmp", cache_path);
+        fp = fopen(temp_path, "w");
+    }
+
+    if (fp != NULL) {
+        size_t padding_len = index_cache_offsets_start(header.path_len) - sizeof header - header.path_len;
+
+        failed = fwrite(&header, sizeof header, 1, fp) != 1 ||
+                 fwrite(full_path, 1, header.path_len, fp) != (size_t) header.path_len ||
+                 fwrite(padding, 1, padding_len, fp) != padding_len ||
+                 fwrite(offsets, sizeof(int64_t), line_count + 1, fp) != (size_t) line_count + 1;
+        failed |= fclose(fp) != 0;
+        failed = failed || rename(temp_path, cache_path) != 0;
+
+        if (failed) {
+            unlink(temp_path);
+        }
+    }
+
+    free(temp_path);
+    free(full_path);
+    free(cache_path);
+    return failed ? -1 : 0;
+}
+
+
+/*
+ * Updates the position kept in the cache file of file_path, when its offsets are still good. Cheaper than writing
+ * the whole cache file again for a file that was only looked at.
+ * Returns 0, or -1 if there's no cache file for the file as it is now.
+ * */
+int index_cache_write_position(const char* file_path, struct IndexCachePosition* position) {
+    struct IndexCacheHeader header;
+    struct stat st;
+    char* cache_path;
+
+    if (index_cache_dir == NULL) {
+        return -1;
+    }
+
+    char* full_path = index_cache_paths(file_path, &cache_path);
+
+    if (full_path == NULL) {
+        return -1;
+    }
+
+    int fd = open(cache_path, O_RDWR | O_CLOEXEC);
+    int result = -1;
+
+    if (fd != -1 && pread(fd, &header, sizeof header, 0) == sizeof header && stat(full_path, &st) == 0 &&
+        memcmp(header.magic, INDEX_CACHE_MAGIC, sizeof header.magic) == 0 &&
+        header.path_len == (int64_t) strlen(full_path) && header.checksum == index_cache_checksum(&header, full_path) &&
+        index_cache_matches(&header, &st)) {
+
+        header.position = *position;
+        header.checksum = index_cache_checksum(&header, full_path);
+        result = pwrite(fd, &header, sizeof header, 0) == sizeof header ? 0 : -1;
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    free(full_path);
+    free(cache_path);
+    return result;
+}
+
+
+/*
+ * IndexWriter
+ * A job writing the cache file of a buffer's file from a snapshot of the buffer, so a missing or stale cache is
+ * rebuilt without holding up the editor.
+ *
+ * job: the writer job. Its completion is given by whoever started it
+ * owner: for the completion, e.g. the buffer whose file it is
+ * snapshot: the lines the offsets are taken from. Released by the job
+ * version: the buffer's version when the snapshot was taken
+ * file_path, position: what the cache file is for, and the position written with it
+ * result: result of index_cache_write, once the job is finished
+ * */
+struct IndexWriter {
+    struct Job job;
+    void* owner;
+    TextBufferSnapshot* snapshot;
+    unsigned long version;
+    char* file_path;
+    struct IndexCachePosition position;
+    int result;
+};
+
+
+void index_writer_run(struct Job* job) {
+    struct IndexWriter* writer = job->arg;
+    TextBufferSnapshot* snapshot = writer->snapshot;
+    int64_t* offsets = malloc(sizeof(int64_t) * (snapshot->line_count + 1));
+
+    writer->result = -1;
+
+    if (offsets != NULL) {
+        offsets[0] = 0;
+        for (int64_t i = 0; i < snapshot->line_count; i++) {
+            offsets[i + 1] = offsets[i] + snapshot->lines[i]->str_len + 1;
+        }
+
+        writer->result = index_cache_write(writer->file_path, offsets, snapshot->line_count, &writer->position);
+        free(offsets);
+    }
+
+    DestroyTextBufferSnapshot(snapshot);
+    writer->snapshot = NULL;
+}
+
+
+/*
+ * Starts a job writing the cache file of file_path, whose contents are text, left at position. complete is run on
+ * the UI thread once it's written, with the writer as the job's arg; it should call index_writer_finish. owner is
+ * stored in the writer for it.
+ * Returns the writer, or NULL if the job couldn't be started.
+ * */
+struct IndexWriter* index_writer_start(TextBuffer* text, const char* file_path, struct IndexCachePosition* position,
+                                       void (*complete)(struct Job*), void* owner) {
+    struct IndexWriter* writer = calloc(1, sizeof(struct IndexWriter));
+
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    writer->owner = owner;
+    writer->position = *position;
+    writer->file_path = strdup(file_path);
+    writer->snapshot = CreateTextBufferSnapshot(text);
+
+    if (writer->file_path == NULL || writer->snapshot == NULL) {
+        if (writer->snapshot != NULL) {
+            DestroyTextBufferSnapshot(writer->snapshot);
+        }
+        free(writer->file_path);
+        free(writer);
+        return NULL;
+    }
+
+    writer->version = writer->snapshot->version;
+    job_init(&writer->job, index_writer_run, complete, writer, NULL);
+
+    if (jobs_submit(&writer->job) != 0) {
+        DestroyTextBufferSnapshot(writer->snapshot);
+        free(writer->file_path);
+        free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+
+/*
+ * Waits for the writer's job to finish and frees the writer.
+ * Returns the result of index_cache_write.
+ * */
+int index_writer_finish(struct IndexWriter* writer) {
+    job_wait(&writer->job);
+
+    int result = writer->result;
+
+    free(writer->file_path);
+    free(writer);
+    return result;
+}
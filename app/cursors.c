@@ -0,0 +1,124 @@
+//
+// Multiple cursors: extra cursors that receive the same edits as the TextBuffer's own cursor.
+//
+
+
+/*
+ * CursorSet
+ * Extra cursors, besides the TextBuffer's own. Cursors are kept as TextBufferEdits so a keystroke can fill in the
+ * edit and hand the whole set to TextBufferApplyEdits, which applies them in one pass per line and returns the new
+ * cursor positions in place.
+ *
+ * cursors: positions of the extra cursors (row, col); the edit fields are only set while applying a keystroke
+ * count: number of extra cursors. 0 when editing with a single cursor
+ * capacity: size of the cursors array
+ * */
+struct CursorSet {
+    TextBufferEdit* cursors;
+    int count;
+    int capacity;
+};
+
+
+int compare_cursors(const void* a, const void* b) {
+    const TextBufferEdit* x = a;
+    const TextBufferEdit* y = b;
+
+    if (x->row != y->row) {
+        return x->row < y->row ? -1 : 1;
+    }
+
+    return x->col < y->col ? -1 : (x->col > y->col);
+}
+
+
+/*
+ * Adds an extra cursor at (row, col). Returns 0 or MEM_ERROR
+ * */
+int cursor_set_add(struct CursorSet* set, int64_t row, int64_t col) {
+
+    if (set->count == set->capacity) {
+        int capacity = set->capacity == 0 ? 16 : set->capacity * 2;
+        TextBufferEdit* cursors = realloc(set->cursors, sizeof(TextBufferEdit) * capacity);
+
+        if (cursors == NULL) {
+            return MEM_ERROR;
+        }
+
+        set->cursors = cursors;
+        set->capacity = capacity;
+    }
+
+    set->cursors[set->count].row = row;
+    set->cursors[set->count].col = col;
+    set->count++;
+
+    return 0;
+}
+
+
+void cursor_set_clear(struct CursorSet* set) {
+    set->count = 0;
+}
+
+
+void cursor_set_destroy(struct CursorSet* set) {
+    free(set->cursors);
+    set->cursors = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
+
+
+/*
+ * Applies the same edit at every extra cursor and at the buffer's cursor, as a single batch:
+ * deletes delete_len characters before each cursor, then inserts text_len characters of text.
+ * Cursors that end up at the same position are merged.
+ *
+ * Returns 0 or MEM_ERROR
+ * */
+int cursor_set_edit(struct CursorSet* set, TextBuffer* buffer, int64_t delete_len, const char* text, int64_t text_len) {
+
+    int err;
+    int64_t primary_row = buffer->cursorRow;
+    int64_t primary_col = buffer->cursorCol;
+
+    // The buffer's cursor joins the batch as the last cursor; sorting puts it in place
+    if ((err = cursor_set_add(set, primary_row, primary_col)) != 0) {
+        return err;
+    }
+
+    qsort(set->cursors, set->count, sizeof(TextBufferEdit), compare_cursors);
+
+    // Merge duplicates so the batch has no two edits at the same position
+    int unique = 0;
+    for (int i = 0; i < set->count; i++) {
+        if (unique > 0 &&
+            set->cursors[unique - 1].row == set->cursors[i].row &&
+            set->cursors[unique - 1].col == set->cursors[i].col) {
+            continue;
+        }
+        set->cursors[unique++] = set->cursors[i];
+    }
+    set->count = unique;
+
+    int primary = 0;
+    for (int i = 0; i < set->count; i++) {
+        set->cursors[i].delete_len = delete_len;
+        set->cursors[i].text = text;
+        set->cursors[i].text_len = text_len;
+
+        if (set->cursors[i].row == primary_row && set->cursors[i].col == primary_col) {
+            primary = i;
+        }
+    }
+
+    err = TextBufferApplyEdits(buffer, set->cursors, set->count);
+
+    // Hand the buffer's cursor back and keep the rest as extra cursors
+    TextBufferMoveCursor(buffer, set->cursors[primary].row, set->cursors[primary].col);
+    memmove(set->cursors + primary, set->cursors + primary + 1, sizeof(TextBufferEdit) * (set->count - primary - 1));
+    set->count--;
+
+    return err;
+}
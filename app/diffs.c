@@ -0,0 +1,252 @@
+//
+// Diffs against disk: a job (see jobs.c) hashes the lines of a buffer's file and of a snapshot of the buffer, and
+// diffs the two lists of hashes with DiffLines. Lines keep their hashes until they're edited (see GapBufferHash),
+// and the file's hashes are kept from one diff to the next while the file doesn't change, so diffing again after
+// an edit only hashes the edited lines.
+//
+
+#include <sys/mman.h>
+
+// Lines deleted and inserted before a diff stops looking for the fewest changes, see DiffLines
+#define DIFF_MAX_CHANGES 4096
+// Lines hashed between checks for cancellation
+#define DIFF_CHECK_LINES 65536
+// Lines the file's hash array starts with
+#define DIFF_FIRST_LINES 4096
+
+
+/*
+ * FileHashes
+ * Hashes of the lines of a file, as it was when they were taken.
+ *
+ * hashes: one a line, count of them. NULL if the file wasn't hashed, or doesn't exist
+ * inode, size, mtime: the file's, to tell whether it changed since
+ * */
+struct FileHashes {
+    uint64_t* hashes;
+    int64_t count;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+};
+
+
+/*
+ * FileDiff
+ * A snapshot of a buffer being diffed against its file by a diff job.
+ *
+ * job, token: the job, and its cancellation token
+ * owner: for the completion, e.g. the buffer being diffed
+ * path: the file, or NULL to only hash the snapshot's lines
+ * snapshot: the buffer when the diff started. Released by the job once its lines are hashed
+ * version: the buffer's version when the diff started
+ * file: hashes of the file's lines. The job is given the ones from the last diff, and only hashes the file again
+ *       if it changed since
+ *
+ * Filled in by the job, read once it's finished:
+ * lines: hashes of the snapshot's lines, line_count of them
+ * hunks: the changes from the file to the snapshot, hunk_count of them. None without a path
+ * failed: the job ran out of memory, or was cancelled
+ * */
+struct FileDiff {
+    struct Job job;
+    struct JobToken token;
+    void* owner;
+    char* path;
+    TextBufferSnapshot* snapshot;
+    unsigned long version;
+    struct FileHashes file;
+
+    uint64_t* lines;
+    int64_t line_count;
+    DiffHunk* hunks;
+    int64_t hunk_count;
+    bool failed;
+};
+
+
+/*
+ * Frees a file's hashes, leaving it with none.
+ * */
+void file_hashes_clear(struct FileHashes* file) {
+    free(file->hashes);
+    memset(file, 0, sizeof(struct FileHashes));
+}
+
+
+/*
+ * Hashes the lines of the file open as fd, split the way the loader splits them (see loader.c): each newline ends
+ * a line, the last line may not have one, and an empty file is a single empty line. Hashes taken of the same file
+ * when it was the same size with the same mtime are kept as they are.
+ * Returns false if the file couldn't be read, the hashes couldn't be allocated, or the job was cancelled.
+ * */
+bool file_hash(struct FileHashes* file, int fd, struct Job* job) {
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+
+    if (file->hashes != NULL && file->inode == st.st_ino && file->size == st.st_size &&
+        file->mtime.tv_sec == st.st_mtim.tv_sec && file->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return true;
+    }
+
+    file_hashes_clear(file);
+
+    int64_t size = st.st_size;
+    int64_t capacity = DIFF_FIRST_LINES;
+    uint64_t* hashes = malloc(sizeof(uint64_t) * capacity);
+    char* map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    int64_t count = 0;
+    bool failed = hashes == NULL || map == MAP_FAILED;
+
+    if (map != NULL && map != MAP_FAILED) {
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+
+    for (int64_t pos = 0; !failed && (pos < size || count == 0); count++) {
+        char* newline = pos < size ? memchr(map + pos, '\n', size - pos) : NULL;
+        int64_t end = newline != NULL ? newline - map : size;
+
+        if (count == capacity) {
+            uint64_t* grown = realloc(hashes, sizeof(uint64_t) * capacity * 2);
+
+            if (grown == NULL) {
+                failed = true;
+                break;
+            }
+
+            hashes = grown;
+            capacity *= 2;
+        }
+
+        hashes[count] = GapBufferHashString(map != NULL ? map + pos : "", end - pos);
+        pos = end + 1;
+
+        if (count % DIFF_CHECK_LINES == 0 && job_cancelled(job)) {
+            failed = true;
+        }
+    }
+
+    if (map != NULL && map != MAP_FAILED) {
+        munmap(map, size);
+    }
+
+    if (failed) {
+        free(hashes);
+        return false;
+    }
+
+    file->hashes = hashes;
+    file->count = count;
+    file->inode = st.st_ino;
+    file->size = st.st_size;
+    file->mtime = st.st_mtim;
+
+    return true;
+}
+
+
+/*
+ * The diff job. Hashes the file (unless its hashes are still good) and the snapshot, then diffs them.
+ * A file that doesn't exist has no lines.
+ * */
+void file_diff_run(struct Job* job) {
+    struct FileDiff* diff = job->arg;
+    TextBufferSnapshot* snapshot = diff->snapshot;
+    int fd = diff->path != NULL ? open(diff->path, O_RDONLY | O_CLOEXEC) : -1;
+
+    if (fd != -1) {
+        diff->failed = !file_hash(&diff->file, fd, job);
+        close(fd);
+    } else if (diff->path != NULL) {
+        file_hashes_clear(&diff->file);
+        diff->failed = errno != ENOENT;
+    }
+
+    diff->lines = !diff->failed ? malloc(sizeof(uint64_t) * snapshot->line_count) : NULL;
+    diff->failed |= diff->lines == NULL;
+
+    for (int64_t row = 0; row < snapshot->line_count && !diff->failed; row++) {
+        diff->lines[row] = GapBufferHash(snapshot->lines[row]);
+
+        if (row % DIFF_CHECK_LINES == 0 && job_cancelled(job)) {
+            diff->failed = true;
+        }
+    }
+
+    diff->line_count = snapshot->line_count;
+
+    // Lines edited from now on don't need to be copied
+    DestroyTextBufferSnapshot(snapshot);
+    diff->snapshot = NULL;
+
+    if (!diff->failed && diff->path != NULL) {
+        diff->failed = DiffLines(diff->file.hashes, diff->file.count, diff->lines, diff->line_count,
+                                 DIFF_MAX_CHANGES, &diff->hunks, &diff->hunk_count) != 0;
+    }
+}
+
+
+/*
+ * Starts a job diffing text against the file at path, or just hashing its lines if path is NULL. file holds the
+ * hashes of the last diff of the same file, if any; the job takes them, and file is left empty. complete is run on
+ * the UI thread once the diff is done, with the diff as the job's arg; it should take what it needs and free the
+ * diff with file_diff_destroy. owner is stored in the diff for it.
+ * Returns the diff, or NULL if it couldn't be started (file is left as it was).
+ * */
+struct FileDiff* file_diff_start(TextBuffer* text, const char* path, struct FileHashes* file,
+                                 void (*complete)(struct Job*), void* owner) {
+    struct FileDiff* diff = calloc(1, sizeof(struct FileDiff));
+
+    if (diff == NULL) {
+        return NULL;
+    }
+
+    diff->owner = owner;
+    diff->version = text->version;
+    diff->path = path != NULL ? strdup(path) : NULL;
+    diff->snapshot = CreateTextBufferSnapshot(text);
+
+    if ((path != NULL && diff->path == NULL) || diff->snapshot == NULL) {
+        if (diff->snapshot != NULL) {
+            DestroyTextBufferSnapshot(diff->snapshot);
+        }
+        free(diff->path);
+        free(diff);
+        return NULL;
+    }
+
+    diff->file = *file;
+    job_init(&diff->job, file_diff_run, complete, diff, &diff->token);
+
+    if (jobs_submit(&diff->job) != 0) {
+        DestroyTextBufferSnapshot(diff->snapshot);
+        free(diff->path);
+        free(diff);
+        return NULL;
+    }
+
+    memset(file, 0, sizeof(struct FileHashes));
+    return diff;
+}
+
+
+/*
+ * Stops the diff if it's still running, and frees it along with whatever results weren't taken.
+ * */
+void file_diff_destroy(struct FileDiff* diff) {
+    job_token_cancel(&diff->token);
+    job_wait(&diff->job);
+
+    if (diff->snapshot != NULL) {
+        DestroyTextBufferSnapshot(diff->snapshot);
+    }
+
+    file_hashes_clear(&diff->file);
+    free(diff->lines);
+    free(diff->hunks);
+    free(diff->path);
+    free(diff);
+}
@@ -0,0 +1,459 @@
+//
+// Filters: a range of lines is piped through a shell command by a job (see jobs.c), and replaced with what the
+// command writes out, like vi's `!`. The lines are streamed to the command straight from their gap buffers while its
+// output is read, so neither side waits on the other, and the output is built into lines as it comes in.
+//
+
+#include <signal.h>
+#include <spawn.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+// Bytes read from the command at a time
+#define FILTER_READ_CHUNK (1024 * 1024)
+// Lines written to the command with each writev, at up to 3 iovecs a line (before and after the gap, and the newline)
+#define FILTER_WRITE_LINES 256
+// Lines the output array starts with
+#define FILTER_FIRST_LINES 4096
+// How often a running command checks if it was cancelled, in ms
+#define FILTER_POLL_MS 100
+// How long a command that was told to stop gets to exit before it's killed, in ms
+#define FILTER_KILL_MS 1000
+
+
+/*
+ * Filter
+ * Lines of a snapshot being piped through a command by a filter job.
+ *
+ * job, token: the job running the command, and its cancellation token
+ * owner: for the completion, e.g. the buffer being filtered
+ * snapshot: the buffer when the filter started. Lines first to first + count - 1 are piped through the command
+ * command: run with /bin/sh -c
+ *
+ * Filled in by the job, read once it's finished:
+ * lines: the command's output, line_count lines. lines_capacity is the size of the array
+ * status: the command's exit status (128 + the signal if it was killed), or -1 if it couldn't be started
+ * failed: the job ran out of memory, or couldn't talk to the command
+ * */
+struct Filter {
+    struct Job job;
+    struct JobToken token;
+    void* owner;
+    TextBufferSnapshot* snapshot;
+    int64_t first;
+    int64_t count;
+    char* command;
+
+    GapBuffer** lines;
+    int64_t line_count;
+    int64_t lines_capacity;
+    int status;
+    bool failed;
+};
+
+
+/*
+ * FilterInput
+ * How far the lines have been written to the command: all of line row up to offset (counting its newline).
+ * */
+struct FilterInput {
+    int64_t row;
+    int64_t offset;
+};
+
+
+/*
+ * Writes as much of the filter's lines as the command takes without blocking, starting where input left off.
+ * Returns the number of bytes written, 0 if the command can't take any, or -1 if writing failed.
+ * */
+ssize_t filter_write(struct Filter* filter, int fd, struct FilterInput* input) {
+    struct iovec iov[FILTER_WRITE_LINES * 3];
+    int iov_count = 0;
+    int64_t end = filter->first + filter->count;
+
+    for (int64_t row = input->row; row < end && row < input->row + FILTER_WRITE_LINES; row++) {
+        GapBuffer* line = filter->snapshot->lines[row];
+        int64_t skip = row == input->row ? input->offset : 0;
+        int64_t before = line->gap_loc;
+        int64_t after = line->str_len - line->gap_loc;
+
+        if (skip < before) {
+            iov[iov_count++] = (struct iovec) {line->buffer + skip, before - skip};
+            skip = 0;
+        } else {
+            skip -= before;
+        }
+
+        if (skip < after) {
+            iov[iov_count++] = (struct iovec) {line->buffer + line->gap_loc + line->gap_len + skip, after - skip};
+            skip = 0;
+        } else {
+            skip -= after;
+        }
+
+        iov[iov_count++] = (struct iovec) {"\n", 1};
+    }
+
+    ssize_t written = writev(fd, iov, iov_count);
+
+    if (written == -1) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+
+    // Move past the lines that were written in full
+    int64_t left = written;
+    while (left > 0) {
+        int64_t line_left = filter->snapshot->lines[input->row]->str_len + 1 - input->offset;
+
+        if (left < line_left) {
+            input->offset += left;
+            break;
+        }
+
+        left -= line_left;
+        input->row++;
+        input->offset = 0;
+    }
+
+    return written;
+}
+
+
+/*
+ * Adds a finished line to the filter's output. Returns false if the output couldn't be grown.
+ * */
+bool filter_add_line(struct Filter* filter, GapBuffer* line) {
+
+    if (filter->line_count == filter->lines_capacity) {
+        int64_t capacity = filter->lines_capacity == 0 ? FILTER_FIRST_LINES : filter->lines_capacity * 2;
+        GapBuffer** lines = realloc(filter->lines, sizeof(GapBuffer*) * capacity);
+
+        if (lines == NULL) {
+            return false;
+        }
+
+        filter->lines = lines;
+        filter->lines_capacity = capacity;
+    }
+
+    filter->lines[filter->line_count++] = line;
+    return true;
+}
+
+
+/*
+ * Turns len bytes of the command's output into lines. A line cut off at the end of the chunk is kept in *partial,
+ * and continued by the next chunk. Returns false if a line couldn't be allocated.
+ * */
+bool filter_read(struct Filter* filter, const char* chunk, int64_t len, GapBuffer** partial) {
+    int64_t start = 0;
+
+    while (start < len) {
+        const char* newline = memchr(chunk + start, '\n', len - start);
+        int64_t line_len = (newline != NULL ? newline - chunk : len) - start;
+
+        if (*partial == NULL) {
+            // Sized like a line read from a file, so an output line is no different from a loaded one
+            *partial = CreateGapBuffer(line_len + TextBufferLoadGap(line_len));
+
+            if (*partial == NULL) {
+                return false;
+            }
+        }
+
+        if (GapBufferInsertString(*partial, chunk + start, line_len) != 0) {
+            return false;
+        }
+
+        if (newline == NULL) {
+            break;
+        }
+
+        if (!filter_add_line(filter, *partial)) {
+            return false;
+        }
+
+        *partial = NULL;
+        start += line_len + 1;
+    }
+
+    return true;
+}
+
+
+/*
+ * Opens a pipe whose ends aren't inherited by commands started later. They're close-on-exec from the start, as
+ * another filter's command can be spawned by another worker at any time. Returns false if it couldn't be opened.
+ * */
+bool filter_pipe(int fds[2]) {
+    return pipe2(fds, O_CLOEXEC) == 0;
+}
+
+
+/*
+ * Starts the command with its input and output connected to in and out. Its errors are thrown away.
+ * Returns the command's pid, or -1.
+ * */
+pid_t filter_spawn(const char* command, int in, int out) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t default_signals;
+    char* argv[] = {"sh", "-c", (char*) command, NULL};
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    // The editor ignores SIGPIPE; the command shouldn't
+    posix_spawnattr_init(&attr);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    return err == 0 ? pid : -1;
+}
+
+
+/*
+ * Waits for the command to exit, and returns its wait status. A command that was sent SIGTERM (terminated) gets
+ * FILTER_KILL_MS to exit before it's sent SIGKILL, so one that ignores SIGTERM can't hold up filter_destroy, which
+ * waits for the job on the UI thread.
+ * */
+int filter_reap(pid_t pid, bool terminated) {
+    int status = 0;
+
+    for (int waited = 0; terminated && waited < FILTER_KILL_MS; waited += 10) {
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            return status;
+        }
+
+        usleep(10 * 1000);
+    }
+
+    if (terminated) {
+        kill(pid, SIGKILL);
+    }
+
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    return status;
+}
+
+
+/*
+ * The filter job. Runs the command, writing lines to it and reading its output in the same poll loop, so a command
+ * that writes before it has read everything (or never reads at all) can't deadlock with the editor.
+ * */
+void filter_run(struct Job* job) {
+    struct Filter* filter = job->arg;
+    struct FilterInput input = {filter->first, 0};
+    GapBuffer* partial = NULL;
+    int to_command[2];
+    int from_command[2];
+    bool terminated = false;
+
+    filter->status = -1;
+
+    char* chunk = malloc(FILTER_READ_CHUNK);
+
+    if (chunk == NULL) {
+        filter->failed = true;
+        return;
+    }
+
+    if (!filter_pipe(to_command)) {
+        free(chunk);
+        filter->failed = true;
+        return;
+    }
+
+    if (!filter_pipe(from_command)) {
+        close(to_command[0]);
+        close(to_command[1]);
+        free(chunk);
+        filter->failed = true;
+        return;
+    }
+
+    pid_t pid = filter_spawn(filter->command, to_command[0], from_command[1]);
+
+    close(to_command[0]);
+    close(from_command[1]);
+
+    int in = to_command[1];
+    int out = from_command[0];
+
+    if (pid == -1) {
+        close(in);
+        close(out);
+        free(chunk);
+        return;
+    }
+
+    fcntl(in, F_SETFL, O_NONBLOCK);
+    fcntl(out, F_SETFL, O_NONBLOCK);
+
+    // Nothing to write: the command sees the end of its input right away
+    if (input.row == filter->first + filter->count) {
+        close(in);
+        in = -1;
+    }
+
+    while (out != -1) {
+        struct pollfd fds[2] = {
+            {.fd = out, .events = POLLIN},
+            {.fd = in, .events = POLLOUT},
+        };
+
+        if (poll(fds, in != -1 ? 2 : 1, FILTER_POLL_MS) == -1 && errno != EINTR) {
+            filter->failed = true;
+            break;
+        }
+
+        if (job_cancelled(job)) {
+            kill(pid, SIGTERM);
+            terminated = true;
+            break;
+        }
+
+        if (in != -1 && fds[1].revents != 0) {
+            // A command that exits without reading all of its input just doesn't get the rest
+            if (filter_write(filter, in, &input) == -1 || input.row == filter->first + filter->count) {
+                close(in);
+                in = -1;
+            }
+        }
+
+        if (fds[0].revents != 0) {
+            ssize_t len = read(out, chunk, FILTER_READ_CHUNK);
+
+            if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+                close(out);
+                out = -1;
+            } else if (len > 0 && !filter_read(filter, chunk, len, &partial)) {
+                filter->failed = true;
+                kill(pid, SIGTERM);
+                terminated = true;
+                break;
+            }
+        }
+    }
+
+    if (in != -1) {
+        close(in);
+    }
+    if (out != -1) {
+        close(out);
+    }
+
+    int status = filter_reap(pid, terminated);
+
+    filter->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    // Output that doesn't end in a newline still ends in a line
+    if (partial != NULL && !filter->failed && !filter_add_line(filter, partial)) {
+        filter->failed = true;
+    }
+    if (partial != NULL && filter->failed) {
+        DestroyGapBuffer(partial);
+    }
+
+    free(chunk);
+}
+
+
+/*
+ * Starts a job piping count lines of text, starting at first, through command. complete is run on the UI thread
+ * once the command has finished, with the filter as the job's arg; it should finish the filter with filter_commit
+ * and filter_destroy. owner is stored in the filter for it.
+ * Returns the filter, or NULL if it couldn't be started.
+ * */
+struct Filter* filter_start(TextBuffer* text, int64_t first, int64_t count, const char* command,
+                            void (*complete)(struct Job*), void* owner) {
+    struct Filter* filter = calloc(1, sizeof(struct Filter));
+
+    if (filter == NULL) {
+        return NULL;
+    }
+
+    filter->owner = owner;
+    filter->first = first;
+    filter->count = count;
+    filter->command = strdup(command);
+    filter->snapshot = CreateTextBufferSnapshot(text);
+
+    if (filter->command == NULL || filter->snapshot == NULL) {
+        if (filter->snapshot != NULL) {
+            DestroyTextBufferSnapshot(filter->snapshot);
+        }
+        free(filter->command);
+        free(filter);
+        return NULL;
+    }
+
+    job_init(&filter->job, filter_run, complete, filter, &filter->token);
+
+    if (jobs_submit(&filter->job) != 0) {
+        DestroyTextBufferSnapshot(filter->snapshot);
+        free(filter->command);
+        free(filter);
+        return NULL;
+    }
+
+    return filter;
+}
+
+
+/*
+ * Replaces the filtered lines of text with the command's output, as a single change. The job must be finished.
+ * Returns the number of lines the command wrote, -1 if text was edited since the filter started, -2 if the
+ * command failed (see filter->status) or MEM_ERROR. Nothing is changed unless it succeeds.
+ * */
+int64_t filter_commit(struct Filter* filter, TextBuffer* text) {
+
+    if (filter->failed) {
+        return MEM_ERROR;
+    }
+
+    if (filter->status != 0) {
+        return -2;
+    }
+
+    if (text->version != filter->snapshot->version) {
+        return -1;
+    }
+
+    if (TextBufferSpliceLines(text, filter->first, filter->count, filter->lines, filter->line_count) != 0) {
+        return MEM_ERROR;
+    }
+
+    // The lines belong to the buffer now
+    int64_t line_count = filter->line_count;
+    filter->line_count = 0;
+
+    return line_count;
+}
+
+
+/*
+ * Stops the command if it's still running, and frees the filter along with any output that wasn't committed.
+ * */
+void filter_destroy(struct Filter* filter) {
+    job_token_cancel(&filter->token);
+    job_wait(&filter->job);
+
+    destroy_lines(filter->lines, filter->line_count);
+    free(filter->lines);
+    DestroyTextBufferSnapshot(filter->snapshot);
+    free(filter->command);
+    free(filter);
+}
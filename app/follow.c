@@ -0,0 +1,299 @@
+//
+// Follow mode: like tail -f, a followed buffer picks up what's appended to its file without reloading it.
+//
+
+#include <sys/inotify.h>
+
+// Gap given to lines appended while following. Appended lines are rarely edited, so they're kept close to the size
+// of the data they hold.
+#define FOLLOW_GAP_LEN 16
+
+// Most bytes read from the file at once
+#define FOLLOW_READ_LEN (1024 * 1024)
+
+// Results of follow_update
+#define FOLLOW_UNCHANGED 0
+#define FOLLOW_APPENDED 1
+#define FOLLOW_RELOADED 2
+
+#define FOLLOW_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+
+/*
+ * Starts following a buffer's file. The buffer is finished loading first. The file offset the buffer covers is
+ * worked out from its lines, so bytes written while it was loading aren't skipped, or read twice.
+ * Returns 0, -1 if the file can't be opened or watched, or MEM_ERROR.
+ * */
+int follow_start(struct OpenBuffer* ob, int inotify_fd) {
+    struct stat st;
+
+    if (ob->following) {
+        return 0;
+    }
+
+    if (buffer_finish_load(ob) != 0) {
+        return MEM_ERROR;
+    }
+
+    int fd = open(ob->file_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    int watch = inotify_add_watch(inotify_fd, ob->file_path, FOLLOW_EVENTS);
+
+    if (watch == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // Size of the buffer if every line ended with a newline
+    off_t size = 0;
+    for (int64_t i = 0; i <= ob->text->last_line_loc; i++) {
+        size += ob->text->lines[i]->str_len + 1;
+    }
+
+    // If the file's last line doesn't end in a newline, new bytes continue it
+    char last;
+    ob->follow_partial = pread(fd, &last, 1, size - 1) != 1 || last != '\n';
+    ob->follow_offset = ob->follow_partial ? size - 1 : size;
+
+    // The buffer doesn't match the file; just follow what gets added from now on
+    if (ob->follow_offset > st.st_size) {
+        ob->follow_offset = st.st_size;
+        ob->follow_partial = false;
+    }
+
+    ob->following = true;
+    ob->follow_fd = fd;
+    ob->follow_watch = watch;
+    ob->follow_inode = st.st_ino;
+    ob->follow_changed = true;
+
+    return 0;
+}
+
+
+void follow_stop(struct OpenBuffer* ob, int inotify_fd) {
+
+    if (!ob->following) {
+        return;
+    }
+
+    if (ob->follow_watch != -1) {
+        inotify_rm_watch(inotify_fd, ob->follow_watch);
+    }
+
+    close(ob->follow_fd);
+    ob->following = false;
+    ob->follow_watch = -1;
+}
+
+
+/*
+ * Reads the pending inotify events and flags the buffers they're about. A file that was moved or deleted loses
+ * its watch; follow_update watches the path again once a new file shows up there.
+ * */
+void follow_read_events(int inotify_fd, struct BufferList* list) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read(inotify_fd, events, sizeof events)) > 0) {
+        for (char* p = events; p < events + len; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+            struct inotify_event* event = (struct inotify_event*) p;
+
+            for (int i = 0; i < list->count; i++) {
+                struct OpenBuffer* ob = &list->buffers[i];
+
+                if (!ob->following || ob->follow_watch != event->wd) {
+                    continue;
+                }
+
+                ob->follow_changed = true;
+
+                if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+                    inotify_rm_watch(inotify_fd, ob->follow_watch);
+                    ob->follow_watch = -1;
+                }
+            }
+        }
+    }
+}
+
+
+/*
+ * Appends len bytes of the file to the buffer. Bytes up to the first newline continue the last line if the file's
+ * last line wasn't finished; every other line is built straight from the data and added with a single
+ * TextBufferAppendLines. A line without a newline at the end of the data is added, and continued next time.
+ * Returns 0 or MEM_ERROR
+ * */
+int follow_append(struct OpenBuffer* ob, const char* data, int64_t len) {
+    TextBuffer* text = ob->text;
+    const char* end = data + len;
+    int err;
+
+    if (ob->follow_partial) {
+        const char* newline = memchr(data, '\n', len);
+        int64_t line_len = (newline != NULL ? newline : end) - data;
+        TextBufferEdit edit = {text->last_line_loc, text->lines[text->last_line_loc]->str_len, 0, data, line_len};
+
+        if (line_len > 0 && (err = TextBufferApplyEdits(text, &edit, 1)) != 0) {
+            return err;
+        }
+
+        if (newline == NULL) {
+            return 0;
+        }
+
+        data = newline + 1;
+        ob->follow_partial = false;
+    }
+
+    // Every line starts at data, or just after a newline; count them to build them in one go
+    int64_t count = 0;
+    for (const char* p = data; p < end; count++) {
+        const char* newline = memchr(p, '\n', end - p);
+        p = newline != NULL ? newline + 1 : end;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    GapBuffer** lines = malloc(sizeof(GapBuffer*) * count);
+
+    if (lines == NULL) {
+        return MEM_ERROR;
+    }
+
+    for (int64_t i = 0; i < count; i++) {
+        const char* newline = memchr(data, '\n', end - data);
+        int64_t line_len = (newline != NULL ? newline : end) - data;
+
+        lines[i] = CreateGapBuffer(line_len + FOLLOW_GAP_LEN);
+
+        if (lines[i] == NULL || GapBufferInsertString(lines[i], data, line_len) != 0) {
+            destroy_lines(lines, lines[i] == NULL ? i : i + 1);
+            free(lines);
+            return MEM_ERROR;
+        }
+
+        ob->follow_partial = newline == NULL;
+        data = newline != NULL ? newline + 1 : end;
+    }
+
+    err = TextBufferAppendLines(text, lines, count);
+
+    if (err != 0) {
+        destroy_lines(lines, count);
+    }
+
+    free(lines);
+    return err;
+}
+
+
+/*
+ * Reloads a followed buffer from scratch, for when its file was truncated or replaced by a new one.
+ * Returns 0, -1 if the file can't be followed any more, or MEM_ERROR.
+ * */
+int follow_reload(struct OpenBuffer* ob, int inotify_fd) {
+    follow_stop(ob, inotify_fd);
+
+    if (ob->diff != NULL) {
+        file_diff_destroy(ob->diff);
+        ob->diff = NULL;
+    }
+    buffer_clear_diff(ob);
+    buffer_clear_search(ob);
+
+    DestroyTextBuffer(ob->text);
+    ob->text = NULL;
+    ob->cursor_row = 0;
+    ob->cursor_col = 0;
+    ob->render_start_line = 0;
+    ob->render_start_col = 0;
+    ob->mark = NULL;
+
+    if (buffer_load(ob) != 0) {
+        return MEM_ERROR;
+    }
+
+    return follow_start(ob, inotify_fd);
+}
+
+
+/*
+ * Brings a followed buffer up to date with its file: bytes appended since follow_offset are added, and the
+ * buffer is reloaded if the file was truncated, or rotated (a new file now sits at the path). A rotated file's
+ * last bytes are read before switching to the new one.
+ * A modified buffer is never reloaded; following stops instead, so edits aren't thrown away.
+ *
+ * Returns FOLLOW_UNCHANGED, FOLLOW_APPENDED, FOLLOW_RELOADED, -1 if following stopped, or MEM_ERROR.
+ * */
+int follow_update(struct OpenBuffer* ob, int inotify_fd) {
+    struct stat st;
+    int result = FOLLOW_UNCHANGED;
+    bool modified = buffer_modified(ob);
+
+    ob->follow_changed = false;
+
+    if (fstat(ob->follow_fd, &st) != 0) {
+        follow_stop(ob, inotify_fd);
+        return -1;
+    }
+
+    if (st.st_size > ob->follow_offset) {
+        char* data = malloc(FOLLOW_READ_LEN);
+
+        if (data == NULL) {
+            return MEM_ERROR;
+        }
+
+        ssize_t got;
+        while (ob->follow_offset < st.st_size &&
+               (got = pread(ob->follow_fd, data, FOLLOW_READ_LEN, ob->follow_offset)) > 0) {
+
+            if (follow_append(ob, data, got) != 0) {
+                free(data);
+                return MEM_ERROR;
+            }
+
+            ob->follow_offset += got;
+        }
+
+        free(data);
+        result = FOLLOW_APPENDED;
+
+        if (!modified) {
+            ob->saved_version = ob->text->version;
+            buffer_set_saved_file(ob, fstat(ob->follow_fd, &st) == 0 ? &st : NULL);
+        }
+    }
+
+    // The file may have grown while it was read, so the size is checked again
+    bool truncated = fstat(ob->follow_fd, &st) == 0 && st.st_size < ob->follow_offset;
+    bool rotated = stat(ob->file_path, &st) == 0 && st.st_ino != ob->follow_inode;
+
+    if (!truncated && !rotated) {
+        // Moved or deleted, and nothing has taken its place yet
+        if (ob->follow_watch == -1) {
+            ob->follow_watch = inotify_add_watch(inotify_fd, ob->file_path, FOLLOW_EVENTS);
+            ob->follow_changed = ob->follow_watch != -1;
+        }
+
+        return result;
+    }
+
+    if (modified) {
+        follow_stop(ob, inotify_fd);
+        return -1;
+    }
+
+    int err = follow_reload(ob, inotify_fd);
+    return err != 0 ? err : FOLLOW_RELOADED;
+}
@@ -0,0 +1,886 @@
+//
+// Grep: searches every file under a directory for a string. A fixed number of jobs (see jobs.c) share a list of
+// directories to read and files to search, so the search never takes more threads than that however big the tree
+// is. Each file is mapped and searched in place; the lines with a match are handed to the UI thread a file at a
+// time, and merged into a results buffer in order of path.
+//
+// Binary files (those with a NUL near the start), symlinks, .git directories and whatever a .gitignore on the way
+// down matches are skipped. .gitignore patterns are matched with fnmatch; negated patterns aren't supported.
+//
+
+#include <dirent.h>
+#include <fnmatch.h>
+
+// Bytes at the start of a file looked at for a NUL, to tell binary files
+#define GREP_BINARY_CHECK 8192
+// Files up to this size are read rather than mapped, as mapping a small file costs more than copying it
+#define GREP_READ_BYTES 65536
+// Bytes of a matching line kept in the results
+#define GREP_LINE_MAX 256
+// Slots the list of directories and files to search starts with
+#define GREP_FIRST_ITEMS 256
+// Result lines a file's array starts with
+#define GREP_FIRST_LINES 16
+
+
+/*
+ * GrepPattern
+ * A line of a .gitignore.
+ * glob: the pattern, without a trailing slash or leading slash
+ * dir_only: the pattern ended in a slash, so only matches directories
+ * anchored: the pattern had a slash before its end, so it's matched against the path from the .gitignore's
+ *           directory rather than against the name alone
+ * */
+struct GrepPattern {
+    char* glob;
+    bool dir_only;
+    bool anchored;
+};
+
+
+/*
+ * GrepIgnore
+ * The patterns of a .gitignore, which apply to everything below its directory, and those of the directories above
+ * it. Shared by every directory and file below it; freed once its last reference is released.
+ *
+ * parent: the .gitignore of a directory above, or NULL
+ * dir_len: length of the path of its directory, relative to the grep's root (0 for the root)
+ * patterns: count of them
+ * refs: references from items and from the .gitignores below
+ * */
+struct GrepIgnore {
+    struct GrepIgnore* parent;
+    size_t dir_len;
+    struct GrepPattern* patterns;
+    int count;
+    int refs;
+};
+
+
+/*
+ * GrepItem
+ * A directory to read or a file to search.
+ * path: the path, starting with the grep's root
+ * dir: whether it's a directory
+ * ignore: the .gitignores that apply to it, or NULL
+ * */
+struct GrepItem {
+    char* path;
+    bool dir;
+    struct GrepIgnore* ignore;
+};
+
+
+/*
+ * GrepFile
+ * The lines of a file with a match, as result lines ("path:row:col: text", row and col from 1).
+ * path: the file, as shown in the results
+ * lines: count of them
+ * next: the next file found
+ * */
+struct GrepFile {
+    char* path;
+    GapBuffer** lines;
+    int64_t count;
+    struct GrepFile* next;
+};
+
+
+struct Grep;
+
+
+/*
+ * GrepWorker
+ * One of the jobs a grep runs on.
+ * small: GREP_READ_BYTES to read small files into while it runs, or NULL if it couldn't be allocated
+ * */
+struct GrepWorker {
+    struct Job job;
+    struct Grep* grep;
+    char* small;
+};
+
+
+/*
+ * GrepShown
+ * A file whose results are in the results buffer, count lines of them.
+ * */
+struct GrepShown {
+    char* path;
+    int64_t count;
+};
+
+
+/*
+ * Grep
+ * A search for a string in every file under a directory.
+ *
+ * owner: for done, e.g. the results buffer
+ * done: called on the UI thread once every worker has finished
+ * root: the directory searched, root_len long
+ * find: the string searched for, find_len long
+ * token: cancels the workers
+ * workers: worker_count of them. workers_done of them are finished (only used on the UI thread)
+ *
+ * Shared with the workers, only accessed while holding lock:
+ * items: directories and files left to look at, item_count of them in item_capacity slots. Taken newest first, so
+ *        the tree is walked depth first
+ * busy: workers looking at an item, which may add more. Workers wait on work while there are no items but some
+ *       are busy
+ * found: files with a match that the UI thread hasn't taken yet, newest first
+ * files_searched, files_matched, matches: counts so far
+ * failed: a worker ran out of memory, so some results may be missing
+ *
+ * UI thread only:
+ * shown: the files in the results buffer, in order of path, shown_count of them in shown_capacity slots
+ * shown_lines: lines of the results buffer the files take up, from its first line
+ * version: the results buffer's version after the files were last merged in
+ * edited: the results buffer was edited since, so new files are added at its end instead
+ * */
+struct Grep {
+    void* owner;
+    void (*done)(struct Grep* grep);
+    char* root;
+    size_t root_len;
+    char* find;
+    int64_t find_len;
+    struct JobToken token;
+    struct GrepWorker* workers;
+    int worker_count;
+    int workers_done;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct GrepItem* items;
+    int64_t item_count;
+    int64_t item_capacity;
+    int busy;
+    struct GrepFile* found;
+    int64_t files_searched;
+    int64_t files_matched;
+    int64_t matches;
+    bool failed;
+
+    struct GrepShown* shown;
+    int64_t shown_count;
+    int64_t shown_capacity;
+    int64_t shown_lines;
+    unsigned long version;
+    bool edited;
+};
+
+
+/*
+ * Releases a reference to a .gitignore, freeing it (and releasing its parent) when it was the last one.
+ * */
+void grep_ignore_release(struct GrepIgnore* ignore) {
+
+    while (ignore != NULL && __atomic_sub_fetch(&ignore->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct GrepIgnore* parent = ignore->parent;
+
+        for (int i = 0; i < ignore->count; i++) {
+            free(ignore->patterns[i].glob);
+        }
+        free(ignore->patterns);
+        free(ignore);
+
+        ignore = parent;
+    }
+}
+
+
+/*
+ * Reads the .gitignore in a directory, if it has one.
+ * Returns the .gitignore, with parent as its parent, or parent itself if there's none (or it can't be read). Either
+ * way the caller gets a reference to release.
+ * */
+struct GrepIgnore* grep_read_ignore(struct Grep* grep, const char* dir, struct GrepIgnore* parent) {
+    size_t dir_len = strlen(dir);
+    char* path = malloc(dir_len + sizeof "/.gitignore");
+    FILE* fp = NULL;
+    struct GrepIgnore* ignore = NULL;
+
+    if (path != NULL) {
+        memcpy(path, dir, dir_len);
+        memcpy(path + dir_len, "/.gitignore", sizeof "/.gitignore");
+        fp = fopen(path, "re");
+        free(path);
+    }
+
+    if (fp != NULL) {
+        ignore = calloc(1, sizeof(struct GrepIgnore));
+    }
+
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int capacity = 0;
+
+    while (ignore != NULL && (len = getline(&line, &line_cap, fp)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ')) {
+            line[--len] = '\0';
+        }
+
+        if (len == 0 || line[0] == '#' || line[0] == '!') {
+            continue;
+        }
+
+        struct GrepPattern pattern = {0};
+        char* glob = line;
+
+        if (glob[len - 1] == '/') {
+            pattern.dir_only = true;
+            glob[--len] = '\0';
+        }
+
+        pattern.anchored = strchr(glob, '/') != NULL;
+        glob += glob[0] == '/';
+
+        if (ignore->count == capacity) {
+            struct GrepPattern* grown = realloc(ignore->patterns,
+                                                sizeof(struct GrepPattern) * (capacity > 0 ? capacity * 2 : 8));
+
+            if (grown == NULL) {
+                break;
+            }
+
+            ignore->patterns = grown;
+            capacity = capacity > 0 ? capacity * 2 : 8;
+        }
+
+        if ((pattern.glob = strdup(glob)) != NULL) {
+            ignore->patterns[ignore->count++] = pattern;
+        }
+    }
+
+    free(line);
+
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    if (ignore == NULL || ignore->count == 0) {
+        free(ignore != NULL ? ignore->patterns : NULL);
+        free(ignore);
+
+        if (parent != NULL) {
+            __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+        }
+        return parent;
+    }
+
+    ignore->parent = parent;
+    ignore->dir_len = dir_len > grep->root_len ? dir_len - grep->root_len - 1 : 0;
+    ignore->refs = 1;
+
+    if (parent != NULL) {
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    return ignore;
+}
+
+
+/*
+ * Returns whether a .gitignore on the way down matches a directory entry. relative is its path from the grep's
+ * root, name its last part.
+ * */
+bool grep_ignored(struct GrepIgnore* ignore, const char* relative, const char* name, bool dir) {
+
+    for (; ignore != NULL; ignore = ignore->parent) {
+        const char* below = relative + (ignore->dir_len > 0 ? ignore->dir_len + 1 : 0);
+
+        for (int i = 0; i < ignore->count; i++) {
+            struct GrepPattern* pattern = &ignore->patterns[i];
+
+            if (pattern->dir_only && !dir) {
+                continue;
+            }
+
+            if (fnmatch(pattern->glob, pattern->anchored ? below : name, pattern->anchored ? FNM_PATHNAME : 0) == 0) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * Adds a directory or file to the list for the workers, taking path and a reference to ignore.
+ * Returns false if the list couldn't grow; path is freed and the reference released then.
+ * */
+bool grep_push(struct Grep* grep, char* path, bool dir, struct GrepIgnore* ignore) {
+    pthread_mutex_lock(&grep->lock);
+
+    if (grep->item_count == grep->item_capacity) {
+        int64_t capacity = grep->item_capacity > 0 ? grep->item_capacity * 2 : GREP_FIRST_ITEMS;
+        struct GrepItem* grown = realloc(grep->items, sizeof(struct GrepItem) * capacity);
+
+        if (grown == NULL) {
+            grep->failed = true;
+            pthread_mutex_unlock(&grep->lock);
+            free(path);
+            grep_ignore_release(ignore);
+            return false;
+        }
+
+        grep->items = grown;
+        grep->item_capacity = capacity;
+    }
+
+    grep->items[grep->item_count++] = (struct GrepItem) {path, dir, ignore};
+    pthread_cond_signal(&grep->work);
+    pthread_mutex_unlock(&grep->lock);
+
+    return true;
+}
+
+
+/*
+ * Adds the entries of a directory to the list, leaving out those that are ignored.
+ * */
+void grep_read_dir(struct Grep* grep, struct GrepItem* item, struct Job* job) {
+    DIR* dir = opendir(item->path);
+
+    if (dir == NULL) {
+        return;
+    }
+
+    struct GrepIgnore* ignore = grep_read_ignore(grep, item->path, item->ignore);
+    size_t path_len = strlen(item->path);
+    struct dirent* entry;
+
+    while ((entry = readdir(dir)) != NULL && !job_cancelled(job)) {
+        const char* name = entry->d_name;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, ".git") == 0) {
+            continue;
+        }
+
+        size_t name_len = strlen(name);
+        char* path = malloc(path_len + name_len + 2);
+
+        if (path == NULL) {
+            break;
+        }
+
+        memcpy(path, item->path, path_len);
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, name, name_len + 1);
+
+        unsigned char type = entry->d_type;
+        struct stat st;
+
+        // Not every file system fills in the type
+        if (type == DT_UNKNOWN && lstat(path, &st) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+
+        const char* relative = path + grep->root_len + 1;
+
+        if ((type != DT_DIR && type != DT_REG) || grep_ignored(ignore, relative, name, type == DT_DIR)) {
+            free(path);
+            continue;
+        }
+
+        if (ignore != NULL) {
+            __atomic_add_fetch(&ignore->refs, 1, __ATOMIC_RELAXED);
+        }
+
+        if (!grep_push(grep, path, type == DT_DIR, ignore)) {
+            break;
+        }
+    }
+
+    grep_ignore_release(ignore);
+    closedir(dir);
+}
+
+
+/*
+ * Adds a result line for the match at col of the line from start to end of a file to its lines.
+ * Returns false if it couldn't be allocated.
+ * */
+bool grep_add_line(struct GrepFile* file, int64_t* capacity, int64_t row, int64_t col, const char* start,
+                   int64_t len) {
+    char prefix[64];
+    int prefix_len = snprintf(prefix, sizeof prefix, ":%" PRId64 ":%" PRId64 ": ", row + 1, col + 1);
+    size_t path_len = strlen(file->path);
+    int64_t text_len = len < GREP_LINE_MAX ? len : GREP_LINE_MAX;
+    GapBuffer* line = CreateGapBuffer(path_len + prefix_len + text_len);
+
+    if (line == NULL) {
+        return false;
+    }
+
+    if (file->count == *capacity) {
+        int64_t grown_capacity = *capacity > 0 ? *capacity * 2 : GREP_FIRST_LINES;
+        GapBuffer** grown = realloc(file->lines, sizeof(GapBuffer*) * grown_capacity);
+
+        if (grown == NULL) {
+            DestroyGapBuffer(line);
+            return false;
+        }
+
+        file->lines = grown;
+        *capacity = grown_capacity;
+    }
+
+    // The gap was made big enough for all three
+    GapBufferInsertString(line, file->path, path_len);
+    GapBufferInsertString(line, prefix, prefix_len);
+    GapBufferInsertString(line, start, text_len);
+
+    file->lines[file->count++] = line;
+    return true;
+}
+
+
+/*
+ * Searches a file for the grep's string, and hands the lines with a match to the UI thread. A line with several
+ * matches is listed once, at the first. Small files are read into small, if there is one; others are mapped.
+ * */
+void grep_search_file(struct Grep* grep, struct GrepItem* item, char* small) {
+    int fd = open(item->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char* map = NULL;
+    bool mapped = false;
+
+    if (fd == -1) {
+        return;
+    }
+
+    int64_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+
+    if (size > 0 && size <= GREP_READ_BYTES && small != NULL) {
+        ssize_t read_len = pread(fd, small, size, 0);
+
+        // The file may have shrunk since
+        map = read_len > 0 ? small : NULL;
+        size = read_len;
+    } else if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        mapped = map != MAP_FAILED;
+        map = mapped ? map : NULL;
+    }
+
+    close(fd);
+
+    if (map == NULL) {
+        return;
+    }
+
+    struct GrepFile file = {0};
+    int64_t capacity = 0;
+    int64_t matches = 0;
+    bool failed = false;
+
+    if (mapped) {
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+
+    // Shown without the "./" of a search of the current directory
+    file.path = item->path + (strncmp(item->path, "./", 2) == 0 ? 2 : 0);
+
+    if (memchr(map, '\0', size < GREP_BINARY_CHECK ? size : GREP_BINARY_CHECK) == NULL) {
+        int64_t row = 0;
+        int64_t line_start = 0;
+        int64_t found;
+
+        while (!failed && (found = find_text(map, size, line_start, grep->find, grep->find_len)) != -1) {
+            char* newline;
+
+            // Count the lines up to the match's
+            while ((newline = memchr(map + line_start, '\n', found - line_start)) != NULL) {
+                line_start = newline - map + 1;
+                row++;
+            }
+
+            newline = memchr(map + found, '\n', size - found);
+            int64_t line_end = newline != NULL ? newline - map : size;
+
+            failed = !grep_add_line(&file, &capacity, row, found - line_start, map + line_start,
+                                    line_end - line_start);
+            matches++;
+
+            line_start = line_end + 1;
+            row++;
+        }
+    }
+
+    if (mapped) {
+        munmap(map, size);
+    }
+
+    struct GrepFile* result = file.count > 0 && !failed ? malloc(sizeof(struct GrepFile)) : NULL;
+
+    if (result != NULL) {
+        *result = file;
+        result->path = strdup(file.path);
+    }
+
+    if (result == NULL || result->path == NULL) {
+        for (int64_t i = 0; i < file.count; i++) {
+            DestroyGapBuffer(file.lines[i]);
+        }
+        free(file.lines);
+        free(result);
+        result = NULL;
+        failed |= file.count > 0;
+    }
+
+    pthread_mutex_lock(&grep->lock);
+    grep->files_searched++;
+    grep->failed |= failed;
+
+    if (result != NULL) {
+        result->next = grep->found;
+        grep->found = result;
+        grep->files_matched++;
+        grep->matches += matches;
+    }
+
+    pthread_mutex_unlock(&grep->lock);
+}
+
+
+/*
+ * A grep worker. Takes directories and files off the list until it's empty and no other worker can add to it.
+ * */
+void grep_run(struct Job* job) {
+    struct GrepWorker* worker = job->arg;
+    struct Grep* grep = worker->grep;
+
+    worker->small = malloc(GREP_READ_BYTES);
+    pthread_mutex_lock(&grep->lock);
+
+    while (true) {
+        while (grep->item_count == 0 && grep->busy > 0 && !job_cancelled(job)) {
+            pthread_cond_wait(&grep->work, &grep->lock);
+        }
+
+        if (grep->item_count == 0 || job_cancelled(job)) {
+            break;
+        }
+
+        struct GrepItem item = grep->items[--grep->item_count];
+        grep->busy++;
+        pthread_mutex_unlock(&grep->lock);
+
+        if (item.dir) {
+            grep_read_dir(grep, &item, job);
+        } else {
+            grep_search_file(grep, &item, worker->small);
+        }
+
+        free(item.path);
+        grep_ignore_release(item.ignore);
+
+        pthread_mutex_lock(&grep->lock);
+        grep->busy--;
+    }
+
+    // The list is empty for good; wake the workers still waiting for it
+    pthread_cond_broadcast(&grep->work);
+    pthread_mutex_unlock(&grep->lock);
+
+    free(worker->small);
+    worker->small = NULL;
+}
+
+
+/*
+ * Completion of a grep worker. Once the last one is done, calls the grep's done.
+ * */
+void grep_worker_finished(struct Job* job) {
+    struct Grep* grep = ((struct GrepWorker*) job->arg)->grep;
+
+    if (++grep->workers_done == grep->worker_count) {
+        grep->done(grep);
+    }
+}
+
+
+/*
+ * Waits for every worker to finish. Their completions don't run; the caller calls done itself.
+ * */
+void grep_wait(struct Grep* grep) {
+
+    for (int i = 0; i < grep->worker_count; i++) {
+        job_wait(&grep->workers[i].job);
+    }
+}
+
+
+/*
+ * Frees a file found, and its lines unless they went to the results.
+ * */
+void grep_free_file(struct GrepFile* file, bool merged) {
+
+    for (int64_t i = 0; !merged && i < file->count; i++) {
+        DestroyGapBuffer(file->lines[i]);
+    }
+
+    free(file->lines);
+    free(file->path);
+    free(file);
+}
+
+
+/*
+ * Frees the files in the array, and the array.
+ * */
+void grep_free_files(struct GrepFile** files, int64_t count, bool merged) {
+
+    for (int64_t i = 0; i < count; i++) {
+        grep_free_file(files[i], merged);
+    }
+
+    free(files);
+}
+
+
+/*
+ * Stops the grep if it's still running, and frees it along with whatever results weren't taken.
+ * */
+void grep_destroy(struct Grep* grep) {
+    job_token_cancel(&grep->token);
+
+    pthread_mutex_lock(&grep->lock);
+    pthread_cond_broadcast(&grep->work);
+    pthread_mutex_unlock(&grep->lock);
+
+    grep_wait(grep);
+
+    for (int64_t i = 0; i < grep->item_count; i++) {
+        free(grep->items[i].path);
+        grep_ignore_release(grep->items[i].ignore);
+    }
+
+    while (grep->found != NULL) {
+        struct GrepFile* next = grep->found->next;
+        grep_free_file(grep->found, false);
+        grep->found = next;
+    }
+
+    for (int64_t i = 0; i < grep->shown_count; i++) {
+        free(grep->shown[i].path);
+    }
+
+    free(grep->shown);
+    free(grep->items);
+    free(grep->workers);
+    free(grep->root);
+    free(grep->find);
+    pthread_mutex_destroy(&grep->lock);
+    pthread_cond_destroy(&grep->work);
+    free(grep);
+}
+
+
+/*
+ * Starts searching every file under root for find, with results to go in text (see grep_take), on a worker less
+ * than the pool has (but at least one) so other jobs can still run. done is run on the UI thread once every file
+ * has been searched, and should take the last results and free the grep with grep_destroy. owner is stored in the
+ * grep for it.
+ * Returns the grep, or NULL if it couldn't be started.
+ * */
+struct Grep* grep_start(const char* root, const char* find, TextBuffer* text, void (*done)(struct Grep*),
+                        void* owner) {
+    struct Grep* grep = calloc(1, sizeof(struct Grep));
+
+    if (grep == NULL) {
+        return NULL;
+    }
+
+    grep->owner = owner;
+    grep->done = done;
+    grep->version = text->version;
+    grep->root_len = strlen(root);
+
+    // A trailing slash would be doubled in the paths below it
+    while (grep->root_len > 1 && root[grep->root_len - 1] == '/') {
+        grep->root_len--;
+    }
+
+    grep->root = strndup(root, grep->root_len);
+    grep->find = strdup(find);
+    grep->find_len = strlen(find);
+    grep->worker_count = job_pool.worker_count > 1 ? job_pool.worker_count - 1 : 1;
+    grep->workers = calloc(grep->worker_count, sizeof(struct GrepWorker));
+    pthread_mutex_init(&grep->lock, NULL);
+    pthread_cond_init(&grep->work, NULL);
+
+    char* path = grep->root != NULL ? strdup(grep->root) : NULL;
+
+    if (grep->find == NULL || grep->workers == NULL || path == NULL || !grep_push(grep, path, true, NULL)) {
+        free(grep->root);
+        free(grep->find);
+        free(grep->workers);
+        free(grep->items);
+        pthread_mutex_destroy(&grep->lock);
+        pthread_cond_destroy(&grep->work);
+        free(grep);
+        return NULL;
+    }
+
+    for (int i = 0; i < grep->worker_count; i++) {
+        grep->workers[i].grep = grep;
+        job_init(&grep->workers[i].job, grep_run, grep_worker_finished, &grep->workers[i], &grep->token);
+
+        // Workers that can't be queued leave fewer to share the work; the ones that were go on with all of it. With
+        // none, the grep searches nothing. Completions run on this thread, so none is counted yet
+        if (jobs_submit(&grep->workers[i].job) != 0) {
+            grep->worker_count = i;
+            break;
+        }
+    }
+
+    if (grep->worker_count == 0) {
+        grep_destroy(grep);
+        return NULL;
+    }
+
+    return grep;
+}
+
+
+/*
+ * Returns the number of files searched so far.
+ * */
+int64_t grep_progress(struct Grep* grep) {
+    pthread_mutex_lock(&grep->lock);
+    int64_t searched = grep->files_searched;
+    pthread_mutex_unlock(&grep->lock);
+
+    return searched;
+}
+
+
+/*
+ * helper for qsort, orders files by path
+ * */
+int compare_grep_files(const void* a, const void* b) {
+    return strcmp((*(struct GrepFile* const*) a)->path, (*(struct GrepFile* const*) b)->path);
+}
+
+
+/*
+ * Merges the files found since the last call into the results in text, in order of path. The results lines from
+ * the first new file on are spliced in again as one change, so a batch costs one pass over them.
+ * Returns the number of lines added, or MEM_ERROR (the files are dropped then).
+ * */
+int64_t grep_take(struct Grep* grep, TextBuffer* text) {
+    pthread_mutex_lock(&grep->lock);
+    struct GrepFile* found = grep->found;
+    grep->found = NULL;
+    pthread_mutex_unlock(&grep->lock);
+
+    int64_t count = 0;
+    int64_t lines = 0;
+
+    for (struct GrepFile* file = found; file != NULL; file = file->next) {
+        count++;
+        lines += file->count;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    struct GrepFile** files = malloc(sizeof(struct GrepFile*) * count);
+
+    if (files == NULL) {
+        grep->failed = true;
+        while (found != NULL) {
+            struct GrepFile* next = found->next;
+            grep_free_file(found, false);
+            found = next;
+        }
+        return MEM_ERROR;
+    }
+
+    count = 0;
+    for (struct GrepFile* file = found; file != NULL; file = file->next) {
+        files[count++] = file;
+    }
+
+    qsort(files, count, sizeof(struct GrepFile*), compare_grep_files);
+
+    // Once the results are edited their rows can't be told apart; new files go after them instead
+    grep->edited |= text->version != grep->version;
+
+    // The first shown file after the first new one, and the row it starts at
+    int64_t first = grep->shown_count;
+    int64_t row = grep->edited ? text->last_line_loc + 1 : grep->shown_lines;
+
+    while (!grep->edited && first > 0 && strcmp(grep->shown[first - 1].path, files[0]->path) > 0) {
+        first--;
+        row -= grep->shown[first].count;
+    }
+
+    int64_t kept = grep->edited ? 0 : grep->shown_lines - row;
+    struct GrepShown* shown = malloc(sizeof(struct GrepShown) * (grep->shown_count + count));
+    GapBuffer** merged = malloc(sizeof(GapBuffer*) * (kept + lines));
+
+    if (shown == NULL || merged == NULL) {
+        free(shown);
+        free(merged);
+        grep->failed = true;
+        grep_free_files(files, count, false);
+        return MEM_ERROR;
+    }
+
+    if (first > 0) {
+        memcpy(shown, grep->shown, sizeof(struct GrepShown) * first);
+    }
+
+    int64_t shown_count = first;
+    int64_t merged_count = 0;
+    int64_t old = first;
+    int64_t old_row = row;
+
+    // The lines already there go back in as they are, with a reference of their own for the splice to take
+    for (int64_t new = 0; old < grep->shown_count || new < count;) {
+        if (new < count && (old == grep->shown_count || strcmp(files[new]->path, grep->shown[old].path) < 0)) {
+            memcpy(merged + merged_count, files[new]->lines, sizeof(GapBuffer*) * files[new]->count);
+            merged_count += files[new]->count;
+            shown[shown_count++] = (struct GrepShown) {files[new]->path, files[new]->count};
+            new++;
+        } else {
+            for (int64_t i = 0; i < grep->shown[old].count; i++) {
+                merged[merged_count] = text->lines[old_row++];
+                GapBufferRetain(merged[merged_count++]);
+            }
+            shown[shown_count++] = grep->shown[old++];
+        }
+    }
+
+    if (TextBufferSpliceLines(text, row, kept, merged, merged_count) != 0) {
+        for (int64_t i = 0; i < merged_count; i++) {
+            DestroyGapBuffer(merged[i]);
+        }
+        free(merged);
+        free(shown);
+        grep->failed = true;
+        grep_free_files(files, count, true);
+        return MEM_ERROR;
+    }
+
+    // The paths went to shown
+    for (int64_t i = 0; i < count; i++) {
+        files[i]->path = NULL;
+    }
+
+    free(merged);
+    free(grep->shown);
+    grep->shown = shown;
+    grep->shown_count = shown_count;
+    grep->shown_lines = row + merged_count;
+    grep->version = text->version;
+    grep_free_files(files, count, true);
+
+    return lines;
+}
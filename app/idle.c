@@ -0,0 +1,126 @@
+//
+// Idle tasks: work that has to run on the UI thread, because it touches the buffers, but doesn't have to run right
+// away. A task does its work a step at a time and keeps track of where it got to between steps. While there's no
+// input, the scheduler runs the steps of the pending tasks, most urgent first, in slices of IDLE_SLICE_US; after each
+// slice it checks for input, and gives up the thread as soon as a key (or a finished job) is waiting, so a task holds
+// up typing by a slice at most. A task that was cut short goes on from where it was at the next idle spell.
+//
+
+#include <time.h>
+
+// Time the scheduler runs steps for before checking for input
+#define IDLE_SLICE_US 2000
+// Most tasks a scheduler holds
+#define IDLE_MAX_TASKS 8
+
+// Task priorities, most urgent first
+#define IDLE_PRIORITY_VISIBLE 0      // work whose results are on screen
+#define IDLE_PRIORITY_MEMORY 1       // giving memory back
+#define IDLE_PRIORITY_BACKGROUND 2   // work that only pays off later
+
+
+/*
+ * IdleTask
+ * priority: tasks with a lower one run first
+ * step: does a piece of the task, small enough to take well under a slice, and returns whether there's more to do
+ * arg: for step, e.g. where the task got to
+ * pending: the task has work left, since it was last woken
+ * started: a step ran since the task was last done, so the next one goes on from there. step sets it when it
+ *          starts the task over; the scheduler clears it once step says it's done
+ * */
+struct IdleTask {
+    int priority;
+    bool (*step)(struct IdleTask* task);
+    void* arg;
+    bool pending;
+    bool started;
+};
+
+
+/*
+ * IdleScheduler
+ * tasks: count of them, in order of priority
+ * */
+struct IdleScheduler {
+    struct IdleTask* tasks[IDLE_MAX_TASKS];
+    int count;
+};
+
+
+/*
+ * Returns a monotonic time in microseconds.
+ * */
+int64_t idle_now_us() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/*
+ * Adds a task to the scheduler, pending, after the tasks of the same priority.
+ * Returns 0, or -1 if the scheduler is full.
+ * */
+int idle_add(struct IdleScheduler* idle, struct IdleTask* task, int priority, bool (*step)(struct IdleTask*),
+             void* arg) {
+
+    if (idle->count == IDLE_MAX_TASKS) {
+        return -1;
+    }
+
+    *task = (struct IdleTask) {priority, step, arg, true, false};
+
+    int i = idle->count++;
+
+    for (; i > 0 && idle->tasks[i - 1]->priority > priority; i--) {
+        idle->tasks[i] = idle->tasks[i - 1];
+    }
+
+    idle->tasks[i] = task;
+    return 0;
+}
+
+
+/*
+ * Marks every task pending, e.g. after a keypress, as anything may need doing again. Tasks that were cut short keep
+ * their place.
+ * */
+void idle_wake(struct IdleScheduler* idle) {
+
+    for (int i = 0; i < idle->count; i++) {
+        idle->tasks[i]->pending = true;
+    }
+}
+
+
+/*
+ * Runs the steps of pending tasks, always the most urgent task's next, until none is pending or interrupted (called
+ * after every slice) says to stop.
+ * Returns whether tasks are still pending.
+ * */
+bool idle_run(struct IdleScheduler* idle, bool (*interrupted)()) {
+
+    while (true) {
+        int64_t deadline = idle_now_us() + IDLE_SLICE_US;
+
+        while (idle_now_us() < deadline) {
+            struct IdleTask* task = NULL;
+
+            for (int i = 0; i < idle->count && task == NULL; i++) {
+                task = idle->tasks[i]->pending ? idle->tasks[i] : NULL;
+            }
+
+            if (task == NULL) {
+                return false;
+            }
+
+            task->pending = task->step(task);
+            task->started &= task->pending;
+        }
+
+        if (interrupted()) {
+            return true;
+        }
+    }
+}
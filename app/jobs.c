@@ -0,0 +1,504 @@
+//
+// Job system: a fixed pool of worker threads that runs long operations (loading, saving, searching, indexing) off
+// the UI thread. Each worker has its own deque of jobs and steals from the others when it runs out. Finished jobs
+// are posted back to the UI thread through a lock-free queue, with an eventfd to wake read_char, so their results
+// are applied between frames.
+//
+// Jobs never touch a TextBuffer that's being edited; they work on their own data (a file, a snapshot) and hand
+// results back, so TextBuffer needs no locks.
+//
+
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define JOBS_MIN_WORKERS 2
+#define JOBS_MAX_WORKERS 16
+
+// Initial number of slots in a worker's deque
+#define JOB_DEQUE_CAPACITY 64
+
+// Job states
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_FINISHED 2
+
+
+/*
+ * JobToken
+ * Cancellation token. Jobs given the same token are cancelled together; a job checks job_cancelled as it goes.
+ * */
+struct JobToken {
+    int cancelled;
+};
+
+
+/*
+ * Job
+ * A unit of work, embedded in whatever owns the work (e.g. a Loader). The owner keeps it alive until job_wait
+ * returns, or until its completion has run.
+ *
+ * run: the work, called on a worker thread. Not called if the job was cancelled before it started
+ * complete: called on the UI thread by jobs_run_completions once run has returned. May be NULL
+ * arg: for run and complete
+ * token: cancellation token, may be NULL
+ * state: JOB_QUEUED, JOB_RUNNING or JOB_FINISHED
+ * next_done: link in the completion queue
+ * */
+struct Job {
+    void (*run)(struct Job* job);
+    void (*complete)(struct Job* job);
+    void* arg;
+    struct JobToken* token;
+    int state;
+    struct Job* next_done;
+};
+
+
+/*
+ * JobDeque
+ * A worker's jobs, as a ring buffer. The worker takes its newest job from the tail; other workers steal the oldest
+ * from the head.
+ * */
+struct JobDeque {
+    pthread_mutex_t lock;
+    struct Job** jobs;
+    int head;
+    int count;
+    int capacity;
+};
+
+
+/*
+ * JobPool
+ *
+ * workers, deques: worker threads and their deques, worker_count of each
+ * lock, work_ready: workers sleep on work_ready while queued is 0
+ * finished: signalled whenever a job finishes, for job_wait
+ * queued: jobs waiting in the deques
+ * next_deque: deque the next job submitted from outside the pool goes to
+ * stopping: set by jobs_shutdown
+ * done: finished jobs waiting for their completion, newest first. Pushed to by workers without a lock
+ * event_fd: eventfd written when a job finishes, to wake the UI thread
+ * completed, completed_tail: finished jobs taken off done by the UI thread, oldest first. UI thread only
+ * */
+struct JobPool {
+    pthread_t workers[JOBS_MAX_WORKERS];
+    struct JobDeque deques[JOBS_MAX_WORKERS];
+    int worker_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t finished;
+    int queued;
+    int next_deque;
+    bool stopping;
+
+    struct Job* done;
+    int event_fd;
+
+    struct Job* completed;
+    struct Job* completed_tail;
+};
+
+struct JobPool job_pool;
+
+// Index of the worker running on this thread, -1 on threads outside the pool
+__thread int current_worker = -1;
+
+
+void job_init(struct Job* job, void (*run)(struct Job*), void (*complete)(struct Job*), void* arg,
+              struct JobToken* token) {
+    memset(job, 0, sizeof(struct Job));
+    job->run = run;
+    job->complete = complete;
+    job->arg = arg;
+    job->token = token;
+}
+
+
+void job_token_cancel(struct JobToken* token) {
+    __atomic_store_n(&token->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+
+bool job_cancelled(struct Job* job) {
+    return job->token != NULL && __atomic_load_n(&job->token->cancelled, __ATOMIC_ACQUIRE);
+}
+
+
+bool job_finished(struct Job* job) {
+    return __atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == JOB_FINISHED;
+}
+
+
+/*
+ * Adds a job to the tail of a deque. Returns false if the deque couldn't grow.
+ * */
+bool job_deque_push(struct JobDeque* deque, struct Job* job) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity == 0 ? JOB_DEQUE_CAPACITY : deque->capacity * 2;
+        struct Job** jobs = malloc(sizeof(struct Job*) * capacity);
+
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+
+        // Unwrap the ring into the new array
+        for (int i = 0; i < deque->count; i++) {
+            jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+        }
+
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+
+    deque->jobs[(deque->head + deque->count) % deque->capacity] = job;
+    deque->count++;
+
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+
+/*
+ * Takes a job from a deque: the newest if the deque is the worker's own, the oldest if it's being stolen from.
+ * Returns NULL if the deque is empty.
+ * */
+struct Job* job_deque_take(struct JobDeque* deque, bool own) {
+    struct Job* job = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count > 0) {
+        if (own) {
+            job = deque->jobs[(deque->head + deque->count - 1) % deque->capacity];
+        } else {
+            job = deque->jobs[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+        }
+        deque->count--;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+
+/*
+ * Removes a job that hasn't started from whichever deque holds it. Returns whether it was found.
+ * */
+bool job_deque_remove(struct JobDeque* deque, struct Job* job) {
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+
+    for (int i = 0; i < deque->count; i++) {
+        if (deque->jobs[(deque->head + i) % deque->capacity] != job) {
+            continue;
+        }
+
+        // Close the gap by moving the later jobs forward
+        for (int j = i; j < deque->count - 1; j++) {
+            deque->jobs[(deque->head + j) % deque->capacity] = deque->jobs[(deque->head + j + 1) % deque->capacity];
+        }
+
+        deque->count--;
+        found = true;
+        break;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+
+/*
+ * Runs a job (unless it was cancelled before it started), posts it to the completion queue and wakes the UI
+ * thread. The job isn't touched once it's marked finished; its owner may free it from then on.
+ * */
+void job_execute(struct Job* job) {
+    __atomic_store_n(&job->state, JOB_RUNNING, __ATOMIC_RELAXED);
+
+    if (!job_cancelled(job)) {
+        job->run(job);
+    }
+
+    // Lock-free push onto the completion queue. Only the UI thread takes from it, and it takes the whole queue at
+    // once, so pushes can't be confused by a node being taken and pushed again.
+    struct Job* head = __atomic_load_n(&job_pool.done, __ATOMIC_RELAXED);
+    do {
+        job->next_done = head;
+    } while (!__atomic_compare_exchange_n(&job_pool.done, &head, job, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_store_n(&job->state, JOB_FINISHED, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&job_pool.lock);
+    pthread_cond_broadcast(&job_pool.finished);
+    pthread_mutex_unlock(&job_pool.lock);
+
+    uint64_t one = 1;
+    write(job_pool.event_fd, &one, sizeof one);
+}
+
+
+/*
+ * Takes the next job for a worker: its own newest job, or the oldest job of another worker.
+ * */
+struct Job* jobs_take(int worker) {
+    struct Job* job = job_deque_take(&job_pool.deques[worker], true);
+
+    for (int i = 1; job == NULL && i < job_pool.worker_count; i++) {
+        job = job_deque_take(&job_pool.deques[(worker + i) % job_pool.worker_count], false);
+    }
+
+    if (job != NULL) {
+        pthread_mutex_lock(&job_pool.lock);
+        job_pool.queued--;
+        pthread_mutex_unlock(&job_pool.lock);
+    }
+
+    return job;
+}
+
+
+void* jobs_worker(void* arg) {
+    current_worker = (int) (intptr_t) arg;
+
+    while (true) {
+        struct Job* job = jobs_take(current_worker);
+
+        if (job != NULL) {
+            job_execute(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&job_pool.lock);
+
+        while (job_pool.queued == 0 && !job_pool.stopping) {
+            pthread_cond_wait(&job_pool.work_ready, &job_pool.lock);
+        }
+
+        bool stop = job_pool.stopping && job_pool.queued == 0;
+        pthread_mutex_unlock(&job_pool.lock);
+
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+
+/*
+ * Starts the pool, with a worker per CPU. Load and save jobs spend most of their time waiting on the disk, so
+ * there are at least JOBS_MIN_WORKERS even on a single CPU.
+ * Returns 0, or -1 if the eventfd or the first worker couldn't be created.
+ * */
+int jobs_init() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < JOBS_MIN_WORKERS ? JOBS_MIN_WORKERS : cpus > JOBS_MAX_WORKERS ? JOBS_MAX_WORKERS : (int) cpus;
+
+    memset(&job_pool, 0, sizeof(struct JobPool));
+    pthread_mutex_init(&job_pool.lock, NULL);
+    pthread_cond_init(&job_pool.work_ready, NULL);
+    pthread_cond_init(&job_pool.finished, NULL);
+
+    job_pool.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (job_pool.event_fd == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&job_pool.deques[i].lock, NULL);
+
+        if (pthread_create(&job_pool.workers[i], NULL, jobs_worker, (void*) (intptr_t) i) != 0) {
+            pthread_mutex_destroy(&job_pool.deques[i].lock);
+            break;
+        }
+
+        job_pool.worker_count++;
+    }
+
+    return job_pool.worker_count > 0 ? 0 : -1;
+}
+
+
+/*
+ * Queues a job. Called from the UI thread, or from a running job. A job submitted by another job goes on its
+ * worker's own deque; the UI thread's jobs are spread over the workers in turn.
+ * Returns 0, or MEM_ERROR if it couldn't be queued.
+ * */
+int jobs_submit(struct Job* job) {
+    int deque = current_worker;
+
+    __atomic_store_n(&job->state, JOB_QUEUED, __ATOMIC_RELAXED);
+
+    if (deque == -1) {
+        deque = job_pool.next_deque;
+        job_pool.next_deque = (job_pool.next_deque + 1) % job_pool.worker_count;
+    }
+
+    if (!job_deque_push(&job_pool.deques[deque], job)) {
+        return MEM_ERROR;
+    }
+
+    pthread_mutex_lock(&job_pool.lock);
+    job_pool.queued++;
+    pthread_cond_signal(&job_pool.work_ready);
+    pthread_mutex_unlock(&job_pool.lock);
+
+    return 0;
+}
+
+
+/*
+ * Moves the jobs that finished since the last call from the lock-free queue to the UI thread's own list, in the
+ * order they finished. UI thread only.
+ * */
+void jobs_collect() {
+    struct Job* job = __atomic_exchange_n(&job_pool.done, NULL, __ATOMIC_ACQUIRE);
+    struct Job* reversed = NULL;
+
+    while (job != NULL) {
+        struct Job* next = job->next_done;
+        job->next_done = reversed;
+        reversed = job;
+        job = next;
+    }
+
+    if (reversed == NULL) {
+        return;
+    }
+
+    if (job_pool.completed == NULL) {
+        job_pool.completed = reversed;
+    } else {
+        job_pool.completed_tail->next_done = reversed;
+    }
+
+    for (job_pool.completed_tail = reversed; job_pool.completed_tail->next_done != NULL;) {
+        job_pool.completed_tail = job_pool.completed_tail->next_done;
+    }
+}
+
+
+/*
+ * Waits for a job to finish. A job that hasn't started yet is run on the calling thread instead, so waiting never
+ * depends on a worker being free. Its completion isn't run; the waiter deals with the result.
+ * UI thread only. The job can be freed once this returns.
+ * */
+void job_wait(struct Job* job) {
+    bool removed = false;
+
+    for (int i = 0; i < job_pool.worker_count && !removed; i++) {
+        removed = job_deque_remove(&job_pool.deques[i], job);
+    }
+
+    if (removed) {
+        pthread_mutex_lock(&job_pool.lock);
+        job_pool.queued--;
+        pthread_mutex_unlock(&job_pool.lock);
+
+        if (!job_cancelled(job)) {
+            job->run(job);
+        }
+
+        __atomic_store_n(&job->state, JOB_FINISHED, __ATOMIC_RELEASE);
+        return;
+    }
+
+    pthread_mutex_lock(&job_pool.lock);
+
+    while (!job_finished(job)) {
+        pthread_cond_wait(&job_pool.finished, &job_pool.lock);
+    }
+
+    pthread_mutex_unlock(&job_pool.lock);
+
+    // Take it out of the completion queue so its completion never runs on a freed job
+    jobs_collect();
+
+    struct Job* prev = NULL;
+    for (struct Job* done = job_pool.completed; done != NULL; prev = done, done = done->next_done) {
+        if (done != job) {
+            continue;
+        }
+
+        if (prev == NULL) {
+            job_pool.completed = done->next_done;
+        } else {
+            prev->next_done = done->next_done;
+        }
+
+        if (job_pool.completed_tail == done) {
+            job_pool.completed_tail = prev;
+        }
+        break;
+    }
+}
+
+
+/*
+ * Runs the completions of the jobs that finished since the last call, in the order they finished, and clears the
+ * eventfd. Called by the main loop before drawing. Returns the number of jobs that finished.
+ * */
+int jobs_run_completions() {
+    uint64_t count;
+    int finished = 0;
+
+    read(job_pool.event_fd, &count, sizeof count);
+    jobs_collect();
+
+    while (job_pool.completed != NULL) {
+        struct Job* job = job_pool.completed;
+
+        job_pool.completed = job->next_done;
+        if (job_pool.completed == NULL) {
+            job_pool.completed_tail = NULL;
+        }
+
+        finished++;
+
+        // The worker marks the job finished just after posting it; the completion may free it, so wait for that
+        pthread_mutex_lock(&job_pool.lock);
+        while (!job_finished(job)) {
+            pthread_cond_wait(&job_pool.finished, &job_pool.lock);
+        }
+        pthread_mutex_unlock(&job_pool.lock);
+
+        if (job->complete != NULL) {
+            job->complete(job);
+        }
+    }
+
+    return finished;
+}
+
+
+/*
+ * Stops the workers once the jobs already queued have run, and frees the pool.
+ * */
+void jobs_shutdown() {
+    pthread_mutex_lock(&job_pool.lock);
+    job_pool.stopping = true;
+    pthread_cond_broadcast(&job_pool.work_ready);
+    pthread_mutex_unlock(&job_pool.lock);
+
+    for (int i = 0; i < job_pool.worker_count; i++) {
+        pthread_join(job_pool.workers[i], NULL);
+        pthread_mutex_destroy(&job_pool.deques[i].lock);
+        free(job_pool.deques[i].jobs);
+    }
+
+    close(job_pool.event_fd);
+    pthread_mutex_destroy(&job_pool.lock);
+    pthread_cond_destroy(&job_pool.work_ready);
+    pthread_cond_destroy(&job_pool.finished);
+    job_pool.worker_count = 0;
+}
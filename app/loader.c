@@ -0,0 +1,387 @@
+//
+// Background loading: files are read by a job (see jobs.c), and their lines are handed to the editor in batches as
+// they're built, so a buffer can be shown before the whole file is in memory. A file with a cached index (see
+// cache.c) is mapped and cut into lines at the cached offsets, without scanning it for newlines.
+//
+
+#include <sys/stat.h>
+
+// Lines in the first batch. Enough for the first screen, so it can be drawn as soon as they're in.
+#define LOADER_FIRST_LINES 256
+// Lines in every batch after the first
+#define LOADER_BATCH_LINES 4096
+
+
+/*
+ * Loader
+ * A file being read by a loader job.
+ *
+ * job, token: the job reading the file, and its cancellation token
+ * fp: the file, owned by the loader
+ * file_size: size of the file when loading started, for progress
+ * index: the file's cached index, or NULL. Owned by the loader
+ *
+ * Shared with the job, only accessed while holding lock:
+ * pending: lines built by the job that haven't been taken by the editor yet
+ * pending_count, pending_capacity: number of pending lines, and size of the pending array
+ * bytes_read: bytes of the file turned into lines so far
+ * done: the job has finished, pending holds the last of the lines
+ * failed: the job ran out of memory; the lines it built are still handed over
+ * stale: the index didn't match the file, so part of the file was scanned for newlines after all
+ * ready: signalled when lines are added to pending or the job finishes
+ *
+ * Only used by the editor's thread:
+ * finished: every line has been taken; the loader can be destroyed
+ * progress: bytes_read when lines were last taken
+ * */
+struct Loader {
+    struct Job job;
+    struct JobToken token;
+    FILE* fp;
+    int64_t file_size;
+    struct IndexCache* index;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    GapBuffer** pending;
+    int64_t pending_count;
+    int64_t pending_capacity;
+    int64_t bytes_read;
+    bool done;
+    bool failed;
+    bool stale;
+
+    bool finished;
+    int64_t progress;
+};
+
+
+void destroy_lines(GapBuffer** lines, int64_t count) {
+    for (int64_t i = 0; i < count; i++) {
+        DestroyGapBuffer(lines[i]);
+    }
+}
+
+
+/*
+ * Hands a batch of lines over to the editor. Returns false if loading was cancelled or the lines couldn't be
+ * queued, in which case the lines are destroyed and the job should stop.
+ * */
+bool loader_publish(struct Loader* loader, GapBuffer** lines, int64_t count, int64_t bytes) {
+    pthread_mutex_lock(&loader->lock);
+
+    if (job_cancelled(&loader->job)) {
+        pthread_mutex_unlock(&loader->lock);
+        destroy_lines(lines, count);
+        return false;
+    }
+
+    if (loader->pending_count + count > loader->pending_capacity) {
+        int64_t capacity = loader->pending_capacity == 0 ? LOADER_BATCH_LINES : loader->pending_capacity;
+
+        while (loader->pending_count + count > capacity) {
+            capacity *= 2;
+        }
+
+        GapBuffer** pending = realloc(loader->pending, sizeof(GapBuffer*) * capacity);
+
+        if (pending == NULL) {
+            loader->failed = true;
+            pthread_mutex_unlock(&loader->lock);
+            destroy_lines(lines, count);
+            return false;
+        }
+
+        loader->pending = pending;
+        loader->pending_capacity = capacity;
+    }
+
+    memcpy(loader->pending + loader->pending_count, lines, sizeof(GapBuffer*) * count);
+    loader->pending_count += count;
+    loader->bytes_read += bytes;
+
+    pthread_cond_signal(&loader->ready);
+    pthread_mutex_unlock(&loader->lock);
+    return true;
+}
+
+
+/*
+ * Loads a file with a cached index: the file is mapped, and each line is copied straight from the mapping into its
+ * gap buffer. Every offset is checked as it's used; once one doesn't end a line of the file, the rest of the file
+ * is scanned for newlines instead, and the loader is marked stale.
+ * The file is only mapped if it's still the size the index was taken at: one truncated since the index was opened
+ * (e.g. a rotated log) would fault when the mapping is read past its end.
+ * Returns false if the file changed size or couldn't be mapped, before any line was published.
+ * */
+bool loader_run_indexed(struct Loader* loader, GapBuffer** batch) {
+    const int64_t* offsets = loader->index->offsets;
+    int64_t line_count = loader->index->header->line_count;
+    int64_t size = loader->index->header->file_size;
+    int batch_count = 0;
+    int batch_limit = LOADER_FIRST_LINES;
+    int64_t batch_bytes = 0;
+    bool failed = false;
+    bool stale = false;
+    struct stat st;
+
+    if (fstat(fileno(loader->fp), &st) != 0 || st.st_size != size) {
+        return false;
+    }
+
+    if (size == 0) {
+        return true;
+    }
+
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(loader->fp), 0);
+
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    int64_t pos = 0;
+    int64_t row;
+    for (row = 0; pos < size && !failed; row++) {
+        int64_t next = -1;
+
+        // The next line ends at the next offset, with a newline (or the end of the file) right before it
+        if (!stale && row < line_count && offsets[row] == pos && offsets[row + 1] > pos && offsets[row + 1] <= size + 1 &&
+            (offsets[row + 1] - 1 == size || map[offsets[row + 1] - 1] == '\n')) {
+            next = offsets[row + 1];
+        } else {
+            char* newline = memchr(map + pos, '\n', size - pos);
+
+            next = newline != NULL ? newline - map + 1 : size + 1;
+            stale = true;
+        }
+
+        int64_t read = (next <= size ? next : size) - pos;
+        int64_t len = next - 1 - pos;
+        GapBuffer* line = CreateGapBuffer(len + TextBufferLoadGap(read));
+
+        if (line == NULL) {
+            failed = true;
+            break;
+        }
+
+        if (GapBufferInsertString(line, map + pos, len) != 0) {
+            DestroyGapBuffer(line);
+            failed = true;
+            break;
+        }
+
+        batch[batch_count++] = line;
+        batch_bytes += read;
+        pos = next;
+
+        if (batch_count == batch_limit) {
+            if (!loader_publish(loader, batch, batch_count, batch_bytes)) {
+                batch_count = 0;
+                break;
+            }
+
+            batch_count = 0;
+            batch_bytes = 0;
+            batch_limit = LOADER_BATCH_LINES;
+        }
+    }
+
+    // Lines past the end of the file mean the index was for something else too
+    stale |= !failed && row < line_count;
+
+    if (batch_count > 0) {
+        loader_publish(loader, batch, batch_count, batch_bytes);
+    }
+
+    munmap(map, size);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->failed |= failed;
+    loader->stale = stale;
+    pthread_mutex_unlock(&loader->lock);
+
+    return true;
+}
+
+
+/*
+ * The loader job. Reads the file a line at a time, building lines the same way CreateTextBufferFromFile does,
+ * and publishes them in batches: a small first batch so the first screen shows up quickly, then bigger ones.
+ * */
+void loader_run(struct Job* job) {
+    struct Loader* loader = job->arg;
+
+    GapBuffer** batch = malloc(sizeof(GapBuffer*) * LOADER_BATCH_LINES);
+    int batch_count = 0;
+    int batch_limit = LOADER_FIRST_LINES;
+    int64_t batch_bytes = 0;
+    bool failed = batch == NULL;
+
+    if (!failed && loader->index != NULL && loader_run_indexed(loader, batch)) {
+        free(batch);
+
+        pthread_mutex_lock(&loader->lock);
+        loader->done = true;
+        pthread_cond_signal(&loader->ready);
+        pthread_mutex_unlock(&loader->lock);
+        return;
+    }
+
+    // An index that couldn't be used is no good for the cache either
+    if (loader->index != NULL) {
+        pthread_mutex_lock(&loader->lock);
+        loader->stale = true;
+        pthread_mutex_unlock(&loader->lock);
+    }
+
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+
+    while (!failed && (read = getline(&line, &len, loader->fp)) != -1) {
+        batch_bytes += read;
+
+        // We dont want to include the newline character
+        if (line[read - 1] == '\n') {
+            line[read - 1] = '\0';
+        }
+
+        int64_t line_gap_size = TextBufferLoadGap(read);
+        GapBuffer* gap_buffer = CreateGapBufferFromString(line, line_gap_size);
+
+        if (gap_buffer == NULL) {
+            failed = true;
+            break;
+        }
+
+        batch[batch_count++] = gap_buffer;
+
+        if (batch_count == batch_limit) {
+            if (!loader_publish(loader, batch, batch_count, batch_bytes)) {
+                batch_count = 0;
+                break;
+            }
+
+            batch_count = 0;
+            batch_bytes = 0;
+            batch_limit = LOADER_BATCH_LINES;
+        }
+    }
+
+    free(line);
+
+    if (batch_count > 0) {
+        loader_publish(loader, batch, batch_count, batch_bytes);
+    }
+    free(batch);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->done = true;
+    loader->failed |= failed;
+    pthread_cond_signal(&loader->ready);
+    pthread_mutex_unlock(&loader->lock);
+}
+
+
+/*
+ * Starts a job loading the file fp, using its cached index if one is given. The loader takes ownership of fp and
+ * index.
+ * Returns the loader, or NULL if the job couldn't be started; fp and index are left to the caller then.
+ * */
+struct Loader* loader_start(FILE* fp, struct IndexCache* index) {
+    struct Loader* loader = calloc(1, sizeof(struct Loader));
+    struct stat st;
+
+    if (loader == NULL) {
+        return NULL;
+    }
+
+    loader->fp = fp;
+    loader->index = index;
+    loader->file_size = fstat(fileno(fp), &st) == 0 ? st.st_size : 0;
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->ready, NULL);
+    job_init(&loader->job, loader_run, NULL, loader, &loader->token);
+
+    if (jobs_submit(&loader->job) != 0) {
+        pthread_mutex_destroy(&loader->lock);
+        pthread_cond_destroy(&loader->ready);
+        free(loader);
+        return NULL;
+    }
+
+    return loader;
+}
+
+
+/*
+ * Blocks until at least `lines` lines are waiting to be taken, or the job is done.
+ * */
+void loader_wait(struct Loader* loader, int64_t lines) {
+    pthread_mutex_lock(&loader->lock);
+
+    while (!loader->done && loader->pending_count < lines) {
+        pthread_cond_wait(&loader->ready, &loader->lock);
+    }
+
+    pthread_mutex_unlock(&loader->lock);
+}
+
+
+/*
+ * Appends the lines built so far to text. Sets finished once the job is done and every line was taken.
+ * Returns the number of lines appended, or MEM_ERROR if the lines couldn't be appended or the job failed.
+ * */
+int64_t loader_take(struct Loader* loader, TextBuffer* text) {
+    pthread_mutex_lock(&loader->lock);
+
+    int64_t count = loader->pending_count;
+    int err = TextBufferAppendLines(text, loader->pending, count);
+
+    if (err == 0) {
+        loader->pending_count = 0;
+        loader->progress = loader->bytes_read;
+        loader->finished = loader->done;
+    }
+
+    if (loader->failed) {
+        err = MEM_ERROR;
+    }
+
+    pthread_mutex_unlock(&loader->lock);
+
+    return err != 0 ? err : count;
+}
+
+
+/*
+ * Returns how much of the file has been taken, in percent.
+ * */
+int loader_progress(struct Loader* loader) {
+    if (loader->file_size <= 0) {
+        return 100;
+    }
+
+    return (int) (loader->progress * 100 / loader->file_size);
+}
+
+
+/*
+ * Stops the job if it's still running and frees the loader, along with any lines that weren't taken.
+ * */
+void loader_destroy(struct Loader* loader) {
+    job_token_cancel(&loader->token);
+    job_wait(&loader->job);
+
+    destroy_lines(loader->pending, loader->pending_count);
+    free(loader->pending);
+    fclose(loader->fp);
+    if (loader->index != NULL) {
+        index_cache_close(loader->index);
+    }
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->ready);
+    free(loader);
+}
@@ -0,0 +1,116 @@
+//
+// Keyboard macros: the bytes of the keys typed while recording, fed back to read_char as if they were typed again.
+// Playing a macro runs process_keypress on its bytes directly, without drawing in between, so a macro applied to
+// every line of a large file costs the edits and nothing else; the screen is drawn once, when it's done.
+//
+
+// Most bytes a macro holds
+#define MACRO_MAX_BYTES 65536
+
+
+/*
+ * Macro
+ * keys: the bytes read while recording, escape sequences included
+ * len: bytes in keys
+ * capacity: size of the keys array
+ * recording: bytes read from the terminal are added to keys
+ * overflowed: more than MACRO_MAX_BYTES were read while recording; the macro isn't kept
+ * playing: bytes are read from keys, from play_pos, rather than from the terminal
+ * play_pos: the next byte played
+ * */
+struct Macro {
+    char* keys;
+    int len;
+    int capacity;
+    bool recording;
+    bool overflowed;
+    bool playing;
+    int play_pos;
+};
+
+
+/*
+ * Starts recording a new macro, in place of the last one.
+ * */
+void macro_start(struct Macro* macro) {
+    macro->len = 0;
+    macro->recording = true;
+    macro->overflowed = false;
+}
+
+
+/*
+ * Adds a byte read while recording.
+ * Returns 0, -1 if the macro is full, or MEM_ERROR.
+ * */
+int macro_add(struct Macro* macro, char c) {
+
+    if (macro->len == MACRO_MAX_BYTES) {
+        macro->overflowed = true;
+        return -1;
+    }
+
+    if (macro->len == macro->capacity) {
+        int capacity = macro->capacity == 0 ? 64 : macro->capacity * 2;
+        char* keys = realloc(macro->keys, capacity);
+
+        if (keys == NULL) {
+            return MEM_ERROR;
+        }
+
+        macro->keys = keys;
+        macro->capacity = capacity;
+    }
+
+    macro->keys[macro->len++] = c;
+    return 0;
+}
+
+
+/*
+ * Drops the last byte recorded, e.g. that of a key that controls recording rather than being part of the macro.
+ * */
+void macro_drop_last(struct Macro* macro) {
+
+    if (macro->len > 0 && !macro->overflowed) {
+        macro->len--;
+    }
+}
+
+
+/*
+ * Stops recording. A macro that overflowed is dropped.
+ * Returns the length of the macro, or -1 if it overflowed.
+ * */
+int macro_stop(struct Macro* macro) {
+    macro->recording = false;
+
+    if (macro->overflowed) {
+        macro->len = 0;
+        return -1;
+    }
+
+    return macro->len;
+}
+
+
+/*
+ * Takes the next byte of the macro being played.
+ * Returns 1, or 0 once every byte was played.
+ * */
+ssize_t macro_next(struct Macro* macro, char* c) {
+
+    if (macro->play_pos == macro->len) {
+        return 0;
+    }
+
+    *c = macro->keys[macro->play_pos++];
+    return 1;
+}
+
+
+void macro_destroy(struct Macro* macro) {
+    free(macro->keys);
+    macro->keys = NULL;
+    macro->len = macro->capacity = 0;
+}
@@ -1,3 +1,6 @@
+// For pipe2
+#define _GNU_SOURCE
+
 #include <libgen.h>
 #include <string.h>
 #include <stdio.h>
@@ -6,13 +9,47 @@
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <sys/errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
 #include "../buffer/buffer.h"
+#include "../buffer/diff.h"
 #include "defs.h"
 
 #include "visual.c"
+#include "jobs.c"
+#include "idle.c"
+#include "cache.c"
+#include "loader.c"
+#include "saver.c"
+#include "replace.c"
+#include "filter.c"
+#include "diffs.c"
+#include "search.c"
+#include "grep.c"
+#include "buffers.c"
+#include "follow.c"
+#include "stats.c"
+#include "cursors.c"
+#include "macro.c"
+#include "replay.c"
 
 /* Constants */
+
+// Idle compaction. Lines with a gap longer than COMPACT_MAX_GAP are shrunk while the editor is idle.
+// Lines within COMPACT_CURSOR_RADIUS of the cursor are skipped; they're the ones likely to be edited next.
+// Over the memory budget (TED_MEMORY_BUDGET, in bytes with an optional K/M/G suffix), gaps are shrunk
+// to COMPACT_BUDGET_MAX_GAP everywhere but the cursor's line, and clean buffers are evicted.
+#define COMPACT_MAX_GAP 128
+#define COMPACT_BUDGET_MAX_GAP 0
+#define COMPACT_CURSOR_RADIUS 64
+// Lines idle compaction goes over in one step
+#define COMPACT_STEP_LINES 16384
+
+// How long read_char waits for a key before treating the editor as idle; the same as the terminal's VTIME
+#define INPUT_TIMEOUT_MS 100
+
 enum specialKeys {
     BACKSPACE = 127,
     ARROW_UP = 1000,
@@ -23,24 +60,76 @@ enum specialKeys {
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DEL_KEY
+    DEL_KEY,
+    REFRESH    // not a key: returned by read_char when the screen should be redrawn without any input
 };
 
 /* structs */
 
+/*
+ * CompactPass
+ * Where idle compaction got to, so its next step can go on from there.
+ * over_budget: the buffers used more than the memory budget when the pass started, so every buffer is compacted
+ *              (and clean ones evicted), rather than only the active buffer's edited lines
+ * buffer, row: the next line to compact
+ * usage: memory the buffers used, less what the pass gave back so far
+ * version: the active buffer's version when the pass started
+ * */
+struct CompactPass {
+    bool over_budget;
+    int buffer;
+    int64_t row;
+    long usage;
+    unsigned long version;
+};
+
+
 // Main state & buffers
 struct EditorState {
 
     // configuration states
     struct termios orig_termios;
 
-    // File states
-    char* file_name;
-    char* file_path;         // path to file.
-    bool flushed;             // was the most recent changes flushed to disk
-
     // buffer states
-    TextBuffer* current_buffer;
+    struct BufferList buffer_list;
+    struct OpenBuffer* buffer;   // the active buffer; its file, TextBuffer and modified state
+    struct CursorSet extra_cursors;  // cursors that edit along with the active buffer's cursor
+
+    // Input states
+    int input_fd;            // where keys are read from; the terminal, or a script when replaying
+    int record_fd;           // keys read are also written here when recording, -1 otherwise
+    struct Macro macro;      // the keyboard macro; while it's played, keys are read from it instead
+
+    // Headless replay states. A headless editor draws into the virtual screen but never writes to a terminal.
+    bool headless;
+    struct ReplayStats replay_stats;
+
+    // Follow mode states
+    int inotify_fd;          // watches followed files, -1 until a file is first followed
+
+    // Memory states
+    long memory_budget;      // total bytes the buffers should fit in, 0 for no budget
+
+    // Idle states: work done on the UI thread while there's no input (see idle.c)
+    struct IdleScheduler idle;
+    struct IdleTask compact_task;
+    struct IdleTask diff_task;
+    struct IdleTask index_task;
+    struct CompactPass compact_pass;
+
+    // Diff states. The gutter marking changed lines is shown when screen.gutter isn't 0
+    bool diff_report;        // say how the active buffer's diff came out once it's done
+
+    // Find states
+    char* last_find;         // what was last searched for, searched for again when the prompt is left empty
+    long search_index_budget;  // most memory a buffer's search index may take up, 0 to never index
+
+    // Prompt states (prompt_label is NULL when not prompting)
+    const char* prompt_label;
+    const char* prompt_text;
+
+    // Message shown in place of the status line until the next keypress. Empty when there's no message.
+    char status_message[256];
 
     // Window states
     struct VirtualScreen screen;
@@ -59,10 +148,42 @@ void set_window_size();
 void disableRawMode();
 void enableRawMode();
 
+/* Buffers */
+int switch_buffer(int index);
+void poll_loaders();
+void save_finished(struct Job* job);
+void toggle_follow();
+bool follow_buffers();
+bool compact_buffers(struct IdleTask* task);
+long parse_size(const char* str);
+void open_file_prompt();
+void replace_all_prompt();
+void replace_finished(struct Replace* replace);
+void filter_prompt();
+void filter_finished(struct Job* job);
+void toggle_diff();
+void diff_finished(struct Job* job);
+bool diff_buffers(struct IdleTask* task);
+void find_prompt();
+void index_finished(struct Job* job);
+bool index_buffers(struct IdleTask* task);
+void grep_prompt();
+void grep_finished(struct Grep* grep);
+void poll_greps();
+void open_grep_result();
+
+/* Keyboard macros */
+void toggle_macro_recording();
+void play_macro_prompt();
+void play_macro();
+int64_t play_macro_lines(struct OpenBuffer* ob, int64_t first, int64_t count);
+
 /* Screen Manipulation */
 void render_screen();
 void draw_screen();
 void draw_status_line(int line_size);
+int draw_prompt_line(int line_size);
+void draw_message_line(int line_size);
 
 
 /* Cursor Movement */
@@ -71,20 +192,40 @@ void down_arrow();
 void right_arrow();
 void left_arrow();
 
+/* Multiple cursors */
+void add_cursor_below();
+void insert_char(char c);
+void backspace();
+
+/* Deletion */
+void delete_forward();
+void set_mark();
+void delete_region();
+
+/* Bookmarks */
+void toggle_bookmark();
+void next_bookmark();
+
 /* Input */
+void on_idle();
+bool input_pending();
+ssize_t read_input(char* c);
+void finish_replay();
+bool buffers_loading();
+bool buffers_saving();
+bool buffers_grepping();
 int read_char();
 void process_keypress();
-
-/* File Manipulation*/
-int flush_buffer_to_file();
-int load_file_and_initialize_buffer();
-
+char* prompt_input(const char* label, bool allow_empty);
 
 /* Main */
 int main(int argc, char* argv[]) {
     initialize(argc, argv);
 
     while (1) {
+        jobs_run_completions();
+        poll_loaders();
+        poll_greps();
         draw_screen();
         render_screen();
         process_keypress();
@@ -96,341 +237,1585 @@ int main(int argc, char* argv[]) {
 
 void initialize(int argc, char* argv[]){
 
-    // Get file path information
+    editor_state.input_fd = STDIN_FILENO;
+    editor_state.record_fd = -1;
+    editor_state.inotify_fd = -1;
+    bool follow = false;
+    bool index_cache = false;
+    editor_state.screen.width = DEFAULT_HEADLESS_WIDTH;
+    editor_state.screen.height = DEFAULT_HEADLESS_HEIGHT;
+
+    /*
+     * Options:
+     * --replay <script>: run headless, reading keys from script, and print measurements when it ends
+     * --record <script>: write every key read to script, to replay later
+     * --size <cols>x<rows>: screen size when headless (default 80x24)
+     * --follow: follow the first file, see toggle_follow
+     * --index-cache: keep the line index of files in a cache, so they reopen without a newline scan, see cache.c
+     * */
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc){
+            editor_state.input_fd = open(argv[++i], O_RDONLY);
+            editor_state.headless = true;
+
+            if (editor_state.input_fd == -1){
+                panic("Failed to open replay script");
+            }
+
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+            editor_state.record_fd = open(argv[++i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+            if (editor_state.record_fd == -1){
+                panic("Failed to open record script");
+            }
+
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc){
+            if (sscanf(argv[++i], "%dx%d", &editor_state.screen.width, &editor_state.screen.height) != 2 ||
+                editor_state.screen.width <= 0 || editor_state.screen.height <= 1){
+                panic("Invalid size");
+            }
+
+        } else if (strcmp(argv[i], "--follow") == 0){
+            follow = true;
+
+        } else if (strcmp(argv[i], "--index-cache") == 0){
+            index_cache = true;
+
+        } else {
+            // Get file path information. Every file given is added to the buffer list, but only the first is loaded.
+            buffer_list_add(&editor_state.buffer_list, argv[i]);
+        }
+    }
+
     // TODO: Dont attempt to load file if no path is given.
-    if (argc >= 2){
-        editor_state.file_path = argv[1];
+    if (editor_state.buffer_list.count == 0){
+        buffer_list_add(&editor_state.buffer_list, "Empty Buffer");
     }
-    else {
-        editor_state.file_path = "Empty Buffer";
+
+    char* budget = getenv("TED_MEMORY_BUDGET");
+    if (budget != NULL){
+        editor_state.memory_budget = parse_size(budget);
+    }
+
+    char* index_budget = getenv("TED_SEARCH_INDEX");
+    editor_state.search_index_budget = index_budget != NULL ? parse_size(index_budget) : SEARCH_INDEX_MAX_BYTES;
+
+    // The gutter is kept up to date first, as it's on screen
+    idle_add(&editor_state.idle, &editor_state.diff_task, IDLE_PRIORITY_VISIBLE, diff_buffers, NULL);
+    idle_add(&editor_state.idle, &editor_state.compact_task, IDLE_PRIORITY_MEMORY, compact_buffers,
+             &editor_state.compact_pass);
+    idle_add(&editor_state.idle, &editor_state.index_task, IDLE_PRIORITY_BACKGROUND, index_buffers, NULL);
+
+    // A command that stops reading its input (see filter.c) would otherwise kill the editor
+    signal(SIGPIPE, SIG_IGN);
+
+    if (jobs_init() != 0){
+        panic("Failed to start worker threads");
+    }
+
+    // Without a cache directory, files are just loaded the usual way
+    if (index_cache){
+        index_cache_init();
     }
-    editor_state.file_name = basename(editor_state.file_path);
 
     // Loads the file and initialize the textbuffer
-    load_file_and_initialize_buffer();
+    if (switch_buffer(0) != 0){
+        panic("Failed to load file");
+    }
+
+    if (follow){
+        toggle_follow();
+    }
 
     // initialize screen
-    enableRawMode();
-    set_window_size();
+    if (editor_state.headless){
+        replay_start(&editor_state.replay_stats);
+    } else {
+        enableRawMode();
+        set_window_size();
+    }
 
-    // double the buffer for the screen to allow escape codes to be sent without overflowing
-    editor_state.screen.len = editor_state.screen.height * editor_state.screen.width * sizeof(char) * 2;
+    // double the buffer for the screen to allow escape codes to be sent without overflowing, plus room to highlight
+    // the anchors on screen and colour the diff gutter
+    editor_state.screen.len = editor_state.screen.height * editor_state.screen.width * sizeof(char) * 2 +
+                              SCREEN_ANCHOR_BYTES + editor_state.screen.height * SCREEN_GUTTER_BYTES;
     editor_state.screen.buffer = malloc(editor_state.screen.len);
     editor_state.screen.buf_pos = 0;
 
-    // the line the screen starts printing from
-    editor_state.screen.render_start_line = 0;
+    // What's sent is at most the frame, plus the codes to move to each row and clear it, and to scroll
+    editor_state.screen.output_len = editor_state.screen.len + editor_state.screen.height * 32 + 64;
+    editor_state.screen.output = malloc(editor_state.screen.output_len);
+    editor_state.screen.row_starts = malloc(sizeof(int) * (editor_state.screen.height + 1));
+    editor_state.screen.frame_rows = malloc(sizeof(uint64_t) * editor_state.screen.height);
+    editor_state.screen.shown_rows = malloc(sizeof(uint64_t) * editor_state.screen.height);
+
+    if (editor_state.screen.buffer == NULL || editor_state.screen.output == NULL ||
+        editor_state.screen.row_starts == NULL || editor_state.screen.frame_rows == NULL ||
+        editor_state.screen.shown_rows == NULL){
+        panic("Failed to allocate the screen");
+    }
 
-    editor_state.flushed = true;
+    // the line the screen starts printing from
+    editor_state.screen.render_start_line = editor_state.buffer->render_start_line;
 }
 
+
 /*
- * Returns:
- * -1: If there was an issue with opening the file; the buffer is still initialized as a blank buffer
- * MEM_ERROR if it wasn't successfully loaded, or there was an issue resizing/manipulating/initializing the TextBuffer.
+ * Makes the buffer at index the active buffer, loading it from disk if it was evicted.
+ * The view position of the previously active buffer is saved so it can be restored when switching back.
+ * Afterwards, idle buffers are evicted if too many are in memory.
+ *
+ * Returns 0 on success or MEM_ERROR; the active buffer is unchanged on error.
  * */
-int load_file_and_initialize_buffer() {
+int switch_buffer(int index){
+    struct BufferList* list = &editor_state.buffer_list;
+    struct OpenBuffer* ob = &list->buffers[index];
 
-    // We'll open all files in read mode. If there's no file, we'll just have a blank buffer.
-    // Only when writing to file, will we rewrite or create + write to the file.
-    FILE* fp = fopen(editor_state.file_path, "r");
-
-    // CreateTextBufferFromFile handles NULL values so we can just pass editor_state.fp and check the return
-    editor_state.current_buffer = CreateTextBufferFromFile(fp);
+    if (buffer_load(ob) != 0){
+        return MEM_ERROR;
+    }
 
-    if (editor_state.current_buffer == NULL){
+    // Replays must see the same buffer every time, so they don't edit while loading
+    if (editor_state.headless && buffer_finish_load(ob) != 0){
         return MEM_ERROR;
     }
 
-    if (fp == NULL){
-        return -1;
+    if (editor_state.buffer != NULL){
+        editor_state.buffer->render_start_line = editor_state.screen.render_start_line;
+        editor_state.buffer->render_start_col = editor_state.screen.render_start_col;
     }
 
-    fclose(fp);
+    list->active = index;
+    editor_state.buffer = ob;
+    cursor_set_clear(&editor_state.extra_cursors);
+    editor_state.screen.render_start_line = ob->render_start_line;
+    editor_state.screen.render_start_col = ob->render_start_col;
+    ob->last_used = ++list->clock;
+
+    buffer_list_evict_idle(list);
     return 0;
 }
 
-void cleanup(){
-
-    // Clear screen
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
 
-    // free memory for screen
-    free(editor_state.screen.buffer);
+/*
+ * Adds the lines loaded in the background since the last poll to their buffers.
+ * */
+void poll_loaders(){
+    struct BufferList* list = &editor_state.buffer_list;
 
-    // Free the text buffer
-    DestroyTextBuffer(editor_state.current_buffer);
+    for (int i = 0; i < list->count; i++){
+        if (buffer_poll_loader(&list->buffers[i]) < 0){
+            panic("Failed to load file");
+        }
+    }
 }
 
-void panic(const char* message){
-    // Clear screen
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    // Enable cursor
-    write(STDOUT_FILENO,"\x1b[?25h", 6);
-    perror(message);
-    exit(1);
-}
 
-void set_window_size() {
-    struct winsize ws;
+/*
+ * Completion of a save job: marks the buffer saved, or reports that writing it failed on the message line.
+ * */
+void save_finished(struct Job* job){
+    struct Saver* saver = job->arg;
+    struct OpenBuffer* ob = saver->owner;
 
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-        // panic("Failed to get window size");
+    if (buffer_finish_save(ob) != 0){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Failed to save %s", ob->file_name);
+    }
+}
 
-        // manually get window size
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
-            panic("Failed to get window size");
-        }
 
-        // read the response
-        char buf[32];
-        for (int i = 0; i < sizeof(buf); i++) {
-            if (read(STDIN_FILENO, &buf[i], 1) != 1) {
-                panic("Failed to get window size");
-            }
+/*
+ * Starts or stops following the active buffer's file, like tail -f: what's appended to the file is added to
+ * the buffer as it's written, and the view stays at the bottom while the cursor is on the last line.
+ * */
+void toggle_follow(){
+    struct OpenBuffer* ob = editor_state.buffer;
 
-            if (buf[i] == 'R') {
-                buf[i + 1] = '\0';
-                break;
-            }
-        }
+    if (ob->following){
+        follow_stop(ob, editor_state.inotify_fd);
+        return;
+    }
 
-        // parse the response and set the windows size
-        if (sscanf(buf, "%d;%d", &editor_state.screen.height, &editor_state.screen.width) != 2) {
-            panic("Failed to get windows size");
+    if (editor_state.inotify_fd == -1){
+        editor_state.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+        if (editor_state.inotify_fd == -1){
+            return;
         }
+    }
 
-    } else {
-        editor_state.screen.height = ws.ws_row;
-        editor_state.screen.width = ws.ws_col;
+    if (follow_start(ob, editor_state.inotify_fd) == MEM_ERROR){
+        panic("Failed to load file");
     }
-}
 
-void disableRawMode() {
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editor_state.orig_termios) == -1) {
-        panic("tcsetattr");
+    // Start at the bottom, like tail -f
+    if (ob->following){
+        TextBufferMoveCursor(ob->text, ob->text->last_line_loc, 0);
     }
 }
 
-// Test raw mode
-void enableRawMode(){
 
-    if(tcgetattr(STDIN_FILENO, &editor_state.orig_termios) == -1) {
-        panic("tcgetattr");
+/*
+ * Brings followed buffers up to date with their files. Buffers whose cursor was on the last line keep it
+ * there, so the view stays pinned to the bottom until the cursor is moved up.
+ * Returns whether the screen should be redrawn.
+ * */
+bool follow_buffers(){
+    struct BufferList* list = &editor_state.buffer_list;
+    bool redraw = false;
+
+    if (editor_state.inotify_fd == -1){
+        return false;
     }
 
-    atexit(disableRawMode);
+    follow_read_events(editor_state.inotify_fd, list);
 
-    struct termios raw = editor_state.orig_termios;
+    for (int i = 0; i < list->count; i++){
+        struct OpenBuffer* ob = &list->buffers[i];
 
-    /*
-     * Local modes:
-     * Here we are disabling:
-     * ECHO: don't echo input characters back to the screen.
-     * ICANON: canonical mode. Now each character is read as soon as it is typed.
-     * ISIG: SIGINT/SIGSTOP signal interpretation. Now Ctrl-C/Ctrl-Z won't send signals to the process.
-     * IEXTEN: extended input processing. Now Ctrl-V/Ctrl-C/Ctrl-D won't be interpreted as special characters.
-     *
-     * | - logic OR
-     * & - logic AND
-     * ~ - logic XOR
-     */
-    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+        // A buffer being saved is writing its own file; it's checked once the save is done
+        if (!ob->following || ob->saver != NULL || (!ob->follow_changed && ob->follow_watch != -1)){
+            continue;
+        }
 
-    /*
-     * Input modes:
-     * Here we're disabling:
-     * IXON: disable software flow control.
-     * ICRNL: maps CR to NL (otherwise, it will be CR+NL). Now Ctrl-M will be ignored.
-     * BRKINT: disable break processing. Now break condition will be ignored.
-     * INPCK: disable parity checking. Now parity errors will be ignored. (This doesn't matter anymore)
-     * ISTRIP: disable stripping of eighth bit. Now eighth bit will be ignored. (This probably doesn't matter)
-     **/
-    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK);
+        bool pinned = ob->text->cursorRow == ob->text->last_line_loc;
+        int result = follow_update(ob, editor_state.inotify_fd);
 
-    /*
-     * Output modes:
-     * Here we're disabling:
-     * OPOST: output processing. Now output processing is disabled.
-     *
-     **/
-    raw.c_oflag &= ~(OPOST);
+        if (result == MEM_ERROR){
+            panic("Failed to follow file");
+        }
 
-    /*
-     * Control modes:
-     * Here we're disabling:
-     * CS8: 8-bit characters. Now 8-bit characters will be used.
-     **/
-    raw.c_cflag |= (CS8);
+        if (result == FOLLOW_RELOADED && ob == editor_state.buffer){
+            cursor_set_clear(&editor_state.extra_cursors);
+            editor_state.screen.render_start_line = 0;
+            editor_state.screen.render_start_col = 0;
+        }
 
-    /*
-     * c_cc - control characters.
-     * VMIN: minimum number of characters to read. Set to 0 so that we can read whatever is available.
-     * VTIME: time to wait for characters to be available. Set to 1 (100ms).
-     **/
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+        if (result == FOLLOW_UNCHANGED){
+            continue;
+        }
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
-        panic("tcsetattr");
+        if (pinned || result == FOLLOW_RELOADED){
+            TextBufferMoveCursor(ob->text, ob->text->last_line_loc, 0);
+        }
+
+        redraw |= ob == editor_state.buffer;
     }
+
+    return redraw;
 }
 
 
-void screen_append(const char *str, int size) {
+/*
+ * Compacts rows first to last of text down to max_gap, leaving out the lines within radius of the cursor.
+ * Returns the number of bytes given back.
+ * */
+long compact_rows(TextBuffer* text, int64_t first, int64_t last, int64_t radius, int64_t max_gap){
+    int64_t before = text->cursorRow - radius;
+    int64_t after = text->cursorRow + radius;
+    long freed = 0;
 
-    if (editor_state.screen.buffer != NULL && (editor_state.screen.len - editor_state.screen.buf_pos) > size) {
-        memcpy(editor_state.screen.buffer + editor_state.screen.buf_pos, str, size);
-        editor_state.screen.buf_pos += size;
+    if (first < before){
+        freed += TextBufferCompactLines(text, first, (last < before - 1 ? last : before - 1) - first + 1, max_gap);
     }
-}
+    if (last > after){
+        int64_t from = first > after + 1 ? first : after + 1;
 
+        freed += TextBufferCompactLines(text, from, last - from + 1, max_gap);
+    }
 
-/* Display */
-void render_screen() {
-
-    // flush internal screen to display
-    write(STDOUT_FILENO, editor_state.screen.buffer, strlen(editor_state.screen.buffer));
+    return freed;
 }
 
 
-void draw_screen(){
+/*
+ * Idle task: gives back memory held by the gaps of lines that aren't near the cursor, COMPACT_STEP_LINES lines a
+ * step. When the buffers use more than the memory budget, all gaps but the cursor line's are closed, in every
+ * resident buffer, and if that isn't enough every clean buffer but the active one is evicted.
+ * */
+bool compact_buffers(struct IdleTask* task){
+    struct CompactPass* pass = task->arg;
+    struct BufferList* list = &editor_state.buffer_list;
 
-    editor_state.screen.buf_pos = 0; // reset the screen
+    // A pass over the active buffer is started over when another buffer became active since
+    if (!task->started || (!pass->over_budget && pass->buffer != list->active)){
+        long usage = 0;
 
-    // Disable cursor
-    screen_append("\x1b[?25l", 6);
+        for (int i = 0; i < list->count; i++){
+            if (list->buffers[i].text != NULL){
+                usage += TextBufferMemoryUsage(list->buffers[i].text);
+            }
+        }
 
-    // Clear screen
-    screen_append("\x1b[2J", 4);
+        task->started = true;
+        pass->over_budget = editor_state.memory_budget != 0 && usage > editor_state.memory_budget;
+        pass->buffer = pass->over_budget ? 0 : list->active;
+        pass->row = 0;
+        pass->usage = usage;
+        pass->version = editor_state.buffer->text->version;
+        return true;
+    }
 
-    // Move cursor to the top
-    screen_append("\x1b[H", 3);
+    if (!pass->over_budget){
+        struct OpenBuffer* ob = editor_state.buffer;
+        TextBuffer* text = ob->text;
+        TextBufferChanges changes = {0, text->last_line_loc, 0};
 
-    move_cursor_in_view(editor_state.current_buffer, &editor_state.screen);
-    draw_editor_window(editor_state.current_buffer, &editor_state.screen);
-    draw_status_line(editor_state.screen.width);
+        // After the first pass, only lines changed since the last pass can have grown gaps
+        if (ob->compacted &&
+            TextBufferChangesSince(text, ob->compacted_version, &changes) == CHANGES_NONE){
+            return false;
+        }
 
-    set_virtual_cursor_position(editor_state.current_buffer, &editor_state.screen);
+        int64_t first = changes.first_row > pass->row ? changes.first_row : pass->row;
+        int64_t last = first + COMPACT_STEP_LINES - 1 < changes.last_row ? first + COMPACT_STEP_LINES - 1
+                                                                         : changes.last_row;
 
-    int row = editor_state.screen.cursor.x;
-    int col = editor_state.screen.cursor.y;
+        compact_rows(text, first, last, COMPACT_CURSOR_RADIUS, COMPACT_MAX_GAP);
+        pass->row = last + 1;
 
-    char buf[32];
-    sprintf(buf, "\x1b[%d;%dH", row, col);
+        if (last < changes.last_row){
+            return true;
+        }
 
-    screen_append(buf, strlen(buf));
+        // Lines edited while the pass went on are left for the next one
+        ob->compacted = true;
+        ob->compacted_version = pass->version;
+        return false;
+    }
 
-    // Enable cursor
-    screen_append("\x1b[?25h", 6);
+    while (pass->buffer < list->count && list->buffers[pass->buffer].text == NULL){
+        pass->buffer++;
+    }
 
-    // End the string (so we can get strlen)
-    screen_append("\0", 1);
-}
+    if (pass->buffer < list->count){
+        TextBuffer* other = list->buffers[pass->buffer].text;
 
+        pass->usage -= compact_rows(other, pass->row, pass->row + COMPACT_STEP_LINES - 1, 0,
+                                    COMPACT_BUDGET_MAX_GAP);
+        pass->row += COMPACT_STEP_LINES;
 
-void draw_status_line(int line_size) {
+        if (pass->row > other->last_line_loc){
+            pass->buffer++;
+            pass->row = 0;
+        }
+        return true;
+    }
 
-    const char commands[] = "Ctrl+Q-quit Ctrl+S-Save";
-    unsigned int commands_len = sizeof commands-1;
+    for (int i = 0; i < list->count && pass->usage > editor_state.memory_budget; i++){
+        struct OpenBuffer* ob = &list->buffers[i];
 
-    const char modified[] = "changed";
-    int modified_len = sizeof modified-1;
+        if (i == list->active || ob->text == NULL){
+            continue;
+        }
 
-    /*
-     * {|file cursor space| |modified len|    |       controls       |
-     * [filename.c | 5,50   changed           Ctrl+Q-quit Ctrl+S-Save]
-     * */
+        long buffer_usage = TextBufferMemoryUsage(ob->text);
+        if (buffer_evict(ob) == 0){
+            pass->usage -= buffer_usage;
+        }
+    }
 
-    // Calculate space for each part of the status line
-    int file_cursor_space = line_size - (commands_len + modified_len);
-    int cur_col_digits = snprintf(NULL, 0, "%d", editor_state.current_buffer->cursorCol);
-    int cur_row_digits = snprintf(NULL, 0, "%d", editor_state.current_buffer->cursorRow);
+    return false;
+}
 
-    int f_name_space = file_cursor_space - (cur_col_digits + cur_row_digits + 5);
-    int file_name_size = strlen(editor_state.file_name);
 
-    int cursor_info_buffer_size = file_cursor_space - f_name_space;
-    char cursor_info_buffer[cursor_info_buffer_size];
+/*
+ * Parses a size in bytes, with an optional K, M or G suffix. Returns 0 if str isn't a size, or is too large.
+ * */
+long parse_size(const char* str){
+    char* end;
+    int shifts = 0;
 
+    errno = 0;
+    long size = strtol(str, &end, 10);
 
-    // invert the colours
-    screen_append(INVERT_COLOUR, INVERT_COLOUR_SIZE);
+    if (end == str || errno == ERANGE || size < 0){
+        return 0;
+    }
 
-    // Write file name. If its longer than available space, we'll cut it short with ellipsis
-    if (file_name_size > f_name_space){
-        screen_append(editor_state.file_name, f_name_space - 4);
+    switch (*end){
+        case 'g': case 'G': shifts = 3; end++; break;
+        case 'm': case 'M': shifts = 2; end++; break;
+        case 'k': case 'K': shifts = 1; end++; break;
+    }
 
-        screen_append("... ", 4);
+    if (*end != '\0'){
+        return 0;
+    }
 
-    } else {
-        screen_append(editor_state.file_name, file_name_size);
+    for (; shifts > 0; shifts--){
+        if (size > LONG_MAX / 1024){
+            return 0;
+        }
+        size *= 1024;
     }
 
-    // Write col and row info
-    sprintf(cursor_info_buffer,
-            " | %d,%d ",
-            editor_state.current_buffer->cursorRow, editor_state.current_buffer->cursorCol);
+    return size;
+}
 
-    screen_append(cursor_info_buffer, strlen(cursor_info_buffer));
 
-    // Indicate if buffer was modified since last write.
-    if (!editor_state.flushed) {
-        screen_append(modified, modified_len);
-    }
-    else {
-        memset(editor_state.screen.buffer + editor_state.screen.buf_pos, ' ', modified_len);
-        editor_state.screen.buf_pos += modified_len;
-    }
+void open_file_prompt(){
+    char* path = prompt_input("Open file", false);
 
-    // Fill with whitespace
-    memset(editor_state.screen.buffer + editor_state.screen.buf_pos, ' ', f_name_space - file_name_size);
-    editor_state.screen.buf_pos += f_name_space - file_name_size;
+    if (path == NULL){
+        return;
+    }
 
-    // print help
-    screen_append(commands, commands_len);
+    int index = buffer_list_add(&editor_state.buffer_list, path);
+    free(path);
 
-    // Finally reset the colour and style
-    screen_append(RESET_STYLE_COLOUR, INVERT_COLOUR_SIZE);
+    if (index != -1){
+        switch_buffer(index);
+    }
 }
 
+/*
+ * Asks what to replace and what with, and starts replacing every occurrence in the active buffer.
+ * Replays wait for the replace, so they see the same buffer every time.
+ * */
+void replace_all_prompt(){
+    struct OpenBuffer* ob = editor_state.buffer;
+
+    if (ob->replace != NULL){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Still replacing in %s",
+                 ob->file_name);
+        return;
+    }
+
+    char* find = prompt_input("Replace", false);
+
+    if (find == NULL){
+        return;
+    }
+
+    char* with = prompt_input("With", true);
+
+    if (with == NULL){
+        free(find);
+        return;
+    }
+
+    int err = buffer_replace(ob, find, with, replace_finished);
+    free(find);
+    free(with);
+
+    if (err != 0){
+        panic("Failed to start replacing");
+    }
+
+    if (editor_state.headless){
+        replace_wait(ob->replace);
+        replace_finished(ob->replace);
+    }
+}
+
+
+/*
+ * Called when a replace-all has searched its whole buffer: swaps the replaced lines in, and says how it went.
+ * */
+void replace_finished(struct Replace* replace){
+    struct OpenBuffer* ob = replace->owner;
+    int64_t result = buffer_finish_replace(ob);
+
+    if (result == MEM_ERROR || result == -2){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Not enough memory to replace");
+    } else if (result == -1){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "%s changed while replacing; nothing was replaced", ob->file_name);
+    } else {
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "Replaced %" PRId64 " occurrences", result);
+    }
+}
+
+
+/*
+ * Asks for a shell command, and pipes the lines from the mark to the cursor through it (the whole buffer if there's
+ * no mark). The lines are replaced with the command's output once it's done.
+ * */
+void filter_prompt(){
+    struct OpenBuffer* ob = editor_state.buffer;
+
+    if (ob->filter != NULL){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Still filtering %s",
+                 ob->file_name);
+        return;
+    }
+
+    char* command = prompt_input("Pipe through", false);
+
+    if (command == NULL){
+        return;
+    }
+
+    int64_t first = 0;
+    int64_t count = ob->text->last_line_loc + 1;
+
+    int64_t mark_row, mark_col;
+
+    if (buffer_take_mark(ob, &mark_row, &mark_col)){
+        int64_t cursor_row = ob->text->cursorRow;
+
+        first = mark_row < cursor_row ? mark_row : cursor_row;
+        count = (mark_row < cursor_row ? cursor_row : mark_row) - first + 1;
+    }
+
+    int err = buffer_filter(ob, first, count, command, filter_finished);
+    free(command);
+
+    if (err != 0){
+        panic("Failed to start the command");
+    }
+
+    // Replays wait for the command, so they see the same buffer every time
+    if (editor_state.headless){
+        job_wait(&ob->filter->job);
+        filter_finished(&ob->filter->job);
+    }
+}
+
+
+/*
+ * Completion of a filter job: puts the command's output in place of its input, or says why it wasn't.
+ * */
+void filter_finished(struct Job* job){
+    struct Filter* filter = job->arg;
+    struct OpenBuffer* ob = filter->owner;
+    int status;
+    int64_t result = buffer_finish_filter(ob, &status);
+
+    if (result == MEM_ERROR){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Not enough memory to filter");
+    } else if (result == -1){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "%s changed while filtering; nothing was replaced", ob->file_name);
+    } else if (result == -2 && status == -1){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Couldn't run the command");
+    } else if (result == -2){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "Command exited with status %d; nothing was replaced", status);
+    } else {
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "Command wrote %" PRId64 " lines", result);
+    }
+}
+
+
+/*
+ * Shows or hides the gutter marking the lines of the active buffer that differ from its file. Showing it diffs the
+ * buffer, and says how many lines differ once the diff is done; while it's shown, the buffer is diffed again
+ * whenever the editor is idle after an edit.
+ * */
+void toggle_diff(){
+    struct OpenBuffer* ob = editor_state.buffer;
+
+    if (editor_state.screen.gutter > 0){
+        editor_state.screen.gutter = 0;
+        editor_state.screen.render_start_col = 0;
+        return;
+    }
+
+    // No room for the text next to the gutter
+    if (editor_state.screen.width <= SCREEN_GUTTER_WIDTH){
+        return;
+    }
+
+    editor_state.screen.gutter = SCREEN_GUTTER_WIDTH;
+    editor_state.diff_report = true;
+
+    if (ob->diff != NULL){
+        return;
+    }
+
+    int err = buffer_diff(ob, true, diff_finished);
+
+    if (err == MEM_ERROR){
+        panic("Failed to start diffing");
+    } else if (err != 0){
+        editor_state.diff_report = false;
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Still saving %s",
+                 ob->file_name);
+        return;
+    }
+
+    // Replays wait for the diff, so they see the same message every time
+    if (editor_state.headless){
+        job_wait(&ob->diff->job);
+        diff_finished(&ob->diff->job);
+    }
+}
+
+
+/*
+ * Completion of a diff job: keeps the results for the gutter and buffer_modified, and says how many lines differ
+ * if the diff was asked for.
+ * */
+void diff_finished(struct Job* job){
+    struct FileDiff* diff = job->arg;
+    struct OpenBuffer* ob = diff->owner;
+    bool against_file = diff->path != NULL;
+    int64_t result = buffer_finish_diff(ob);
+    int64_t changed = 0, added = 0, deleted = 0;
+
+    // Only hashed its lines; the diff that was asked for starts next
+    if (!editor_state.diff_report || ob != editor_state.buffer || !against_file){
+        return;
+    }
+
+    editor_state.diff_report = false;
+
+    if (result == MEM_ERROR){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Couldn't diff %s with its file",
+                 ob->file_name);
+        return;
+    }
+
+    if (result == 0){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "%s is the same as its file",
+                 ob->file_name);
+        return;
+    }
+
+    // Lines replaced one for one are changed; the rest of a hunk was added or deleted
+    for (int64_t i = 0; i < ob->hunk_count; i++){
+        DiffHunk* hunk = &ob->hunks[i];
+        int64_t replaced = hunk->old_count < hunk->new_count ? hunk->old_count : hunk->new_count;
+
+        changed += replaced;
+        added += hunk->new_count - replaced;
+        deleted += hunk->old_count - replaced;
+    }
+
+    snprintf(editor_state.status_message, sizeof editor_state.status_message,
+             "Lines changed: %" PRId64 ", added: %" PRId64 ", deleted: %" PRId64 " (%" PRId64 " hunks)",
+             changed, added, deleted, result);
+}
+
+
+/*
+ * Idle task: diffs the active buffer again if the gutter is shown and the buffer changed since its last diff, and
+ * hashes the lines of unmodified buffers that haven't been hashed since they were loaded or saved, so
+ * buffer_modified can tell when edits are undone by hand. Followed buffers change too often to keep hashing.
+ * Replays leave buffers alone, so they do the same work every time.
+ * */
+bool diff_buffers(struct IdleTask* task){
+    struct BufferList* list = &editor_state.buffer_list;
+
+    if (editor_state.headless){
+        return false;
+    }
+
+    for (int i = 0; i < list->count; i++){
+        struct OpenBuffer* ob = &list->buffers[i];
+
+        if (ob->text == NULL || ob->loader != NULL || ob->saver != NULL || ob->diff != NULL){
+            continue;
+        }
+
+        bool stale = ob == editor_state.buffer && editor_state.screen.gutter > 0 &&
+                     (!ob->diffed || ob->hunks_version != ob->text->version);
+        bool unhashed = !ob->following && ob->text->version == ob->saved_version &&
+                        (ob->saved_hashes == NULL || ob->saved_hashes_version != ob->saved_version);
+
+        // Failing to start is left for the next idle spell
+        if (stale || unhashed){
+            buffer_diff(ob, stale, diff_finished);
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * Asks what to find, and moves the cursor to its next occurrence in the active buffer, wrapping around at the end.
+ * Leaving the prompt empty finds the last thing searched for again.
+ * */
+void find_prompt(){
+    struct OpenBuffer* ob = editor_state.buffer;
+    char* find = prompt_input("Find", editor_state.last_find != NULL);
+
+    if (find == NULL){
+        return;
+    }
+
+    if (find[0] == '\0'){
+        free(find);
+    } else {
+        free(editor_state.last_find);
+        editor_state.last_find = find;
+    }
+
+    int64_t row = ob->text->cursorRow;
+    int64_t col = ob->text->cursorCol;
+    int64_t searched;
+    int result = buffer_find(ob, editor_state.last_find, &row, &col, &searched);
+
+    if (result == MEM_ERROR){
+        panic("Failed to search");
+    }
+
+    if (result == 0){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "%s not found",
+                 editor_state.last_find);
+        return;
+    }
+
+    TextBufferMoveCursor(ob->text, row, col);
+
+    // Say how much of the buffer the index let the search skip
+    if (ob->search_index != NULL){
+        char size[16];
+
+        format_size(TrigramIndexMemoryUsage(ob->search_index), size);
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "Searched %" PRId64 " of %" PRId64 " lines (index %s)", searched, ob->text->last_line_loc + 1,
+                 size);
+    }
+}
+
+
+/*
+ * Completion of an indexing job: keeps the index for the next searches, or says why there's none.
+ * */
+void index_finished(struct Job* job){
+    struct SearchIndexer* indexer = job->arg;
+    struct OpenBuffer* ob = indexer->owner;
+    int64_t result = buffer_finish_index(ob);
+
+    if (result == -1){
+        char size[16];
+
+        // Not tried again until the buffer is reloaded
+        ob->searched = false;
+        format_size(editor_state.search_index_budget, size);
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "Search index of %s doesn't fit in %s", ob->file_name, size);
+    }
+}
+
+
+/*
+ * Idle task: indexes large buffers that were searched, and indexes them again once too many of their lines were
+ * edited since, so finding text in them only reads the lines that can have it (see search.c).
+ * Replays search without an index, so they do the same work every time.
+ * */
+bool index_buffers(struct IdleTask* task){
+    struct BufferList* list = &editor_state.buffer_list;
+
+    if (editor_state.headless || editor_state.search_index_budget == 0){
+        return false;
+    }
+
+    for (int i = 0; i < list->count; i++){
+        struct OpenBuffer* ob = &list->buffers[i];
+
+        if (ob->text == NULL || !ob->searched || ob->loader != NULL || ob->indexer != NULL ||
+            ob->text->last_line_loc + 1 < SEARCH_INDEX_MIN_LINES){
+            continue;
+        }
+
+        // Failing to start is left for the next idle spell
+        if (ob->search_index == NULL || search_index_stale(ob->text, ob->search_version)){
+            buffer_index(ob, editor_state.search_index_budget, index_finished);
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * Asks what to search for and in which directory (the current one if left empty), and lists every line that has
+ * it, in every file below, in a buffer of its own. The results come in as they're found; Enter on one opens it.
+ * Replays wait for the whole search, so they see the same buffer every time.
+ * */
+void grep_prompt(){
+    char* find = prompt_input("Grep", false);
+
+    if (find == NULL){
+        return;
+    }
+
+    char* root = prompt_input("In directory", true);
+
+    if (root == NULL){
+        free(find);
+        return;
+    }
+
+    // Named after the search, so searching again for the same thing reuses the buffer
+    char name[256];
+    snprintf(name, sizeof name, "grep %s in %s", find, root[0] != '\0' ? root : ".");
+
+    int index = buffer_list_add(&editor_state.buffer_list, name);
+
+    if (index == -1 || switch_buffer(index) != 0){
+        free(find);
+        free(root);
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Too many buffers open");
+        return;
+    }
+
+    struct OpenBuffer* ob = editor_state.buffer;
+    int err = buffer_grep(ob, root[0] != '\0' ? root : ".", find, grep_finished);
+    free(find);
+    free(root);
+
+    if (err != 0){
+        panic("Failed to start grep");
+    }
+
+    editor_state.screen.render_start_line = 0;
+    editor_state.screen.render_start_col = 0;
+
+    if (editor_state.headless){
+        grep_wait(ob->grep);
+        grep_finished(ob->grep);
+    }
+}
+
+
+/*
+ * Called once a grep has searched every file: takes its last results, and says how many it found.
+ * */
+void grep_finished(struct Grep* grep){
+    struct OpenBuffer* ob = grep->owner;
+    int64_t files, searched;
+    int64_t result = buffer_finish_grep(ob, &files, &searched);
+
+    if (result == MEM_ERROR){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "Not enough memory for every grep result");
+    } else {
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "%" PRId64 " matches in %" PRId64 " of %" PRId64 " files", result, files, searched);
+    }
+}
+
+
+/*
+ * Adds the results greps found since the last poll to their buffers.
+ * */
+void poll_greps(){
+    struct BufferList* list = &editor_state.buffer_list;
+
+    for (int i = 0; i < list->count; i++){
+        if (buffer_poll_grep(&list->buffers[i]) == MEM_ERROR){
+            snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                     "Not enough memory for every grep result");
+        }
+    }
+}
+
+
+/*
+ * Opens the file of the grep result on the cursor's line ("path:row:col: text"), with the cursor on the match.
+ * */
+void open_grep_result(){
+    TextBuffer* text = editor_state.buffer->text;
+    GapBuffer* line = text->lines[text->cursorRow];
+    char* scratch = NULL;
+    int64_t scratch_len = 0;
+    const char* line_str = line_text(line, &scratch, &scratch_len);
+    char* result = line_str != NULL ? strndup(line_str, line->str_len) : NULL;
+
+    free(scratch);
+
+    if (result == NULL){
+        return;
+    }
+
+    // Paths can have colons of their own; the position is the first ":row:col:" after them
+    int64_t row = 0, col = 0;
+    char* position = result;
+    int end = 0;
+
+    while ((position = strchr(position, ':')) != NULL){
+        if (sscanf(position, ":%" SCNd64 ":%" SCNd64 ":%n", &row, &col, &end) == 2 && end > 0){
+            break;
+        }
+        position++;
+    }
+
+    if (position == NULL || position == result){
+        free(result);
+        return;
+    }
+
+    *position = '\0';
+    int index = buffer_list_add(&editor_state.buffer_list, result);
+    free(result);
+
+    if (index == -1 || switch_buffer(index) != 0){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Too many buffers open");
+        return;
+    }
+
+    // The match can be further in than a background load has got to
+    struct OpenBuffer* ob = editor_state.buffer;
+
+    if (buffer_finish_load(ob) != 0){
+        panic("Failed to load file");
+    }
+
+    TextBufferMoveCursor(ob->text, row - 1, col - 1);
+}
+
+/*
+ * Starts recording the keyboard macro, or stops and keeps it.
+ * */
+void toggle_macro_recording(){
+    struct Macro* macro = &editor_state.macro;
+
+    // Playing a macro can't record one
+    if (macro->playing){
+        return;
+    }
+
+    if (!macro->recording){
+        macro_start(macro);
+        return;
+    }
+
+    // The key that stopped recording was recorded too
+    macro_drop_last(macro);
+
+    if (macro_stop(macro) == -1){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Macro too long, not kept");
+    } else {
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Recorded a macro of %d bytes",
+                 macro->len);
+    }
+}
+
+
+/*
+ * Asks how many times to play the keyboard macro. Left empty, the macro is played once on each line from the mark
+ * to the cursor, from the start of the line, or just once if there's no mark.
+ * */
+void play_macro_prompt(){
+    struct OpenBuffer* ob = editor_state.buffer;
+    struct Macro* macro = &editor_state.macro;
+
+    if (macro->playing){
+        return;
+    }
+
+    if (macro->recording){
+        // The key that asked was recorded; it isn't part of the macro
+        macro_drop_last(macro);
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Still recording the macro");
+        return;
+    }
+
+    if (macro->len == 0){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "No macro recorded");
+        return;
+    }
+
+    char* input = prompt_input("Play macro times", true);
+
+    if (input == NULL){
+        return;
+    }
+
+    char* end;
+    long times = input[0] == '\0' ? 1 : strtol(input, &end, 10);
+    bool valid = input[0] == '\0' || (*end == '\0' && times > 0);
+    bool per_line = input[0] == '\0';
+    free(input);
+
+    if (!valid){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "Not a number of times");
+        return;
+    }
+
+    int64_t mark_row, mark_col;
+
+    if (per_line && buffer_take_mark(ob, &mark_row, &mark_col)){
+        int64_t cursor_row = ob->text->cursorRow;
+        int64_t first = mark_row < cursor_row ? mark_row : cursor_row;
+        int64_t count = (mark_row < cursor_row ? cursor_row : mark_row) - first + 1;
+
+        int64_t played = play_macro_lines(ob, first, count);
+        snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                 "Played the macro on %" PRId64 " lines", played);
+        return;
+    }
+
+    long played = 0;
+
+    // A macro that switches buffers would go on in the other one; it stops instead
+    for (; played < times && editor_state.buffer == ob; played++){
+        play_macro();
+    }
+
+    snprintf(editor_state.status_message, sizeof editor_state.status_message, "Played the macro %ld times", played);
+}
+
+
+/*
+ * Plays the keyboard macro once: its keys are handled as if typed, but nothing is drawn until it's done.
+ * */
+void play_macro(){
+    struct Macro* macro = &editor_state.macro;
+
+    macro->playing = true;
+    macro->play_pos = 0;
+
+    while (macro->play_pos < macro->len){
+        process_keypress();
+    }
+
+    macro->playing = false;
+}
+
+
+/*
+ * Plays the keyboard macro once on each of count lines from first, with the cursor at the start of the line. The
+ * next line is kept track of with an anchor, so a macro that adds, removes or joins lines doesn't throw it off.
+ * Stops at the end of the buffer, or if the macro switches buffers.
+ * Returns the number of lines the macro was played on.
+ * */
+int64_t play_macro_lines(struct OpenBuffer* ob, int64_t first, int64_t count){
+    TextBuffer* text = ob->text;
+    int64_t row = first;
+    int64_t col;
+
+    for (int64_t played = 0; played < count; played++){
+        bool last = played + 1 == count || row >= text->last_line_loc;
+        Anchor* next = NULL;
+
+        if (!last && (next = TextBufferAddAnchor(text, row + 1, 0, ANCHOR_MACRO)) == NULL){
+            panic("Failed to play the macro");
+        }
+
+        TextBufferMoveCursor(text, row, 0);
+        play_macro();
+
+        if (last){
+            return played + 1;
+        }
+
+        TextBufferAnchorPosition(text, next, &row, &col);
+        TextBufferRemoveAnchor(text, next);
+
+        if (editor_state.buffer != ob){
+            return played + 1;
+        }
+    }
+
+    return count;
+}
+
+
+
+void cleanup(){
+
+    if (editor_state.headless){
+        replay_report(&editor_state.replay_stats, editor_state.buffer->text, stdout);
+    } else {
+        // Clear screen
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+    }
+
+    if (editor_state.record_fd != -1){
+        close(editor_state.record_fd);
+    }
+
+    // free memory for screen
+    free(editor_state.screen.buffer);
+    free(editor_state.screen.output);
+    free(editor_state.screen.row_starts);
+    free(editor_state.screen.frame_rows);
+    free(editor_state.screen.shown_rows);
+
+    // The active buffer's view is kept in the buffer, for its index cache
+    editor_state.buffer->render_start_line = editor_state.screen.render_start_line;
+    editor_state.buffer->render_start_col = editor_state.screen.render_start_col;
+
+    // Free the text buffers. Their jobs are finished or cancelled first, so the workers can be stopped after
+    buffer_list_destroy(&editor_state.buffer_list);
+    free(index_cache_dir);
+    jobs_shutdown();
+
+    if (editor_state.inotify_fd != -1){
+        close(editor_state.inotify_fd);
+    }
+    cursor_set_destroy(&editor_state.extra_cursors);
+    macro_destroy(&editor_state.macro);
+    free(editor_state.last_find);
+}
+
+void panic(const char* message){
+    // Clear screen
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    // Enable cursor
+    write(STDOUT_FILENO,"\x1b[?25h", 6);
+    perror(message);
+    exit(1);
+}
+
+void set_window_size() {
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        // panic("Failed to get window size");
+
+        // manually get window size
+        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
+            panic("Failed to get window size");
+        }
+
+        // read the response
+        char buf[32];
+        for (int i = 0; i < sizeof(buf); i++) {
+            if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+                panic("Failed to get window size");
+            }
+
+            if (buf[i] == 'R') {
+                buf[i + 1] = '\0';
+                break;
+            }
+        }
+
+        // parse the response and set the windows size
+        if (sscanf(buf, "%d;%d", &editor_state.screen.height, &editor_state.screen.width) != 2) {
+            panic("Failed to get windows size");
+        }
+
+    } else {
+        editor_state.screen.height = ws.ws_row;
+        editor_state.screen.width = ws.ws_col;
+    }
+}
+
+void disableRawMode() {
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &editor_state.orig_termios) == -1) {
+        panic("tcsetattr");
+    }
+}
+
+// Test raw mode
+void enableRawMode(){
+
+    if(tcgetattr(STDIN_FILENO, &editor_state.orig_termios) == -1) {
+        panic("tcgetattr");
+    }
+
+    atexit(disableRawMode);
+
+    struct termios raw = editor_state.orig_termios;
+
+    /*
+     * Local modes:
+     * Here we are disabling:
+     * ECHO: don't echo input characters back to the screen.
+     * ICANON: canonical mode. Now each character is read as soon as it is typed.
+     * ISIG: SIGINT/SIGSTOP signal interpretation. Now Ctrl-C/Ctrl-Z won't send signals to the process.
+     * IEXTEN: extended input processing. Now Ctrl-V/Ctrl-C/Ctrl-D won't be interpreted as special characters.
+     *
+     * | - logic OR
+     * & - logic AND
+     * ~ - logic XOR
+     */
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+
+    /*
+     * Input modes:
+     * Here we're disabling:
+     * IXON: disable software flow control.
+     * ICRNL: maps CR to NL (otherwise, it will be CR+NL). Now Ctrl-M will be ignored.
+     * BRKINT: disable break processing. Now break condition will be ignored.
+     * INPCK: disable parity checking. Now parity errors will be ignored. (This doesn't matter anymore)
+     * ISTRIP: disable stripping of eighth bit. Now eighth bit will be ignored. (This probably doesn't matter)
+     **/
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK);
+
+    /*
+     * Output modes:
+     * Here we're disabling:
+     * OPOST: output processing. Now output processing is disabled.
+     *
+     **/
+    raw.c_oflag &= ~(OPOST);
+
+    /*
+     * Control modes:
+     * Here we're disabling:
+     * CS8: 8-bit characters. Now 8-bit characters will be used.
+     **/
+    raw.c_cflag |= (CS8);
+
+    /*
+     * c_cc - control characters.
+     * VMIN: minimum number of characters to read. Set to 0 so that we can read whatever is available.
+     * VTIME: time to wait for characters to be available. Set to 1 (100ms).
+     **/
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 1;
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
+        panic("tcsetattr");
+    }
+}
+
+
+void screen_append(const char *str, int size) {
+
+    if (editor_state.screen.buffer != NULL && (editor_state.screen.len - editor_state.screen.buf_pos) > size) {
+        memcpy(editor_state.screen.buffer + editor_state.screen.buf_pos, str, size);
+        editor_state.screen.buf_pos += size;
+    }
+}
+
+
+/* Display */
+void render_screen() {
+    int len = screen_compose(&editor_state.screen);
+
+    // A headless editor only counts what it would have written
+    if (editor_state.headless){
+        editor_state.replay_stats.frames++;
+        editor_state.replay_stats.bytes += len;
+        return;
+    }
+
+    // flush what changed to display. Lines may contain null bytes, so the length is the position, not strlen
+    write(STDOUT_FILENO, editor_state.screen.output, len);
+}
+
+
+void draw_screen(){
+
+    editor_state.screen.buf_pos = 0; // reset the screen
+
+    // The cursor is hidden, and the rows that changed cleared, when the frame is sent (see screen_compose)
+    move_cursor_in_view(editor_state.buffer->text, &editor_state.screen);
+    draw_editor_window(editor_state.buffer->text, &editor_state.screen, editor_state.buffer->hunks,
+                       editor_state.buffer->hunk_count);
+    editor_state.screen.status_start = editor_state.screen.buf_pos;
+
+    int64_t row, col;
+
+    if (editor_state.prompt_label != NULL){
+        // While prompting, the cursor sits at the end of the input on the status line
+        col = draw_prompt_line(editor_state.screen.width);
+        row = editor_state.screen.height;
+
+    } else {
+        if (editor_state.status_message[0] != '\0'){
+            draw_message_line(editor_state.screen.width);
+        } else {
+            draw_status_line(editor_state.screen.width);
+        }
+
+        set_virtual_cursor_position(editor_state.buffer->text, &editor_state.screen);
+
+        row = editor_state.screen.cursor.x;
+        col = editor_state.screen.cursor.y;
+    }
+
+    char buf[32];
+    sprintf(buf, "\x1b[%" PRId64 ";%" PRId64 "H", row, col);
+
+    screen_append(buf, strlen(buf));
+
+    // Enable cursor
+    screen_append("\x1b[?25h", 6);
+}
+
+
+void draw_status_line(int line_size) {
+
+    const char commands[] = "Ctrl+Q-quit Ctrl+S-Save";
+    unsigned int commands_len = sizeof commands-1;
+
+    const char modified[] = "changed";
+    int modified_len = sizeof modified-1;
+
+    /*
+     * {|file cursor space| |modified len|    |       controls       |
+     * [filename.c | 5,50   changed           Ctrl+Q-quit Ctrl+S-Save]
+     * */
+
+    // Calculate space for each part of the status line
+    int file_cursor_space = line_size - (commands_len + modified_len);
+    int cur_col_digits = snprintf(NULL, 0, "%" PRId64, editor_state.buffer->text->cursorCol);
+    int cur_row_digits = snprintf(NULL, 0, "%" PRId64, editor_state.buffer->text->cursorRow);
+
+    // Extra cursors are shown as a count after the cursor position, e.g. "5,50 +3", followed by how much of the
+    // file is in while it's loading, e.g. "5,50 +3 42%", whether it's followed, and how much of it is saved while
+    // it's saving, or searched while replacing, whether it's being filtered or diffed, and how many files a grep
+    // searched, and whether a macro is being recorded
+    char extra_info[112] = "";
+    int extra_info_len = 0;
+
+    if (editor_state.extra_cursors.count > 0){
+        extra_info_len += sprintf(extra_info, " +%d", editor_state.extra_cursors.count);
+    }
+    if (editor_state.buffer->loader != NULL){
+        extra_info_len += sprintf(extra_info + extra_info_len, " %d%%", loader_progress(editor_state.buffer->loader));
+    }
+    if (editor_state.buffer->following){
+        extra_info_len += sprintf(extra_info + extra_info_len, " follow");
+    }
+    if (editor_state.buffer->saver != NULL){
+        extra_info_len += sprintf(extra_info + extra_info_len, " saving %d%%", saver_progress(editor_state.buffer->saver));
+    }
+    if (editor_state.buffer->filter != NULL){
+        extra_info_len += sprintf(extra_info + extra_info_len, " filtering");
+    }
+    if (editor_state.buffer->diff != NULL && editor_state.diff_report){
+        extra_info_len += sprintf(extra_info + extra_info_len, " diffing");
+    }
+    if (editor_state.buffer->replace != NULL){
+        extra_info_len += sprintf(extra_info + extra_info_len, " replacing %d%%",
+                                  replace_progress(editor_state.buffer->replace));
+    }
+    if (editor_state.buffer->grep != NULL){
+        extra_info_len += sprintf(extra_info + extra_info_len, " grepping %" PRId64,
+                                  grep_progress(editor_state.buffer->grep));
+    }
+    if (editor_state.macro.recording){
+        extra_info_len += sprintf(extra_info + extra_info_len, " recording");
+    }
+
+    int cursor_info_buffer_size = cur_col_digits + cur_row_digits + extra_info_len + 5;
+    char cursor_info_buffer[cursor_info_buffer_size + 1];
+
+    // A long name (a grep's holds what was searched for) or a narrow terminal can leave no room for the name
+    int f_name_space = file_cursor_space - cursor_info_buffer_size;
+    int file_name_size = strlen(editor_state.buffer->file_name);
+    int name_len = file_name_size;
+
+    if (f_name_space < 0){
+        f_name_space = 0;
+    }
+
+
+    // invert the colours
+    screen_append(INVERT_COLOUR, INVERT_COLOUR_SIZE);
+
+    // Write file name. If its longer than available space, we'll cut it short with ellipsis, or leave it out if
+    // there isn't room for that either
+    if (file_name_size > f_name_space){
+        name_len = f_name_space >= 4 ? f_name_space : 0;
+
+        if (name_len > 0){
+            screen_append(editor_state.buffer->file_name, name_len - 4);
+            screen_append("... ", 4);
+        }
+
+    } else {
+        screen_append(editor_state.buffer->file_name, file_name_size);
+    }
+
+    // Write col and row info
+    sprintf(cursor_info_buffer,
+            " | %" PRId64 ",%" PRId64 "%s ",
+            editor_state.buffer->text->cursorRow, editor_state.buffer->text->cursorCol, extra_info);
+
+    screen_append(cursor_info_buffer, strlen(cursor_info_buffer));
+
+    // Indicate if buffer was modified since last write.
+    if (buffer_modified(editor_state.buffer)) {
+        screen_append(modified, modified_len);
+    }
+    else {
+        memset(editor_state.screen.buffer + editor_state.screen.buf_pos, ' ', modified_len);
+        editor_state.screen.buf_pos += modified_len;
+    }
+
+    // Fill with whitespace
+    memset(editor_state.screen.buffer + editor_state.screen.buf_pos, ' ', f_name_space - name_len);
+    editor_state.screen.buf_pos += f_name_space - name_len;
+
+    // print help
+    screen_append(commands, commands_len);
+
+    // Finally reset the colour and style
+    screen_append(RESET_STYLE_COLOUR, INVERT_COLOUR_SIZE);
+}
+
+
+/*
+ * Draws the prompt label and the text typed so far in place of the status line.
+ * If the text doesn't fit, only its end is shown.
+ * Returns the screen column of the end of the text (where the cursor goes).
+ * */
+int draw_prompt_line(int line_size) {
+
+    int label_len = strlen(editor_state.prompt_label);
+    int text_len = strlen(editor_state.prompt_text);
+    const char* text = editor_state.prompt_text;
+
+    // Leave room for ": " and the cursor
+    int text_space = line_size - (label_len + 3);
+    if (text_space < 0){
+        text_space = 0;
+    }
+
+    if (text_len > text_space){
+        text += text_len - text_space;
+        text_len = text_space;
+    }
+
+    screen_append(INVERT_COLOUR, INVERT_COLOUR_SIZE);
+    screen_append(editor_state.prompt_label, label_len);
+    screen_append(": ", 2);
+    screen_append(text, text_len);
+
+    for (int i = label_len + 2 + text_len; i < line_size; i++){
+        screen_append(" ", 1);
+    }
+
+    screen_append(RESET_STYLE_COLOUR, INVERT_COLOUR_SIZE);
+
+    return label_len + 2 + text_len + 1;
+}
+
+
+/*
+ * Draws the status message in place of the status line, cut short if it doesn't fit.
+ * */
+void draw_message_line(int line_size) {
+    int message_len = strlen(editor_state.status_message);
+
+    if (message_len > line_size){
+        message_len = line_size;
+    }
+
+    screen_append(INVERT_COLOUR, INVERT_COLOUR_SIZE);
+    screen_append(editor_state.status_message, message_len);
+
+    for (int i = message_len; i < line_size; i++){
+        screen_append(" ", 1);
+    }
+
+    screen_append(RESET_STYLE_COLOUR, INVERT_COLOUR_SIZE);
+}
+
+
+/* Input */
+/*
+ * Runs the idle tasks while waiting for input, after the first read timeout. A keypress wakes them all again.
+ * */
+void on_idle(){
+    idle_run(&editor_state.idle, input_pending);
+}
+
+
+/*
+ * Returns whether there's a key to read, or a finished job to show, so idle tasks should make way.
+ * */
+bool input_pending(){
+    struct pollfd fds[2] = {
+        {.fd = editor_state.input_fd, .events = POLLIN},
+        {.fd = job_pool.event_fd, .events = POLLIN},
+    };
+
+    return poll(fds, 2, 0) != 0;
+}
+
+
+/*
+ * Reads one byte of input, from the terminal or the replay script, or from the keyboard macro while it's played.
+ * When recording, the byte is also written to the record script, so a replay sees exactly the same bytes, escape
+ * sequences included; the same goes for the macro while it's recorded. Bytes played from the macro aren't recorded
+ * again, since the key that played them was.
+ * Returns the result of read.
+ * */
+ssize_t read_input(char* c){
+
+    if (editor_state.macro.playing){
+        return macro_next(&editor_state.macro, c);
+    }
+
+    ssize_t err = read(editor_state.input_fd, c, 1);
+
+    if (err == 1 && editor_state.record_fd != -1){
+        write(editor_state.record_fd, c, 1);
+    }
+
+    if (err == 1 && editor_state.macro.recording && macro_add(&editor_state.macro, *c) == MEM_ERROR){
+        panic("Failed to record the macro");
+    }
+
+    return err;
+}
 
 
 /*
- * Returns -1 when unable to open the file, -2 on write error, 0 on success
+ * Waits up to the read timeout for input, or for a job to finish. A replay script, or a macro being played, is
+ * always ready.
+ * Returns 1 if there's input to read, 0 if the wait timed out, or -1 if a job finished first.
  * */
-int flush_buffer_to_file(){
+int wait_input(){
+    struct pollfd fds[2] = {
+        {.fd = editor_state.input_fd, .events = POLLIN},
+        {.fd = job_pool.event_fd, .events = POLLIN},
+    };
+
+    if (editor_state.headless || editor_state.macro.playing){
+        return 1;
+    }
+
+    if (poll(fds, 2, INPUT_TIMEOUT_MS) == -1){
+        return errno == EINTR ? 0 : 1;
+    }
+
+    if (fds[0].revents != 0){
+        return 1;
+    }
+
+    return fds[1].revents != 0 ? -1 : 0;
+}
 
-    FILE* fp = fopen(editor_state.file_path, "w");
-    char* line = NULL;
 
-    if (fp == NULL){
-        return -1;
+bool buffers_loading(){
+    for (int i = 0; i < editor_state.buffer_list.count; i++){
+        if (editor_state.buffer_list.buffers[i].loader != NULL){
+            return true;
+        }
     }
 
-    for (int i=0; i<=editor_state.current_buffer->last_line_loc; i++){
-        line = TextBufferGetLine(editor_state.current_buffer, i);
+    return false;
+}
+
 
-        if (line == NULL){
-            fclose(fp);
-            return -2;
+bool buffers_saving(){
+    for (int i = 0; i < editor_state.buffer_list.count; i++){
+        if (editor_state.buffer_list.buffers[i].saver != NULL){
+            return true;
         }
+    }
+
+    return false;
+}
 
 
-        if (fputs(line, fp) < strlen(line)){
-            fclose(fp);
-            return -2;
+bool buffers_grepping(){
+    for (int i = 0; i < editor_state.buffer_list.count; i++){
+        if (editor_state.buffer_list.buffers[i].grep != NULL){
+            return true;
         }
     }
 
-    fclose(fp);
-    return 0;
+    return false;
+}
+
+
+void finish_replay(){
+    cleanup();
+    exit(0);
 }
 
 
-/* Input */
 /*
  * read_char is heavily motivated by this tutorial: https://viewsourcecode.org/snaptoken/kilo/03.rawInputAndOutput.html
  * whose code comes from kilo: http://antirez.com/news/108
@@ -439,24 +1824,64 @@ int read_char(){
     char c;
     ssize_t err;
 
-    while((err = read(STDIN_FILENO, &c, 1)) != 1) {
+    while(true) {
+        int ready = wait_input();
+
+        // A finished job's results are shown by the main loop
+        if (ready == -1) {
+            return REFRESH;
+        }
+
+        err = ready == 1 ? read_input(&c) : 0;
+
+        if (err == 1) {
+            break;
+        }
+
         if (err == EAGAIN) {
             panic("read_char: read() returned EAGAIN");
         }
+
+        // A macro that ran out of keys halfway through a prompt cancels it
+        if (err == 0 && editor_state.macro.playing) {
+            return ESC;
+        }
+
+        // The end of a replay script ends the replay
+        if (err == 0 && editor_state.headless) {
+            finish_replay();
+        }
+
+        // read timed out with no input. While files are loading, greps find more, or followed files grow, redraw
+        // to show the new lines
+        if (err == 0 && (buffers_loading() | buffers_saving() | buffers_grepping() | follow_buffers())) {
+            return REFRESH;
+        }
+
+        if (err == 0) {
+            on_idle();
+        }
+    }
+
+    idle_wake(&editor_state.idle);
+
+    // Keys played from a macro are counted as the one key that played them
+    if (editor_state.headless && !editor_state.macro.playing) {
+        editor_state.replay_stats.keys++;
     }
 
     // Handle escape sequences
     if (c == ESC){
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return ESC;
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return ESC;
+        if (read_input(&seq[0]) != 1) return ESC;
+        if (read_input(&seq[1]) != 1) return ESC;
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return ESC;
+                if (read_input(&seq[2]) != 1) return ESC;
                 if (seq[2] == '~') {
-                    switch (seq[2]) {
+                    switch (seq[1]) {
                         case '1': return HOME_KEY;
                         case '3': return DEL_KEY;
                         case '4': return END_KEY;
@@ -492,38 +1917,274 @@ int read_char(){
 }
 
 
+/*
+ * Reads a line of input on the status line. Enter accepts, Escape cancels. Empty input is only accepted if
+ * allow_empty is set.
+ * Returns an allocated string with the input, or NULL if cancelled (or empty, unless allowed).
+ * */
+char* prompt_input(const char* label, bool allow_empty){
+    size_t cap = 128;
+    size_t len = 0;
+    char* input = malloc(cap);
+
+    if (input == NULL){
+        return NULL;
+    }
+
+    input[0] = '\0';
+    editor_state.prompt_label = label;
+    editor_state.prompt_text = input;
+
+    while (1) {
+        // Jobs keep finishing while prompting; their completions are run here, the same as in the main loop.
+        // A macro's prompts aren't drawn
+        jobs_run_completions();
+
+        if (!editor_state.macro.playing){
+            draw_screen();
+            render_screen();
+        }
+
+        int c = read_char();
+
+        if (c == '\r'){
+            if (len > 0 || allow_empty){
+                break;
+            }
+
+        } else if (c == ESC){
+            len = 0;
+            allow_empty = false;
+            break;
+
+        } else if (c == BACKSPACE || c == CTRL_KEY('h')){
+            if (len > 0){
+                input[--len] = '\0';
+            }
+
+        } else if (c >= ' ' && c < BACKSPACE){
+            if (len + 1 == cap){
+                char* new_input = realloc(input, cap * 2);
+
+                if (new_input == NULL){
+                    break;
+                }
+
+                input = new_input;
+                cap *= 2;
+                editor_state.prompt_text = input;
+            }
+
+            input[len++] = c;
+            input[len] = '\0';
+        }
+    }
+
+    editor_state.prompt_label = NULL;
+    editor_state.prompt_text = NULL;
+
+    if (len == 0 && !allow_empty){
+        free(input);
+        return NULL;
+    }
+
+    return input;
+}
+
+
 void process_keypress(){
 
     int c = read_char();
     int err;
 
+    // A message stays up until a key is pressed
+    if (c != REFRESH){
+        editor_state.status_message[0] = '\0';
+    }
+
     switch (c) {
 
+        case REFRESH:
+            break;
+
         case '\r':
-            TextBufferNewLine(editor_state.current_buffer);
+            cursor_set_clear(&editor_state.extra_cursors);
+
+            // Enter on a grep result opens it
+            if (editor_state.buffer->grep_results){
+                open_grep_result();
+                break;
+            }
+
+            TextBufferNewLine(editor_state.buffer->text);
+            break;
+
+            // Moving the cursor drops any extra cursors
+        case ARROW_UP: cursor_set_clear(&editor_state.extra_cursors); up_arrow(); break;
+        case ARROW_DOWN: cursor_set_clear(&editor_state.extra_cursors); down_arrow(); break;
+        case ARROW_LEFT: cursor_set_clear(&editor_state.extra_cursors); left_arrow(); break;
+        case ARROW_RIGHT: cursor_set_clear(&editor_state.extra_cursors); right_arrow(); break;
+
+            // Add a cursor on the next line
+        case CTRL_KEY('e'):
+            add_cursor_below();
+            break;
+
+        case DEL_KEY:
+            cursor_set_clear(&editor_state.extra_cursors);
+            delete_forward();
+            break;
+
+        case HOME_KEY:
+            cursor_set_clear(&editor_state.extra_cursors);
+            TextBufferMoveCursor(editor_state.buffer->text, editor_state.buffer->text->cursorRow, 0);
             break;
 
-        case ARROW_UP: up_arrow(); break;
-        case ARROW_DOWN: down_arrow(); break;
-        case ARROW_LEFT: left_arrow(); break;
-        case ARROW_RIGHT: right_arrow(); break;
+        case END_KEY:
+            cursor_set_clear(&editor_state.extra_cursors);
+            TextBufferMoveCursor(editor_state.buffer->text, editor_state.buffer->text->cursorRow,
+                                 editor_state.buffer->text->lines[editor_state.buffer->text->cursorRow]->str_len);
+            break;
 
             // We wont use these keys for now
         case PAGE_UP:
         case PAGE_DOWN:
-        case HOME_KEY:
-        case END_KEY:
-        case DEL_KEY:
             break;
 
+            // Mark and region
+        case CTRL_KEY('k'):
+            set_mark();
+            break;
+
+        case CTRL_KEY('x'):
+            cursor_set_clear(&editor_state.extra_cursors);
+            delete_region();
+            break;
+
+            // Bookmarks
+        case CTRL_KEY('b'):
+            toggle_bookmark();
+            break;
+
+        case CTRL_KEY('g'):
+            cursor_set_clear(&editor_state.extra_cursors);
+            next_bookmark();
+            break;
+
+            // Redraw the whole screen, e.g. after something else wrote to the terminal
         case CTRL_KEY('l'):
+            editor_state.screen.rows_shown = false;
+            break;
+
+            // Mark the lines that differ from the file
+        case CTRL_KEY('d'):
+            toggle_diff();
+            break;
+
+            // Show where the buffer's memory goes
+        case CTRL_KEY('a'):
+            format_memory_stats(editor_state.buffer->text, editor_state.status_message,
+                                sizeof editor_state.status_message);
+            append_index_stats(editor_state.buffer->search_index, editor_state.status_message,
+                               sizeof editor_state.status_message);
+            break;
+
+            // Follow the file as it grows
+        case CTRL_KEY('t'):
+            toggle_follow();
+            break;
+
+            // Toggle line wrapping
+        case CTRL_KEY('w'):
+            editor_state.screen.no_wrap = !editor_state.screen.no_wrap;
+            editor_state.screen.render_start_col = 0;
+            break;
+
         case '\x1b':
+            cursor_set_clear(&editor_state.extra_cursors);
             break;
 
             // Save buffer state to file
         case CTRL_KEY('s'):
-            err = flush_buffer_to_file();
-            editor_state.flushed = true;
+            // Replays measure editing; they don't overwrite files
+            if (editor_state.headless){
+                break;
+            }
+
+            if (editor_state.buffer->grep_results){
+                snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                         "Grep results aren't saved");
+                break;
+            }
+
+            // Saved in the background; the buffer is marked saved by save_finished
+            if (editor_state.buffer->saver != NULL){
+                snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                         "Still saving %s", editor_state.buffer->file_name);
+                break;
+            }
+
+            err = buffer_save(editor_state.buffer, save_finished);
+            if (err == MEM_ERROR){
+                panic("Failed to save file");
+            } else if (err != 0){
+                snprintf(editor_state.status_message, sizeof editor_state.status_message,
+                         "Can't open %s for writing", editor_state.buffer->file_name);
+            }
+            break;
+
+            // Find the next occurrence
+        case CTRL_KEY('f'):
+            cursor_set_clear(&editor_state.extra_cursors);
+            find_prompt();
+            break;
+
+            // Search every file under a directory
+        case CTRL_KEY('y'):
+            cursor_set_clear(&editor_state.extra_cursors);
+            grep_prompt();
+            break;
+
+            // Replace all, and undo it
+        case CTRL_KEY('r'):
+            cursor_set_clear(&editor_state.extra_cursors);
+            replace_all_prompt();
+            break;
+
+            // Pipe lines through a command
+        case CTRL_KEY('u'):
+            cursor_set_clear(&editor_state.extra_cursors);
+            filter_prompt();
+            break;
+
+        case CTRL_KEY('z'):
+            if (buffer_undo(editor_state.buffer) != 0){
+                snprintf(editor_state.status_message, sizeof editor_state.status_message, "Nothing to undo");
+            }
+            break;
+
+            // Buffer list
+        case CTRL_KEY('o'):
+            open_file_prompt();
+            break;
+
+        case CTRL_KEY('n'):
+            switch_buffer((editor_state.buffer_list.active + 1) % editor_state.buffer_list.count);
+            break;
+
+        case CTRL_KEY('p'):
+            switch_buffer((editor_state.buffer_list.active + editor_state.buffer_list.count - 1)
+                          % editor_state.buffer_list.count);
+            break;
+
+            // Keyboard macros
+        case CTRL_KEY('\\'):
+            toggle_macro_recording();
+            break;
+
+        case CTRL_KEY(']'):
+            cursor_set_clear(&editor_state.extra_cursors);
+            play_macro_prompt();
             break;
 
         case CTRL_KEY('q'):
@@ -534,26 +2195,129 @@ void process_keypress(){
             // Backspace
         case BACKSPACE:
         case CTRL_KEY('h'):
-            TextBufferBackspace(editor_state.current_buffer);
-            editor_state.flushed = false;
+            backspace();
             break;
         default:
-            TextBufferInsert(editor_state.current_buffer, c);
-            editor_state.flushed = false;
+            insert_char(c);
             break;
     }
 }
 
 
+/*
+ * Leaves a cursor at the current position and moves the buffer's cursor down a line.
+ * Repeating this gives a cursor per line in a block.
+ * */
+void add_cursor_below() {
+    TextBuffer* text = editor_state.buffer->text;
+
+    if (text->cursorRow == text->last_line_loc){
+        return;
+    }
+
+    if (cursor_set_add(&editor_state.extra_cursors, text->cursorRow, text->cursorCol) != 0){
+        return;
+    }
+
+    TextBufferMoveCursor(text, text->cursorRow + 1, text->cursorCol);
+}
+
+
+void delete_forward() {
+    TextBuffer* text = editor_state.buffer->text;
+    int64_t row = text->cursorRow;
+    int64_t col = text->cursorCol;
+
+    if (col < text->lines[row]->str_len){
+        TextBufferDeleteRange(text, row, col, row, col + 1);
+    } else {
+        TextBufferJoinLines(text, row);
+    }
+}
+
+
+void set_mark() {
+
+    if (buffer_set_mark(editor_state.buffer) != 0){
+        panic("Failed to set the mark");
+    }
+}
+
+
+/*
+ * Deletes the text between the mark and the cursor. Without a mark, deletes the cursor's line.
+ * */
+void delete_region() {
+    struct OpenBuffer* ob = editor_state.buffer;
+    int64_t mark_row, mark_col;
+
+    if (buffer_take_mark(ob, &mark_row, &mark_col)){
+        TextBufferDeleteRange(ob->text, mark_row, mark_col, ob->text->cursorRow, ob->text->cursorCol);
+    } else {
+        TextBufferDeleteLines(ob->text, ob->text->cursorRow, 1);
+    }
+}
+
+
+/*
+ * Bookmarks the cursor's line, or clears its bookmark.
+ * */
+void toggle_bookmark() {
+    int set = buffer_toggle_bookmark(editor_state.buffer);
+
+    if (set == MEM_ERROR){
+        panic("Failed to set a bookmark");
+    }
+
+    snprintf(editor_state.status_message, sizeof editor_state.status_message,
+             "%s", set ? "Bookmark set" : "Bookmark cleared");
+}
+
+
+/*
+ * Moves the cursor to the next bookmark, going back to the top after the last one.
+ * */
+void next_bookmark() {
+    int64_t row, col;
+
+    if (buffer_next_bookmark(editor_state.buffer, &row, &col) != 0){
+        snprintf(editor_state.status_message, sizeof editor_state.status_message, "No bookmarks");
+        return;
+    }
+
+    TextBufferMoveCursor(editor_state.buffer->text, row, col);
+}
+
+
+void insert_char(char c) {
+
+    if (editor_state.extra_cursors.count > 0){
+        cursor_set_edit(&editor_state.extra_cursors, editor_state.buffer->text, 0, &c, 1);
+    } else {
+        TextBufferInsert(editor_state.buffer->text, c);
+    }
+}
+
+
+void backspace() {
+
+    if (editor_state.extra_cursors.count > 0){
+        cursor_set_edit(&editor_state.extra_cursors, editor_state.buffer->text, 1, NULL, 0);
+    } else {
+        TextBufferBackspace(editor_state.buffer->text);
+    }
+}
+
+
 void up_arrow() {
 
-    int col = editor_state.current_buffer->cursorCol;
-    int row = editor_state.current_buffer->cursorRow;
+    int64_t col = editor_state.buffer->text->cursorCol;
+    int64_t row = editor_state.buffer->text->cursorRow;
 
     if (row > 0){
         row--;
 
-        TextBufferMoveCursor(editor_state.current_buffer, row, col);
+        TextBufferMoveCursor(editor_state.buffer->text, row, col);
     }
 
     // ding the terminal if you figure out how to
@@ -561,26 +2325,26 @@ void up_arrow() {
 
 void down_arrow() {
 
-    int col = editor_state.current_buffer->cursorCol;
-    int row = editor_state.current_buffer->cursorRow;
+    int64_t col = editor_state.buffer->text->cursorCol;
+    int64_t row = editor_state.buffer->text->cursorRow;
 
-    if (row < editor_state.current_buffer->last_line_loc){
+    if (row < editor_state.buffer->text->last_line_loc){
         row++;
 
-        TextBufferMoveCursor(editor_state.current_buffer, row, col);
+        TextBufferMoveCursor(editor_state.buffer->text, row, col);
     }
 
     // ding terminal
 }
 
 void left_arrow() {
-    int row = editor_state.current_buffer->cursorRow;
-    int col = editor_state.current_buffer->cursorCol - 1;
-    TextBufferMoveCursor(editor_state.current_buffer, row, col);
+    int64_t row = editor_state.buffer->text->cursorRow;
+    int64_t col = editor_state.buffer->text->cursorCol - 1;
+    TextBufferMoveCursor(editor_state.buffer->text, row, col);
 }
 
 void right_arrow() {
-    int row = editor_state.current_buffer->cursorRow;
-    int col = editor_state.current_buffer->cursorCol + 1;
-    TextBufferMoveCursor(editor_state.current_buffer, row, col);
+    int64_t row = editor_state.buffer->text->cursorRow;
+    int64_t col = editor_state.buffer->text->cursorCol + 1;
+    TextBufferMoveCursor(editor_state.buffer->text, row, col);
 }
\ No newline at end of file
@@ -0,0 +1,464 @@
+//
+// Replace-all: every line of a snapshot of the buffer is searched by jobs (see jobs.c), a chunk of lines each, and
+// each job builds the new contents of the lines it changed. Once every chunk is done, the new lines are swapped
+// into the buffer as one change, which can be undone. Lines without a match are never copied or touched.
+//
+
+// Lines searched by each job
+#define REPLACE_CHUNK_LINES 16384
+// Gap given to a line built by a replace. Small, since most replaced lines are never typed in
+#define REPLACE_LINE_GAP 16
+
+
+struct Replace;
+
+
+/*
+ * ReplaceChunk
+ * A chunk of lines searched by one replace job.
+ *
+ * job: the job searching the chunk
+ * replace: the replace the chunk belongs to
+ * first, count: the lines of the snapshot in the chunk
+ *
+ * Filled in by the job, read once it's finished:
+ * rows, lines: the rows that had a match and their new lines, found of them. capacity is the size of both arrays
+ * matches: number of matches replaced
+ * failed: the job ran out of memory
+ * */
+struct ReplaceChunk {
+    struct Job job;
+    struct Replace* replace;
+    int64_t first;
+    int64_t count;
+
+    int64_t* rows;
+    GapBuffer** lines;
+    int64_t found;
+    int64_t capacity;
+    int64_t matches;
+    bool failed;
+};
+
+
+/*
+ * Replace
+ * A replace-all running over a snapshot of a buffer.
+ *
+ * owner: for done, e.g. the buffer being replaced in
+ * done: called on the UI thread when the last chunk is finished
+ * snapshot: the lines being searched
+ * find, with: the text to find and what to replace it with, find_len and with_len long. Owned by the replace
+ * token: cancels the chunks' jobs
+ * chunks: chunk_count chunks. chunks_done of them are finished (only used on the UI thread)
+ * */
+struct Replace {
+    void* owner;
+    void (*done)(struct Replace* replace);
+    TextBufferSnapshot* snapshot;
+    char* find;
+    int64_t find_len;
+    char* with;
+    int64_t with_len;
+    struct JobToken token;
+    struct ReplaceChunk* chunks;
+    int chunk_count;
+    int chunks_done;
+};
+
+
+/*
+ * LineUndo
+ * Undoes a change made with TextBufferReplaceLines: lines are the lines that were replaced at rows, count of them.
+ * Only valid while the buffer is still at version; any other edit in between makes it stale.
+ * */
+struct LineUndo {
+    int64_t* rows;
+    GapBuffer** lines;
+    int64_t count;
+    unsigned long version;
+};
+
+
+/*
+ * Returns the index of the first occurrence of find in text at or after start, or -1.
+ * */
+int64_t find_text(const char* text, int64_t len, int64_t start, const char* find, int64_t find_len) {
+
+    while (start + find_len <= len) {
+        const char* first = memchr(text + start, find[0], len - start - find_len + 1);
+
+        if (first == NULL) {
+            return -1;
+        }
+
+        start = first - text;
+
+        if (memcmp(text + start, find, find_len) == 0) {
+            return start;
+        }
+
+        start++;
+    }
+
+    return -1;
+}
+
+
+/*
+ * Returns the line's string as one run of characters. Lines whose gap is at either end are read in place;
+ * otherwise the string is copied to *scratch, which is grown as needed. *scratch_len is its size.
+ * Returns NULL if scratch couldn't be grown.
+ * */
+const char* line_text(GapBuffer* line, char** scratch, int64_t* scratch_len) {
+
+    if (line->gap_loc == line->str_len) {
+        return line->buffer;
+    }
+
+    if (line->gap_loc == 0) {
+        return line->buffer + line->gap_len;
+    }
+
+    if (*scratch_len < line->str_len) {
+        char* grown = realloc(*scratch, line->str_len);
+
+        if (grown == NULL) {
+            return NULL;
+        }
+
+        *scratch = grown;
+        *scratch_len = line->str_len;
+    }
+
+    GapBufferCopyRange(line, 0, line->str_len, *scratch);
+    return *scratch;
+}
+
+
+/*
+ * Builds the line that replaces text, with every match of the replace's text from `match` on replaced.
+ * Returns the line, or NULL if it couldn't be allocated.
+ * */
+GapBuffer* replace_line(struct Replace* replace, const char* text, int64_t len, int64_t match, int64_t* matches) {
+    int64_t count = 0;
+
+    for (int64_t i = match; i != -1; i = find_text(text, len, i + replace->find_len, replace->find,
+                                                     replace->find_len)) {
+        count++;
+    }
+
+    GapBuffer* line = CreateGapBuffer(len + count * (replace->with_len - replace->find_len) + REPLACE_LINE_GAP);
+
+    if (line == NULL) {
+        return NULL;
+    }
+
+    // Sized for the whole line above, so none of these inserts resize it
+    int64_t copied = 0;
+    for (int64_t i = match; i != -1; i = find_text(text, len, i + replace->find_len, replace->find,
+                                                     replace->find_len)) {
+        GapBufferInsertString(line, text + copied, i - copied);
+        GapBufferInsertString(line, replace->with, replace->with_len);
+        copied = i + replace->find_len;
+    }
+    GapBufferInsertString(line, text + copied, len - copied);
+
+    *matches += count;
+    return line;
+}
+
+
+/*
+ * Adds a replaced line to the chunk's results. Returns false if the results couldn't be grown.
+ * */
+bool replace_chunk_add(struct ReplaceChunk* chunk, int64_t row, GapBuffer* line) {
+
+    if (chunk->found == chunk->capacity) {
+        int64_t capacity = chunk->capacity == 0 ? 64 : chunk->capacity * 2;
+        int64_t* rows = realloc(chunk->rows, sizeof(int64_t) * capacity);
+
+        if (rows == NULL) {
+            return false;
+        }
+        chunk->rows = rows;
+
+        GapBuffer** lines = realloc(chunk->lines, sizeof(GapBuffer*) * capacity);
+
+        if (lines == NULL) {
+            return false;
+        }
+        chunk->lines = lines;
+        chunk->capacity = capacity;
+    }
+
+    chunk->rows[chunk->found] = row;
+    chunk->lines[chunk->found] = line;
+    chunk->found++;
+    return true;
+}
+
+
+/*
+ * The replace job. Searches each line of the chunk, and builds a new line for every line with a match.
+ * */
+void replace_run(struct Job* job) {
+    struct ReplaceChunk* chunk = job->arg;
+    struct Replace* replace = chunk->replace;
+    char* scratch = NULL;
+    int64_t scratch_len = 0;
+
+    for (int64_t row = chunk->first; row < chunk->first + chunk->count && !job_cancelled(job); row++) {
+        GapBuffer* line = replace->snapshot->lines[row];
+
+        if (line->str_len < replace->find_len) {
+            continue;
+        }
+
+        const char* text = line_text(line, &scratch, &scratch_len);
+
+        if (text == NULL) {
+            chunk->failed = true;
+            break;
+        }
+
+        int64_t match = find_text(text, line->str_len, 0, replace->find, replace->find_len);
+
+        if (match == -1) {
+            continue;
+        }
+
+        GapBuffer* replaced = replace_line(replace, text, line->str_len, match, &chunk->matches);
+
+        if (replaced == NULL) {
+            chunk->failed = true;
+            break;
+        }
+
+        if (!replace_chunk_add(chunk, row, replaced)) {
+            DestroyGapBuffer(replaced);
+            chunk->failed = true;
+            break;
+        }
+    }
+
+    free(scratch);
+}
+
+
+/*
+ * Completion of a chunk's job. The last one to finish completes the replace.
+ * */
+void replace_chunk_finished(struct Job* job) {
+    struct ReplaceChunk* chunk = job->arg;
+    struct Replace* replace = chunk->replace;
+
+    if (++replace->chunks_done == replace->chunk_count && replace->done != NULL) {
+        replace->done(replace);
+    }
+}
+
+
+/*
+ * Cancels the replace if it's still running, and frees it along with any lines it built that weren't committed.
+ * */
+void replace_destroy(struct Replace* replace) {
+    job_token_cancel(&replace->token);
+
+    for (int i = 0; i < replace->chunk_count; i++) {
+        struct ReplaceChunk* chunk = &replace->chunks[i];
+
+        job_wait(&chunk->job);
+        destroy_lines(chunk->lines, chunk->found);
+        free(chunk->lines);
+        free(chunk->rows);
+    }
+
+    DestroyTextBufferSnapshot(replace->snapshot);
+    free(replace->chunks);
+    free(replace->find);
+    free(replace->with);
+    free(replace);
+}
+
+
+/*
+ * Starts replacing every occurrence of find in text with `with`, on a snapshot of text. The buffer can be edited
+ * meanwhile, but then the replace can't be committed. done is run on the UI thread once every line has been
+ * searched, and should commit the replace with replace_commit, or drop it. owner is stored in the replace for it.
+ * Returns the replace, or NULL if find is empty or the replace couldn't be started.
+ * */
+struct Replace* replace_start(TextBuffer* text, const char* find, const char* with,
+                              void (*done)(struct Replace*), void* owner) {
+
+    if (find[0] == '\0') {
+        return NULL;
+    }
+
+    struct Replace* replace = calloc(1, sizeof(struct Replace));
+
+    if (replace == NULL) {
+        return NULL;
+    }
+
+    replace->owner = owner;
+    replace->done = done;
+    replace->find = strdup(find);
+    replace->find_len = strlen(find);
+    replace->with = strdup(with);
+    replace->with_len = strlen(with);
+    replace->snapshot = CreateTextBufferSnapshot(text);
+
+    int64_t line_count = text->last_line_loc + 1;
+    replace->chunk_count = (int) ((line_count + REPLACE_CHUNK_LINES - 1) / REPLACE_CHUNK_LINES);
+    replace->chunks = calloc(replace->chunk_count, sizeof(struct ReplaceChunk));
+
+    if (replace->find == NULL || replace->with == NULL || replace->snapshot == NULL || replace->chunks == NULL) {
+        if (replace->snapshot != NULL) {
+            DestroyTextBufferSnapshot(replace->snapshot);
+        }
+        free(replace->chunks);
+        free(replace->find);
+        free(replace->with);
+        free(replace);
+        return NULL;
+    }
+
+    for (int i = 0; i < replace->chunk_count; i++) {
+        struct ReplaceChunk* chunk = &replace->chunks[i];
+
+        chunk->replace = replace;
+        chunk->first = (int64_t) i * REPLACE_CHUNK_LINES;
+        chunk->count = line_count - chunk->first < REPLACE_CHUNK_LINES ? line_count - chunk->first
+                                                                        : REPLACE_CHUNK_LINES;
+        job_init(&chunk->job, replace_run, replace_chunk_finished, chunk, &replace->token);
+    }
+
+    // Submitted once they're all set up; a chunk can finish before the next one is submitted
+    for (int i = 0; i < replace->chunk_count; i++) {
+        if (jobs_submit(&replace->chunks[i].job) != 0) {
+            // Counted as done, so the replace still completes once the submitted chunks are finished
+            replace->chunks[i].failed = true;
+            replace->chunks[i].job.state = JOB_FINISHED;
+            replace->chunks_done++;
+        }
+    }
+
+    // Completions run on this thread, so only chunks that failed to be queued can be counted yet. If none was
+    // queued, no completion will run done
+    if (replace->chunks_done == replace->chunk_count) {
+        replace_destroy(replace);
+        return NULL;
+    }
+
+    return replace;
+}
+
+
+/*
+ * Returns how many of the replace's lines have been searched, in percent.
+ * */
+int replace_progress(struct Replace* replace) {
+    return replace->chunks_done * 100 / replace->chunk_count;
+}
+
+
+/*
+ * Waits for every chunk to be searched, without running the completions. Used when the result is needed right away.
+ * */
+void replace_wait(struct Replace* replace) {
+    for (int i = 0; i < replace->chunk_count; i++) {
+        job_wait(&replace->chunks[i].job);
+    }
+
+    replace->chunks_done = replace->chunk_count;
+}
+
+
+/*
+ * Frees the lines and undo record of a LineUndo, leaving it empty.
+ * */
+void line_undo_clear(struct LineUndo* undo) {
+    destroy_lines(undo->lines, undo->count);
+    free(undo->lines);
+    free(undo->rows);
+    memset(undo, 0, sizeof(struct LineUndo));
+}
+
+
+/*
+ * Swaps the replaced lines into text as a single change. The lines that were replaced are kept in undo, which is
+ * cleared first. Every chunk must be finished.
+ * Returns the number of matches replaced, -1 if text was edited since the replace started, -2 if a job ran out of
+ * memory, or MEM_ERROR. Nothing is changed unless it succeeds.
+ * */
+int64_t replace_commit(struct Replace* replace, TextBuffer* text, struct LineUndo* undo) {
+    int64_t found = 0;
+    int64_t matches = 0;
+
+    if (text->version != replace->snapshot->version) {
+        return -1;
+    }
+
+    for (int i = 0; i < replace->chunk_count; i++) {
+        if (replace->chunks[i].failed) {
+            return -2;
+        }
+
+        found += replace->chunks[i].found;
+        matches += replace->chunks[i].matches;
+    }
+
+    if (found == 0) {
+        return 0;
+    }
+
+    int64_t* rows = malloc(sizeof(int64_t) * found);
+    GapBuffer** lines = malloc(sizeof(GapBuffer*) * found);
+
+    if (rows == NULL || lines == NULL) {
+        free(rows);
+        free(lines);
+        return MEM_ERROR;
+    }
+
+    // Chunks are in order, so the rows come out sorted
+    int64_t next = 0;
+    for (int i = 0; i < replace->chunk_count; i++) {
+        struct ReplaceChunk* chunk = &replace->chunks[i];
+
+        memcpy(rows + next, chunk->rows, sizeof(int64_t) * chunk->found);
+        memcpy(lines + next, chunk->lines, sizeof(GapBuffer*) * chunk->found);
+        next += chunk->found;
+
+        // The lines belong to the buffer now
+        chunk->found = 0;
+    }
+
+    TextBufferReplaceLines(text, rows, lines, found);
+
+    line_undo_clear(undo);
+    undo->rows = rows;
+    undo->lines = lines;
+    undo->count = found;
+    undo->version = text->version;
+
+    return matches;
+}
+
+
+/*
+ * Undoes the change recorded in undo, if text hasn't been edited since. The undo is cleared either way.
+ * Returns 0, or -1 if there's nothing to undo or the undo is stale.
+ * */
+int line_undo_apply(struct LineUndo* undo, TextBuffer* text) {
+    int result = -1;
+
+    if (undo->count > 0 && text->version == undo->version) {
+        // Swapping the lines back hands the replaced lines to undo, to be freed below
+        result = TextBufferReplaceLines(text, undo->rows, undo->lines, undo->count);
+    }
+
+    line_undo_clear(undo);
+    return result;
+}
@@ -0,0 +1,81 @@
+//
+// Headless replay: runs a recorded keystroke script through the editor without a terminal, to measure it.
+//
+
+#include <time.h>
+
+#define DEFAULT_HEADLESS_WIDTH 80
+#define DEFAULT_HEADLESS_HEIGHT 24
+
+
+/*
+ * ReplayStats
+ * Counters for a headless run.
+ * keys: keypresses processed
+ * frames: screens drawn
+ * bytes: bytes of text and escape codes drawn, that would have been written to the terminal
+ * start: when the replay started
+ * */
+struct ReplayStats {
+    long keys;
+    long frames;
+    long bytes;
+    struct timespec start;
+};
+
+
+void replay_start(struct ReplayStats* stats) {
+    memset(stats, 0, sizeof(struct ReplayStats));
+    clock_gettime(CLOCK_MONOTONIC, &stats->start);
+}
+
+
+double replay_elapsed(struct ReplayStats* stats) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - stats->start.tv_sec) + (now.tv_nsec - stats->start.tv_nsec) / 1e9;
+}
+
+
+/*
+ * 64-bit FNV-1a hash of the buffer's contents as they would be saved (lines joined by newlines).
+ * Read straight from the gap buffers, so hashing doesn't allocate.
+ * */
+unsigned long long text_buffer_hash(TextBuffer* buffer) {
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (int64_t i = 0; i <= buffer->last_line_loc; i++) {
+        GapBuffer* line = buffer->lines[i];
+
+        for (int64_t j = 0; j < line->gap_loc; j++) {
+            hash = (hash ^ (unsigned char) line->buffer[j]) * 1099511628211ULL;
+        }
+
+        for (int64_t j = line->gap_loc + line->gap_len; j < line->str_len + line->gap_len; j++) {
+            hash = (hash ^ (unsigned char) line->buffer[j]) * 1099511628211ULL;
+        }
+
+        hash = (hash ^ '\n') * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+void replay_report(struct ReplayStats* stats, TextBuffer* buffer, FILE* out) {
+    double elapsed = replay_elapsed(stats);
+
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+
+    fprintf(out, "time: %.3fs\n", elapsed);
+    fprintf(out, "keys: %ld (%.0f keys/s)\n", stats->keys, stats->keys / elapsed);
+    fprintf(out, "frames: %ld (%.0f frames/s)\n", stats->frames, stats->frames / elapsed);
+    fprintf(out, "bytes: %ld (%.0f bytes/frame)\n",
+            stats->bytes, stats->frames > 0 ? (double) stats->bytes / stats->frames : 0.0);
+    fprintf(out, "lines: %" PRId64 "\n", buffer->last_line_loc + 1);
+    fprintf(out, "hash: %016llx\n", text_buffer_hash(buffer));
+    print_memory_stats(buffer, out);
+}
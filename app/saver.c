@@ -0,0 +1,190 @@
+//
+// Background saving: a buffer is written out from a snapshot by a job (see jobs.c), so saving a large file doesn't hold up
+// editing. The file is overwritten in place and cut to size once the snapshot is written, so a save that can't
+// start leaves the file as it was. Lines at the start of the buffer that the file already has are skipped, so
+// saving lines appended to a large file only writes the new lines.
+//
+
+// Lines written between progress updates
+#define SAVER_BATCH_LINES 4096
+
+
+/*
+ * Saver
+ * A snapshot of a buffer being written to its file by a saver job.
+ *
+ * job: the job writing the file. Its completion is given by whoever started the save
+ * owner: for the completion, e.g. the buffer being saved
+ * fp: the file, owned by the saver
+ * snapshot: the lines being written. Released by the job once they're written
+ * version, size: version of the buffer that's being saved, and the bytes it takes up
+ * first_row: lines before it are in the file as they are in the snapshot, and aren't written again
+ * st: the file once it's written, to tell whether it's changed by the next save
+ *
+ * Shared with the job, only accessed while holding lock:
+ * bytes_written: bytes of the snapshot written so far
+ * failed: writing or closing the file failed
+ * */
+struct Saver {
+    struct Job job;
+    void* owner;
+    FILE* fp;
+    TextBufferSnapshot* snapshot;
+    unsigned long version;
+    int64_t size;
+    int64_t first_row;
+    struct stat st;
+
+    pthread_mutex_t lock;
+    int64_t bytes_written;
+    bool failed;
+};
+
+
+/*
+ * Returns the offset in the file of the saver's first_row: where writing starts. The lines from there on are
+ * counted back from the end, so an append to a large file is found without going over the lines before it.
+ * Lines are only skipped if the file has a newline where the last one ends; otherwise (e.g. a file whose last line
+ * had none, and was then added to) the whole file is written.
+ * */
+int64_t saver_offset(struct Saver* saver) {
+    TextBufferSnapshot* snapshot = saver->snapshot;
+    int64_t offset = snapshot->size;
+    struct stat st;
+    char newline;
+
+    for (int64_t row = snapshot->line_count - 1; row >= saver->first_row; row--) {
+        offset -= snapshot->lines[row]->str_len + 1;
+    }
+
+    if (offset == 0 || fstat(fileno(saver->fp), &st) != 0 || st.st_size < offset ||
+        pread(fileno(saver->fp), &newline, 1, offset - 1) != 1 || newline != '\n') {
+        saver->first_row = 0;
+        return 0;
+    }
+
+    return offset;
+}
+
+
+/*
+ * The saver job. Writes the snapshot from its first changed line a batch of lines at a time, updating the progress
+ * after each batch.
+ * */
+void saver_run(struct Job* job) {
+    struct Saver* saver = job->arg;
+    TextBufferSnapshot* snapshot = saver->snapshot;
+    int64_t offset = saver_offset(saver);
+    bool failed = fseeko(saver->fp, offset, SEEK_SET) != 0;
+
+    pthread_mutex_lock(&saver->lock);
+    saver->bytes_written = offset;
+    pthread_mutex_unlock(&saver->lock);
+
+    for (int64_t first = saver->first_row; first < snapshot->line_count && !failed; first += SAVER_BATCH_LINES) {
+        int64_t count = snapshot->line_count - first < SAVER_BATCH_LINES ? snapshot->line_count - first
+                                                                         : SAVER_BATCH_LINES;
+        int64_t bytes = 0;
+
+        failed = TextBufferSnapshotWrite(snapshot, first, count, saver->fp) != 0;
+
+        for (int64_t i = first; i < first + count; i++) {
+            bytes += snapshot->lines[i]->str_len + 1;
+        }
+
+        pthread_mutex_lock(&saver->lock);
+        saver->bytes_written += bytes;
+        pthread_mutex_unlock(&saver->lock);
+    }
+
+    if (!failed) {
+        failed = fflush(saver->fp) != 0 || ftruncate(fileno(saver->fp), snapshot->size) != 0 ||
+                 fstat(fileno(saver->fp), &saver->st) != 0;
+    }
+    failed |= fclose(saver->fp) != 0;
+    saver->fp = NULL;
+
+    // Lines edited from now on don't need to be copied
+    DestroyTextBufferSnapshot(snapshot);
+    saver->snapshot = NULL;
+
+    pthread_mutex_lock(&saver->lock);
+    saver->failed = failed;
+    pthread_mutex_unlock(&saver->lock);
+}
+
+
+/*
+ * Starts a job writing text to fp. The saver takes ownership of fp, which should be open for reading and writing.
+ * The file already has the lines before first_row as they are in text, so it's written from there on (0 writes the
+ * whole file).
+ * complete is run on the UI thread once the file is written, with the saver as the job's arg; it should finish the
+ * save with saver_finish. owner is stored in the saver for it.
+ * Returns the saver, or NULL if the snapshot couldn't be taken or the job couldn't be started; fp is left open
+ * for the caller then.
+ * */
+struct Saver* saver_start(FILE* fp, TextBuffer* text, int64_t first_row, void (*complete)(struct Job*),
+                          void* owner) {
+    struct Saver* saver = calloc(1, sizeof(struct Saver));
+
+    if (saver == NULL) {
+        return NULL;
+    }
+
+    saver->snapshot = CreateTextBufferSnapshot(text);
+
+    if (saver->snapshot == NULL) {
+        free(saver);
+        return NULL;
+    }
+
+    saver->owner = owner;
+    saver->fp = fp;
+    saver->version = saver->snapshot->version;
+    saver->size = saver->snapshot->size;
+    saver->first_row = first_row;
+    pthread_mutex_init(&saver->lock, NULL);
+    job_init(&saver->job, saver_run, complete, saver, NULL);
+
+    if (jobs_submit(&saver->job) != 0) {
+        DestroyTextBufferSnapshot(saver->snapshot);
+        pthread_mutex_destroy(&saver->lock);
+        free(saver);
+        return NULL;
+    }
+
+    return saver;
+}
+
+
+/*
+ * Returns how much of the snapshot has been written, in percent.
+ * */
+int saver_progress(struct Saver* saver) {
+    pthread_mutex_lock(&saver->lock);
+    int64_t written = saver->bytes_written;
+    pthread_mutex_unlock(&saver->lock);
+
+    if (saver->size <= 0) {
+        return 100;
+    }
+
+    return (int) (written * 100 / saver->size);
+}
+
+
+/*
+ * Waits for the job to finish writing and frees the saver. A save is never cut short, or the file would be
+ * left half written.
+ * Returns 0, or -2 if the file couldn't be written.
+ * */
+int saver_finish(struct Saver* saver) {
+    job_wait(&saver->job);
+
+    int result = saver->failed ? -2 : 0;
+
+    pthread_mutex_destroy(&saver->lock);
+    free(saver);
+
+    return result;
+}
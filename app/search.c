@@ -0,0 +1,321 @@
+//
+// Find: searches a buffer from the cursor for a string. Large buffers get a trigram index (see trigram.h), built
+// by a job (see jobs.c) from a snapshot, so a search only reads the blocks of lines that can have a match. Lines
+// edited since the index was built are searched directly, and the index is rebuilt once too many lines changed.
+//
+
+#include "../buffer/trigram.h"
+
+// Text in each block of the index, to start with. The index is made coarser until it fits in its memory limit
+#define SEARCH_BLOCK_BYTES 16384
+// Coarsest blocks an index is built with; past that, the buffer is searched without one
+#define SEARCH_MAX_BLOCK_BYTES (16 << 20)
+// Lines indexed between checks for cancellation
+#define SEARCH_CHECK_LINES 65536
+// Lines a buffer needs to be worth indexing
+#define SEARCH_INDEX_MIN_LINES 100000
+// Lines edited since the index was built that are searched directly before it's rebuilt
+#define SEARCH_DIRTY_LINES 65536
+// Memory an index may take up when TED_SEARCH_INDEX doesn't say
+#define SEARCH_INDEX_MAX_BYTES (256L << 20)
+
+
+/*
+ * SearchIndexer
+ * A snapshot of a buffer being indexed by a job.
+ *
+ * job, token: the job, and its cancellation token
+ * owner: for the completion, e.g. the buffer being indexed
+ * snapshot: the buffer when indexing started. Released by the job once its lines are indexed
+ * version: the buffer's version when indexing started
+ * max_bytes: most memory the index may take up
+ *
+ * Filled in by the job, read once it's finished:
+ * index: the index of the snapshot's lines, or NULL if it failed
+ * full: no index fit in max_bytes, even with the coarsest blocks
+ * */
+struct SearchIndexer {
+    struct Job job;
+    struct JobToken token;
+    void* owner;
+    TextBufferSnapshot* snapshot;
+    unsigned long version;
+    int64_t max_bytes;
+
+    TrigramIndex* index;
+    bool full;
+};
+
+
+/*
+ * SearchRange
+ * Rows first to last of a buffer, that may have a match.
+ * */
+struct SearchRange {
+    int64_t first;
+    int64_t last;
+};
+
+
+/*
+ * The indexing job. Adds the snapshot's lines to an index a batch at a time; an index that goes over its memory
+ * limit is thrown away and built again with blocks twice the size.
+ * */
+void search_index_run(struct Job* job) {
+    struct SearchIndexer* indexer = job->arg;
+    TextBufferSnapshot* snapshot = indexer->snapshot;
+    int64_t block_bytes = SEARCH_BLOCK_BYTES;
+
+    while (block_bytes <= SEARCH_MAX_BLOCK_BYTES && !job_cancelled(job)) {
+        TrigramIndex* index = CreateTrigramIndex(block_bytes, indexer->max_bytes);
+        int err = index == NULL ? MEM_ERROR : 0;
+
+        for (int64_t row = 0; row < snapshot->line_count && err == 0; row += SEARCH_CHECK_LINES) {
+            int64_t count = snapshot->line_count - row < SEARCH_CHECK_LINES ? snapshot->line_count - row
+                                                                              : SEARCH_CHECK_LINES;
+
+            err = TrigramIndexAddLines(index, snapshot->lines + row, count);
+
+            if (err == 0 && job_cancelled(job)) {
+                err = MEM_ERROR;
+            }
+        }
+
+        if (err == 0) {
+            indexer->index = index;
+            break;
+        }
+
+        DestroyTrigramIndex(index);
+
+        if (err != TRIGRAM_FULL) {
+            break;
+        }
+
+        block_bytes *= 2;
+        indexer->full = block_bytes > SEARCH_MAX_BLOCK_BYTES;
+    }
+
+    // Lines edited from now on don't need to be copied
+    DestroyTextBufferSnapshot(snapshot);
+    indexer->snapshot = NULL;
+}
+
+
+/*
+ * Starts a job indexing text, in an index of at most max_bytes. complete is run on the UI thread once it's done,
+ * with the indexer as the job's arg; it should take the index and free the indexer with search_index_destroy.
+ * owner is stored in the indexer for it.
+ * Returns the indexer, or NULL if it couldn't be started.
+ * */
+struct SearchIndexer* search_index_start(TextBuffer* text, int64_t max_bytes, void (*complete)(struct Job*),
+                                         void* owner) {
+    struct SearchIndexer* indexer = calloc(1, sizeof(struct SearchIndexer));
+
+    if (indexer == NULL) {
+        return NULL;
+    }
+
+    indexer->owner = owner;
+    indexer->version = text->version;
+    indexer->max_bytes = max_bytes;
+    indexer->snapshot = CreateTextBufferSnapshot(text);
+
+    if (indexer->snapshot == NULL) {
+        free(indexer);
+        return NULL;
+    }
+
+    job_init(&indexer->job, search_index_run, complete, indexer, &indexer->token);
+
+    if (jobs_submit(&indexer->job) != 0) {
+        DestroyTextBufferSnapshot(indexer->snapshot);
+        free(indexer);
+        return NULL;
+    }
+
+    return indexer;
+}
+
+
+/*
+ * Stops the indexer if it's still running, and frees it along with the index if it wasn't taken.
+ * */
+void search_index_destroy(struct SearchIndexer* indexer) {
+    job_token_cancel(&indexer->token);
+    job_wait(&indexer->job);
+
+    if (indexer->snapshot != NULL) {
+        DestroyTextBufferSnapshot(indexer->snapshot);
+    }
+
+    DestroyTrigramIndex(indexer->index);
+    free(indexer);
+}
+
+
+/*
+ * Returns whether the lines changed since an index was taken at version are too many to keep searching directly,
+ * or can't be told apart from the rest.
+ * */
+bool search_index_stale(TextBuffer* text, unsigned long version) {
+    TextBufferChanges changes;
+    int result = TextBufferChangesSince(text, version, &changes);
+
+    return result == CHANGES_ALL ||
+           (result == CHANGES_RANGE && changes.last_row - changes.first_row >= SEARCH_DIRTY_LINES);
+}
+
+
+/*
+ * helper for qsort, orders ranges by their first row
+ * */
+int compare_ranges(const void* a, const void* b) {
+    const struct SearchRange* first = a;
+    const struct SearchRange* second = b;
+
+    return (first->first > second->first) - (first->first < second->first);
+}
+
+
+/*
+ * Finds the rows of text that may have a line containing find: with an index of the text as it was at version,
+ * the rows of the blocks that have every trigram of find, moved to where those lines are now, and the rows edited
+ * since. Without one (index NULL, or the edits can't be told apart), every row.
+ * ranges is set to an allocated array of the ranges, in order and not overlapping, which the caller frees.
+ * Returns the number of ranges, or -1 if they couldn't be allocated.
+ * */
+int64_t search_ranges(TextBuffer* text, TrigramIndex* index, unsigned long version, const char* find, int64_t len,
+                      struct SearchRange** ranges) {
+    TextBufferChanges changes = {0, -1, 0};
+    int64_t* blocks = NULL;
+    int64_t block_count = 0;
+    int result = index != NULL ? TextBufferChangesSince(text, version, &changes) : CHANGES_ALL;
+
+    if (result != CHANGES_ALL) {
+        int err = TrigramIndexQuery(index, find, len, &blocks, &block_count);
+
+        if (err == MEM_ERROR) {
+            return -1;
+        }
+
+        result = err == TRIGRAM_ALL_BLOCKS ? CHANGES_ALL : result;
+    }
+
+    if (result == CHANGES_ALL) {
+        if ((*ranges = malloc(sizeof(struct SearchRange))) == NULL) {
+            return -1;
+        }
+
+        (*ranges)[0].first = 0;
+        (*ranges)[0].last = text->last_line_loc;
+        return 1;
+    }
+
+    // Each block can be cut in two by the edited rows, which are a range of their own
+    int64_t count = 0;
+    int64_t old_last = changes.last_row - changes.line_delta;
+    struct SearchRange* found = malloc(sizeof(struct SearchRange) * (block_count * 2 + 1));
+
+    if (found == NULL) {
+        free(blocks);
+        return -1;
+    }
+
+    if (result == CHANGES_RANGE) {
+        found[count].first = changes.first_row;
+        found[count].last = changes.last_row < text->last_line_loc ? changes.last_row : text->last_line_loc;
+        count++;
+    }
+
+    for (int64_t i = 0; i < block_count; i++) {
+        int64_t first = index->block_rows[blocks[i]];
+        int64_t last = index->block_rows[blocks[i] + 1] - 1;
+
+        if (result == CHANGES_NONE) {
+            found[count++] = (struct SearchRange) {first, last};
+            continue;
+        }
+
+        // Rows before the edits are where they were, and rows after them moved by line_delta
+        if (first < changes.first_row) {
+            found[count++] = (struct SearchRange) {first, last < changes.first_row ? last : changes.first_row - 1};
+        }
+        if (last > old_last) {
+            found[count++] = (struct SearchRange) {(first > old_last ? first : old_last + 1) + changes.line_delta,
+                                                   last + changes.line_delta};
+        }
+    }
+
+    free(blocks);
+    qsort(found, count, sizeof(struct SearchRange), compare_ranges);
+
+    // Blocks next to each other, or next to the edited rows, are searched as one range
+    int64_t merged = 0;
+
+    for (int64_t i = 0; i < count; i++) {
+        if (merged > 0 && found[i].first <= found[merged - 1].last + 1) {
+            if (found[i].last > found[merged - 1].last) {
+                found[merged - 1].last = found[i].last;
+            }
+        } else if (found[i].first <= found[i].last) {
+            found[merged++] = found[i];
+        }
+    }
+
+    *ranges = found;
+    return merged;
+}
+
+
+/*
+ * Searches the rows in ranges for find, starting just after (row, col) and wrapping around to the start of the
+ * buffer, and sets (row, col) to the first match. A match at (row, col) itself is only found once every other row
+ * has been searched.
+ * Returns 1 if there's a match, 0 if there isn't, or MEM_ERROR.
+ * */
+int search_next(TextBuffer* text, struct SearchRange* ranges, int64_t range_count, const char* find, int64_t len,
+                int64_t* row, int64_t* col) {
+    char* scratch = NULL;
+    int64_t scratch_len = 0;
+    int64_t start_row = *row;
+    int64_t start_col = *col + 1;
+
+    // The first pass goes from the cursor to the end, the second from the start back to the cursor
+    for (int pass = 0; pass < 2; pass++) {
+        for (int64_t i = 0; i < range_count; i++) {
+            int64_t first = ranges[i].first;
+            int64_t last = ranges[i].last;
+
+            if (pass == 0 ? last < start_row : first > start_row) {
+                continue;
+            }
+
+            first = pass == 0 && first < start_row ? start_row : first;
+            last = pass == 1 && last > start_row ? start_row : last;
+
+            for (int64_t r = first; r <= last; r++) {
+                GapBuffer* line = text->lines[r];
+                const char* line_str = line_text(line, &scratch, &scratch_len);
+
+                if (line_str == NULL) {
+                    free(scratch);
+                    return MEM_ERROR;
+                }
+
+                int64_t from = pass == 0 && r == start_row ? start_col : 0;
+                int64_t found = find_text(line_str, line->str_len, from, find, len);
+
+                if (found != -1) {
+                    free(scratch);
+                    *row = r;
+                    *col = found;
+                    return 1;
+                }
+            }
+        }
+    }
+
+    free(scratch);
+    return 0;
+}
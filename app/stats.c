@@ -0,0 +1,113 @@
+//
+// Memory statistics: where a buffer's memory goes, and what the Buffer library allocated, for the status line and
+// replay reports.
+//
+
+#include "../buffer/alloc.h"
+
+
+/*
+ * Writes bytes with a K, M or G suffix to out, e.g. "12.3M". out must have room for 16 characters.
+ * */
+void format_size(int64_t bytes, char* out) {
+    const char suffixes[] = "BKMG";
+    double size = bytes;
+    int suffix = 0;
+
+    while (size >= 1024 && suffix < 3) {
+        size /= 1024;
+        suffix++;
+    }
+
+    if (suffix == 0) {
+        sprintf(out, "%" PRId64 "B", bytes);
+    } else {
+        sprintf(out, "%.1f%c", size, suffixes[suffix]);
+    }
+}
+
+
+/*
+ * Writes a one line summary of the buffer's memory and the library's allocations to out, e.g.
+ * "text 4.0M gap 6.1M lines 0.8M+0.8M structs 1.2M malloc ~0.5M | 1234 allocs 5.1M/7.2M peak"
+ * */
+void format_memory_stats(TextBuffer* text, char* out, size_t len) {
+    TextBufferStats stats;
+    BufferAllocStats alloc_stats;
+    char sizes[7][16];
+
+    TextBufferGetStats(text, &stats);
+    BufferGetAllocStats(&alloc_stats);
+
+    format_size(stats.text_bytes, sizes[0]);
+    format_size(stats.gap_bytes, sizes[1]);
+    format_size(stats.array_bytes, sizes[2]);
+    format_size(stats.array_slack_bytes, sizes[3]);
+    format_size(stats.struct_bytes, sizes[4]);
+    format_size(stats.overhead_bytes, sizes[5]);
+    format_size(alloc_stats.bytes, sizes[6]);
+
+    int written = snprintf(out, len, "text %s gap %s lines %s+%s structs %s malloc ~%s | %lu allocs %s/",
+                           sizes[0], sizes[1], sizes[2], sizes[3], sizes[4], sizes[5], alloc_stats.allocs, sizes[6]);
+
+    if (written >= 0 && (size_t) written < len) {
+        format_size(alloc_stats.peak_bytes, sizes[6]);
+        snprintf(out + written, len - written, "%s peak", sizes[6]);
+    }
+}
+
+
+/*
+ * Adds the memory of a buffer's search index, if it has one, to the summary in out, e.g. " | index 3.2M".
+ * */
+void append_index_stats(TrigramIndex* index, char* out, size_t len) {
+    size_t written = strlen(out);
+    char size[16];
+
+    if (index == NULL || written >= len) {
+        return;
+    }
+
+    format_size(TrigramIndexMemoryUsage(index), size);
+    snprintf(out + written, len - written, " | index %s", size);
+}
+
+
+/*
+ * Prints the full breakdown of the buffer's memory, the distribution of its line capacities and the library's
+ * allocation counts.
+ * */
+void print_memory_stats(TextBuffer* text, FILE* out) {
+    TextBufferStats stats;
+    BufferAllocStats alloc_stats;
+
+    TextBufferGetStats(text, &stats);
+    BufferGetAllocStats(&alloc_stats);
+
+    fprintf(out, "memory: %" PRId64 " bytes (%" PRId64 " with malloc overhead)\n", TextBufferMemoryUsage(text),
+            TextBufferMemoryUsage(text) + stats.overhead_bytes);
+    fprintf(out, "  text: %" PRId64 "\n", stats.text_bytes);
+    fprintf(out, "  gaps: %" PRId64 "\n", stats.gap_bytes);
+    fprintf(out, "  lines array: %" PRId64 " (%" PRId64 " of %" PRId64 " slots used, %" PRId64 " unused)\n",
+            stats.array_bytes + stats.array_slack_bytes, stats.lines, stats.lines_capacity, stats.array_slack_bytes);
+    fprintf(out, "  structs: %" PRId64 "\n", stats.struct_bytes);
+    fprintf(out, "  malloc overhead (estimated): %" PRId64 "\n", stats.overhead_bytes);
+
+    fprintf(out, "line capacities:\n");
+    for (int i = 0; i < STATS_CAPACITY_BUCKETS; i++) {
+        if (stats.capacity_histogram[i] == 0) {
+            continue;
+        }
+
+        if (i == STATS_CAPACITY_BUCKETS - 1) {
+            fprintf(out, "  %ld+: %" PRId64 "\n", 1L << i, stats.capacity_histogram[i]);
+        } else {
+            fprintf(out, "  %ld-%ld: %" PRId64 "\n", i == 0 ? 0L : 1L << i, (2L << i) - 1, stats.capacity_histogram[i]);
+        }
+    }
+
+    fprintf(out, "allocations: %lu allocs, %lu reallocs, %lu frees, %lu failed\n",
+            alloc_stats.allocs, alloc_stats.reallocs, alloc_stats.frees, alloc_stats.failures);
+    fprintf(out, "allocated: %" PRId64 " bytes now, %" PRId64 " peak, %llu total\n",
+            alloc_stats.bytes, alloc_stats.peak_bytes, alloc_stats.total_bytes);
+}
@@ -5,10 +5,22 @@
 
 void screen_append(const char *str, int size);
 
+// Most anchors shown on one screen
+#define SCREEN_ANCHORS_MAX 256
+
+// Bytes the escape codes highlighting SCREEN_ANCHORS_MAX anchors take up
+#define SCREEN_ANCHOR_BYTES (SCREEN_ANCHORS_MAX * 9)
+
+// Columns the diff gutter takes up when it's shown: a mark and a space
+#define SCREEN_GUTTER_WIDTH 2
+
+// Bytes the gutter takes up on each screen row, with the escape codes colouring its mark
+#define SCREEN_GUTTER_BYTES 12
+
 
 typedef struct Cursor {
-    int x;
-    int y;
+    int64_t x;
+    int64_t y;
 } Cursor;
 
 
@@ -19,14 +31,127 @@ struct VirtualScreen {
     Cursor cursor;
     int width;
     int height;
-    int render_start_line;
+    int64_t render_start_line;
+    bool no_wrap;           // show each line on one screen row, scrolled horizontally by render_start_col
+    int64_t render_start_col;   // first column shown when no_wrap is set
+    int gutter;             // columns left of the text for diff marks, 0 when they aren't shown
+
+    // The frame in buffer is made of text rows, then the status line from status_start. Only what differs from what
+    // the terminal shows is sent to it, from output (see screen_compose)
+    int* row_starts;        // where each text row starts in buffer, and where the last one ends; row_count rows
+    int row_count;
+    int status_start;
+    uint64_t* frame_rows;   // hash of each text row of the frame
+    uint64_t* shown_rows;   // hash of each text row as the terminal shows it
+    bool rows_shown;        // shown_rows is known; false before the first frame, or to redraw everything
+    char* output;
+    int output_len;
 };
 
+
+/*
+ * Ends a text row of the frame, and records where the next one starts.
+ * */
+void screen_end_row(struct VirtualScreen* screen) {
+    screen_append("\r\n", 2);
+
+    if (screen->row_count < screen->height) {
+        screen->row_starts[++screen->row_count] = screen->buf_pos;
+    }
+}
+
+
+/*
+ * Appends len characters of line, starting at column start, to the screen. The characters are copied straight
+ * out of the line's gap buffer, so only the part of the line that's on screen is read.
+ * */
+void screen_append_line_slice(struct VirtualScreen* screen, GapBuffer* line, int64_t start, int64_t len) {
+
+    if (screen->buffer != NULL && (screen->len - screen->buf_pos) > len) {
+        screen->buf_pos += GapBufferCopyRange(line, start, len, screen->buffer + screen->buf_pos);
+    }
+}
+
+/*
+ * Appends a slice of a line like screen_append_line_slice, showing the characters anchors sit on in reverse video
+ * (a blank for an anchor at the end of the line). anchors are the anchors on screen, in order; *next is the first
+ * one not drawn yet, and is moved past the ones in the slice.
+ * */
+void screen_append_anchored_slice(struct VirtualScreen* screen, GapBuffer* line, int64_t row, int64_t start,
+                                  int64_t len, AnchorInfo* anchors, int64_t count, int64_t* next) {
+    int64_t pos = start;
+
+    while (*next < count && anchors[*next].row == row && anchors[*next].col < start + len) {
+        int64_t col = anchors[(*next)++].col;
+
+        // Scrolled off to the left, or a second anchor on the same character
+        if (col < pos) {
+            continue;
+        }
+
+        screen_append_line_slice(screen, line, pos, col - pos);
+        screen_append("\x1b[7m", 4);
+
+        if (col < line->str_len) {
+            screen_append_line_slice(screen, line, col, 1);
+        } else {
+            screen_append(" ", 1);
+        }
+
+        screen_append("\x1b[27m", 5);
+        pos = col + 1;
+    }
+
+    screen_append_line_slice(screen, line, pos, start + len - pos);
+}
+
+
+/*
+ * helpers that give the first and last buffer rows a hunk marks in the gutter. A deletion is marked on the line
+ * before it (the first line, for a deletion at the top).
+ * */
+int64_t gutter_first_row(const DiffHunk* hunk) {
+    return hunk->new_count > 0 || hunk->new_row == 0 ? hunk->new_row : hunk->new_row - 1;
+}
+
+int64_t gutter_last_row(const DiffHunk* hunk) {
+    return hunk->new_count > 0 ? hunk->new_row + hunk->new_count - 1 : gutter_first_row(hunk);
+}
+
+
+/*
+ * Appends the gutter for a buffer row: '+' for an added line, '~' for a changed one, '-' next to deleted lines, or
+ * a blank. hunks are sorted by row; *next is the first one that doesn't end before row, and is moved past the ones
+ * that do.
+ * */
+void screen_append_gutter(int64_t row, const DiffHunk* hunks, int64_t count, int64_t* next) {
+
+    while (*next < count && gutter_last_row(&hunks[*next]) < row) {
+        (*next)++;
+    }
+
+    if (*next == count || gutter_first_row(&hunks[*next]) > row) {
+        screen_append("  ", 2);
+        return;
+    }
+
+    const DiffHunk* hunk = &hunks[*next];
+
+    if (hunk->new_count == 0) {
+        screen_append("\x1b[31m-\x1b[39m ", 12);
+    } else if (row - hunk->new_row < hunk->old_count) {
+        screen_append("\x1b[33m~\x1b[39m ", 12);
+    } else {
+        screen_append("\x1b[32m+\x1b[39m ", 12);
+    }
+}
+
+
 /*
  * Returns the number of screen rows required to print a line of the given length.
  * undefined for line_length < 0
  * */
-int required_screen_rows(int line_length, int screen_width) {
+int64_t required_screen_rows(int64_t line_length, int screen_width) {
 
     // lines required is the number of times the screen width is filled len/width + 1 if there's a remainder
     if (line_length == 0) {
@@ -51,10 +176,30 @@ int required_screen_rows(int line_length, int screen_width) {
 void move_cursor_in_view(TextBuffer* buffer, struct VirtualScreen* screen){
 
     Cursor buffer_cursor = {buffer->cursorRow, buffer->cursorCol};
+    int text_width = screen->width - screen->gutter;
 
-    int cumul_req_rows = 0;
-    int cur_line_required_rows;
-    int cur_line = screen->render_start_line;
+    // Without wrapping every line is a single row, and the view scrolls sideways to keep the cursor in view
+    if (screen->no_wrap){
+        int text_rows = screen->height - 1;
+
+        if (buffer_cursor.x < screen->render_start_line){
+            screen->render_start_line = buffer_cursor.x;
+        } else if (buffer_cursor.x >= screen->render_start_line + text_rows){
+            screen->render_start_line = buffer_cursor.x - text_rows + 1;
+        }
+
+        if (buffer_cursor.y < screen->render_start_col){
+            screen->render_start_col = buffer_cursor.y;
+        } else if (buffer_cursor.y >= screen->render_start_col + text_width){
+            screen->render_start_col = buffer_cursor.y - text_width + 1;
+        }
+
+        return;
+    }
+
+    int64_t cumul_req_rows = 0;
+    int64_t cur_line_required_rows;
+    int64_t cur_line = screen->render_start_line;
 
 
     // The entire render_start_line is guaranteed to be rendered (except the corner case where
@@ -67,7 +212,7 @@ void move_cursor_in_view(TextBuffer* buffer, struct VirtualScreen* screen){
     else {
         while (cur_line <= buffer->last_line_loc) {
 
-            cur_line_required_rows = required_screen_rows(buffer->lines[cur_line]->str_len, screen->width);
+            cur_line_required_rows = required_screen_rows(buffer->lines[cur_line]->str_len, text_width);
 
             if ((cur_line_required_rows + cumul_req_rows) > screen->height - 1) {
                 cur_line--;
@@ -78,21 +223,26 @@ void move_cursor_in_view(TextBuffer* buffer, struct VirtualScreen* screen){
             cur_line++;
         }
 
+        // The render start line is always drawn, even when it needs more rows than the screen has
+        if (cur_line < screen->render_start_line){
+            cur_line = screen->render_start_line;
+        }
+
         // If the cursor is not in view, shift the text displayed until it is
         if (buffer_cursor.x > cur_line) {
 
-            int rows_required = 0;
+            int64_t rows_required = 0;
 
             // Calculate required space
             while(cur_line <= buffer_cursor.x){
-                rows_required += required_screen_rows(buffer->lines[cur_line]->str_len, screen->width);
+                rows_required += required_screen_rows(buffer->lines[cur_line]->str_len, text_width);
                 cur_line++;
             }
 
 
             // shift the render start line down until we've made enough room
-            while (rows_required > 0){
-                rows_required -= required_screen_rows(buffer->lines[screen->render_start_line]->str_len, screen->width);
+            while (rows_required > 0 && screen->render_start_line < buffer_cursor.x){
+                rows_required -= required_screen_rows(buffer->lines[screen->render_start_line]->str_len, text_width);
                 screen->render_start_line++;
 
             }
@@ -101,80 +251,212 @@ void move_cursor_in_view(TextBuffer* buffer, struct VirtualScreen* screen){
 }
 
 
-void draw_editor_window(TextBuffer* buffer, struct VirtualScreen* screen){
-    char* line = NULL;
-    int cur_line = screen->render_start_line;
+/*
+ * Draws the lines of the buffer that fit on the screen, starting from render_start_line. The text area is every
+ * screen row but the last, which is left for the status line.
+ * Only the part of each line that's visible is read, so drawing doesn't depend on how long the lines are. Anchors
+ * (marks, bookmarks) are looked up for the visible lines only.
+ * When the gutter is shown, the lines are marked with the hunks of a diff (hunk_count of them, sorted by row).
+ * */
+void draw_editor_window(TextBuffer* buffer, struct VirtualScreen* screen, const DiffHunk* hunks, int64_t hunk_count){
+    int64_t cur_line = screen->render_start_line;
     int lines_written = 0;
-    int screen_cols;
-
-    while (cur_line <= buffer->last_line_loc && lines_written < screen->height - 1){
+    int text_rows = screen->height - 1;
+    int text_width = screen->width - screen->gutter;
+    GapBuffer* line;
 
-        screen_cols = screen->width;
+    // Binary search for the first hunk that isn't above the screen
+    int64_t next_hunk = 0;
+    int64_t hunks_end = hunk_count;
 
-        // Let's draw cur_line using as many screen rows as needed.
-        line = TextBufferGetLine(buffer, cur_line);
+    while (next_hunk < hunks_end){
+        int64_t mid = next_hunk + (hunks_end - next_hunk) / 2;
 
-        if (line == NULL){
-            panic("draw editor cant get text of current line in buffer");
+        if (gutter_last_row(&hunks[mid]) < cur_line){
+            next_hunk = mid + 1;
+        } else {
+            hunks_end = mid;
         }
+    }
 
-        // Draw the line
-        if (strlen(line) > screen_cols) {
-            // Here we need multiple screen rows to draw 'line' we'll use whatever is available to draw it
+    screen->row_starts[0] = screen->buf_pos;
+    screen->row_count = 0;
 
-            int i=0;
-            int len_to_write;
+    AnchorInfo anchors[SCREEN_ANCHORS_MAX];
+    int64_t anchor_count = TextBufferFindAnchors(buffer, cur_line, cur_line + text_rows - 1, -1, anchors,
+                                                 SCREEN_ANCHORS_MAX);
+    int64_t next_anchor = 0;
 
-            do {
-                // if remaining line can fit in screen space, write the remaining line, else fill the remaining space
-                len_to_write = screen_cols < strlen(&line[i]) ? screen_cols : strlen(&line[i]);
+    while (cur_line <= buffer->last_line_loc && lines_written < text_rows){
 
-                screen_append(&line[i], len_to_write);
-                screen_append("\r\n", 2); screen_append("\x1b[K", 3);
-                i += len_to_write;
-                lines_written++;
+        line = buffer->lines[cur_line];
 
-                // Screen is full, lets stop
-                if (lines_written == screen->height - 2){
-                    break;
-                }
+        // Anchors on the rest of a line that didn't fit
+        while (next_anchor < anchor_count && anchors[next_anchor].row < cur_line){
+            next_anchor++;
+        }
 
-            } while (i < strlen(line) - 1);
+        if (screen->gutter > 0){
+            screen_append_gutter(cur_line, hunks, hunk_count, &next_hunk);
+        }
 
-        } else {
-            screen_append(line, strlen(line));
-            screen_append("\r\n", 2);
+        if (screen->no_wrap){
+            screen_append_anchored_slice(screen, line, cur_line, screen->render_start_col, text_width,
+                                         anchors, anchor_count, &next_anchor);
+            screen_end_row(screen);
             lines_written++;
+
+        } else {
+            // Draw cur_line using as many screen rows as needed, or as many as are left
+            int64_t i = 0;
+
+            do {
+                // Rows a line wraps onto have a blank gutter
+                if (screen->gutter > 0 && i > 0){
+                    screen_append("  ", 2);
+                }
+
+                screen_append_anchored_slice(screen, line, cur_line, i, text_width, anchors, anchor_count,
+                                             &next_anchor);
+                screen_end_row(screen);
+                i += text_width;
+                lines_written++;
+
+            } while (i < line->str_len && lines_written < text_rows);
         }
 
-        free(line);
         cur_line++;
     }
 
     // If there's remaining space, fill with blanks
-    for (; lines_written < screen->height-2; lines_written++){
-        screen_append("\r\n", 2);
+    for (; lines_written < text_rows; lines_written++){
+        screen_end_row(screen);
     }
 }
 
 
 void set_virtual_cursor_position(TextBuffer* buffer, struct VirtualScreen* screen){
+    int text_width = screen->width - screen->gutter;
 
-    int current_line = screen->render_start_line;
-    int virtual_cursor_row = 1;
-    int required_rows;
+    if (screen->no_wrap){
+        screen->cursor.x = buffer->cursorRow - screen->render_start_line + 1;
+        screen->cursor.y = buffer->cursorCol - screen->render_start_col + 1 + screen->gutter;
+        return;
+    }
+
+    int64_t current_line = screen->render_start_line;
+    int64_t virtual_cursor_row = 1;
+    int64_t required_rows;
 
     while (current_line != buffer->cursorRow){
-        required_rows = required_screen_rows(buffer->lines[current_line]->str_len, screen->width);
+        required_rows = required_screen_rows(buffer->lines[current_line]->str_len, text_width);
 
         virtual_cursor_row += required_rows;
         current_line++;
     }
 
     // if the cursor line wraps, we need to shift the cursor down the number of times it wraps
-    virtual_cursor_row += (buffer->cursorCol) / screen->width;
+    virtual_cursor_row += (buffer->cursorCol) / text_width;
 
     // now lets set the screen cursor x and y position
     screen->cursor.x = virtual_cursor_row;
-    screen->cursor.y = (buffer->cursorCol % screen->width) + 1;
+    screen->cursor.y = (buffer->cursorCol % text_width) + 1 + screen->gutter;
+}
+
+
+/*
+ * Appends len bytes to the screen's output, if there's room.
+ * */
+void screen_output(struct VirtualScreen* screen, int* pos, const char* str, int len) {
+
+    if (screen->output_len - *pos > len) {
+        memcpy(screen->output + *pos, str, len);
+        *pos += len;
+    }
+}
+
+
+/*
+ * Works out what to send the terminal to turn what it shows into the frame in buffer, and puts it in output.
+ * Text rows that moved up or down since the last frame are scrolled there inside a scroll region (DECSTBM) that
+ * leaves the status line out, and only the rows that then differ from the frame are drawn, so scrolling by k rows
+ * sends k rows and the status line however tall the screen is. The whole update is one synchronized update (DEC
+ * mode 2026), which terminals that support it show at once.
+ * Returns the number of bytes in output.
+ * */
+int screen_compose(struct VirtualScreen* screen) {
+    int rows = screen->row_count;
+    uint64_t blank = GapBufferHashString("", 0);
+    char codes[32];
+    int pos = 0;
+
+    screen_output(screen, &pos, "\x1b[?2026h\x1b[?25l", 14);
+
+    // Nothing is known about what the terminal shows before the first frame
+    if (!screen->rows_shown) {
+        screen_output(screen, &pos, "\x1b[2J", 4);
+
+        for (int i = 0; i < rows; i++) {
+            screen->shown_rows[i] = blank;
+        }
+        screen->rows_shown = true;
+    }
+
+    for (int i = 0; i < rows; i++) {
+        screen->frame_rows[i] = GapBufferHashString(screen->buffer + screen->row_starts[i],
+                                                    screen->row_starts[i + 1] - screen->row_starts[i] - 2);
+    }
+
+    // The shift that leaves the most rows showing what they should; positive when the text moved up
+    int shift = 0;
+    int best = 0;
+
+    for (int k = 1 - rows; k < rows; k++) {
+        int kept = 0;
+
+        for (int i = k > 0 ? 0 : -k; i < (k > 0 ? rows - k : rows); i++) {
+            kept += screen->frame_rows[i] == screen->shown_rows[i + k];
+        }
+
+        if (kept > best || (kept == best && k == 0)) {
+            best = kept;
+            shift = k;
+        }
+    }
+
+    if (shift != 0) {
+        int len = snprintf(codes, sizeof codes, "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, abs(shift), shift > 0 ? 'S' : 'T');
+        screen_output(screen, &pos, codes, len);
+
+        if (shift > 0) {
+            memmove(screen->shown_rows, screen->shown_rows + shift, sizeof(uint64_t) * (rows - shift));
+        } else {
+            memmove(screen->shown_rows - shift, screen->shown_rows, sizeof(uint64_t) * (rows + shift));
+        }
+
+        // Rows scrolled in are blank
+        for (int i = 0; i < abs(shift); i++) {
+            screen->shown_rows[shift > 0 ? rows - 1 - i : i] = blank;
+        }
+    }
+
+    for (int i = 0; i < rows; i++) {
+        if (screen->frame_rows[i] == screen->shown_rows[i]) {
+            continue;
+        }
+
+        int len = snprintf(codes, sizeof codes, "\x1b[%d;1H\x1b[2K", i + 1);
+        screen_output(screen, &pos, codes, len);
+        screen_output(screen, &pos, screen->buffer + screen->row_starts[i],
+                      screen->row_starts[i + 1] - screen->row_starts[i] - 2);
+        screen->shown_rows[i] = screen->frame_rows[i];
+    }
+
+    // The status line changes with nearly every frame; it's followed by the cursor's position
+    int len = snprintf(codes, sizeof codes, "\x1b[%d;1H\x1b[2K", screen->height);
+    screen_output(screen, &pos, codes, len);
+    screen_output(screen, &pos, screen->buffer + screen->status_start, screen->buf_pos - screen->status_start);
+    screen_output(screen, &pos, "\x1b[?2026l", 8);
+
+    return pos;
 }
@@ -0,0 +1,117 @@
+//
+// Allocation hooks and accounting for the Buffer library.
+//
+
+#include <stdlib.h>
+
+#include "alloc.h"
+
+
+void* defaultAlloc(size_t size, void* ctx){
+    return malloc(size);
+}
+
+
+void* defaultRealloc(void* ptr, size_t old_size, size_t new_size, void* ctx){
+    return realloc(ptr, new_size);
+}
+
+
+void defaultFree(void* ptr, size_t size, void* ctx){
+    free(ptr);
+}
+
+
+static const BufferAllocator default_allocator = {defaultAlloc, defaultRealloc, defaultFree, NULL};
+static BufferAllocator allocator = {defaultAlloc, defaultRealloc, defaultFree, NULL};
+
+// Lines can be built on other threads (see the editor's background loader), so the counts are updated atomically
+static BufferAllocStats stats;
+
+
+/*
+ * Adds delta to the bytes allocated, raising the peak if it's passed.
+ * */
+void countBytes(int64_t delta){
+    int64_t bytes = __atomic_add_fetch(&stats.bytes, delta, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&stats.peak_bytes, __ATOMIC_RELAXED);
+
+    while (bytes > peak &&
+           !__atomic_compare_exchange_n(&stats.peak_bytes, &peak, bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    }
+
+    if (delta > 0){
+        __atomic_add_fetch(&stats.total_bytes, (unsigned long long) delta, __ATOMIC_RELAXED);
+    }
+}
+
+
+void BufferSetAllocator(const BufferAllocator* new_allocator){
+    allocator = new_allocator != NULL ? *new_allocator : default_allocator;
+}
+
+
+void BufferGetAllocStats(BufferAllocStats* out){
+    out->allocs = __atomic_load_n(&stats.allocs, __ATOMIC_RELAXED);
+    out->reallocs = __atomic_load_n(&stats.reallocs, __ATOMIC_RELAXED);
+    out->frees = __atomic_load_n(&stats.frees, __ATOMIC_RELAXED);
+    out->failures = __atomic_load_n(&stats.failures, __ATOMIC_RELAXED);
+    out->bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+    out->peak_bytes = __atomic_load_n(&stats.peak_bytes, __ATOMIC_RELAXED);
+    out->total_bytes = __atomic_load_n(&stats.total_bytes, __ATOMIC_RELAXED);
+}
+
+
+void BufferResetAllocStats(){
+    __atomic_store_n(&stats.allocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.reallocs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.frees, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.total_bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.peak_bytes, __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+
+void* BufferAlloc(size_t size){
+    void* ptr = allocator.alloc(size, allocator.ctx);
+
+    if (ptr == NULL){
+        __atomic_add_fetch(&stats.failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&stats.allocs, 1, __ATOMIC_RELAXED);
+    countBytes((int64_t) size);
+    return ptr;
+}
+
+
+void* BufferRealloc(void* ptr, size_t old_size, size_t new_size){
+
+    if (ptr == NULL){
+        return BufferAlloc(new_size);
+    }
+
+    void* new_ptr = allocator.realloc(ptr, old_size, new_size, allocator.ctx);
+
+    if (new_ptr == NULL){
+        __atomic_add_fetch(&stats.failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&stats.reallocs, 1, __ATOMIC_RELAXED);
+    countBytes((int64_t) new_size - (int64_t) old_size);
+    return new_ptr;
+}
+
+
+void BufferFree(void* ptr, size_t size){
+
+    if (ptr == NULL){
+        return;
+    }
+
+    allocator.free(ptr, size, allocator.ctx);
+    __atomic_add_fetch(&stats.frees, 1, __ATOMIC_RELAXED);
+    countBytes(-(int64_t) size);
+}
@@ -0,0 +1,80 @@
+//
+// Allocation hooks and accounting for the Buffer library.
+//
+
+#ifndef TED_ALLOC_H
+#define TED_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * BufferAllocator
+ * Hooks every allocation the Buffer library makes for its structures goes through: GapBuffers, their text and the
+ * lines arrays of TextBuffers. Frees and reallocs are given the size of the block, so hooks can keep their own
+ * accounting without a header per block.
+ *
+ * Strings returned to callers (GapBufferGetString, TextBufferGetLine) are freed by the caller with free(), so they
+ * always come from malloc and aren't seen by the hooks.
+ *
+ * ctx is passed to every hook.
+ * */
+typedef struct BufferAllocator {
+    void* (*alloc)(size_t size, void* ctx);
+    void* (*realloc)(void* ptr, size_t old_size, size_t new_size, void* ctx);
+    void (*free)(void* ptr, size_t size, void* ctx);
+    void* ctx;
+} BufferAllocator;
+
+
+/*
+ * BufferAllocStats
+ * Counts of the allocations made through the hooks, across all threads.
+ * allocs, reallocs, frees: number of calls that succeeded
+ * failures: number of allocs and reallocs that returned NULL
+ * bytes: bytes currently allocated
+ * peak_bytes: most bytes allocated at once since the last reset
+ * total_bytes: bytes allocated since the last reset, counting growth by realloc
+ * */
+typedef struct BufferAllocStats {
+    unsigned long allocs;
+    unsigned long reallocs;
+    unsigned long frees;
+    unsigned long failures;
+    int64_t bytes;
+    int64_t peak_bytes;
+    unsigned long long total_bytes;
+} BufferAllocStats;
+
+
+/*
+ * Installs allocation hooks. NULL restores the default ones, which use malloc, realloc and free.
+ * Hooks should only be changed while no Buffer library structures exist, since blocks are freed by the hooks
+ * installed at the time.
+ * */
+void BufferSetAllocator(const BufferAllocator* allocator);
+
+
+/*
+ * Copies the allocation counts into stats.
+ * */
+void BufferGetAllocStats(BufferAllocStats* stats);
+
+
+/*
+ * Zeroes the call counts and total_bytes, and sets peak_bytes to the bytes currently allocated. bytes is kept,
+ * since blocks allocated before the reset can still be freed after it.
+ * */
+void BufferResetAllocStats();
+
+
+/*
+ * Allocation functions used inside the library. They count the call and hand it to the installed hooks.
+ * BufferFree and BufferRealloc must be given the size the block was allocated with.
+ * */
+void* BufferAlloc(size_t size);
+void* BufferRealloc(void* ptr, size_t old_size, size_t new_size);
+void BufferFree(void* ptr, size_t size);
+
+#endif //TED_ALLOC_H
@@ -0,0 +1,353 @@
+//
+// Anchors kept in a treap with lazily pushed shifts, see anchor.h
+//
+
+#include <stdlib.h>
+
+#include "anchor.h"
+#include "alloc.h"
+
+
+void AnchorTreeInit(AnchorTree* tree){
+    tree->root = NULL;
+    tree->seed = 2463534242u;
+}
+
+
+/*
+ * helper that frees a subtree
+ * */
+void freeAnchors(Anchor* anchor){
+
+    if (anchor == NULL){
+        return;
+    }
+
+    freeAnchors(anchor->left);
+    freeAnchors(anchor->right);
+    BufferFree(anchor, sizeof(Anchor));
+}
+
+
+void AnchorTreeClear(AnchorTree* tree){
+    freeAnchors(tree->root);
+    tree->root = NULL;
+}
+
+
+/*
+ * helper that applies a shift to an anchor, and records it as owed to the anchors below it.
+ * */
+void applyShift(Anchor* anchor, const AnchorShift* shift){
+
+    if (anchor == NULL){
+        return;
+    }
+
+    if (shift->set){
+        anchor->row = shift->row;
+        anchor->col = shift->col;
+        anchor->pending = *shift;
+
+    } else {
+        anchor->row += shift->row;
+        anchor->col += shift->col;
+
+        // Moving anchors that are all going to one place moves that place
+        anchor->pending.row += shift->row;
+        anchor->pending.col += shift->col;
+    }
+}
+
+
+/*
+ * helper that hands the shift pending at an anchor down to its children
+ * */
+void pushShift(Anchor* anchor){
+
+    if (anchor->pending.set || anchor->pending.row != 0 || anchor->pending.col != 0){
+        applyShift(anchor->left, &anchor->pending);
+        applyShift(anchor->right, &anchor->pending);
+
+        anchor->pending.set = 0;
+        anchor->pending.row = 0;
+        anchor->pending.col = 0;
+    }
+}
+
+
+/*
+ * helper that pushes down every shift pending above an anchor and at the anchor itself, so it and its children
+ * have their real positions.
+ * */
+void pushPath(Anchor* anchor){
+
+    if (anchor->parent != NULL){
+        pushPath(anchor->parent);
+    }
+
+    pushShift(anchor);
+}
+
+
+/*
+ * helper that recomputes an anchor's subtree size from its children
+ * */
+void resizeAnchor(Anchor* anchor){
+    anchor->size = 1 + (anchor->left != NULL ? anchor->left->size : 0) +
+                   (anchor->right != NULL ? anchor->right->size : 0);
+}
+
+
+/*
+ * helper that splits a tree into the anchors before (row, col), and those at or after it.
+ * Both halves come out with no parent.
+ * */
+void splitAnchors(Anchor* tree, int64_t row, int64_t col, Anchor** before, Anchor** after){
+
+    if (tree == NULL){
+        *before = NULL;
+        *after = NULL;
+        return;
+    }
+
+    pushShift(tree);
+
+    if (tree->row < row || (tree->row == row && tree->col < col)){
+        splitAnchors(tree->right, row, col, &tree->right, after);
+
+        if (tree->right != NULL){
+            tree->right->parent = tree;
+        }
+        *before = tree;
+
+    } else {
+        splitAnchors(tree->left, row, col, before, &tree->left);
+
+        if (tree->left != NULL){
+            tree->left->parent = tree;
+        }
+        *after = tree;
+    }
+
+    resizeAnchor(tree);
+    tree->parent = NULL;
+}
+
+
+/*
+ * helper that joins two trees, every anchor of `before` coming before every anchor of `after`.
+ * returns the joined tree, which is left with no parent
+ * */
+Anchor* mergeAnchors(Anchor* before, Anchor* after){
+
+    if (before == NULL){
+        return after;
+    }
+    if (after == NULL){
+        return before;
+    }
+
+    if (before->priority > after->priority){
+        pushShift(before);
+        before->right = mergeAnchors(before->right, after);
+        before->right->parent = before;
+        resizeAnchor(before);
+        before->parent = NULL;
+        return before;
+    }
+
+    pushShift(after);
+    after->left = mergeAnchors(before, after->left);
+    after->left->parent = after;
+    resizeAnchor(after);
+    after->parent = NULL;
+    return after;
+}
+
+
+Anchor* AnchorTreeAdd(AnchorTree* tree, int64_t row, int64_t col, int kind){
+    Anchor* anchor = BufferAlloc(sizeof(Anchor));
+
+    if (anchor == NULL){
+        return NULL;
+    }
+
+    // xorshift32
+    tree->seed ^= tree->seed << 13;
+    tree->seed ^= tree->seed >> 17;
+    tree->seed ^= tree->seed << 5;
+
+    anchor->left = NULL;
+    anchor->right = NULL;
+    anchor->parent = NULL;
+    anchor->priority = tree->seed;
+    anchor->size = 1;
+    anchor->row = row;
+    anchor->col = col;
+    anchor->kind = kind;
+    anchor->pending.set = 0;
+    anchor->pending.row = 0;
+    anchor->pending.col = 0;
+
+    // Split after the anchors already at the position, so the new one goes last among them
+    Anchor* before;
+    Anchor* after;
+
+    splitAnchors(tree->root, row, col + 1, &before, &after);
+    tree->root = mergeAnchors(mergeAnchors(before, anchor), after);
+
+    return anchor;
+}
+
+
+void AnchorTreeRemove(AnchorTree* tree, Anchor* anchor){
+    pushPath(anchor);
+
+    Anchor* parent = anchor->parent;
+    Anchor* replacement = mergeAnchors(anchor->left, anchor->right);
+
+    if (replacement != NULL){
+        replacement->parent = parent;
+    }
+
+    if (parent == NULL){
+        tree->root = replacement;
+    } else if (parent->left == anchor){
+        parent->left = replacement;
+    } else {
+        parent->right = replacement;
+    }
+
+    for (; parent != NULL; parent = parent->parent){
+        resizeAnchor(parent);
+    }
+
+    BufferFree(anchor, sizeof(Anchor));
+}
+
+
+void AnchorTreePosition(Anchor* anchor, int64_t* row, int64_t* col){
+
+    if (anchor->parent != NULL){
+        pushPath(anchor->parent);
+    }
+
+    *row = anchor->row;
+    *col = anchor->col;
+}
+
+
+/*
+ * helper that applies a shift to the anchors from (from_row, from_col) up to (to_row, to_col): they're split off
+ * into a subtree of their own, the shift is left at its root, and the tree is joined back up.
+ * */
+void shiftRange(AnchorTree* tree, int64_t from_row, int64_t from_col, int64_t to_row, int64_t to_col,
+                const AnchorShift* shift){
+    Anchor* before;
+    Anchor* range;
+    Anchor* after;
+
+    if (tree->root == NULL){
+        return;
+    }
+
+    splitAnchors(tree->root, from_row, from_col, &before, &range);
+    splitAnchors(range, to_row, to_col, &range, &after);
+
+    applyShift(range, shift);
+
+    tree->root = mergeAnchors(mergeAnchors(before, range), after);
+}
+
+
+void AnchorTreeShift(AnchorTree* tree, int64_t from_row, int64_t from_col, int64_t to_row, int64_t to_col,
+                     int64_t rows, int64_t cols){
+    AnchorShift shift = {0, rows, cols};
+
+    if (rows != 0 || cols != 0){
+        shiftRange(tree, from_row, from_col, to_row, to_col, &shift);
+    }
+}
+
+
+void AnchorTreeCollapse(AnchorTree* tree, int64_t from_row, int64_t from_col, int64_t to_row, int64_t to_col,
+                        int64_t row, int64_t col){
+    AnchorShift shift = {1, row, col};
+    shiftRange(tree, from_row, from_col, to_row, to_col, &shift);
+}
+
+
+/*
+ * helper that counts the anchors before (row, col), walking down from the root
+ * */
+int64_t countBefore(Anchor* anchor, int64_t row, int64_t col){
+    int64_t count = 0;
+
+    while (anchor != NULL){
+        pushShift(anchor);
+
+        if (anchor->row < row || (anchor->row == row && anchor->col < col)){
+            count += 1 + (anchor->left != NULL ? anchor->left->size : 0);
+            anchor = anchor->right;
+        } else {
+            anchor = anchor->left;
+        }
+    }
+
+    return count;
+}
+
+
+int64_t AnchorTreeCount(AnchorTree* tree, int64_t first_row, int64_t last_row){
+
+    if (first_row > last_row){
+        return 0;
+    }
+
+    int64_t end = last_row < ANCHOR_END_ROW ? countBefore(tree->root, last_row + 1, 0)
+                                            : (tree->root != NULL ? tree->root->size : 0);
+
+    return end - countBefore(tree->root, first_row, 0);
+}
+
+
+/*
+ * helper that collects the anchors of a subtree on rows first_row to last_row, in order, skipping subtrees that
+ * are wholly outside them.
+ * */
+void findAnchors(Anchor* anchor, int64_t first_row, int64_t last_row, int kind, AnchorInfo* found, int64_t max,
+                 int64_t* count){
+
+    if (anchor == NULL || *count >= max){
+        return;
+    }
+
+    pushShift(anchor);
+
+    if (anchor->row >= first_row){
+        findAnchors(anchor->left, first_row, last_row, kind, found, max, count);
+    }
+
+    if (*count < max && anchor->row >= first_row && anchor->row <= last_row && (kind < 0 || anchor->kind == kind)){
+        found[*count].anchor = anchor;
+        found[*count].row = anchor->row;
+        found[*count].col = anchor->col;
+        found[*count].kind = anchor->kind;
+        (*count)++;
+    }
+
+    if (anchor->row <= last_row){
+        findAnchors(anchor->right, first_row, last_row, kind, found, max, count);
+    }
+}
+
+
+int64_t AnchorTreeFind(AnchorTree* tree, int64_t first_row, int64_t last_row, int kind, AnchorInfo* found,
+                       int64_t max){
+    int64_t count = 0;
+
+    findAnchors(tree->root, first_row, last_row, kind, found, max, &count);
+
+    return count;
+}
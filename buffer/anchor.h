@@ -0,0 +1,144 @@
+/*
+ * anchor.h
+ * Anchors: positions in a TextBuffer that stay on the same text as lines are edited, split and joined. Used for
+ * marks, bookmarks and anything else that needs to remember a place in the text.
+ *
+ * Anchors are kept in a treap ordered by position. An edit moves every anchor after it, so instead of visiting
+ * them, the anchors in the affected range are split off into a subtree and the shift is recorded at its root.
+ * Shifts are pushed down to children only when a search passes through a node, so an edit costs O(log n) however
+ * many anchors follow it.
+ *
+ * Note that anchors should not be manually populated. The tree is kept up to date by the TextBuffer that owns it;
+ * use the TextBuffer anchor functions in buffer.h.
+ * */
+
+#ifndef TED_ANCHOR_H
+#define TED_ANCHOR_H
+
+#include <stdint.h>
+
+// Row past every anchor, for ranges that run to the end of the buffer
+#define ANCHOR_END_ROW INT64_MAX
+
+
+/*
+ * AnchorShift
+ * A change of position owed to every anchor in a subtree.
+ * set: the anchors all move to (row, col). Otherwise row and col are added to their positions.
+ * */
+typedef struct AnchorShift {
+    int set;
+    int64_t row;
+    int64_t col;
+} AnchorShift;
+
+
+/*
+ * Anchor
+ * A node of the anchor tree.
+ * left, right, parent: tree links. The subtree on the left is before the anchor, the one on the right after it
+ * priority: random heap priority that keeps the tree balanced
+ * size: number of anchors in the subtree, this one included
+ * row, col: the anchor's position, before the pending shifts of its ancestors are applied
+ * kind: what the anchor is for. Chosen by whoever adds it; the tree doesn't look at it
+ * pending: shift still owed to the anchors below this one
+ * */
+typedef struct Anchor {
+    struct Anchor* left;
+    struct Anchor* right;
+    struct Anchor* parent;
+    uint32_t priority;
+    int64_t size;
+    int64_t row;
+    int64_t col;
+    int kind;
+    AnchorShift pending;
+} Anchor;
+
+
+/*
+ * AnchorTree
+ * root: the tree, NULL when there are no anchors
+ * seed: state of the generator for priorities
+ * */
+typedef struct AnchorTree {
+    Anchor* root;
+    uint32_t seed;
+} AnchorTree;
+
+
+/*
+ * AnchorInfo
+ * An anchor found by AnchorTreeFind, with its position at the time.
+ * */
+typedef struct AnchorInfo {
+    Anchor* anchor;
+    int64_t row;
+    int64_t col;
+    int kind;
+} AnchorInfo;
+
+
+/*
+ * Initializes an empty tree.
+ * */
+void AnchorTreeInit(AnchorTree* tree);
+
+
+/*
+ * Frees every anchor in the tree, leaving it empty.
+ * */
+void AnchorTreeClear(AnchorTree* tree);
+
+
+/*
+ * Adds an anchor at (row, col). Anchors at the same position are kept in the order they were added.
+ * returns the anchor, or NULL if it couldn't be allocated
+ * */
+Anchor* AnchorTreeAdd(AnchorTree* tree, int64_t row, int64_t col, int kind);
+
+
+/*
+ * Removes an anchor from the tree and frees it.
+ * */
+void AnchorTreeRemove(AnchorTree* tree, Anchor* anchor);
+
+
+/*
+ * Gets the current position of an anchor. Costs O(log n): the shifts pending above it are pushed down first.
+ * */
+void AnchorTreePosition(Anchor* anchor, int64_t* row, int64_t* col);
+
+
+/*
+ * Moves the anchors from (from_row, from_col) up to, but not including, (to_row, to_col) by rows and cols.
+ * The moved anchors must still come after the anchors before the range and before the anchors after it.
+ * */
+void AnchorTreeShift(AnchorTree* tree, int64_t from_row, int64_t from_col, int64_t to_row, int64_t to_col,
+                     int64_t rows, int64_t cols);
+
+
+/*
+ * Moves the anchors from (from_row, from_col) up to, but not including, (to_row, to_col) to (row, col), e.g. when
+ * the text they were on is deleted. The same ordering rule as AnchorTreeShift applies.
+ * */
+void AnchorTreeCollapse(AnchorTree* tree, int64_t from_row, int64_t from_col, int64_t to_row, int64_t to_col,
+                        int64_t row, int64_t col);
+
+
+/*
+ * Returns the number of anchors on rows first_row to last_row. Uses the subtree sizes, so it costs O(log n).
+ * */
+int64_t AnchorTreeCount(AnchorTree* tree, int64_t first_row, int64_t last_row);
+
+
+/*
+ * Finds the anchors on rows first_row to last_row, in order of position, e.g. the ones a renderer has on screen.
+ * Only anchors of the given kind are returned, or of any kind if kind is negative.
+ * Fills in at most max entries of found, and returns how many it filled in. Costs O(log n) plus the anchors
+ * visited.
+ * */
+int64_t AnchorTreeFind(AnchorTree* tree, int64_t first_row, int64_t last_row, int kind, AnchorInfo* found,
+                       int64_t max);
+
+#endif //TED_ANCHOR_H
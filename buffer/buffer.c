@@ -4,21 +4,23 @@
 
 #include "buffer.h"
 #include "gap.h"
+#include "alloc.h"
 #include <stdlib.h>
-#include <strings.h>
+#include <string.h>
 
 
-TextBuffer* CreateTextBuffer(int num_lines, int line_size){
-    TextBuffer* textBuffer = malloc(sizeof(TextBuffer));
+TextBuffer* CreateTextBuffer(int64_t num_lines, int64_t line_size){
+    TextBuffer* textBuffer = BufferAlloc(sizeof(TextBuffer));
 
     if (textBuffer == NULL){
         return NULL;
     }
 
     // Allocate gap buffer array
-    textBuffer->lines = malloc(sizeof(GapBuffer*) * num_lines);
+    textBuffer->lines = BufferAlloc(sizeof(GapBuffer*) * num_lines);
 
     if (textBuffer->lines == NULL){
+        BufferFree(textBuffer, sizeof(TextBuffer));
         return NULL;
     }
 
@@ -26,11 +28,13 @@ TextBuffer* CreateTextBuffer(int num_lines, int line_size){
     textBuffer->lines[0] = CreateGapBuffer(line_size);
 
     if (textBuffer->lines[0] == NULL){
+        BufferFree(textBuffer->lines, sizeof(GapBuffer*) * num_lines);
+        BufferFree(textBuffer, sizeof(TextBuffer));
         return NULL;
     }
 
     // NULL the rest of the lines
-    for (int i=1; i<num_lines; i++){
+    for (int64_t i=1; i<num_lines; i++){
         textBuffer->lines[i] = NULL;
     }
 
@@ -39,6 +43,10 @@ TextBuffer* CreateTextBuffer(int num_lines, int line_size){
     textBuffer->cursorCol = 0;
     textBuffer->cursorColMoved = 0;
     textBuffer->last_line_loc = 0;
+    textBuffer->version = 0;
+    textBuffer->journal_next = 0;
+    textBuffer->journal_count = 0;
+    AnchorTreeInit(&textBuffer->anchors);
 
     return textBuffer;
 }
@@ -46,24 +54,222 @@ TextBuffer* CreateTextBuffer(int num_lines, int line_size){
 
 void DestroyTextBuffer(TextBuffer* instance){
 
-    // Deallocate each GapBuffer
-    for(int i=0; i<instance->lines_capacity; i++){
+    // Deallocate each GapBuffer. Slots past the last line may be uninitialized after the array grows.
+    for(int64_t i=0; i<=instance->last_line_loc; i++){
+        DestroyGapBuffer(instance->lines[i]);
+    }
+
+    AnchorTreeClear(&instance->anchors);
+
+    // Deallocate the gapbuffer array and the TextBuffer itself
+    BufferFree(instance->lines, sizeof(GapBuffer*) * instance->lines_capacity);
+    BufferFree(instance, sizeof(TextBuffer));
+}
+
+
+/*
+ * helper that adds an entry for the current version to the journal: `removed` lines at row were replaced by
+ * `added` lines, which are now at row.
+ * A change inside lines the previous change replaced (typing on the same line) extends that entry instead of
+ * taking a new one, so the journal covers more than JOURNAL_LEN keystrokes.
+ * */
+void journalChange(TextBuffer* instance, int64_t row, int64_t removed, int64_t added){
+
+    if (instance->journal_count > 0){
+        TextBufferJournalEntry* last = &instance->journal[(instance->journal_next + JOURNAL_LEN - 1) % JOURNAL_LEN];
+
+        if (removed == added && row >= last->row && row + added <= last->row + last->added){
+            last->version = instance->version;
+            return;
+        }
+    }
+
+    TextBufferJournalEntry* entry = &instance->journal[instance->journal_next];
+    entry->version = instance->version;
+    entry->row = row;
+    entry->removed = removed;
+    entry->added = added;
+
+    instance->journal_next = (instance->journal_next + 1) % JOURNAL_LEN;
+
+    if (instance->journal_count < JOURNAL_LEN){
+        instance->journal_count++;
+    }
+}
+
+
+/*
+ * helper that records a change: `removed` lines at row were replaced by `added` lines, which are now at row.
+ * Bumps the version, stamps the added lines with it and adds the change to the journal.
+ * */
+void recordChange(TextBuffer* instance, int64_t row, int64_t removed, int64_t added){
+
+    instance->version++;
+
+    for (int64_t i = row; i < row + added; i++){
+        instance->lines[i]->version = instance->version;
+    }
+
+    journalChange(instance, row, removed, added);
+}
 
-        // Break if we're at the last line
-        if (instance->lines[i] == NULL){
+
+int TextBufferChangesSince(TextBuffer* instance, unsigned long since_version, TextBufferChanges* changes){
+
+    if (since_version >= instance->version){
+        return CHANGES_NONE;
+    }
+
+    // Find the oldest entry after since_version. Merged entries carry the newest version they cover,
+    // so the journal only reaches back to since_version if an older entry is still there.
+    int oldest = (instance->journal_next + JOURNAL_LEN - instance->journal_count) % JOURNAL_LEN;
+    int start = -1;
+
+    for (int i = 0; i < instance->journal_count; i++){
+        int index = (oldest + i) % JOURNAL_LEN;
+
+        if (instance->journal[index].version > since_version){
+            start = i;
             break;
         }
+    }
 
-        DestroyGapBuffer(instance->lines[i]);
+    if (start == -1 || (start == 0 && instance->journal_count == JOURNAL_LEN)){
+        return CHANGES_ALL;
     }
 
-    // Deallocate the gapbuffer array and the TextBuffer itself
-    free(instance->lines);
-    free(instance);
+    // Replay the changes, keeping the dirty range in the coordinates of the buffer after each change
+    int64_t first = -1;
+    int64_t last = -1;
+    int64_t delta = 0;
+
+    for (int64_t i = start; i < instance->journal_count; i++){
+        TextBufferJournalEntry* entry = &instance->journal[(oldest + i) % JOURNAL_LEN];
+
+        // A pure deletion still changes the row: the line after the deleted ones moves into it
+        int64_t end = entry->row + (entry->added > 0 ? entry->added : 1) - 1;
+
+        if (first == -1){
+            first = entry->row;
+            last = end;
+
+        } else {
+            if (last >= entry->row + entry->removed){
+                last += entry->added - entry->removed;
+            } else if (last >= entry->row){
+                last = end;
+            }
+
+            if (entry->row < first){
+                first = entry->row;
+            }
+            if (end > last){
+                last = end;
+            }
+        }
+
+        delta += entry->added - entry->removed;
+    }
+
+    changes->first_row = first;
+    changes->last_row = last;
+    changes->line_delta = delta;
+
+    return CHANGES_RANGE;
+}
+
+
+/*
+ * helper that moves anchors past text inserted at (row, col). The text ends `rows` lines down, at column end_col of
+ * its last line (if rows is 0, end_col is col plus its length). Anchors right at (row, col) stay in front of it.
+ * */
+void anchorsInserted(TextBuffer* instance, int64_t row, int64_t col, int64_t rows, int64_t end_col){
+
+    if (instance->anchors.root == NULL){
+        return;
+    }
+
+    // The lines below move first, so the rest of the line isn't moved twice
+    if (rows > 0){
+        AnchorTreeShift(&instance->anchors, row + 1, 0, ANCHOR_END_ROW, 0, rows, 0);
+    }
+
+    AnchorTreeShift(&instance->anchors, row, col + 1, row + 1, 0, rows, end_col - col);
+}
+
+
+/*
+ * helper that moves anchors for text deleted from (start_row, start_col) up to (end_row, end_col): anchors inside
+ * the deleted text go to its start, and the ones after it move back.
+ * */
+void anchorsDeleted(TextBuffer* instance, int64_t start_row, int64_t start_col, int64_t end_row, int64_t end_col){
+    AnchorTree* anchors = &instance->anchors;
+
+    if (anchors->root == NULL){
+        return;
+    }
+
+    AnchorTreeCollapse(anchors, start_row, start_col, end_row, end_col, start_row, start_col);
+    AnchorTreeShift(anchors, end_row, end_col, end_row + 1, 0, start_row - end_row, start_col - end_col);
+
+    if (end_row > start_row){
+        AnchorTreeShift(anchors, end_row + 1, 0, ANCHOR_END_ROW, 0, start_row - end_row, 0);
+    }
 }
 
 
-void TextBufferMoveCursor(TextBuffer* instance, int row, int col){
+/*
+ * helper that moves anchors for `removed` whole lines at row being replaced by `added` lines. Must be called
+ * before the lines array changes. Anchors on the removed lines go to the start of row, or to the end of the line
+ * above if nothing is left at row.
+ * */
+void anchorsLinesReplaced(TextBuffer* instance, int64_t row, int64_t removed, int64_t added){
+    AnchorTree* anchors = &instance->anchors;
+
+    if (anchors->root == NULL){
+        return;
+    }
+
+    if (row + removed <= instance->last_line_loc){
+        if (removed > 0){
+            AnchorTreeCollapse(anchors, row, 0, row + removed, 0, row, 0);
+        }
+        AnchorTreeShift(anchors, row + removed, 0, ANCHOR_END_ROW, 0, added - removed, 0);
+
+    } else if (added > 0 || row == 0){
+        AnchorTreeCollapse(anchors, row, 0, ANCHOR_END_ROW, 0, row, 0);
+
+    } else {
+        AnchorTreeCollapse(anchors, row, 0, ANCHOR_END_ROW, 0, row - 1, instance->lines[row - 1]->str_len);
+    }
+}
+
+
+/*
+ * helper that returns the line at row, ready to be changed. A line shared with a snapshot is replaced with a copy
+ * first, so the snapshot keeps the line as it was.
+ * returns NULL if the copy couldn't be allocated
+ * */
+GapBuffer* writableLine(TextBuffer* instance, int64_t row){
+    GapBuffer* line = instance->lines[row];
+
+    if (!GapBufferShared(line)){
+        return line;
+    }
+
+    GapBuffer* copy = GapBufferClone(line);
+
+    if (copy == NULL){
+        return NULL;
+    }
+
+    DestroyGapBuffer(line);
+    instance->lines[row] = copy;
+    return copy;
+}
+
+
+void TextBufferMoveCursor(TextBuffer* instance, int64_t row, int64_t col){
     if (row > instance->last_line_loc){
         row = instance->last_line_loc;
     }
@@ -71,6 +277,11 @@ void TextBufferMoveCursor(TextBuffer* instance, int row, int col){
         row = 0;
     }
 
+    // The gap of the new row can be anywhere, so a row change also needs a move before inserts
+    if (instance->cursorRow != row){
+        instance->cursorColMoved = 1;
+    }
+
     instance->cursorRow = row;
 
     if (col > instance->lines[row]->str_len){
@@ -94,6 +305,10 @@ int TextBufferInsert(TextBuffer* instance, char ch){
 
     int err;
 
+    if (writableLine(instance, instance->cursorRow) == NULL){
+        return MEM_ERROR;
+    }
+
     // If the cursor column changed, we need to move the gap buffer before inserting
     if (instance->cursorColMoved) {
         err = GapBufferMoveGap(instance->lines[instance->cursorRow], instance->cursorCol);
@@ -112,6 +327,8 @@ int TextBufferInsert(TextBuffer* instance, char ch){
     }
 
     instance->cursorCol = instance->lines[instance->cursorRow]->gap_loc;
+    anchorsInserted(instance, instance->cursorRow, instance->cursorCol - 1, 0, instance->cursorCol);
+    recordChange(instance, instance->cursorRow, 1, 1);
     return 0;
 }
 
@@ -119,6 +336,20 @@ int TextBufferInsert(TextBuffer* instance, char ch){
 int TextBufferBackspace(TextBuffer* instance){
     int err;
 
+    // At the start of a line, backspace removes the line break before it
+    if (instance->cursorCol == 0){
+        if (instance->cursorRow == 0){
+            return 0;
+        }
+
+        int64_t row = instance->cursorRow - 1;
+        return TextBufferDeleteRange(instance, row, instance->lines[row]->str_len, row + 1, 0);
+    }
+
+    if (writableLine(instance, instance->cursorRow) == NULL){
+        return MEM_ERROR;
+    }
+
     // If the cursor column changed, we need to move the gap buffer before deleting
     if (instance->cursorColMoved) {
         err = GapBufferMoveGap(instance->lines[instance->cursorRow], instance->cursorCol);
@@ -132,7 +363,371 @@ int TextBufferBackspace(TextBuffer* instance){
 
     GapBufferBackSpace(instance->lines[instance->cursorRow]);
     instance->cursorCol = instance->lines[instance->cursorRow]->gap_loc;
+    anchorsDeleted(instance, instance->cursorRow, instance->cursorCol, instance->cursorRow, instance->cursorCol + 1);
+    recordChange(instance, instance->cursorRow, 1, 1);
+
+    return 0;
+}
+
+
+/*
+ * helper that clamps a position to a valid position in the buffer
+ * */
+void clampPosition(TextBuffer* instance, int64_t* row, int64_t* col){
+    if (*row > instance->last_line_loc){
+        *row = instance->last_line_loc;
+        *col = instance->lines[*row]->str_len;
+    }
+    if (*row < 0){
+        *row = 0;
+        *col = 0;
+    }
+    if (*col > instance->lines[*row]->str_len){
+        *col = instance->lines[*row]->str_len;
+    }
+    if (*col < 0){
+        *col = 0;
+    }
+}
+
+
+/*
+ * helper that frees lines [first, first + count) and closes up the lines array with a single memmove.
+ * */
+void removeLines(TextBuffer* instance, int64_t first, int64_t count){
+
+    for (int64_t i = first; i < first + count; i++){
+        DestroyGapBuffer(instance->lines[i]);
+    }
+
+    memmove(instance->lines + first,
+            instance->lines + first + count,
+            sizeof(GapBuffer*) * (instance->last_line_loc + 1 - (first + count)));
+
+    instance->last_line_loc -= count;
+}
+
+
+int TextBufferDeleteRange(TextBuffer* instance, int64_t start_row, int64_t start_col, int64_t end_row, int64_t end_col){
+
+    int err;
+
+    clampPosition(instance, &start_row, &start_col);
+    clampPosition(instance, &end_row, &end_col);
+
+    if (end_row < start_row || (end_row == start_row && end_col < start_col)){
+        int64_t tmp_row = start_row, tmp_col = start_col;
+        start_row = end_row; start_col = end_col;
+        end_row = tmp_row; end_col = tmp_col;
+    }
+
+    if (start_row == end_row && start_col == end_col){
+        return 0;
+    }
+
+    GapBuffer* first = writableLine(instance, start_row);
+
+    if (first == NULL){
+        return MEM_ERROR;
+    }
+
+    if (start_row == end_row){
+        // Inside one line, the range is the characters before end_col
+        GapBufferMoveGap(first, end_col);
+        GapBufferBackSpaceN(first, end_col - start_col);
+
+    } else {
+        GapBuffer* last = instance->lines[end_row];
+        int64_t tail_len = last->str_len - end_col;
+
+        // Make room for what's left of the last line first, so the first line isn't cut if there's no memory for it
+        if ((err = GapBufferReserve(first, tail_len + 1)) != 0){
+            return err;
+        }
+
+        // Cut the first line at start_col and bring over what's left of the last line
+        GapBufferMoveGap(first, start_col);
+        GapBufferDeleteForward(first, first->str_len - start_col);
+        GapBufferInsertRange(first, last, end_col, tail_len);
+
+        removeLines(instance, start_row + 1, end_row - start_row);
+    }
+
+    anchorsDeleted(instance, start_row, start_col, end_row, end_col);
+    recordChange(instance, start_row, end_row - start_row + 1, 1);
+
+    // Keep the cursor on the same text
+    int64_t row = instance->cursorRow;
+    int64_t col = instance->cursorCol;
+
+    if (row > end_row){
+        row -= end_row - start_row;
+
+    } else if (row == end_row && col >= end_col){
+        row = start_row;
+        col = start_col + (col - end_col);
+
+    } else if (row > start_row || (row == start_row && col > start_col)){
+        row = start_row;
+        col = start_col;
+    }
+
+    instance->cursorRow = row;
+    instance->cursorCol = col;
+    instance->cursorColMoved = 1;
+
+    return 0;
+}
+
+
+int TextBufferJoinLines(TextBuffer* instance, int64_t row){
+
+    if (row < 0 || row >= instance->last_line_loc){
+        return 0;
+    }
+
+    return TextBufferDeleteRange(instance, row, instance->lines[row]->str_len, row + 1, 0);
+}
+
+
+int TextBufferDeleteLines(TextBuffer* instance, int64_t row, int64_t count){
+
+    if (row < 0){
+        count += row;
+        row = 0;
+    }
+
+    if (row + count > instance->last_line_loc + 1){
+        count = instance->last_line_loc + 1 - row;
+    }
+
+    if (count <= 0){
+        return 0;
+    }
+
+    // The buffer always has at least one line. Deleting all of them keeps the first, emptied.
+    if (count == instance->last_line_loc + 1){
+        GapBuffer* line = instance->lines[0];
+
+        // A shared line is replaced with an empty one rather than copied just to be emptied
+        if (GapBufferShared(line)){
+            GapBuffer* empty = CreateGapBuffer(line->str_len + line->gap_len);
+
+            if (empty == NULL){
+                return MEM_ERROR;
+            }
+
+            DestroyGapBuffer(line);
+            instance->lines[0] = empty;
+        } else {
+            GapBufferMoveGap(line, 0);
+            GapBufferDeleteForward(line, line->str_len);
+        }
+
+        anchorsLinesReplaced(instance, 0, count, 1);
+        removeLines(instance, 1, count - 1);
+        recordChange(instance, 0, count, 1);
+
+        row = 1;
+        count--;
+
+    } else {
+        anchorsLinesReplaced(instance, row, count, 0);
+        removeLines(instance, row, count);
+        recordChange(instance, row, count, 0);
+    }
+
+    if (instance->cursorRow >= row + count){
+        instance->cursorRow -= count;
+
+    } else if (instance->cursorRow >= row){
+        instance->cursorRow = row <= instance->last_line_loc ? row : instance->last_line_loc;
+        instance->cursorCol = 0;
+    }
+
+    if (instance->cursorCol > instance->lines[instance->cursorRow]->str_len){
+        instance->cursorCol = instance->lines[instance->cursorRow]->str_len;
+    }
+
+    instance->cursorColMoved = 1;
+
+    return 0;
+}
+
+
+int TextBufferApplyEdits(TextBuffer* instance, TextBufferEdit* edits, int64_t count){
+
+    int err = 0;
+    int64_t first = 0;
+    int64_t first_row = -1;
+    int64_t last_row = -1;
+
+    while (first < count){
+
+        int64_t row = edits[first].row;
+        if (row > instance->last_line_loc){
+            row = instance->last_line_loc;
+        }
+        if (row < 0){
+            row = 0;
+        }
+
+        // Find the edits on this line and how much the line grows, so it's resized at most once
+        int64_t last = first;
+        int64_t growth = 0;
+        while (last < count && edits[last].row == edits[first].row){
+            growth += edits[last].text_len;
+            last++;
+        }
+
+        GapBuffer* line = writableLine(instance, row);
+
+        if (line == NULL){
+            err = MEM_ERROR;
+            break;
+        }
+
+        if ((err = GapBufferReserve(line, growth + 1)) != 0){
+            break;
+        }
+
+        if (first_row == -1){
+            first_row = row;
+        }
+        last_row = row;
+
+        // Walk the gap forward through the line. shift converts original columns to current ones.
+        int64_t shift = 0;
+        int64_t prev_col = 0;
+
+        for (int64_t i = first; i < last; i++){
+            int64_t col = edits[i].col;
+
+            if (col > line->str_len - shift){
+                col = line->str_len - shift;
+            }
+            if (col < prev_col){
+                col = prev_col;
+            }
+
+            GapBufferMoveGap(line, col + shift);
+
+            int64_t delete_len = edits[i].delete_len;
+            if (delete_len > col - prev_col){
+                delete_len = col - prev_col;
+            }
+
+            int64_t deleted = GapBufferBackSpaceN(line, delete_len);
+            shift -= deleted;
+
+            if (deleted > 0){
+                anchorsDeleted(instance, row, line->gap_loc, row, line->gap_loc + deleted);
+            }
+
+            if (edits[i].text_len > 0){
+                // The gap was reserved above, this can't resize
+                GapBufferInsertString(line, edits[i].text, edits[i].text_len);
+                shift += edits[i].text_len;
+                anchorsInserted(instance, row, line->gap_loc - edits[i].text_len, 0, line->gap_loc);
+            }
+
+            prev_col = col;
+            edits[i].row = row;
+            edits[i].col = line->gap_loc;
+        }
+
+        if (row == instance->cursorRow){
+            instance->cursorColMoved = 1;
+        }
+
+        first = last;
+    }
+
+    // The whole batch is one change
+    if (first_row != -1){
+        recordChange(instance, first_row, last_row - first_row + 1, last_row - first_row + 1);
+    }
+
+    return err;
+}
+
+
+int TextBufferReplaceLines(TextBuffer* instance, const int64_t* rows, GapBuffer** lines, int64_t count){
+
+    if (count <= 0){
+        return 0;
+    }
+
+    for (int64_t i = 0; i < count; i++){
+        if (rows[i] < 0 || rows[i] > instance->last_line_loc || (i > 0 && rows[i] <= rows[i - 1])){
+            return -1;
+        }
+    }
+
+    instance->version++;
+
+    for (int64_t i = 0; i < count; i++){
+        GapBuffer* old = instance->lines[rows[i]];
+
+        // Anchors past the end of a shorter line are left at its end
+        if (lines[i]->str_len < old->str_len){
+            anchorsDeleted(instance, rows[i], lines[i]->str_len, rows[i], old->str_len);
+        }
+
+        instance->lines[rows[i]] = lines[i];
+        lines[i]->version = instance->version;
+        lines[i] = old;
+
+        // The new line's gap can be anywhere, and the cursor's column may be past its end
+        if (rows[i] == instance->cursorRow){
+            if (instance->cursorCol > instance->lines[rows[i]]->str_len){
+                instance->cursorCol = instance->lines[rows[i]]->str_len;
+            }
+            instance->cursorColMoved = 1;
+        }
+    }
+
+    // Only the replaced lines are stamped; the journal entry covers the lines in between too
+    int64_t replaced = rows[count - 1] - rows[0] + 1;
+    journalChange(instance, rows[0], replaced, replaced);
+
+    return 0;
+}
+
+
+/*
+ * helper that makes room in the lines array for at least `needed` lines, doubling its capacity.
+ * returns 0, or MEM_ERROR if the array can't be allocated or its size in bytes would overflow
+ * */
+int growLines(TextBuffer* instance, int64_t needed){
+
+    if (needed <= instance->lines_capacity){
+        return 0;
+    }
+
+    int64_t max_capacity = (int64_t) (SIZE_MAX / sizeof(GapBuffer*) < INT64_MAX ?
+                                      SIZE_MAX / sizeof(GapBuffer*) : INT64_MAX);
+
+    if (needed > max_capacity){
+        return MEM_ERROR;
+    }
+
+    int64_t capacity = instance->lines_capacity < 1 ? 1 : instance->lines_capacity;
+
+    while (capacity < needed){
+        capacity = capacity > max_capacity / 2 ? max_capacity : capacity * 2;
+    }
 
+    GapBuffer** new_lines = BufferRealloc(instance->lines,
+                                          sizeof(GapBuffer*) * instance->lines_capacity,
+                                          sizeof(GapBuffer*) * capacity);
+
+    if (new_lines == NULL){
+        return MEM_ERROR;
+    }
+
+    instance->lines = new_lines;
+    instance->lines_capacity = capacity;
     return 0;
 }
 
@@ -146,6 +741,10 @@ int TextBufferNewLine(TextBuffer* instance){
 
     int errno;
 
+    if (writableLine(instance, instance->cursorRow) == NULL){
+        return MEM_ERROR;
+    }
+
     // First ensure the gap location reflects the cursor position
     if (instance->cursorColMoved){
         errno = GapBufferMoveGap(instance->lines[instance->cursorRow], instance->cursorCol);
@@ -166,16 +765,9 @@ int TextBufferNewLine(TextBuffer* instance){
     }
 
     // Check if there's space to add a new line. If not, reallocate `lines` and copy the old to the new
-    if (instance->last_line_loc == instance->lines_capacity - 1){
-        GapBuffer** new_lines = realloc(instance->lines, sizeof(GapBuffer*) * (instance->lines_capacity * 2));
-
-        if (new_lines == NULL){
-            // TODO: Panic here. recovering at the moment is hard
-            return MEM_ERROR;
-        }
-
-        instance->lines = new_lines;
-        instance->lines_capacity *= 2;
+    if (growLines(instance, instance->last_line_loc + 2) != 0){
+        // TODO: Panic here. recovering at the moment is hard
+        return MEM_ERROR;
     }
 
     // Shift the lines array down one place with memmove
@@ -194,10 +786,335 @@ int TextBufferNewLine(TextBuffer* instance){
     instance->cursorRow++;
     instance->cursorCol = newline->gap_loc;
 
+    anchorsInserted(instance, instance->cursorRow - 1, instance->lines[instance->cursorRow - 1]->str_len, 1, 0);
+    recordChange(instance, instance->cursorRow - 1, 1, 2);
+
+    return 0;
+}
+
+int TextBufferInsertText(TextBuffer* instance, const char* text, int64_t len){
+    int err;
+    int64_t row = instance->cursorRow;
+    GapBuffer* line = writableLine(instance, row);
+
+    if (line == NULL){
+        return MEM_ERROR;
+    }
+
+    if (instance->cursorColMoved){
+        if ((err = GapBufferMoveGap(line, instance->cursorCol)) != 0){
+            return err;
+        }
+
+        instance->cursorColMoved = 0;
+    }
+
+    int64_t col = instance->cursorCol;
+    int64_t new_lines = 0;
+    const char* first_newline = len > 0 ? memchr(text, '\n', len) : NULL;
+
+    for (const char* next = first_newline; next != NULL; next = memchr(next + 1, '\n', text + len - next - 1)){
+        new_lines++;
+    }
+
+    if (new_lines == 0){
+        if ((err = GapBufferInsertString(line, text, len)) != 0){
+            return err;
+        }
+
+        instance->cursorCol = line->gap_loc;
+        anchorsInserted(instance, row, col, 0, instance->cursorCol);
+        recordChange(instance, row, 1, 1);
+        return 0;
+    }
+
+    int64_t first_len = first_newline - text;
+    int64_t tail_len = line->str_len - col;
+
+    // Everything that can fail comes before the buffer is changed: room for the new lines, and for the first
+    // piece of text on the cursor's line
+    if (growLines(instance, instance->last_line_loc + 1 + new_lines) != 0 ||
+        GapBufferReserve(line, first_len + 1) != 0){
+        return MEM_ERROR;
+    }
+
+    memmove(instance->lines + row + 1 + new_lines,
+            instance->lines + row + 1,
+            sizeof(GapBuffer*) * (instance->last_line_loc - row));
+
+    // Each piece of text after a newline starts a line. The last one is followed by the rest of the cursor's line
+    const char* start = first_newline + 1;
+    int64_t last_len = 0;
+
+    for (int64_t i = 1; i <= new_lines; i++){
+        const char* end = i < new_lines ? memchr(start, '\n', text + len - start) : text + len;
+        int64_t piece_len = end - start;
+        int64_t size = piece_len + (i == new_lines ? tail_len : 0);
+        GapBuffer* new_line = CreateGapBuffer(size + TextBufferLoadGap(size));
+
+        if (new_line == NULL || GapBufferInsertString(new_line, start, piece_len) != 0 ||
+            (i == new_lines && GapBufferInsertRange(new_line, line, col, tail_len) != 0)){
+
+            if (new_line != NULL){
+                DestroyGapBuffer(new_line);
+            }
+            for (int64_t j = 1; j < i; j++){
+                DestroyGapBuffer(instance->lines[row + j]);
+            }
+
+            memmove(instance->lines + row + 1,
+                    instance->lines + row + 1 + new_lines,
+                    sizeof(GapBuffer*) * (instance->last_line_loc - row));
+            return MEM_ERROR;
+        }
+
+        instance->lines[row + i] = new_line;
+        last_len = piece_len;
+        start = end + 1;
+    }
+
+    // Can't fail: the gap was made big enough above
+    GapBufferDeleteForward(line, tail_len);
+    GapBufferInsertString(line, text, first_len);
+
+    instance->last_line_loc += new_lines;
+    instance->cursorRow += new_lines;
+    instance->cursorCol = last_len;
+    instance->cursorColMoved = 1;
+
+    anchorsInserted(instance, row, col, new_lines, last_len);
+    recordChange(instance, row, 1, new_lines + 1);
+
     return 0;
 }
 
-char *TextBufferGetLine(TextBuffer *instance, int row) {
+
+int TextBufferAppendLines(TextBuffer* instance, GapBuffer** lines, int64_t count){
+
+    if (count <= 0){
+        return 0;
+    }
+
+    if (growLines(instance, instance->last_line_loc + 1 + count) != 0){
+        return MEM_ERROR;
+    }
+
+    memcpy(instance->lines + instance->last_line_loc + 1, lines, sizeof(GapBuffer*) * count);
+    instance->last_line_loc += count;
+
+    recordChange(instance, instance->last_line_loc - count + 1, 0, count);
+    return 0;
+}
+
+
+int TextBufferSpliceLines(TextBuffer* instance, int64_t row, int64_t removed, GapBuffer** lines, int64_t added){
+    GapBuffer* blank = NULL;
+
+    if (row < 0){
+        row = 0;
+    }
+    if (row > instance->last_line_loc + 1){
+        row = instance->last_line_loc + 1;
+    }
+    if (removed > instance->last_line_loc + 1 - row){
+        removed = instance->last_line_loc + 1 - row;
+    }
+    if (removed < 0){
+        removed = 0;
+    }
+    if (added < 0){
+        added = 0;
+    }
+
+    if (removed == 0 && added == 0){
+        return 0;
+    }
+
+    // The buffer always has at least one line
+    if (added == 0 && removed == instance->last_line_loc + 1){
+        if ((blank = CreateGapBuffer(DEFAULT_GAP_BUF_CAP)) == NULL){
+            return MEM_ERROR;
+        }
+
+        lines = &blank;
+        added = 1;
+    }
+
+    if (growLines(instance, instance->last_line_loc + 1 - removed + added) != 0){
+        DestroyGapBuffer(blank);
+        return MEM_ERROR;
+    }
+
+    anchorsLinesReplaced(instance, row, removed, added);
+
+    for (int64_t i = row; i < row + removed; i++){
+        DestroyGapBuffer(instance->lines[i]);
+    }
+
+    memmove(instance->lines + row + added,
+            instance->lines + row + removed,
+            sizeof(GapBuffer*) * (instance->last_line_loc + 1 - (row + removed)));
+    if (added > 0){
+        memcpy(instance->lines + row, lines, sizeof(GapBuffer*) * added);
+    }
+    instance->last_line_loc += added - removed;
+
+    recordChange(instance, row, removed, added);
+
+    if (instance->cursorRow >= row + removed){
+        instance->cursorRow += added - removed;
+
+    } else if (instance->cursorRow >= row){
+        instance->cursorRow = row <= instance->last_line_loc ? row : instance->last_line_loc;
+        instance->cursorCol = 0;
+    }
+
+    if (instance->cursorCol > instance->lines[instance->cursorRow]->str_len){
+        instance->cursorCol = instance->lines[instance->cursorRow]->str_len;
+    }
+
+    instance->cursorColMoved = 1;
+
+    return 0;
+}
+
+
+int64_t TextBufferCompactLines(TextBuffer* instance, int64_t row, int64_t count, int64_t max_gap){
+    int64_t freed = 0;
+
+    if (row < 0){
+        count += row;
+        row = 0;
+    }
+
+    if (row + count > instance->last_line_loc + 1){
+        count = instance->last_line_loc + 1 - row;
+    }
+
+    // Shared lines are left alone; they're compacted on a later pass, once the snapshot is gone
+    for (int64_t i = row; i < row + count; i++){
+        if (!GapBufferShared(instance->lines[i])){
+            freed += GapBufferShrink(instance->lines[i], max_gap);
+        }
+    }
+
+    // Halve the lines array while it's mostly empty, but never below the default
+    int64_t needed = instance->last_line_loc + 1;
+    int64_t new_capacity = instance->lines_capacity;
+
+    while (new_capacity / 2 > DEFAULT_CAPACITY && new_capacity / 4 > needed){
+        new_capacity /= 2;
+    }
+
+    if (new_capacity != instance->lines_capacity){
+        GapBuffer** new_lines = BufferRealloc(instance->lines,
+                                              sizeof(GapBuffer*) * instance->lines_capacity,
+                                              sizeof(GapBuffer*) * new_capacity);
+
+        if (new_lines != NULL){
+            freed += sizeof(GapBuffer*) * (int64_t)(instance->lines_capacity - new_capacity);
+            instance->lines = new_lines;
+            instance->lines_capacity = new_capacity;
+        }
+    }
+
+    return freed;
+}
+
+
+/*
+ * helper that returns the number of anchors in the buffer
+ * */
+int64_t anchorCount(TextBuffer* instance){
+    return instance->anchors.root != NULL ? instance->anchors.root->size : 0;
+}
+
+
+int64_t TextBufferMemoryUsage(TextBuffer* instance){
+    int64_t usage = sizeof(TextBuffer) + sizeof(GapBuffer*) * (int64_t)instance->lines_capacity +
+                    sizeof(Anchor) * anchorCount(instance);
+
+    for (int64_t i = 0; i <= instance->last_line_loc; i++){
+        usage += sizeof(GapBuffer) + instance->lines[i]->str_len + instance->lines[i]->gap_len;
+    }
+
+    return usage;
+}
+
+
+/*
+ * Estimate of what malloc really takes for a block of size bytes: the size plus an 8 byte header, rounded up to
+ * 16 bytes, and at least 32 bytes. Returns the bytes past size.
+ * */
+int64_t mallocOverhead(int64_t size){
+    int64_t block = (size + 8 + 15) & ~(int64_t)15;
+
+    if (block < 32){
+        block = 32;
+    }
+
+    return block - size;
+}
+
+
+void TextBufferGetStats(TextBuffer* instance, TextBufferStats* stats){
+    memset(stats, 0, sizeof(TextBufferStats));
+
+    stats->lines = instance->last_line_loc + 1;
+    stats->lines_capacity = instance->lines_capacity;
+    stats->array_bytes = sizeof(GapBuffer*) * (int64_t)stats->lines;
+    stats->array_slack_bytes = sizeof(GapBuffer*) * (int64_t)(stats->lines_capacity - stats->lines);
+    stats->struct_bytes = sizeof(TextBuffer) + sizeof(GapBuffer) * (int64_t)stats->lines +
+                          sizeof(Anchor) * anchorCount(instance);
+    stats->overhead_bytes = mallocOverhead(sizeof(TextBuffer)) +
+                            mallocOverhead(sizeof(GapBuffer*) * (int64_t)stats->lines_capacity) +
+                            mallocOverhead(sizeof(Anchor)) * anchorCount(instance);
+
+    for (int64_t i = 0; i <= instance->last_line_loc; i++){
+        GapBuffer* line = instance->lines[i];
+        int64_t capacity = line->str_len + line->gap_len;
+        int bucket = 0;
+
+        while (bucket < STATS_CAPACITY_BUCKETS - 1 && capacity >= (2 << bucket)){
+            bucket++;
+        }
+
+        stats->text_bytes += line->str_len;
+        stats->gap_bytes += line->gap_len;
+        stats->overhead_bytes += mallocOverhead(sizeof(GapBuffer)) + mallocOverhead(capacity);
+        stats->capacity_histogram[bucket]++;
+    }
+}
+
+
+Anchor* TextBufferAddAnchor(TextBuffer* instance, int64_t row, int64_t col, int kind){
+    clampPosition(instance, &row, &col);
+    return AnchorTreeAdd(&instance->anchors, row, col, kind);
+}
+
+
+void TextBufferRemoveAnchor(TextBuffer* instance, Anchor* anchor){
+    AnchorTreeRemove(&instance->anchors, anchor);
+}
+
+
+void TextBufferAnchorPosition(TextBuffer* instance, Anchor* anchor, int64_t* row, int64_t* col){
+    AnchorTreePosition(anchor, row, col);
+}
+
+
+int64_t TextBufferCountAnchors(TextBuffer* instance, int64_t first_row, int64_t last_row){
+    return AnchorTreeCount(&instance->anchors, first_row, last_row);
+}
+
+
+int64_t TextBufferFindAnchors(TextBuffer* instance, int64_t first_row, int64_t last_row, int kind,
+                              AnchorInfo* found, int64_t max){
+    return AnchorTreeFind(&instance->anchors, first_row, last_row, kind, found, max);
+}
+
+
+char *TextBufferGetLine(TextBuffer *instance, int64_t row) {
     if (row > instance->last_line_loc){
         return NULL;
     }
@@ -228,7 +1145,7 @@ TextBuffer* CreateTextBufferFromFile(FILE* fp){
     char *line = NULL;
     size_t len = 0;
     ssize_t read;
-    int line_gap_size;
+    int64_t line_gap_size;
 
     while ((read = getline(&line, &len, fp)) != -1 ) {
 
@@ -238,26 +1155,20 @@ TextBuffer* CreateTextBufferFromFile(FILE* fp){
         }
 
         // reallocate if out of space
-        if (new_tbuffer->last_line_loc == new_tbuffer->lines_capacity-1){
-            new_tbuffer->lines = realloc(
-                    new_tbuffer->lines, sizeof(GapBuffer*) * new_tbuffer->lines_capacity * 2);
-
-            if (new_tbuffer->lines == NULL){
-                DestroyTextBuffer(new_tbuffer);
-                return NULL;
-            }
-
-            new_tbuffer->lines_capacity = new_tbuffer->lines_capacity * 2;
+        if (growLines(new_tbuffer, new_tbuffer->last_line_loc + 2) != 0){
+            free(line);
+            DestroyTextBuffer(new_tbuffer);
+            return NULL;
         }
 
         // Create a new gap buf with the read line, append it to the tbuffer and update the last line location
 
-        // the gap size will be max(DEFAULT_GAP_BUF_CAP, read * 2)
-        line_gap_size = read * 2 < DEFAULT_GAP_BUF_CAP ? DEFAULT_GAP_BUF_CAP : read * 2;
+        line_gap_size = TextBufferLoadGap(read);
 
         new_tbuffer->lines[new_tbuffer->last_line_loc + 1] = CreateGapBufferFromString(line, line_gap_size);
 
         if (new_tbuffer->lines[new_tbuffer->last_line_loc + 1] == NULL){
+            free(line);
             DestroyTextBuffer(new_tbuffer);
             return NULL;
         }
@@ -266,5 +1177,174 @@ TextBuffer* CreateTextBufferFromFile(FILE* fp){
     }
 
     free(line);
+
+    // Lines are loaded with the gap at the end, the cursor starts at column 0
+    new_tbuffer->cursorColMoved = 1;
+
+    // An empty file still needs a line for the cursor to sit on
+    if (new_tbuffer->last_line_loc == -1){
+        new_tbuffer->lines[0] = CreateGapBuffer(DEFAULT_GAP_BUF_CAP);
+
+        if (new_tbuffer->lines[0] == NULL){
+            DestroyTextBuffer(new_tbuffer);
+            return NULL;
+        }
+
+        new_tbuffer->last_line_loc = 0;
+    }
+
+    return new_tbuffer;
+}
+
+
+/*
+ * helper that writes count lines, a newline after each, straight from their gap buffers. returns 0, or -1
+ * */
+int writeLines(GapBuffer** lines, int64_t count, FILE* fp){
+
+    for (int64_t i=0; i<count; i++){
+        GapBuffer* line = lines[i];
+        size_t before = line->gap_loc;
+        size_t after = line->str_len - line->gap_loc;
+
+        if (fwrite(line->buffer, 1, before, fp) != before ||
+            fwrite(line->buffer + line->gap_loc + line->gap_len, 1, after, fp) != after ||
+            fputc('\n', fp) == EOF){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int TextBufferWrite(TextBuffer* instance, FILE* fp){
+    return writeLines(instance->lines, instance->last_line_loc + 1, fp);
+}
+
+
+TextBufferSnapshot* CreateTextBufferSnapshot(TextBuffer* instance){
+    TextBufferSnapshot* snapshot = BufferAlloc(sizeof(TextBufferSnapshot));
+
+    if (snapshot == NULL){
+        return NULL;
+    }
+
+    snapshot->line_count = instance->last_line_loc + 1;
+    snapshot->lines = BufferAlloc(sizeof(GapBuffer*) * snapshot->line_count);
+
+    if (snapshot->lines == NULL){
+        BufferFree(snapshot, sizeof(TextBufferSnapshot));
+        return NULL;
+    }
+
+    snapshot->version = instance->version;
+    snapshot->size = 0;
+
+    for (int64_t i=0; i<snapshot->line_count; i++){
+        snapshot->lines[i] = instance->lines[i];
+        GapBufferRetain(snapshot->lines[i]);
+        snapshot->size += snapshot->lines[i]->str_len + 1;
+    }
+
+    return snapshot;
+}
+
+
+int TextBufferSnapshotWrite(TextBufferSnapshot* snapshot, int64_t first, int64_t count, FILE* fp){
+
+    if (first < 0 || count < 0 || first + count > snapshot->line_count){
+        return -1;
+    }
+
+    return writeLines(snapshot->lines + first, count, fp);
+}
+
+
+void DestroyTextBufferSnapshot(TextBufferSnapshot* snapshot){
+
+    for (int64_t i=0; i<snapshot->line_count; i++){
+        DestroyGapBuffer(snapshot->lines[i]);
+    }
+
+    BufferFree(snapshot->lines, sizeof(GapBuffer*) * snapshot->line_count);
+    BufferFree(snapshot, sizeof(TextBufferSnapshot));
+}
+
+
+int64_t TextBufferLoadGap(int64_t len){
+    int64_t gap = len > LOAD_GAP_MAX / 2 ? LOAD_GAP_MAX : len * 2;
+    return gap < DEFAULT_GAP_BUF_CAP ? DEFAULT_GAP_BUF_CAP : gap;
+}
+
+
+void TextBufferLineOffsets(TextBuffer* instance, int64_t* offsets){
+    offsets[0] = 0;
+
+    for (int64_t i=0; i<=instance->last_line_loc; i++){
+        offsets[i + 1] = offsets[i] + instance->lines[i]->str_len + 1;
+    }
+}
+
+
+TextBuffer* CreateTextBufferFromIndex(FILE* fp, const int64_t* offsets, int64_t line_count){
+
+    if (fp == NULL || line_count <= 0){
+        return CreateTextBufferFromFile(fp);
+    }
+
+    // Size the lines array to fit the index so it never needs to grow while loading
+    int64_t capacity = line_count < DEFAULT_CAPACITY ? DEFAULT_CAPACITY : line_count + 1;
+    TextBuffer* new_tbuffer = CreateTextBuffer(capacity, DEFAULT_GAP_BUF_CAP);
+
+    if (new_tbuffer == NULL){
+        return NULL;
+    }
+
+    DestroyGapBuffer(new_tbuffer->lines[0]);
+    new_tbuffer->lines[0] = NULL;
+    new_tbuffer->last_line_loc = -1;
+
+    int64_t read;
+    GapBuffer* line;
+
+    // Lines are read straight into their gap buffers, with no intermediate copy
+    for (int64_t i=0; i<line_count; i++){
+        read = offsets[i + 1] - offsets[i];
+        line = read < 0 ? NULL : CreateGapBuffer(read + TextBufferLoadGap(read));
+
+        if (line == NULL){
+            DestroyTextBuffer(new_tbuffer);
+            return NULL;
+        }
+
+        new_tbuffer->lines[i] = line;
+        new_tbuffer->last_line_loc = i;
+
+        // Each line ends with a newline, except that the last line of a file may not, so it can come up one byte
+        // short. Anything else means the lines have moved in the file
+        int64_t got = (int64_t) fread(line->buffer, 1, read, fp);
+
+        if (got == read && got > 0 && line->buffer[got - 1] == '\n'){
+            got--;
+        } else if (!(i == line_count - 1 && got == read - 1)){
+            DestroyTextBuffer(new_tbuffer);
+            return NULL;
+        }
+
+        line->str_len = got;
+        line->gap_loc = got;
+        line->gap_len = read + TextBufferLoadGap(read) - got;
+    }
+
+    // The file has more than the index
+    if (fgetc(fp) != EOF){
+        DestroyTextBuffer(new_tbuffer);
+        return NULL;
+    }
+
+    // Lines are loaded with the gap at the end, the cursor starts at column 0
+    new_tbuffer->cursorColMoved = 1;
+
     return new_tbuffer;
 }
\ No newline at end of file
@@ -6,11 +6,100 @@
 #define TED_BUFFER_H
 
 #include "gap.h"
+#include "anchor.h"
 #include <stdio.h>
 
 #define DEFAULT_CAPACITY 100
 #define DEFAULT_GAP_BUF_CAP 100
 
+// Largest gap given to a line loaded from a file, so loading a very long line doesn't triple its memory
+#define LOAD_GAP_MAX (1024 * 1024)
+
+// Number of changes kept in the change journal
+#define JOURNAL_LEN 64
+
+// Results of TextBufferChangesSince
+#define CHANGES_NONE 0
+#define CHANGES_RANGE 1
+#define CHANGES_ALL 2
+
+// Buckets in the line capacity histogram of TextBufferStats
+#define STATS_CAPACITY_BUCKETS 16
+
+
+/*
+ * TextBufferJournalEntry
+ * A change to the lines of a TextBuffer: `removed` lines starting at `row` were replaced by `added` lines.
+ * Editing inside a line is recorded as 1 line replaced by 1, a split as 1 replaced by 2, a join as 2 by 1.
+ * version: the buffer's version after the change
+ * */
+typedef struct TextBufferJournalEntry {
+    unsigned long version;
+    int64_t row;
+    int64_t removed;
+    int64_t added;
+} TextBufferJournalEntry;
+
+
+/*
+ * TextBufferChanges
+ * Summary of the changes made to a TextBuffer since some version, see TextBufferChangesSince.
+ * first_row, last_row: range of lines, in the buffer as it is now, that may have changed. Lines before first_row
+ *                      are untouched. Lines after last_row are untouched too, but moved by line_delta.
+ * line_delta: the number of lines added (or removed, if negative) since the version
+ * */
+typedef struct TextBufferChanges {
+    int64_t first_row;
+    int64_t last_row;
+    int64_t line_delta;
+} TextBufferChanges;
+
+/*
+ * TextBufferStats
+ * Where the memory of a TextBuffer goes, see TextBufferGetStats. Sizes are in bytes.
+ * lines, lines_capacity: lines in the buffer, and slots in its lines array
+ * text_bytes: characters in the lines
+ * gap_bytes: gap space in the lines, allocated but unused
+ * array_bytes: slots of the lines array in use
+ * array_slack_bytes: slots of the lines array past the last line, allocated but unused
+ * struct_bytes: the TextBuffer, GapBuffer and Anchor structures
+ * overhead_bytes: an estimate of malloc's own overhead for the blocks above, assuming a typical 64-bit malloc
+ *                 with an 8 byte header per block, 16 byte alignment and 32 byte minimum blocks
+ * capacity_histogram: number of lines by allocated size (text + gap). Bucket 0 counts lines of less than 2 bytes,
+ *                     bucket i lines of 2^i to 2^(i+1)-1 bytes, and the last bucket every larger line too
+ * */
+typedef struct TextBufferStats {
+    int64_t lines;
+    int64_t lines_capacity;
+    int64_t text_bytes;
+    int64_t gap_bytes;
+    int64_t array_bytes;
+    int64_t array_slack_bytes;
+    int64_t struct_bytes;
+    int64_t overhead_bytes;
+    int64_t capacity_histogram[STATS_CAPACITY_BUCKETS];
+} TextBufferStats;
+
+/*
+ * TextBufferSnapshot
+ * A read-only copy of a TextBuffer's lines as they were at one version, that can be written out on another thread
+ * while the buffer keeps being edited.
+ * Taking a snapshot copies the array of line pointers, not the lines: every line is shared with the buffer (see
+ * GapBufferRetain). The buffer copies a shared line the first time it changes it, so only lines edited while the
+ * snapshot is alive are ever duplicated. Lines the buffer deletes are freed when the snapshot is destroyed.
+ *
+ * lines: the lines, line_count of them
+ * size: bytes the lines take up written out, a newline after each
+ * version: the buffer's version when the snapshot was taken
+ * */
+typedef struct TextBufferSnapshot {
+    GapBuffer** lines;
+    int64_t line_count;
+    int64_t size;
+    unsigned long version;
+} TextBufferSnapshot;
+
+
 /*
  * TextBuffer
  * This data structure represents the current buffer of the text editor.
@@ -41,25 +130,55 @@
  * cursorCol: column of the cursor
  * cursorColMoved: whether the cursorCol changed (by a move operation for example)
  * last_line_loc: the last line in the buffer
+ * version: edit version. Starts at 0 and goes up by one with every change to the text
+ * journal: the last JOURNAL_LEN changes, in a ring. journal_next is where the next entry goes
+ * journal_count: number of entries in the journal (up to JOURNAL_LEN)
+ * anchors: positions that move with the text as it's edited, see anchor.h
+ *
+ * Every line's GapBuffer carries the version of the last change that touched it, so consumers can tell which
+ * lines changed since a version they saw by comparing stamps, or ask for the dirty range with TextBufferChangesSince.
  * */
 
 typedef struct TextBuffer {
     GapBuffer** lines;
-    int lines_capacity;
-    int cursorRow;
-    int cursorCol;
+    int64_t lines_capacity;
+    int64_t cursorRow;
+    int64_t cursorCol;
     int cursorColMoved;    // if cursorColMoved, a move must be performed on the gap buffer before inserts
-    int last_line_loc;  // Index of the last line (also the number of lines)
+    int64_t last_line_loc;  // Index of the last line (also the number of lines)
+    unsigned long version;
+    TextBufferJournalEntry journal[JOURNAL_LEN];
+    int journal_next;
+    int journal_count;
+    AnchorTree anchors;
 } TextBuffer;
 
 
+/*
+ * TextBufferEdit
+ * One edit in a batch given to TextBufferApplyEdits: at (row, col), delete up to delete_len characters before the
+ * column (like hitting backspace delete_len times), then insert text_len characters of text. text must not contain
+ * newlines.
+ *
+ * Positions are in the coordinates of the buffer before the batch is applied. After the batch, row and col are
+ * set to the position right after the edit, which is where a cursor that made the edit ends up.
+ * */
+typedef struct TextBufferEdit {
+    int64_t row;
+    int64_t col;
+    int64_t delete_len;
+    const char* text;
+    int64_t text_len;
+} TextBufferEdit;
+
+
 /*
  * CreateTextBuffer creates and initializes a new text buffer.
  * lines: The number of lines to support initially
  * line_size: Default initial line size to allocate.
  * Returns a pointer to an initialized TextBuffer or NULL
  * */
-TextBuffer* CreateTextBuffer(int lines, int line_size);
+TextBuffer* CreateTextBuffer(int64_t lines, int64_t line_size);
 
 
 /*
@@ -76,7 +195,7 @@ void DestroyTextBuffer(TextBuffer* instance);
  * Returns 0 on success or MEM_ERROR
  * */
 
-void TextBufferMoveCursor(TextBuffer* instance, int row, int col);
+void TextBufferMoveCursor(TextBuffer* instance, int64_t row, int64_t col);
 
 
 /*
@@ -91,10 +210,69 @@ int TextBufferInsert(TextBuffer* instance, char ch);
 
 /*
  * Backspace deletes the character that appears before the cursor location. Similar to hitting the backspace button.
+ * At the start of a line, the line is joined to the end of the line above it.
  * */
 int TextBufferBackspace(TextBuffer* instance);
 
 
+/*
+ * DeleteRange deletes the text from (start_row, start_col) up to, but not including, (end_row, end_col).
+ * Line breaks inside the range are deleted too, so the remainder of end_row is joined to start_row.
+ * If the end comes before the start, they're swapped. Positions are clamped to the buffer.
+ *
+ * Each line in the range is dealt with once: the first line moves its gap once and takes the tail of the last
+ * line in one copy, the lines in between are freed, and the lines array is closed up with a single memmove.
+ *
+ * The cursor keeps its place in the text; if it was inside the range it moves to the start of the range.
+ * Returns 0 or MEM_ERROR
+ * */
+int TextBufferDeleteRange(TextBuffer* instance, int64_t start_row, int64_t start_col, int64_t end_row, int64_t end_col);
+
+
+/*
+ * JoinLines joins the line at row with the line below it. Does nothing on the last line.
+ * Returns 0 or MEM_ERROR
+ * */
+int TextBufferJoinLines(TextBuffer* instance, int64_t row);
+
+
+/*
+ * DeleteLines deletes count whole lines, starting at row. The lines array is closed up with a single memmove.
+ * Deleting every line leaves a single blank line.
+ * A cursor inside the deleted lines moves to the start of the line that takes their place.
+ * Returns 0 or MEM_ERROR
+ * */
+int TextBufferDeleteLines(TextBuffer* instance, int64_t row, int64_t count);
+
+
+/*
+ * ApplyEdits applies a batch of edits, for example one per cursor when editing with multiple cursors.
+ * edits must be sorted by row, then column, with no two edits at the same position. Each line is edited in a
+ * single pass from left to right: the gap only moves forward, and the line is resized at most once.
+ *
+ * A delete never reaches past the column of the previous edit on the same line, so edits don't overlap.
+ * Edits with an out of bounds position are clamped to the closest valid position.
+ *
+ * The cursor isn't moved; callers use the adjusted positions in edits to place it.
+ * Returns 0 on success, or MEM_ERROR. On error, edits before the failing line have been applied.
+ * */
+int TextBufferApplyEdits(TextBuffer* instance, TextBufferEdit* edits, int64_t count);
+
+
+/*
+ * ReplaceLines swaps count lines for new ones as a single change, e.g. every line a replace-all changed.
+ * rows must be sorted, with no duplicates. The buffer takes ownership of lines[i], which replaces the line at
+ * rows[i]; the line it replaces is handed back in lines[i]. Calling ReplaceLines again with the same arrays
+ * undoes the change, otherwise the caller destroys the old lines.
+ *
+ * Lines that aren't in rows aren't touched, not even to stamp their version. The journal records one change
+ * spanning rows[0] to rows[count - 1].
+ * A cursor on a replaced line keeps its row and column, clamped to the new line.
+ * Returns 0, or -1 if rows is out of bounds or out of order; the buffer and lines are unchanged then.
+ * */
+int TextBufferReplaceLines(TextBuffer* instance, const int64_t* rows, GapBuffer** lines, int64_t count);
+
+
 /*
  * NewLine adds a new line to the buffer and moves the cursor to the start of that new line.
  * Handles the logic of hitting the return key.
@@ -121,21 +299,185 @@ int TextBufferBackspace(TextBuffer* instance);
 int TextBufferNewLine(TextBuffer* instance);
 
 
+/*
+ * InsertText inserts len bytes of text at the cursor, as if they were typed, and leaves the cursor after them.
+ * Newlines in the text split the line, the same as NewLine, but all at once: the newlines are counted first, so
+ * the lines below are moved down with a single memmove, and each new line is allocated once at its final size
+ * (sized like a line loaded from a file). Inserting m lines into n costs O(m + n) rather than O(m * n).
+ * Returns 0 or MEM_ERROR; on error the buffer is unchanged.
+ * */
+int TextBufferInsertText(TextBuffer* instance, const char* text, int64_t len);
+
+
+/*
+ * AppendLines adds count lines after the last line of the buffer. The buffer takes ownership of the GapBuffers,
+ * the lines array itself is only copied. Used to add lines as they're loaded, without rebuilding the buffer.
+ * The cursor isn't moved.
+ * Returns 0 or MEM_ERROR; on error the buffer is unchanged and the lines still belong to the caller.
+ * */
+int TextBufferAppendLines(TextBuffer* instance, GapBuffer** lines, int64_t count);
+
+
+/*
+ * SpliceLines replaces `removed` lines starting at row with `added` new lines, as a single change, e.g. to put
+ * the output of a command in place of the lines it was given. The buffer takes ownership of the GapBuffers, the
+ * lines array itself is only copied; the removed lines are destroyed. row may be last_line_loc + 1 to add lines at
+ * the end. Removing every line without adding any leaves a single blank line.
+ *
+ * A cursor after the removed lines keeps its place in the text; a cursor inside them moves to the start of row.
+ * Returns 0 or MEM_ERROR; on error the buffer is unchanged and the lines still belong to the caller.
+ * */
+int TextBufferSpliceLines(TextBuffer* instance, int64_t row, int64_t removed, GapBuffer** lines, int64_t added);
+
+
+/*
+ * AddAnchor adds an anchor at (row, col), clamped to the buffer. From then on every edit moves it along with the
+ * text it's on: text inserted before it on its line pushes it right, a line break before it takes it down to the
+ * new line, and deleting the text around it leaves it where the deletion happened. Text inserted right at an
+ * anchor goes after it. Deleted lines leave their anchors at the start of the line that takes their place.
+ *
+ * kind is kept with the anchor for the caller, e.g. to tell bookmarks from search hits.
+ * Each edit costs O(log n) in the number of anchors, however many it moves.
+ * Returns the anchor, or NULL on a memory error. It belongs to the buffer until removed or the buffer is destroyed.
+ * */
+Anchor* TextBufferAddAnchor(TextBuffer* instance, int64_t row, int64_t col, int kind);
+
+
+/*
+ * RemoveAnchor removes an anchor added by AddAnchor and frees it.
+ * */
+void TextBufferRemoveAnchor(TextBuffer* instance, Anchor* anchor);
+
+
+/*
+ * AnchorPosition gets the position an anchor has been moved to.
+ * */
+void TextBufferAnchorPosition(TextBuffer* instance, Anchor* anchor, int64_t* row, int64_t* col);
+
+
+/*
+ * CountAnchors returns the number of anchors on rows first_row to last_row, in O(log n).
+ * */
+int64_t TextBufferCountAnchors(TextBuffer* instance, int64_t first_row, int64_t last_row);
+
+
+/*
+ * FindAnchors fills in up to max entries of found with the anchors on rows first_row to last_row, in order of
+ * position, e.g. for drawing the ones on screen. Only anchors of the given kind are found, or of every kind if
+ * kind is negative.
+ * Returns the number of entries filled in.
+ * */
+int64_t TextBufferFindAnchors(TextBuffer* instance, int64_t first_row, int64_t last_row, int kind,
+                              AnchorInfo* found, int64_t max);
+
+
+/*
+ * CompactLines gives back memory held by the gaps of count lines starting at row: every line whose gap is longer
+ * than max_gap is shrunk to a gap of max_gap. Lines are left alone otherwise, so the cost of compaction that
+ * has nothing to do is a scan of the lines' gap lengths.
+ *
+ * The lines array itself is shrunk too when less than a quarter of it is in use.
+ * Returns the number of bytes given back.
+ * */
+int64_t TextBufferCompactLines(TextBuffer* instance, int64_t row, int64_t count, int64_t max_gap);
+
+
+/*
+ * MemoryUsage returns the number of bytes allocated for the TextBuffer: its line buffers (text and gaps),
+ * the lines array and the structures themselves, anchors included.
+ * */
+int64_t TextBufferMemoryUsage(TextBuffer* instance);
+
+
+/*
+ * GetStats fills in stats with a breakdown of the buffer's memory: live text, gap slack, lines array slack and
+ * (estimated) malloc overhead, and the distribution of line capacities. The total of the byte counts, less
+ * overhead_bytes, is TextBufferMemoryUsage.
+ * */
+void TextBufferGetStats(TextBuffer* instance, TextBufferStats* stats);
+
+
+/*
+ * ChangesSince summarizes the changes made since the buffer was at since_version, for consumers that want to
+ * redo only the work for lines that changed.
+ *
+ * Returns CHANGES_NONE if nothing changed, CHANGES_RANGE if `changes` was filled in, or CHANGES_ALL if the
+ * journal doesn't go back far enough and everything should be treated as changed.
+ * */
+int TextBufferChangesSince(TextBuffer* instance, unsigned long since_version, TextBufferChanges* changes);
+
+
 /*
  * Returns an allocated string of the contents of the line at the given index.
  * if index is out of bounds, or there was a memory error, returns NULL
  *
  * */
-char* TextBufferGetLine(TextBuffer* instance, int row);
+char* TextBufferGetLine(TextBuffer* instance, int64_t row);
 
 
 
 /*
  * Creates a TextBuffer with the contents of the file pointed to by the file pointer given.
- * By default, the gap buffer for each line is double the line size or DEFAULT_GAP_BUF_CAP, whichever is greater
+ * The gap buffer for each line is sized by TextBufferLoadGap
  * If fp is NULL, behaves the same as CreateTextBuffer(DEFAULT_CAPACITY, DEFAULT_GAP_BUF_CAP),
  * returns NULL if there's an error, otherwise an initialized TextBuffer*
  * */
 TextBuffer* CreateTextBufferFromFile(FILE* fp);
 
+
+/*
+ * Returns the gap given to a line of `len` bytes loaded from a file: double the line size or DEFAULT_GAP_BUF_CAP,
+ * whichever is greater, and at most LOAD_GAP_MAX.
+ * */
+int64_t TextBufferLoadGap(int64_t len);
+
+
+/*
+ * Writes the buffer to fp, a newline after every line. Lines are written straight from their gap buffers.
+ * returns 0, or -1 if writing failed
+ * */
+int TextBufferWrite(TextBuffer* instance, FILE* fp);
+
+
+/*
+ * Takes a snapshot of the buffer's lines, see TextBufferSnapshot. Costs an allocation and a pass over the line
+ * pointers; no text is copied.
+ * returns NULL if there's an error, otherwise the snapshot
+ * */
+TextBufferSnapshot* CreateTextBufferSnapshot(TextBuffer* instance);
+
+
+/*
+ * Writes count lines of the snapshot, starting at line first, to fp, a newline after every line.
+ * Safe to call on a different thread from the one editing the buffer the snapshot was taken from.
+ * returns 0, or -1 if writing failed or the lines are out of range
+ * */
+int TextBufferSnapshotWrite(TextBufferSnapshot* snapshot, int64_t first, int64_t count, FILE* fp);
+
+
+/*
+ * Releases the snapshot's lines and frees it. Can be called from the thread the snapshot was written on.
+ * */
+void DestroyTextBufferSnapshot(TextBufferSnapshot* snapshot);
+
+
+/*
+ * Fills `offsets` with the file offset each line would start at if the buffer was written out with a newline
+ * after every line. offsets must have room for last_line_loc + 2 entries; the final entry is the total size.
+ *
+ * Used to keep a small index of a buffer's file so it can be discarded and rebuilt without scanning for newlines.
+ * */
+void TextBufferLineOffsets(TextBuffer* instance, int64_t* offsets);
+
+
+/*
+ * Creates a TextBuffer from the file pointed to by fp, using a line offset index (see TextBufferLineOffsets)
+ * instead of scanning the file for newlines. Each line's gap buffer is sized the same way as in
+ * CreateTextBufferFromFile.
+ * offsets: line_count + 1 offsets; the final entry is the end of the last line.
+ *
+ * returns NULL if there's an error or the file doesn't match the index, otherwise an initialized TextBuffer*
+ * */
+TextBuffer* CreateTextBufferFromIndex(FILE* fp, const int64_t* offsets, int64_t line_count);
+
 #endif //TED_BUFFER_H
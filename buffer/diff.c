@@ -0,0 +1,341 @@
+//
+// Line diffs with Myers' algorithm, see diff.h
+//
+
+#include <stdlib.h>
+
+#include "diff.h"
+#include "gap.h"
+
+
+/*
+ * DiffEdit
+ * One step of an edit script: at (old_row, new_row), delete the old line, or insert the new one.
+ * */
+typedef struct DiffEdit {
+    int64_t old_row;
+    int64_t new_row;
+    int insert;
+} DiffEdit;
+
+
+/*
+ * DiffSearch
+ * State shared by the steps of a linear space diff (see diffSplit).
+ * old, new: the lines being diffed
+ * forward, backward: furthest point reached on each diagonal, searching from the start and from the end.
+ *                    Reused by every step; each holds 2 * max_rounds + 2 entries
+ * max_rounds: most rounds a step searches for, which bounds how many edits it can find
+ * edits: edit_count edits found so far, in order, at most max_edits
+ * */
+typedef struct DiffSearch {
+    const uint64_t* old;
+    const uint64_t* new;
+    int64_t* forward;
+    int64_t* backward;
+    int64_t max_rounds;
+    DiffEdit* edits;
+    int64_t edit_count;
+    int64_t max_edits;
+} DiffSearch;
+
+
+/*
+ * helper that adds an edit. Returns 0, or 1 if there are already max_edits.
+ * */
+int diffAddEdit(DiffSearch* search, int64_t old_row, int64_t new_row, int insert){
+
+    if (search->edit_count == search->max_edits){
+        return 1;
+    }
+
+    search->edits[search->edit_count].old_row = old_row;
+    search->edits[search->edit_count].new_row = new_row;
+    search->edits[search->edit_count].insert = insert;
+    search->edit_count++;
+
+    return 0;
+}
+
+
+/*
+ * helper that finds the middle snake of old lines [old_start, old_start + n) and new lines [new_start,
+ * new_start + m) with Myers' linear space search: the greedy search runs from both ends at once, and where the two
+ * paths meet is a point the shortest edit script goes through. Only the furthest point on each diagonal for the
+ * current round is kept, so memory doesn't grow with the number of edits.
+ * split_x, split_y are set to that point, relative to the starts.
+ * Returns 0, or 1 if the paths didn't meet within max_rounds.
+ * */
+int diffMiddleSnake(DiffSearch* search, int64_t old_start, int64_t n, int64_t new_start, int64_t m,
+                    int64_t* split_x, int64_t* split_y){
+    const uint64_t* a = search->old + old_start;
+    const uint64_t* b = search->new + new_start;
+    int64_t max_d = (n + m + 1) / 2 < search->max_rounds ? (n + m + 1) / 2 : search->max_rounds;
+    int64_t offset = max_d;
+    int64_t length = 2 * max_d + 2;
+    int64_t* v1 = search->forward;
+    int64_t* v2 = search->backward;
+    int64_t delta = n - m;
+    int front = delta % 2 != 0;
+
+    // Diagonals that went off the edge of the grid are left out of later rounds
+    int64_t k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+
+    for (int64_t i = 0; i < length; i++){
+        v1[i] = -1;
+        v2[i] = -1;
+    }
+
+    v1[offset + 1] = 0;
+    v2[offset + 1] = 0;
+
+    for (int64_t d = 0; d < max_d; d++){
+
+        // Forward, from the start
+        for (int64_t k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2){
+            int64_t k1_offset = offset + k1;
+            int64_t x1;
+
+            if (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1])){
+                x1 = v1[k1_offset + 1];
+            } else {
+                x1 = v1[k1_offset - 1] + 1;
+            }
+
+            int64_t y1 = x1 - k1;
+
+            while (x1 < n && y1 < m && a[x1] == b[y1]){
+                x1++;
+                y1++;
+            }
+
+            v1[k1_offset] = x1;
+
+            if (x1 > n){
+                k1_end += 2;
+            } else if (y1 > m){
+                k1_start += 2;
+            } else if (front){
+                int64_t k2_offset = offset + delta - k1;
+
+                if (k2_offset >= 0 && k2_offset < length && v2[k2_offset] != -1 && x1 >= n - v2[k2_offset]){
+                    *split_x = x1;
+                    *split_y = y1;
+                    return 0;
+                }
+            }
+        }
+
+        // Backward, from the end; x2 and y2 count back from it
+        for (int64_t k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2){
+            int64_t k2_offset = offset + k2;
+            int64_t x2;
+
+            if (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1])){
+                x2 = v2[k2_offset + 1];
+            } else {
+                x2 = v2[k2_offset - 1] + 1;
+            }
+
+            int64_t y2 = x2 - k2;
+
+            while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]){
+                x2++;
+                y2++;
+            }
+
+            v2[k2_offset] = x2;
+
+            if (x2 > n){
+                k2_end += 2;
+            } else if (y2 > m){
+                k2_start += 2;
+            } else if (!front){
+                int64_t k1_offset = offset + delta - k2;
+
+                if (k1_offset >= 0 && k1_offset < length && v1[k1_offset] != -1 && v1[k1_offset] >= n - x2){
+                    *split_x = v1[k1_offset];
+                    *split_y = v1[k1_offset] - (k1_offset - offset);
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+ * helper that adds the edits turning old lines [old_start, old_start + n) into new lines [new_start,
+ * new_start + m), by splitting them at their middle snake and diffing each side in turn. Each split about halves the
+ * edits left on either side, so the recursion is only about log2 of the edits deep.
+ * Returns 0, or 1 if more than max_edits edits are needed.
+ * */
+int diffSplit(DiffSearch* search, int64_t old_start, int64_t n, int64_t new_start, int64_t m){
+
+    // Lines in common at either end aren't edits
+    while (n > 0 && m > 0 && search->old[old_start] == search->new[new_start]){
+        old_start++;
+        new_start++;
+        n--;
+        m--;
+    }
+
+    while (n > 0 && m > 0 && search->old[old_start + n - 1] == search->new[new_start + m - 1]){
+        n--;
+        m--;
+    }
+
+    int64_t split_x, split_y;
+
+    if (n > 0 && m > 0 && diffMiddleSnake(search, old_start, n, new_start, m, &split_x, &split_y) == 0){
+        return diffSplit(search, old_start, split_x, new_start, split_y) ||
+               diffSplit(search, old_start + split_x, n - split_x, new_start + split_y, m - split_y);
+    }
+
+    // Only deletes or only inserts left, or no way through in max_rounds: delete the old lines, insert the new ones
+    for (int64_t i = 0; i < n; i++){
+        if (diffAddEdit(search, old_start + i, new_start, 0) != 0){
+            return 1;
+        }
+    }
+
+    for (int64_t i = 0; i < m; i++){
+        if (diffAddEdit(search, old_start + n, new_start + i, 1) != 0){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * helper that finds the shortest edit script from old to new, with the linear space variant of Myers' algorithm
+ * (see diffMiddleSnake). Memory is O(max_changes), however many lines there are.
+ * edits is set to an allocated array of the edit_count edits, in order.
+ * Returns 0, 1 if more than max_changes edits are needed, or MEM_ERROR.
+ * */
+int diffMiddle(const uint64_t* old, int64_t old_count, const uint64_t* new, int64_t new_count, int64_t max_changes,
+               DiffEdit** edits, int64_t* edit_count){
+    int64_t max_edits = old_count + new_count < max_changes ? old_count + new_count : max_changes;
+
+    // Paths from both ends meet within half the edits of the script, and a round more
+    int64_t max_rounds = max_edits / 2 + 2;
+
+    DiffSearch search = {old, new, NULL, NULL, max_rounds, NULL, 0, max_edits};
+
+    search.forward = malloc(sizeof(int64_t) * (2 * max_rounds + 2));
+    search.backward = malloc(sizeof(int64_t) * (2 * max_rounds + 2));
+    search.edits = malloc(sizeof(DiffEdit) * (max_edits > 0 ? max_edits : 1));
+
+    if (search.forward == NULL || search.backward == NULL || search.edits == NULL){
+        free(search.forward);
+        free(search.backward);
+        free(search.edits);
+        return MEM_ERROR;
+    }
+
+    int err = diffSplit(&search, 0, old_count, 0, new_count);
+
+    free(search.forward);
+    free(search.backward);
+
+    if (err != 0){
+        free(search.edits);
+        return 1;
+    }
+
+    *edits = search.edits;
+    *edit_count = search.edit_count;
+
+    return 0;
+}
+
+
+int DiffLines(const uint64_t* old_hashes, int64_t old_count, const uint64_t* new_hashes, int64_t new_count,
+              int64_t max_changes, DiffHunk** hunks, int64_t* hunk_count){
+    int64_t start = 0;
+    int64_t end = 0;
+
+    *hunks = NULL;
+    *hunk_count = 0;
+
+    while (start < old_count && start < new_count && old_hashes[start] == new_hashes[start]){
+        start++;
+    }
+
+    while (end < old_count - start && end < new_count - start &&
+           old_hashes[old_count - 1 - end] == new_hashes[new_count - 1 - end]){
+        end++;
+    }
+
+    old_count -= start + end;
+    new_count -= start + end;
+
+    if (old_count == 0 && new_count == 0){
+        return 0;
+    }
+
+    DiffEdit* edits = NULL;
+    int64_t edit_count = 0;
+    int err = 1;
+
+    if (old_count > 0 && new_count > 0){
+        err = diffMiddle(old_hashes + start, old_count, new_hashes + start, new_count, max_changes, &edits,
+                         &edit_count);
+
+        if (err == MEM_ERROR){
+            return MEM_ERROR;
+        }
+    }
+
+    // Only inserts or only deletes, or too many changes to look into: one hunk covers it all
+    if (err == 1){
+        if ((*hunks = malloc(sizeof(DiffHunk))) == NULL){
+            return MEM_ERROR;
+        }
+
+        (*hunks)[0].old_row = start;
+        (*hunks)[0].old_count = old_count;
+        (*hunks)[0].new_row = start;
+        (*hunks)[0].new_count = new_count;
+        *hunk_count = 1;
+
+        return 0;
+    }
+
+    if ((*hunks = malloc(sizeof(DiffHunk) * edit_count)) == NULL){
+        free(edits);
+        return MEM_ERROR;
+    }
+
+    // Edits that follow on from each other make up a hunk
+    int64_t count = 0;
+
+    for (int64_t i = 0; i < edit_count; i++){
+        DiffHunk* last = count > 0 ? &(*hunks)[count - 1] : NULL;
+        int64_t old_row = start + edits[i].old_row;
+        int64_t new_row = start + edits[i].new_row;
+
+        if (last == NULL || last->old_row + last->old_count != old_row || last->new_row + last->new_count != new_row){
+            last = &(*hunks)[count++];
+            last->old_row = old_row;
+            last->old_count = 0;
+            last->new_row = new_row;
+            last->new_count = 0;
+        }
+
+        if (edits[i].insert){
+            last->new_count++;
+        } else {
+            last->old_count++;
+        }
+    }
+
+    free(edits);
+    *hunk_count = count;
+
+    return 0;
+}
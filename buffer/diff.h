@@ -0,0 +1,44 @@
+/*
+ * diff.h
+ * Line diffs: the changes that turn one list of lines into another, found by comparing line hashes (see
+ * GapBufferHash) rather than text. Used to compare a buffer with the file it was loaded from.
+ *
+ * Lines the two lists start and end with in common are skipped first, so the cost of a diff depends on how much
+ * changed rather than on the size of the file. What's left is diffed with Myers' algorithm, which finds the
+ * fewest lines to delete and insert in O((N + M) D) time for D changed lines. Its linear space variant is used, so
+ * a diff takes O(max_changes) memory however much changed.
+ * */
+
+#ifndef TED_DIFF_H
+#define TED_DIFF_H
+
+#include <stdint.h>
+
+
+/*
+ * DiffHunk
+ * A run of changed lines: old_count lines at old_row were replaced by new_count lines at new_row.
+ * A hunk with no old lines is an insertion, one with no new lines a deletion (new_row is then the line the deleted
+ * lines would come before).
+ * */
+typedef struct DiffHunk {
+    int64_t old_row;
+    int64_t old_count;
+    int64_t new_row;
+    int64_t new_count;
+} DiffHunk;
+
+
+/*
+ * Diffs two lists of line hashes, old_count and new_count long.
+ * If more than max_changes lines were deleted and inserted, the search stops and everything between the common
+ * start and end is given as a single hunk, so very different inputs can't take quadratic time.
+ *
+ * hunks is set to an allocated array of the hunks, in order, which the caller frees with free(); NULL if there are
+ * none. hunk_count is set to their number.
+ * Returns 0 or MEM_ERROR.
+ * */
+int DiffLines(const uint64_t* old_hashes, int64_t old_count, const uint64_t* new_hashes, int64_t new_count,
+              int64_t max_changes, DiffHunk** hunks, int64_t* hunk_count);
+
+#endif //TED_DIFF_H
@@ -6,45 +6,45 @@
 #include <string.h>
 
 #include "gap.h"
+#include "alloc.h"
 
 
 /*
- * TODO: Consider rewriting this using realloc and memmove.
- * helper function for copying the contents of a GapBuffer.buffer to a new buffer, with/without
- * resizing the gap. This method is useful when moving the 'cursor' or when resizing a filled buffer.
+ * helper function for resizing the gap of a GapBuffer.buffer in place with realloc and memmove.
+ * The string before the gap stays where it is; the string after the gap is moved so it ends at the end of
+ * the resized buffer. This method is useful when resizing a filled buffer.
  * instance: GapBuffer instance
  * new_capacity: The new size of the buffer. If <= original capacity, the same capacity will be used.
  *
  * return 0 on success or MEM_ERROR
  * */
-int resizeBuffer(GapBuffer* instance, int new_capacity){
+int resizeBuffer(GapBuffer* instance, int64_t new_capacity){
 
-    int buffer_size = instance->str_len + instance->gap_len;
+    int64_t buffer_size = instance->str_len + instance->gap_len;
 
-    if (new_capacity < buffer_size){
-        new_capacity = buffer_size;
+    if (new_capacity <= buffer_size){
+        return 0;
+    }
+
+    if (new_capacity > GAP_BUFFER_MAX_CAPACITY){
+        return MEM_ERROR;
     }
 
     // If we increase the capacity, all the new space should go to the gap.
-    int gap_size = instance->gap_len + (new_capacity - buffer_size);
+    int64_t gap_size = instance->gap_len + (new_capacity - buffer_size);
 
-    // First malloc new buffer
-    char* new_buffer = malloc(sizeof(char) * new_capacity);
+    char* new_buffer = BufferRealloc(instance->buffer, sizeof(char) * buffer_size, sizeof(char) * new_capacity);
 
     if (new_buffer == NULL){
         return MEM_ERROR;
     }
 
-    // first, copy up to the start of the gap
-    memcpy(new_buffer, instance->buffer, sizeof(char) * (instance->gap_loc));
-
-    // Copy the rest of the buffer, starting from the suffix of the gap
-    memcpy(
+    // Move the rest of the string, starting from the suffix of the gap, to the end of the new buffer
+    memmove(
             (new_buffer + instance->gap_loc + gap_size),                // [a, a, a, a, _, _, _, starts here>a, a, a, a]
-            (instance->buffer + instance->gap_loc + instance->gap_len), // [a, a, a, a, _, starts here>a, a, a, a]
-            instance->str_len - instance->gap_loc);  //  now we copy the remaining str_len - gap_loc characters
+            (new_buffer + instance->gap_loc + instance->gap_len),       // [a, a, a, a, _, starts here>a, a, a, a]
+            instance->str_len - instance->gap_loc);  //  now we move the remaining str_len - gap_loc characters
 
-    free(instance->buffer);
     instance->buffer = new_buffer;
     instance->gap_len = gap_size;
 
@@ -52,32 +52,88 @@ int resizeBuffer(GapBuffer* instance, int new_capacity){
 }
 
 
-GapBuffer* CreateGapBuffer(int capacity){
+GapBuffer* CreateGapBuffer(int64_t capacity){
+
+    if (capacity < 0 || capacity > GAP_BUFFER_MAX_CAPACITY){
+        return NULL;
+    }
 
-    GapBuffer* gap_buffer = malloc(sizeof(GapBuffer));
+    GapBuffer* gap_buffer = BufferAlloc(sizeof(GapBuffer));
 
     if (gap_buffer == NULL){
         return NULL;
     }
 
-    gap_buffer->buffer = malloc(sizeof(char) * capacity);
+    gap_buffer->buffer = BufferAlloc(sizeof(char) * capacity);
 
     if (gap_buffer->buffer == NULL){
-        free(gap_buffer);
+        BufferFree(gap_buffer, sizeof(GapBuffer));
         return NULL;
     }
 
     gap_buffer->gap_loc = 0;
     gap_buffer->gap_len = capacity;
     gap_buffer->str_len = 0;
+    gap_buffer->version = 0;
+    gap_buffer->refs = 1;
+    gap_buffer->hash = 0;
 
     return gap_buffer;
 }
 
 
 void DestroyGapBuffer(GapBuffer * instance){
-    free(instance->buffer);
-    free(instance);
+
+    if (instance == NULL){
+        return;
+    }
+
+    // Other owners still use it
+    if (__atomic_sub_fetch(&instance->refs, 1, __ATOMIC_ACQ_REL) > 0){
+        return;
+    }
+
+    BufferFree(instance->buffer, sizeof(char) * (instance->str_len + instance->gap_len));
+    BufferFree(instance, sizeof(GapBuffer));
+}
+
+
+void GapBufferRetain(GapBuffer* instance){
+    __atomic_add_fetch(&instance->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+int GapBufferShared(GapBuffer* instance){
+    return __atomic_load_n(&instance->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+
+GapBuffer* GapBufferClone(GapBuffer* instance){
+    GapBuffer* clone = CreateGapBuffer(instance->str_len + instance->gap_len);
+
+    if (clone == NULL){
+        return NULL;
+    }
+
+    memcpy(clone->buffer, instance->buffer, instance->str_len + instance->gap_len);
+    clone->str_len = instance->str_len;
+    clone->gap_len = instance->gap_len;
+    clone->gap_loc = instance->gap_loc;
+    clone->version = instance->version;
+    clone->hash = __atomic_load_n(&instance->hash, __ATOMIC_RELAXED);
+
+    return clone;
+}
+
+
+/*
+ * helper function for the capacity to grow a buffer of capacity bytes to, so it holds at least needed bytes:
+ * double the capacity, or needed if that's more. Doubling stops at GAP_BUFFER_MAX_CAPACITY instead of overflowing.
+ * */
+int64_t growCapacity(int64_t capacity, int64_t needed){
+    int64_t doubled = capacity > GAP_BUFFER_MAX_CAPACITY / 2 ? GAP_BUFFER_MAX_CAPACITY : capacity * 2;
+
+    return needed > doubled ? needed : doubled;
 }
 
 
@@ -87,13 +143,14 @@ int GapBufferInsertChar(GapBuffer* instance, char ch){
 
     // If the gap is about to close, resize it.
     if (instance->gap_len <= 1){
-        int current_cap = instance->gap_len + instance->str_len;
-        if ((errno = resizeBuffer(instance, current_cap * 2)) != 0){
+        int64_t current_cap = instance->gap_len + instance->str_len;
+        if ((errno = resizeBuffer(instance, growCapacity(current_cap, current_cap + 1))) != 0){
             return errno;
         }
     }
 
     instance->buffer[instance->gap_loc] = ch;
+    instance->hash = 0;
     instance->str_len++;
     instance->gap_loc++;
     instance->gap_len--;
@@ -105,6 +162,7 @@ int GapBufferInsertChar(GapBuffer* instance, char ch){
 void GapBufferBackSpace(GapBuffer* instance){
 
     if (instance->gap_loc > 0){
+        instance->hash = 0;
         instance->gap_loc--;
         instance->gap_len++;
         instance->str_len--;
@@ -112,7 +170,7 @@ void GapBufferBackSpace(GapBuffer* instance){
 }
 
 
-int GapBufferMoveGap(GapBuffer* instance, int location){
+int GapBufferMoveGap(GapBuffer* instance, int64_t location){
     if (location > instance->str_len){
         location = instance->str_len;
     }
@@ -121,51 +179,192 @@ int GapBufferMoveGap(GapBuffer* instance, int location){
         location = 0;
     }
 
-    int capacity = instance->gap_len + instance->str_len;
-    char* new_buffer = malloc(sizeof(char) * capacity);
-
-    if (new_buffer == NULL){
-        return MEM_ERROR;
-    }
-
     if (location < instance->gap_loc){
 
         // here the new location is before the current gap location
-        // copy up to location
-        memcpy(new_buffer, instance->buffer, sizeof(char) * (location));
-
-        // then copy what remains up to instance.gap_loc, to the position after the gap in the new buffer
-        memcpy(new_buffer + location + instance->gap_len,
-               instance->buffer + location,
-               sizeof(char) * (instance->gap_loc-location));
-
-        // copy the rest of the string
-        memcpy((new_buffer + location + instance->gap_len + (instance->gap_loc-location)),
-                (instance->buffer + instance->gap_loc + instance->gap_len),
-               sizeof(char) * instance->str_len - instance->gap_loc);  //  now we copy the remaining str_len - gap_loc characters
+        // move the characters between location and the gap to the end of the gap
+        memmove(instance->buffer + location + instance->gap_len,
+                instance->buffer + location,
+                sizeof(char) * (instance->gap_loc - location));
     } else {
 
         // here the new location is further after the current gap location
-        // copy upto original gap
-        memcpy(new_buffer, instance->buffer, sizeof(char) * (instance->gap_loc));
+        // move the characters between the end of the gap and location to the start of the gap
+        memmove(instance->buffer + instance->gap_loc,
+                instance->buffer + instance->gap_loc + instance->gap_len,
+                sizeof(char) * (location - instance->gap_loc));
+    }
+
+    instance->gap_loc = location;
+    return 0;
+}
+
+
+int64_t GapBufferDeleteForward(GapBuffer* instance, int64_t count){
+
+    if (count > instance->str_len - instance->gap_loc){
+        count = instance->str_len - instance->gap_loc;
+    }
+
+    if (count < 0){
+        count = 0;
+    }
+
+    instance->gap_len += count;
+    instance->str_len -= count;
+    instance->hash = count > 0 ? 0 : instance->hash;
+
+    return count;
+}
+
+
+int64_t GapBufferCopyRange(GapBuffer* instance, int64_t start, int64_t len, char* dest){
+
+    if (start < 0){
+        start = 0;
+    }
+
+    if (start + len > instance->str_len){
+        len = instance->str_len - start;
+    }
+
+    if (len <= 0){
+        return 0;
+    }
+
+    // Part of the range before the gap
+    int64_t before_gap = 0;
+    if (start < instance->gap_loc){
+        before_gap = instance->gap_loc - start < len ? instance->gap_loc - start : len;
+        memcpy(dest, instance->buffer + start, before_gap);
+    }
+
+    // Part of the range after the gap
+    if (before_gap < len){
+        memcpy(dest + before_gap,
+               instance->buffer + start + before_gap + instance->gap_len,
+               len - before_gap);
+    }
+
+    return len;
+}
+
+
+int GapBufferInsertRange(GapBuffer* instance, GapBuffer* src, int64_t start, int64_t len){
+
+    int err;
+
+    if ((err = GapBufferReserve(instance, len + 1)) != 0){
+        return err;
+    }
+
+    len = GapBufferCopyRange(src, start, len, instance->buffer + instance->gap_loc);
+
+    instance->hash = len > 0 ? 0 : instance->hash;
+    instance->str_len += len;
+    instance->gap_loc += len;
+    instance->gap_len -= len;
+
+    return 0;
+}
+
+
+int64_t GapBufferShrink(GapBuffer* instance, int64_t gap_len){
+
+    // Always keep at least one byte allocated
+    if (gap_len < 1 && instance->str_len == 0){
+        gap_len = 1;
+    }
+
+    if (gap_len < 0){
+        gap_len = 0;
+    }
+
+    if (instance->gap_len <= gap_len){
+        return 0;
+    }
+
+    int64_t freed = instance->gap_len - gap_len;
+
+    // Close up the gap first, so the string fits in the smaller buffer
+    memmove(instance->buffer + instance->gap_loc + gap_len,
+            instance->buffer + instance->gap_loc + instance->gap_len,
+            instance->str_len - instance->gap_loc);
 
-        // copy what's left before the new location
-        memcpy(new_buffer+instance->gap_loc,
-               instance->buffer + instance->gap_loc + instance->gap_len,
-               sizeof(char) * (location - instance->gap_loc));
+    char* new_buffer = BufferRealloc(instance->buffer,
+                                     sizeof(char) * (instance->str_len + instance->gap_len),
+                                     sizeof(char) * (instance->str_len + gap_len));
 
-        // now copy the remaining string after the gap
-        memcpy(new_buffer + location + instance->gap_len,
-               instance->buffer + instance->gap_loc + instance->gap_len + (location - instance->gap_loc),
-               sizeof(char) * instance->str_len - location);
+    // A failed shrink leaves the old, larger, allocation in place. Open the gap back up so the buffer's length
+    // still matches its allocation.
+    if (new_buffer == NULL){
+        memmove(instance->buffer + instance->gap_loc + instance->gap_len,
+                instance->buffer + instance->gap_loc + gap_len,
+                instance->str_len - instance->gap_loc);
+        return 0;
     }
 
-    free(instance->buffer);
     instance->buffer = new_buffer;
-    instance->gap_loc = location;
+    instance->gap_len = gap_len;
+
+    return freed;
+}
+
+
+int GapBufferReserve(GapBuffer* instance, int64_t gap_len){
+
+    if (instance->gap_len >= gap_len){
+        return 0;
+    }
+
+    if (gap_len > GAP_BUFFER_MAX_CAPACITY - instance->str_len){
+        return MEM_ERROR;
+    }
+
+    // Grow by at least double, as single inserts would, so repeated batches stay amortized
+    int64_t current_cap = instance->gap_len + instance->str_len;
+
+    return resizeBuffer(instance, growCapacity(current_cap, instance->str_len + gap_len));
+}
+
+
+int GapBufferInsertString(GapBuffer* instance, const char* str, int64_t len){
+
+    int err;
+
+    // Keep at least one character of gap, as GapBufferInsertChar does
+    if ((err = GapBufferReserve(instance, len + 1)) != 0){
+        return err;
+    }
+
+    memcpy(instance->buffer + instance->gap_loc, str, len);
+    instance->hash = len > 0 ? 0 : instance->hash;
+    instance->str_len += len;
+    instance->gap_loc += len;
+    instance->gap_len -= len;
+
     return 0;
 }
 
+
+int64_t GapBufferBackSpaceN(GapBuffer* instance, int64_t count){
+
+    if (count > instance->gap_loc){
+        count = instance->gap_loc;
+    }
+
+    if (count < 0){
+        count = 0;
+    }
+
+    instance->gap_loc -= count;
+    instance->gap_len += count;
+    instance->str_len -= count;
+    instance->hash = count > 0 ? 0 : instance->hash;
+
+    return count;
+}
+
 char* GapBufferGetString(GapBuffer* instance){
     char* buffer = malloc(1 + (sizeof(char) * instance->str_len));
 
@@ -194,8 +393,10 @@ GapBuffer* GapBufferSplit(GapBuffer *instance) {
     // split the current GapBuffer where the gap is.
     // Create a new GapBuffer and copy the second half of the string to the new GapBuffer
 
-    int capacity = instance->gap_len + instance->str_len;
-    int second_half_of_str_len = instance->str_len - instance->gap_loc;
+    int64_t second_half_of_str_len = instance->str_len - instance->gap_loc;
+
+    // The new buffer is sized to the text it gets, with a small gap for typing
+    int64_t capacity = second_half_of_str_len + SPLIT_GAP_LEN;
 
     GapBuffer* new_gap_buffer = CreateGapBuffer(capacity);
 
@@ -216,9 +417,10 @@ GapBuffer* GapBufferSplit(GapBuffer *instance) {
     new_gap_buffer->gap_len = capacity - second_half_of_str_len;
 
 
-    // set str_len, gap_len of the old GapBuffer
+    // set str_len, gap_len of the old GapBuffer. The second half becomes part of its gap.
+    instance->gap_len += second_half_of_str_len;
     instance->str_len = instance->gap_loc;
-    instance->gap_len = capacity - instance->str_len;
+    instance->hash = second_half_of_str_len > 0 ? 0 : instance->hash;
 
     return new_gap_buffer;
 
@@ -228,10 +430,10 @@ GapBuffer* GapBufferSplit(GapBuffer *instance) {
 
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "DanglingPointer" // Ignore because CreateGapBuffer never returns a deallocated pointer.
-GapBuffer* CreateGapBufferFromString(char* str, int gap_len){
+GapBuffer* CreateGapBufferFromString(char* str, int64_t gap_len){
 
-    int s_len = strlen(str);
-    int capacity = s_len + gap_len;
+    int64_t s_len = strlen(str);
+    int64_t capacity = s_len + gap_len;
     GapBuffer* new_buffer;
 
     if (str == NULL || s_len == 0){
@@ -259,7 +461,7 @@ GapBuffer* CreateGapBufferFromString(char* str, int gap_len){
 #pragma clang diagnostic pop
 
 
-char GapBufferCharAt(GapBuffer *instance, int i) {
+char GapBufferCharAt(GapBuffer *instance, int64_t i) {
 
     if ( instance == NULL ||
          instance->str_len == 0 ||
@@ -273,4 +475,109 @@ char GapBufferCharAt(GapBuffer *instance, int i) {
     else {
         return instance->buffer[i + instance->gap_len];
     }
-}
\ No newline at end of file
+}
+
+
+/*
+ * HashState
+ * A hash being computed over a string that comes in pieces, like the two halves of a gap buffer. The string is
+ * mixed in 8 bytes at a time; tail holds the bytes of a word that isn't complete yet.
+ * */
+typedef struct HashState {
+    uint64_t hash;
+    uint64_t tail;
+    int tail_len;
+    int64_t len;
+} HashState;
+
+
+/*
+ * helper that mixes a word into the hash
+ * */
+uint64_t hashWord(uint64_t hash, uint64_t word){
+    hash ^= word * 0xff51afd7ed558ccdULL;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * 0xc4ceb9fe1a85ec53ULL;
+}
+
+
+/*
+ * helper that adds len bytes of str to the hash
+ * */
+void hashUpdate(HashState* state, const char* str, int64_t len){
+    state->len += len;
+
+    // Finish the word left over from the last piece first
+    while (state->tail_len > 0 && len > 0){
+        ((unsigned char*) &state->tail)[state->tail_len++] = (unsigned char) *str++;
+        len--;
+
+        if (state->tail_len == 8){
+            state->hash = hashWord(state->hash, state->tail);
+            state->tail = 0;
+            state->tail_len = 0;
+        }
+    }
+
+    for (; len >= 8; str += 8, len -= 8){
+        uint64_t word;
+        memcpy(&word, str, 8);
+        state->hash = hashWord(state->hash, word);
+    }
+
+    while (len-- > 0){
+        ((unsigned char*) &state->tail)[state->tail_len++] = (unsigned char) *str++;
+    }
+}
+
+
+/*
+ * helper that finishes the hash, mixing in the length so strings padded with zero bytes don't collide
+ * */
+uint64_t hashFinish(HashState* state){
+    uint64_t hash = state->hash;
+
+    if (state->tail_len > 0){
+        hash = hashWord(hash, state->tail);
+    }
+
+    hash ^= (uint64_t) state->len;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    // 0 means not computed
+    return hash != 0 ? hash : 1;
+}
+
+
+uint64_t GapBufferHashString(const char* str, int64_t len){
+    HashState state = {0x9e3779b97f4a7c15ULL, 0, 0, 0};
+
+    hashUpdate(&state, str, len);
+    return hashFinish(&state);
+}
+
+
+uint64_t GapBufferHash(GapBuffer* instance){
+
+    // Owners of a shared buffer may hash it at the same time on different threads. The text can't change while
+    // it's shared, so they all store the same value.
+    uint64_t hash = __atomic_load_n(&instance->hash, __ATOMIC_RELAXED);
+
+    if (hash != 0){
+        return hash;
+    }
+
+    HashState state = {0x9e3779b97f4a7c15ULL, 0, 0, 0};
+
+    hashUpdate(&state, instance->buffer, instance->gap_loc);
+    hashUpdate(&state, instance->buffer + instance->gap_loc + instance->gap_len, instance->str_len - instance->gap_loc);
+
+    hash = hashFinish(&state);
+    __atomic_store_n(&instance->hash, hash, __ATOMIC_RELAXED);
+
+    return hash;
+}
@@ -9,8 +9,16 @@
 #ifndef TED_GAP_H
 #define TED_GAP_H
 
+#include <stdint.h>
+
 #define MEM_ERROR 128
 
+// Gap given to the new buffer made by GapBufferSplit
+#define SPLIT_GAP_LEN 16
+
+// Largest buffer a GapBuffer can have: its length has to fit in an int64_t, and in a size_t to be allocated
+#define GAP_BUFFER_MAX_CAPACITY (SIZE_MAX < INT64_MAX ? (int64_t) SIZE_MAX : INT64_MAX)
+
 /*
  * Gap Buffer Data structure
  * A buffer that uses a "gap" within a string to allow addition of new characters to it.
@@ -22,6 +30,8 @@
  * - The string is seen as a separate object starting from buffer[0] and extending str_len characters.
  * - The gap is always somewhere between this string, or at the prefix or suffix.
  * - The length of the buffer is always the sum of the string length and the gap length.
+ * - Lengths and locations are 64-bit, so a single buffer can hold more than 2GB. Growth that would go past
+ *   GAP_BUFFER_MAX_CAPACITY fails with MEM_ERROR instead of overflowing.
  * - The string is buffer[0:gap_loc-1] + buffer[(gap_loc+gap_len):(gap_loc+gap_len) + (str_len-gap_loc)]:
  *      - 0 to gap_loc-1 is the string up to the gap
  *      - (gap_loc+gap_len) is the index right after the gap
@@ -30,9 +40,12 @@
 
 typedef struct GapBuffer {
     char* buffer;  // Buffer containing string and gap
-    int str_len;    // Length of the string
-    int gap_len;    // Length of the gap
-    int gap_loc;    // Gap location as an offset from the start of the buffer
+    int64_t str_len;    // Length of the string
+    int64_t gap_len;    // Length of the gap
+    int64_t gap_loc;    // Gap location as an offset from the start of the buffer
+    unsigned long version;  // Version stamp of the last change, for owners that track changes. Starts at 0
+    int refs;               // Number of owners. A buffer with more than one is shared, and must not be changed
+    uint64_t hash;          // Hash of the string, see GapBufferHash. 0 until computed, and again after any change
 } GapBuffer;
 
 
@@ -45,17 +58,39 @@ typedef struct GapBuffer {
  * Creates and initializes a new gap buffer. Initially the gap is of size `capacity`
  * returns NULL on fail.
  * */
-GapBuffer* CreateGapBuffer(int capacity);
+GapBuffer* CreateGapBuffer(int64_t capacity);
 
 
 /*
  * DestroyGapBuffer Safely deallocates a gapbuffer. The pointer given is set to NULL after.
  * Passing a NULL pointer does nothing.
+ * A shared buffer (see GapBufferRetain) loses one owner, and is only deallocated once its last owner destroys it.
  * buffer: pointer to an allocated gapbuffer.
  * */
 void DestroyGapBuffer(GapBuffer* instance);
 
 
+/*
+ * Adds an owner to the buffer, so it can be read somewhere else (e.g. by another thread) without being copied.
+ * Each owner calls DestroyGapBuffer when it's done with it. Owners may be on different threads.
+ * While a buffer has more than one owner it is read-only: an owner that wants to change it makes its own copy
+ * with GapBufferClone and destroys its share of the original.
+ * */
+void GapBufferRetain(GapBuffer* instance);
+
+
+/*
+ * Returns 1 if the buffer has more than one owner, 0 otherwise.
+ * */
+int GapBufferShared(GapBuffer* instance);
+
+
+/*
+ * Returns a copy of the buffer, with the same contents, gap and version, and a single owner. NULL on failure.
+ * */
+GapBuffer* GapBufferClone(GapBuffer* instance);
+
+
 /*
  * Inserts a character into the gap buffer. Resizes the buffer and the gap if necessary.
  * Returns 0 if successful or MEM_ERROR
@@ -72,8 +107,62 @@ void GapBufferBackSpace(GapBuffer* instance);
 /*
  * Moves the gap to a new location in the string. If the location is greater than str_len,
  * it moves to the end of the string. if less than 0, moves to the start of the string
+ * Only the characters between the old and new location are moved, so short moves are cheap.
+ * */
+int GapBufferMoveGap(GapBuffer* instance, int64_t location);
+
+
+/*
+ * Inserts len characters of str at the gap. The buffer is resized at most once.
+ * Returns 0 if successful or MEM_ERROR
+ * */
+int GapBufferInsertString(GapBuffer* instance, const char* str, int64_t len);
+
+
+/*
+ * Deletes up to count characters from the prefix of the gap; the same as count backspaces.
+ * Returns the number of characters deleted.
+ * */
+int64_t GapBufferBackSpaceN(GapBuffer* instance, int64_t count);
+
+
+/*
+ * Deletes up to count characters from the suffix of the gap, like hitting delete count times.
+ * Returns the number of characters deleted.
+ * */
+int64_t GapBufferDeleteForward(GapBuffer* instance, int64_t count);
+
+
+/*
+ * Copies len characters of the string, starting at index start, into dest. The gap is skipped over;
+ * indexes are the same as for GapBufferCharAt. dest is not null terminated.
+ * The range is clamped to the string; returns the number of characters copied.
+ * */
+int64_t GapBufferCopyRange(GapBuffer* instance, int64_t start, int64_t len, char* dest);
+
+
+/*
+ * Inserts len characters of the string in src, starting at index start, at the gap of instance.
+ * The characters are copied straight from src, without making an intermediate string.
+ * Returns 0 if successful or MEM_ERROR
+ * */
+int GapBufferInsertRange(GapBuffer* instance, GapBuffer* src, int64_t start, int64_t len);
+
+
+/*
+ * Shrinks the buffer so the gap is at most gap_len long, giving the rest of the memory back.
+ * Buffers whose gap is already short enough are left alone.
+ * Returns the number of bytes freed.
  * */
-int GapBufferMoveGap(GapBuffer* instance, int location);
+int64_t GapBufferShrink(GapBuffer* instance, int64_t gap_len);
+
+
+/*
+ * Makes sure the gap is at least gap_len long, resizing the buffer once if it isn't.
+ * Used to grow a buffer once before a batch of inserts.
+ * Returns 0 if successful or MEM_ERROR
+ * */
+int GapBufferReserve(GapBuffer* instance, int64_t gap_len);
 
 
 /*
@@ -83,9 +172,9 @@ char* GapBufferGetString(GapBuffer* instance);
 
 
 /*
- * Splits the buffer at the cursor location, returning a new buffer of the same capacity as the original
- * with the second half of the string. The original buffer will contain the first half of the string,
- * with the gap extending to fill the capacity.
+ * Splits the buffer at the cursor location, returning a new buffer with the second half of the string.
+ * The new buffer is sized to the second half, plus a gap of SPLIT_GAP_LEN. The original buffer will contain
+ * the first half of the string, with the gap extending to fill the capacity.
  *
  * return a pointer to the new buffer, or NULL on failure.
  * */
@@ -99,7 +188,22 @@ GapBuffer* GapBufferSplit(GapBuffer* instance);
  *
  * returns an initialized GapBuffer* or NULL on error
  * */
-GapBuffer* CreateGapBufferFromString(char* str, int gap_len);
+GapBuffer* CreateGapBufferFromString(char* str, int64_t gap_len);
+
+
+/*
+ * Returns a 64-bit hash of the string, for comparing lines without comparing their text. The hash is computed
+ * the first time it's asked for and kept until the string changes, so asking again is free.
+ * Owners of a shared buffer can hash it from any thread.
+ * Never returns 0.
+ * */
+uint64_t GapBufferHash(GapBuffer* instance);
+
+
+/*
+ * Returns the hash GapBufferHash gives a buffer holding the len characters of str.
+ * */
+uint64_t GapBufferHashString(const char* str, int64_t len);
 
 
 /*
@@ -108,7 +212,7 @@ GapBuffer* CreateGapBufferFromString(char* str, int gap_len);
  * domain for i = [0, strlen-1]
  * returns null byte if the instance is invalid, the string is empty, or i is out of domain
  * */
-char GapBufferCharAt(GapBuffer* instance, int i);
+char GapBufferCharAt(GapBuffer* instance, int64_t i);
 
 
 #endif //TED_GAP_H
@@ -0,0 +1,383 @@
+//
+// Trigram index over blocks of lines, see trigram.h
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigram.h"
+#include "alloc.h"
+
+// Table entries an index starts with
+#define TRIGRAM_FIRST_TABLE_SIZE 4096
+// Blocks the block array starts with
+#define TRIGRAM_FIRST_BLOCKS 64
+// Bytes a posting list that's moved out of its table entry starts with
+#define TRIGRAM_FIRST_LIST_BYTES 32
+
+
+TrigramIndex* CreateTrigramIndex(int64_t block_bytes, int64_t max_bytes){
+    TrigramIndex* index = BufferAlloc(sizeof(TrigramIndex));
+
+    if (index == NULL){
+        return NULL;
+    }
+
+    index->table = BufferAlloc(sizeof(TrigramList) * TRIGRAM_FIRST_TABLE_SIZE);
+    index->block_rows = BufferAlloc(sizeof(int64_t) * (TRIGRAM_FIRST_BLOCKS + 1));
+
+    if (index->table == NULL || index->block_rows == NULL){
+        BufferFree(index->table, sizeof(TrigramList) * TRIGRAM_FIRST_TABLE_SIZE);
+        BufferFree(index->block_rows, sizeof(int64_t) * (TRIGRAM_FIRST_BLOCKS + 1));
+        BufferFree(index, sizeof(TrigramIndex));
+        return NULL;
+    }
+
+    memset(index->table, 0, sizeof(TrigramList) * TRIGRAM_FIRST_TABLE_SIZE);
+    index->table_size = TRIGRAM_FIRST_TABLE_SIZE;
+    index->list_count = 0;
+    index->block_rows[0] = 0;
+    index->block_count = 0;
+    index->blocks_capacity = TRIGRAM_FIRST_BLOCKS;
+    index->block_bytes = block_bytes > 0 ? block_bytes : 1;
+    index->open_bytes = 0;
+    index->line_count = 0;
+    index->max_bytes = max_bytes;
+    index->bytes = sizeof(TrigramIndex) + sizeof(TrigramList) * TRIGRAM_FIRST_TABLE_SIZE +
+                   sizeof(int64_t) * (TRIGRAM_FIRST_BLOCKS + 1);
+
+    return index;
+}
+
+
+void DestroyTrigramIndex(TrigramIndex* index){
+
+    if (index == NULL){
+        return;
+    }
+
+    for (int64_t i = 0; i < index->table_size; i++){
+        TrigramList* list = &index->table[i];
+
+        if (list->key != 0 && list->capacity > TRIGRAM_INLINE_BYTES){
+            BufferFree(list->data.bytes, list->capacity);
+        }
+    }
+
+    BufferFree(index->table, sizeof(TrigramList) * index->table_size);
+    BufferFree(index->block_rows, sizeof(int64_t) * (index->blocks_capacity + 1));
+    BufferFree(index, sizeof(TrigramIndex));
+}
+
+
+int64_t TrigramIndexMemoryUsage(TrigramIndex* index){
+    return index->bytes;
+}
+
+
+/*
+ * helper that returns the table entry for a key: the list with that key, or the empty entry it would go in
+ * */
+TrigramList* findList(TrigramList* table, int64_t table_size, uint32_t key){
+    // Fibonacci hashing spreads the bytes of neighbouring trigrams over the table
+    uint64_t slot = ((uint64_t) key * 0x9E3779B97F4A7C15ull) >> 32;
+
+    for (;; slot++){
+        TrigramList* list = &table[slot & (table_size - 1)];
+
+        if (list->key == key || list->key == 0){
+            return list;
+        }
+    }
+}
+
+
+/*
+ * helper that doubles the size of the index's table, moving the lists over.
+ * Returns 0 or MEM_ERROR; on error the table is unchanged.
+ * */
+int growTable(TrigramIndex* index){
+    int64_t size = index->table_size * 2;
+    TrigramList* table = BufferAlloc(sizeof(TrigramList) * size);
+
+    if (table == NULL){
+        return MEM_ERROR;
+    }
+
+    memset(table, 0, sizeof(TrigramList) * size);
+
+    for (int64_t i = 0; i < index->table_size; i++){
+        if (index->table[i].key != 0){
+            *findList(table, size, index->table[i].key) = index->table[i];
+        }
+    }
+
+    BufferFree(index->table, sizeof(TrigramList) * index->table_size);
+    index->bytes += sizeof(TrigramList) * (size - index->table_size);
+    index->table = table;
+    index->table_size = size;
+
+    return 0;
+}
+
+
+/*
+ * helper that adds a block to a trigram's posting list, unless it's the list's last block already.
+ * Returns 0 or MEM_ERROR.
+ * */
+int addTrigram(TrigramIndex* index, uint32_t trigram, int64_t block){
+    uint32_t key = trigram + 1;
+    TrigramList* list = findList(index->table, index->table_size, key);
+
+    if (list->key == 0){
+
+        // Kept at most half full, so probes stay short
+        if ((index->list_count + 1) * 2 > index->table_size){
+            if (growTable(index) != 0){
+                return MEM_ERROR;
+            }
+            list = findList(index->table, index->table_size, key);
+        }
+
+        list->key = key;
+        list->len = 0;
+        list->capacity = TRIGRAM_INLINE_BYTES;
+        list->last_block = -1;
+        index->list_count++;
+    }
+
+    if (list->last_block == block){
+        return 0;
+    }
+
+    // Varint: seven bits a byte, low bits first, the top bit set on all but the last byte
+    uint8_t encoded[10];
+    uint64_t delta = block - list->last_block;
+    uint32_t n = 0;
+
+    while (delta >= 0x80){
+        encoded[n++] = (uint8_t) (delta | 0x80);
+        delta >>= 7;
+    }
+    encoded[n++] = (uint8_t) delta;
+
+    if (list->len + n > list->capacity){
+        uint32_t capacity = list->capacity > TRIGRAM_INLINE_BYTES ? list->capacity * 2 : TRIGRAM_FIRST_LIST_BYTES;
+        uint8_t* bytes;
+
+        if (list->capacity > TRIGRAM_INLINE_BYTES){
+            bytes = BufferRealloc(list->data.bytes, list->capacity, capacity);
+        } else if ((bytes = BufferAlloc(capacity)) != NULL){
+            memcpy(bytes, list->data.small, list->len);
+        }
+
+        if (bytes == NULL){
+            return MEM_ERROR;
+        }
+
+        index->bytes += capacity - (list->capacity > TRIGRAM_INLINE_BYTES ? list->capacity : 0);
+        list->data.bytes = bytes;
+        list->capacity = capacity;
+    }
+
+    uint8_t* bytes = list->capacity > TRIGRAM_INLINE_BYTES ? list->data.bytes : list->data.small;
+
+    memcpy(bytes + list->len, encoded, n);
+    list->len += n;
+    list->last_block = block;
+
+    return 0;
+}
+
+
+/*
+ * helper that starts a new block at the next line to be added.
+ * Returns 0 or MEM_ERROR.
+ * */
+int openBlock(TrigramIndex* index){
+
+    if (index->block_count == index->blocks_capacity){
+        int64_t capacity = index->blocks_capacity * 2;
+        int64_t* rows = BufferRealloc(index->block_rows, sizeof(int64_t) * (index->blocks_capacity + 1),
+                                      sizeof(int64_t) * (capacity + 1));
+
+        if (rows == NULL){
+            return MEM_ERROR;
+        }
+
+        index->bytes += sizeof(int64_t) * (capacity - index->blocks_capacity);
+        index->block_rows = rows;
+        index->blocks_capacity = capacity;
+    }
+
+    index->block_rows[index->block_count] = index->line_count;
+    index->block_count++;
+    index->block_rows[index->block_count] = index->line_count;
+    index->open_bytes = 0;
+
+    return 0;
+}
+
+
+int TrigramIndexAddLines(TrigramIndex* index, GapBuffer** lines, int64_t count){
+
+    for (int64_t i = 0; i < count; i++){
+        GapBuffer* line = lines[i];
+
+        if (index->block_count == 0 || index->open_bytes >= index->block_bytes){
+            if (openBlock(index) != 0){
+                return MEM_ERROR;
+            }
+        }
+
+        // The text is on both sides of the gap; the window runs across it
+        int64_t block = index->block_count - 1;
+        const char* parts[2] = {line->buffer, line->buffer + line->gap_loc + line->gap_len};
+        int64_t part_lens[2] = {line->gap_loc, line->str_len - line->gap_loc};
+        uint32_t window = 0;
+        int64_t seen = 0;
+
+        for (int part = 0; part < 2; part++){
+            for (int64_t j = 0; j < part_lens[part]; j++){
+                window = ((window << 8) | (unsigned char) parts[part][j]) & 0xFFFFFF;
+
+                if (++seen >= 3 && addTrigram(index, window, block) != 0){
+                    return MEM_ERROR;
+                }
+            }
+        }
+
+        index->open_bytes += line->str_len + 1;
+        index->line_count++;
+        index->block_rows[index->block_count] = index->line_count;
+
+        if (index->bytes > index->max_bytes){
+            return TRIGRAM_FULL;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * helper that reads the varint at *pos of a posting list, moving pos past it.
+ * */
+uint64_t readVarint(const uint8_t* bytes, uint32_t* pos){
+    uint64_t value = 0;
+    int shift = 0;
+
+    while (bytes[*pos] & 0x80){
+        value |= (uint64_t) (bytes[(*pos)++] & 0x7F) << shift;
+        shift += 7;
+    }
+
+    return value | (uint64_t) bytes[(*pos)++] << shift;
+}
+
+
+int TrigramIndexQuery(TrigramIndex* index, const char* pattern, int64_t len, int64_t** blocks, int64_t* count){
+    *blocks = NULL;
+    *count = 0;
+
+    if (len < 3){
+        return TRIGRAM_ALL_BLOCKS;
+    }
+
+    // The pattern's lists, with repeats skipped. The shortest is decoded, and the others are walked to filter it
+    int64_t list_count = 0;
+    TrigramList** lists = malloc(sizeof(TrigramList*) * (len - 2));
+    TrigramList* shortest = NULL;
+    uint32_t window = 0;
+
+    if (lists == NULL){
+        return MEM_ERROR;
+    }
+
+    for (int64_t i = 0; i < len; i++){
+        window = ((window << 8) | (unsigned char) pattern[i]) & 0xFFFFFF;
+
+        if (i < 2){
+            continue;
+        }
+
+        TrigramList* list = findList(index->table, index->table_size, window + 1);
+
+        // A trigram that's nowhere means the pattern is nowhere
+        if (list->key == 0){
+            free(lists);
+            return 0;
+        }
+
+        int64_t j = 0;
+
+        while (j < list_count && lists[j] != list){
+            j++;
+        }
+
+        if (j == list_count){
+            lists[list_count++] = list;
+
+            if (shortest == NULL || list->len < shortest->len){
+                shortest = list;
+            }
+        }
+    }
+
+    // A list has at most a block per byte
+    int64_t* found = malloc(sizeof(int64_t) * shortest->len);
+    int64_t found_count = 0;
+
+    if (found == NULL){
+        free(lists);
+        return MEM_ERROR;
+    }
+
+    const uint8_t* bytes = shortest->capacity > TRIGRAM_INLINE_BYTES ? shortest->data.bytes : shortest->data.small;
+    int64_t block = -1;
+
+    for (uint32_t pos = 0; pos < shortest->len;){
+        block += readVarint(bytes, &pos);
+        found[found_count++] = block;
+    }
+
+    for (int64_t i = 0; i < list_count && found_count > 0; i++){
+        TrigramList* list = lists[i];
+
+        if (list == shortest){
+            continue;
+        }
+
+        bytes = list->capacity > TRIGRAM_INLINE_BYTES ? list->data.bytes : list->data.small;
+        block = -1;
+
+        uint32_t pos = 0;
+        int64_t kept = 0;
+
+        for (int64_t j = 0; j < found_count; j++){
+            while (block < found[j] && pos < list->len){
+                block += readVarint(bytes, &pos);
+            }
+
+            if (block == found[j]){
+                found[kept++] = found[j];
+            } else if (block < found[j]){
+                break;
+            }
+        }
+
+        found_count = kept;
+    }
+
+    free(lists);
+
+    if (found_count == 0){
+        free(found);
+        return 0;
+    }
+
+    *blocks = found;
+    *count = found_count;
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * trigram.h
+ * Trigram index: for every run of three bytes in a buffer's lines, the blocks of lines it appears in. A search for
+ * a string of three or more bytes only has to look at the blocks that have all of its trigrams, so searching a large
+ * buffer again and again reads a small part of it each time.
+ *
+ * Lines are grouped into blocks of about block_bytes of text. The blocks a trigram appears in are kept in order as a
+ * posting list of varint-encoded deltas, so a trigram that's in most blocks costs about a byte a block, and short
+ * lists are kept inside the table entry without an allocation of their own. Trigrams are only taken within lines,
+ * as searches don't span lines.
+ *
+ * An index is built by adding lines in order, e.g. from a snapshot on another thread, and covers the lines as they
+ * were then. Keeping track of which lines changed since is left to the caller (see TextBufferChangesSince).
+ * */
+
+#ifndef TED_TRIGRAM_H
+#define TED_TRIGRAM_H
+
+#include <stdint.h>
+#include "gap.h"
+
+// Returned by TrigramIndexAddLines when the index went over its memory limit
+#define TRIGRAM_FULL 1
+
+// Returned by TrigramIndexQuery when the pattern is too short to have trigrams, so every block is a candidate
+#define TRIGRAM_ALL_BLOCKS 1
+
+// Posting list bytes kept in a table entry before the list gets an allocation of its own
+#define TRIGRAM_INLINE_BYTES 8
+
+
+/*
+ * TrigramList
+ * An entry in the index's hash table: a trigram and the blocks it appears in.
+ *
+ * key: the trigram plus one, 0 for an empty entry
+ * len, capacity: bytes of the posting list used, and allocated. Lists up to TRIGRAM_INLINE_BYTES are in `small`
+ * last_block: last block in the list, that the next one is a delta from. -1 for an empty list
+ * */
+typedef struct TrigramList {
+    uint32_t key;
+    uint32_t len;
+    uint32_t capacity;
+    int64_t last_block;
+    union {
+        uint8_t* bytes;
+        uint8_t small[TRIGRAM_INLINE_BYTES];
+    } data;
+} TrigramList;
+
+
+/*
+ * TrigramIndex
+ * table: open addressing hash table of posting lists, table_size entries (a power of two), list_count in use
+ * block_rows: first line of each block, block_count + 1 entries; the last is line_count, the end of the last block.
+ *             blocks_capacity is the size of the array
+ * block_bytes: text (counting newlines) a block is closed at
+ * open_bytes: text in the last block so far
+ * line_count: lines added
+ * bytes, max_bytes: memory the index takes up, and the most it may
+ * */
+typedef struct TrigramIndex {
+    TrigramList* table;
+    int64_t table_size;
+    int64_t list_count;
+    int64_t* block_rows;
+    int64_t block_count;
+    int64_t blocks_capacity;
+    int64_t block_bytes;
+    int64_t open_bytes;
+    int64_t line_count;
+    int64_t bytes;
+    int64_t max_bytes;
+} TrigramIndex;
+
+
+/*
+ * Creates an empty index, with blocks of about block_bytes of text, that may take up to max_bytes of memory.
+ * returns NULL if it couldn't be allocated
+ * */
+TrigramIndex* CreateTrigramIndex(int64_t block_bytes, int64_t max_bytes);
+
+
+/*
+ * Frees the index.
+ * */
+void DestroyTrigramIndex(TrigramIndex* index);
+
+
+/*
+ * Adds count lines after the lines already in the index. Only reads the lines, so they can be a snapshot's.
+ * Returns 0, TRIGRAM_FULL if the index takes up more than max_bytes (it's then incomplete, and only good for
+ * destroying; bigger blocks make a smaller index), or MEM_ERROR.
+ * */
+int TrigramIndexAddLines(TrigramIndex* index, GapBuffer** lines, int64_t count);
+
+
+/*
+ * Finds the blocks that may have a line containing the len bytes of pattern: those with every trigram of the
+ * pattern. The lines of a candidate block still have to be searched.
+ * blocks is set to an allocated array of the candidates, in order, which the caller frees with free(); NULL if
+ * there are none. count is set to their number.
+ * Returns 0, TRIGRAM_ALL_BLOCKS if the pattern is shorter than three bytes (blocks is NULL), or MEM_ERROR.
+ * */
+int TrigramIndexQuery(TrigramIndex* index, const char* pattern, int64_t len, int64_t** blocks, int64_t* count);
+
+
+/*
+ * Returns the memory the index takes up, in bytes.
+ * */
+int64_t TrigramIndexMemoryUsage(TrigramIndex* index);
+
+#endif //TED_TRIGRAM_H
@@ -8,11 +8,23 @@
 #include <string.h>
 #include "../buffer/gap.h"
 #include "../buffer/buffer.h"
+#include "../buffer/alloc.h"
+#include "../buffer/diff.h"
+#include "../buffer/trigram.h"
 
 
 // Test Suites
 void TestGapBuffer();
 void TestTextBuffer();
+void TestTextBufferEdits();
+void TestTextBufferCompaction();
+void TestTextBufferJournal();
+void TestTextBufferSnapshot();
+void TestTextBufferAnchors();
+void TestLineDiff();
+void TestTrigramIndex();
+void TestAllocation();
+void TestLargeBuffers();
 
 FILE* test_fp;
 
@@ -36,6 +48,20 @@ int main(){
 
     TestGapBuffer();
     TestTextBuffer();
+    TestTextBufferEdits();
+    TestTextBufferCompaction();
+    TestTextBufferJournal();
+    TestTextBufferSnapshot();
+    TestTextBufferAnchors();
+    TestLineDiff();
+    TestTrigramIndex();
+    TestAllocation();
+
+    // Needs a few GB of memory and disk, so it's only run when asked for
+    if (getenv("TED_LARGE_TESTS") != NULL){
+        TestLargeBuffers();
+    }
+
     printf("All tests passed!\n");
 }
 
@@ -201,10 +227,68 @@ void TestGapBuffer(){
     string_comp_assert(string_holder, sample1);
 
 
+    printf("Test 8 Insert string, backspace n\n");
+    err = GapBufferMoveGap(buffer3, 1);
+    assert(err == 0);
+
+    err = GapBufferInsertString(buffer3, "0123456789012345678901234567890", 31);
+    assert(err == 0);
+    assert(GapBufferBackSpaceN(buffer3, 30) == 30);
+    assert(GapBufferBackSpaceN(buffer3, 30) == 2);
+
+    string_holder = GapBufferGetString(buffer3);
+    string_comp_assert(string_holder, "bbbaaaaaaaaaaaaaaaaadddp");
+
+    printf("Test 9 Split sizes the new buffer to its text\n");
+    err = GapBufferMoveGap(buffer3, 4);
+    assert(err == 0);
+    GapBuffer* buffer4 = GapBufferSplit(buffer3);
+    assert(buffer4 != NULL);
+    assert(buffer4->str_len + buffer4->gap_len == 20 + SPLIT_GAP_LEN);
+
+    printf("Test 10 Shrink\n");
+    err = GapBufferMoveGap(buffer4, 5);
+    assert(err == 0);
+    assert(GapBufferShrink(buffer4, 2) == SPLIT_GAP_LEN - 2);
+    assert(buffer4->gap_len == 2);
+    assert(GapBufferShrink(buffer4, 2) == 0);
+
+    string_holder = GapBufferGetString(buffer4);
+    string_comp_assert(string_holder, "aaaaaaaaaaaaaaaadddp");
+
+    err = GapBufferInsertString(buffer4, "xyz", 3);
+    assert(err == 0);
+    string_holder = GapBufferGetString(buffer4);
+    string_comp_assert(string_holder, "aaaaaxyzaaaaaaaaaaadddp");
+
+    printf("Test 11 Hash\n");
+    uint64_t hash = GapBufferHash(buffer4);
+    assert(hash != 0);
+    assert(hash == GapBufferHashString("aaaaaxyzaaaaaaaaaaadddp", 23));
+    assert(GapBufferHash(buffer4) == hash);
+
+    // The hash doesn't depend on where the gap is
+    err = GapBufferMoveGap(buffer4, 0);
+    assert(err == 0);
+    assert(GapBufferHash(buffer4) == hash);
+
+    err = GapBufferInsertChar(buffer4, 'q');
+    assert(err == 0);
+    assert(GapBufferHash(buffer4) != hash);
+    assert(GapBufferHash(buffer4) == GapBufferHashString("qaaaaaxyzaaaaaaaaaaadddp", 24));
+
+    GapBufferBackSpace(buffer4);
+    assert(GapBufferHash(buffer4) == hash);
+    assert(GapBufferHashString("", 0) != GapBufferHashString("a", 1));
+
     printf("Cleanup...\n");
     DestroyGapBuffer(buffer);
     DestroyGapBuffer(buffer2);
     DestroyGapBuffer(buffer3);
+    DestroyGapBuffer(buffer4);
+
+    // Destroying nothing does nothing
+    DestroyGapBuffer(NULL);
 
     printf("GapBuffer Tests Passed.");
 }
@@ -284,9 +368,1230 @@ void TestTextBuffer(){
     string_holder = TextBufferGetLine(textBuffer2, 2);
     string_comp_assert(string_holder, sample5);
 
+
+    printf("Test 6 Line offsets, create from index\n");
+    int64_t offsets[4];
+    TextBufferLineOffsets(textBuffer2, offsets);
+    assert(offsets[0] == 0);
+    assert(offsets[1] == 12);
+    assert(offsets[2] == 23);
+    assert(offsets[3] == 33);
+
+    rewind(test_fp);
+    TextBuffer* textBuffer3 = CreateTextBufferFromIndex(test_fp, offsets, 3);
+    assert(textBuffer3 != NULL);
+    assert(textBuffer3->last_line_loc == 2);
+
+    string_holder = TextBufferGetLine(textBuffer3, 0);
+    string_comp_assert(string_holder, sample3);
+
+    string_holder = TextBufferGetLine(textBuffer3, 2);
+    string_comp_assert(string_holder, sample5);
+
+    printf("Test 6.1 An index that doesn't match the file\n");
+    int64_t moved_offsets[4] = {0, 11, 23, 33};
+    rewind(test_fp);
+    assert(CreateTextBufferFromIndex(test_fp, moved_offsets, 3) == NULL);
+
+    // The file goes on past the index's last line
+    rewind(test_fp);
+    assert(CreateTextBufferFromIndex(test_fp, offsets, 2) == NULL);
+
+    printf("Test 6.2 Insert at the start of a loaded line\n");
+    errno = TextBufferInsert(textBuffer3, 'b');
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer3, 0);
+    string_comp_assert(string_holder, "baaaaaaaaaaa");
+
     printf("Cleanup...\n");
     DestroyTextBuffer(texBuffer);
+    DestroyTextBuffer(textBuffer2);
+    DestroyTextBuffer(textBuffer3);
 
 
     printf("TextBuffer Tests Passed.\n");
-}
\ No newline at end of file
+}
+
+
+void TestTextBufferEdits(){
+
+    printf("\n\nTesting TextBuffer batched edits\n");
+
+    TextBuffer* textBuffer = CreateTextBuffer(10, 4);
+    assert(textBuffer != NULL);
+
+    int errno;
+    char* string_holder = NULL;
+
+    for (int row=0; row<3; row++){
+        for (int i=0; i<6; i++){
+            errno = TextBufferInsert(textBuffer, "abcdef"[i]);
+            assert(errno == 0);
+        }
+        if (row < 2){
+            errno = TextBufferNewLine(textBuffer);
+            assert(errno == 0);
+        }
+    }
+
+    printf("Test 1 Insert at several cursors\n");
+    TextBufferEdit edits[] = {
+            {0, 0, 0, "xy", 2},
+            {0, 3, 0, "xy", 2},
+            {0, 6, 0, "xy", 2},
+            {2, 2, 0, "xy", 2},
+    };
+    errno = TextBufferApplyEdits(textBuffer, edits, 4);
+    assert(errno == 0);
+
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "xyabcxydefxy");
+    string_holder = TextBufferGetLine(textBuffer, 1);
+    string_comp_assert(string_holder, "abcdef");
+    string_holder = TextBufferGetLine(textBuffer, 2);
+    string_comp_assert(string_holder, "abxycdef");
+
+    assert(edits[0].row == 0 && edits[0].col == 2);
+    assert(edits[1].row == 0 && edits[1].col == 7);
+    assert(edits[2].row == 0 && edits[2].col == 12);
+    assert(edits[3].row == 2 && edits[3].col == 4);
+
+    printf("Test 2 Delete at several cursors, clamped to the previous cursor\n");
+    TextBufferEdit deletes[] = {
+            {0, 2, 5, NULL, 0},
+            {0, 7, 1, NULL, 0},
+            {1, 6, 1, "z", 1},
+    };
+    errno = TextBufferApplyEdits(textBuffer, deletes, 3);
+    assert(errno == 0);
+
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "abcxdefxy");
+    string_holder = TextBufferGetLine(textBuffer, 1);
+    string_comp_assert(string_holder, "abcdez");
+
+    assert(deletes[0].col == 0);
+    assert(deletes[1].col == 4);
+    assert(deletes[2].col == 6);
+
+    printf("Test 3 Insert at the cursor after a batch\n");
+    TextBufferMoveCursor(textBuffer, 1, 0);
+    errno = TextBufferInsert(textBuffer, 'q');
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 1);
+    string_comp_assert(string_holder, "qabcdez");
+
+    printf("Test 4 Delete range within a line\n");
+    // lines: "abcxdefxy", "qabcdez", "abxycdef"
+    TextBufferMoveCursor(textBuffer, 0, 9);
+    errno = TextBufferDeleteRange(textBuffer, 0, 3, 0, 7);
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "abcxy");
+    assert(textBuffer->cursorRow == 0 && textBuffer->cursorCol == 5);
+
+    printf("Test 5 Delete range across lines\n");
+    TextBufferMoveCursor(textBuffer, 2, 4);
+    errno = TextBufferDeleteRange(textBuffer, 2, 2, 0, 3);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 0);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "abcxycdef");
+    assert(textBuffer->cursorRow == 0 && textBuffer->cursorCol == 5);
+
+    errno = TextBufferInsert(textBuffer, '_');
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "abcxy_cdef");
+
+    printf("Test 6 Backspace at the start of a line joins it\n");
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 1);
+    errno = TextBufferBackspace(textBuffer);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 0);
+    assert(textBuffer->cursorRow == 0 && textBuffer->cursorCol == 6);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "abcxy_cdef");
+
+    printf("Test 7 Join and delete lines\n");
+    for (int i=0; i<5; i++){
+        errno = TextBufferNewLine(textBuffer);
+        assert(errno == 0);
+        errno = TextBufferInsert(textBuffer, '0' + i);
+        assert(errno == 0);
+    }
+    // lines: "abcxy_", "0", "1", "2", "3", "4cdef"
+    errno = TextBufferJoinLines(textBuffer, 1);
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 1);
+    string_comp_assert(string_holder, "01");
+    assert(textBuffer->last_line_loc == 4);
+
+    errno = TextBufferDeleteLines(textBuffer, 2, 2);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 2);
+    string_holder = TextBufferGetLine(textBuffer, 2);
+    string_comp_assert(string_holder, "4cdef");
+    assert(textBuffer->cursorRow == 2 && textBuffer->cursorCol == 1);
+
+    errno = TextBufferDeleteLines(textBuffer, 0, 10);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 0);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "");
+    assert(textBuffer->cursorRow == 0 && textBuffer->cursorCol == 0);
+    DestroyTextBuffer(textBuffer);
+
+    printf("Test 8 Replace lines as one change, and swap them back\n");
+    rewind(test_fp);
+    textBuffer = CreateTextBufferFromFile(test_fp);
+    assert(textBuffer != NULL);
+    TextBufferMoveCursor(textBuffer, 2, 9);
+
+    GapBuffer* middle = textBuffer->lines[1];
+    unsigned long middle_version = middle->version;
+    int64_t rows[] = {0, 2};
+    GapBuffer* lines[] = {CreateGapBufferFromString("x", 4), CreateGapBufferFromString("yy", 4)};
+    GapBuffer* new_lines[] = {lines[0], lines[1]};
+    unsigned long version = textBuffer->version;
+
+    errno = TextBufferReplaceLines(textBuffer, rows, lines, 2);
+    assert(errno == 0);
+    assert(textBuffer->lines[0] == new_lines[0] && textBuffer->lines[2] == new_lines[1]);
+    assert(textBuffer->lines[1] == middle && middle->version == middle_version);
+    assert(textBuffer->version == version + 1 && new_lines[0]->version == textBuffer->version);
+    assert(textBuffer->cursorRow == 2 && textBuffer->cursorCol == 2);
+
+    TextBufferChanges changes;
+    assert(TextBufferChangesSince(textBuffer, version, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == 0 && changes.last_row == 2 && changes.line_delta == 0);
+
+    // The replaced lines were handed back
+    string_holder = GapBufferGetString(lines[0]);
+    string_comp_assert(string_holder, "aaaaaaaaaaa");
+
+    errno = TextBufferReplaceLines(textBuffer, rows, lines, 2);
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 2);
+    string_comp_assert(string_holder, "aaaaaaaaa");
+    assert(lines[0] == new_lines[0] && lines[1] == new_lines[1]);
+
+    int64_t unsorted[] = {2, 0};
+    assert(TextBufferReplaceLines(textBuffer, unsorted, lines, 2) == -1);
+    int64_t out_of_range[] = {0, 3};
+    assert(TextBufferReplaceLines(textBuffer, out_of_range, lines, 2) == -1);
+    assert(textBuffer->version == version + 2);
+
+    DestroyGapBuffer(lines[0]);
+    DestroyGapBuffer(lines[1]);
+
+    printf("Test 9 Splice lines in place of others\n");
+    // lines: "aaaaaaaaaaa", "aaaaaaaaaa", "aaaaaaaaa"
+    TextBufferMoveCursor(textBuffer, 2, 4);
+    version = textBuffer->version;
+    GapBuffer* spliced[] = {CreateGapBufferFromString("p", 4), CreateGapBufferFromString("q", 4),
+                            CreateGapBufferFromString("r", 4)};
+
+    errno = TextBufferSpliceLines(textBuffer, 1, 1, spliced, 3);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 4);
+    string_holder = TextBufferGetLine(textBuffer, 3);
+    string_comp_assert(string_holder, "r");
+    string_holder = TextBufferGetLine(textBuffer, 4);
+    string_comp_assert(string_holder, "aaaaaaaaa");
+    assert(textBuffer->cursorRow == 4 && textBuffer->cursorCol == 4);
+    assert(TextBufferChangesSince(textBuffer, version, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == 1 && changes.last_row == 3 && changes.line_delta == 2);
+
+    // A cursor in the removed lines moves to where they were
+    errno = TextBufferSpliceLines(textBuffer, 3, 2, NULL, 0);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 2);
+    assert(textBuffer->cursorRow == 2 && textBuffer->cursorCol == 0);
+
+    // Removing every line leaves a blank one
+    errno = TextBufferSpliceLines(textBuffer, 0, 3, NULL, 0);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 0);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "");
+
+    printf("Test 10 Insert text with newlines in one go\n");
+    errno = TextBufferInsertText(textBuffer, "headtail\nlast", 13);
+    assert(errno == 0);
+    TextBufferMoveCursor(textBuffer, 0, 4);
+    Anchor* after = TextBufferAddAnchor(textBuffer, 0, 6, 0);
+    version = textBuffer->version;
+
+    errno = TextBufferInsertText(textBuffer, "1\n22\n\n333", 9);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 4);
+    assert(textBuffer->cursorRow == 3 && textBuffer->cursorCol == 3);
+
+    const char* inserted[] = {"head1", "22", "", "333tail", "last"};
+    for (int row = 0; row < 5; row++){
+        string_holder = TextBufferGetLine(textBuffer, row);
+        string_comp_assert(string_holder, inserted[row]);
+    }
+
+    int64_t anchor_row, anchor_col;
+    TextBufferAnchorPosition(textBuffer, after, &anchor_row, &anchor_col);
+    assert(anchor_row == 3 && anchor_col == 5);
+    assert(TextBufferChangesSince(textBuffer, version, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == 0 && changes.last_row == 3 && changes.line_delta == 3);
+
+    // Typing goes on after the inserted text
+    errno = TextBufferInsert(textBuffer, 'x');
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 3);
+    string_comp_assert(string_holder, "333xtail");
+
+    // Without newlines it's a plain insert, and a trailing newline leaves an empty line at the cursor
+    errno = TextBufferInsertText(textBuffer, "yz", 2);
+    assert(errno == 0);
+    errno = TextBufferInsertText(textBuffer, "\n", 1);
+    assert(errno == 0);
+    assert(textBuffer->cursorRow == 4 && textBuffer->cursorCol == 0);
+    string_holder = TextBufferGetLine(textBuffer, 3);
+    string_comp_assert(string_holder, "333xyz");
+    string_holder = TextBufferGetLine(textBuffer, 4);
+    string_comp_assert(string_holder, "tail");
+    string_holder = TextBufferGetLine(textBuffer, 5);
+    string_comp_assert(string_holder, "last");
+
+    printf("Cleanup...\n");
+    DestroyTextBuffer(textBuffer);
+
+    printf("TextBuffer Edit Tests Passed.\n");
+}
+
+
+
+void TestTextBufferCompaction(){
+
+    printf("\n\nTesting TextBuffer compaction\n");
+
+    TextBuffer* textBuffer = CreateTextBuffer(10, 64);
+    assert(textBuffer != NULL);
+
+    int errno;
+    char* string_holder = NULL;
+
+    for (int row=0; row<400; row++){
+        errno = TextBufferInsert(textBuffer, 'a' + row % 26);
+        assert(errno == 0);
+        errno = TextBufferNewLine(textBuffer);
+        assert(errno == 0);
+    }
+
+    printf("Test 1 Compact lines\n");
+    long before = TextBufferMemoryUsage(textBuffer);
+    // Line 0 has the initial 64 byte buffer, later lines were split off with a gap of SPLIT_GAP_LEN
+    long freed = TextBufferCompactLines(textBuffer, 0, 10, 4);
+    assert(freed == (64 - 1 - 4) + 9 * (SPLIT_GAP_LEN - 1 - 4));
+    assert(TextBufferMemoryUsage(textBuffer) == before - freed);
+    assert(TextBufferCompactLines(textBuffer, 0, 10, 4) == 0);
+
+    string_holder = TextBufferGetLine(textBuffer, 5);
+    string_comp_assert(string_holder, "f");
+
+    printf("Test 2 Edit a compacted line\n");
+    TextBufferMoveCursor(textBuffer, 5, 0);
+    for (int i=0; i<10; i++){
+        errno = TextBufferInsert(textBuffer, 'x');
+        assert(errno == 0);
+    }
+    string_holder = TextBufferGetLine(textBuffer, 5);
+    string_comp_assert(string_holder, "xxxxxxxxxxf");
+
+    printf("Test 3 Lines array shrinks after deleting lines\n");
+    assert(textBuffer->lines_capacity == 640);
+    errno = TextBufferDeleteLines(textBuffer, 20, 400);
+    assert(errno == 0);
+    TextBufferCompactLines(textBuffer, 0, textBuffer->last_line_loc + 1, 4);
+    assert(textBuffer->lines_capacity == 160);
+
+    string_holder = TextBufferGetLine(textBuffer, 19);
+    string_comp_assert(string_holder, "t");
+
+    printf("Cleanup...\n");
+    DestroyTextBuffer(textBuffer);
+
+    printf("TextBuffer Compaction Tests Passed.\n");
+}
+
+
+
+void TestTextBufferJournal(){
+
+    printf("\n\nTesting TextBuffer change journal\n");
+
+    TextBuffer* textBuffer = CreateTextBuffer(10, 20);
+    assert(textBuffer != NULL);
+
+    int errno;
+    TextBufferChanges changes;
+
+    for (int row=0; row<10; row++){
+        errno = TextBufferInsert(textBuffer, 'a');
+        assert(errno == 0);
+        errno = TextBufferNewLine(textBuffer);
+        assert(errno == 0);
+    }
+
+    printf("Test 1 Versions\n");
+    assert(textBuffer->version == 20);
+    assert(TextBufferChangesSince(textBuffer, 20, &changes) == CHANGES_NONE);
+    assert(textBuffer->lines[3]->version == 8);
+
+    unsigned long seen = textBuffer->version;
+
+    printf("Test 2 Typing on one line\n");
+    TextBufferMoveCursor(textBuffer, 4, 1);
+    for (int i=0; i<100; i++){
+        errno = TextBufferInsert(textBuffer, 'b');
+        assert(errno == 0);
+    }
+    assert(textBuffer->version == seen + 100);
+    assert(TextBufferChangesSince(textBuffer, seen, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == 4 && changes.last_row == 4 && changes.line_delta == 0);
+    assert(textBuffer->lines[4]->version == textBuffer->version);
+    assert(textBuffer->lines[3]->version == 8);
+
+    printf("Test 3 Split and join\n");
+    TextBufferMoveCursor(textBuffer, 2, 1);
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    assert(TextBufferChangesSince(textBuffer, seen, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == 2 && changes.last_row == 5 && changes.line_delta == 1);
+
+    errno = TextBufferDeleteLines(textBuffer, 8, 2);
+    assert(errno == 0);
+    assert(TextBufferChangesSince(textBuffer, seen, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == 2 && changes.last_row == 8 && changes.line_delta == -1);
+
+    seen = textBuffer->version;
+    errno = TextBufferJoinLines(textBuffer, 0);
+    assert(errno == 0);
+    assert(TextBufferChangesSince(textBuffer, seen, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == 0 && changes.last_row == 0 && changes.line_delta == -1);
+
+    printf("Test 4 No-op edits don't change the version\n");
+    seen = textBuffer->version;
+    TextBufferMoveCursor(textBuffer, 0, 0);
+    errno = TextBufferBackspace(textBuffer);
+    assert(errno == 0);
+    errno = TextBufferDeleteRange(textBuffer, 3, 0, 3, 0);
+    assert(errno == 0);
+    assert(textBuffer->version == seen);
+
+    printf("Test 5 The journal runs out\n");
+    for (int i=0; i<JOURNAL_LEN; i++){
+        TextBufferMoveCursor(textBuffer, i % 2, 0);
+        errno = TextBufferInsert(textBuffer, 'c');
+        assert(errno == 0);
+    }
+    assert(TextBufferChangesSince(textBuffer, seen, &changes) == CHANGES_ALL);
+    assert(TextBufferChangesSince(textBuffer, textBuffer->version - 1, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == 1 && changes.last_row == 1);
+
+    printf("Test 6 Appending loaded lines\n");
+    GapBuffer* loaded[300];
+    for (int i=0; i<300; i++){
+        loaded[i] = CreateGapBufferFromString("loaded", 10);
+        assert(loaded[i] != NULL);
+    }
+    loaded[299]->buffer[0] = 'L';
+
+    int lines_before = textBuffer->last_line_loc + 1;
+    int cursor_row = textBuffer->cursorRow;
+    seen = textBuffer->version;
+
+    errno = TextBufferAppendLines(textBuffer, loaded, 300);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == lines_before + 299);
+    assert(textBuffer->lines_capacity > textBuffer->last_line_loc);
+    assert(textBuffer->cursorRow == cursor_row);
+    assert(textBuffer->lines[lines_before]->version == textBuffer->version);
+    assert(TextBufferChangesSince(textBuffer, seen, &changes) == CHANGES_RANGE);
+    assert(changes.first_row == lines_before && changes.last_row == textBuffer->last_line_loc);
+    assert(changes.line_delta == 300);
+
+    char* line = TextBufferGetLine(textBuffer, textBuffer->last_line_loc);
+    string_comp_assert(line, "Loaded");
+
+    printf("Cleanup...\n");
+    DestroyTextBuffer(textBuffer);
+
+    printf("TextBuffer Journal Tests Passed.\n");
+}
+
+
+void TestTextBufferSnapshot(){
+
+    printf("\n\nTesting TextBuffer snapshots\n");
+
+    BufferAllocStats stats;
+    BufferGetAllocStats(&stats);
+    int64_t bytes = stats.bytes;
+
+    rewind(test_fp);
+    TextBuffer* textBuffer = CreateTextBufferFromFile(test_fp);
+    assert(textBuffer != NULL);
+
+    int errno;
+    char contents[64];
+
+    printf("Test 1 Lines are shared\n");
+    TextBufferSnapshot* snapshot = CreateTextBufferSnapshot(textBuffer);
+    assert(snapshot != NULL);
+    assert(snapshot->line_count == 3 && snapshot->size == 33);
+    assert(snapshot->version == textBuffer->version);
+    for (int i=0; i<3; i++){
+        assert(snapshot->lines[i] == textBuffer->lines[i]);
+        assert(GapBufferShared(textBuffer->lines[i]));
+    }
+
+    printf("Test 2 Edited lines are copied\n");
+    GapBuffer* shared = textBuffer->lines[0];
+    TextBufferMoveCursor(textBuffer, 0, 3);
+    errno = TextBufferInsert(textBuffer, 'X');
+    assert(errno == 0);
+    assert(textBuffer->lines[0] != shared && snapshot->lines[0] == shared);
+    assert(!GapBufferShared(textBuffer->lines[0]) && !GapBufferShared(shared));
+    string_comp_assert(GapBufferGetString(shared), "aaaaaaaaaaa");
+    string_comp_assert(TextBufferGetLine(textBuffer, 0), "aaaXaaaaaaaa");
+    assert(textBuffer->lines[1] == snapshot->lines[1]);
+
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    errno = TextBufferDeleteLines(textBuffer, 3, 1);
+    assert(errno == 0);
+    TextBufferEdit edit = {2, 0, 0, "yy", 2};
+    errno = TextBufferApplyEdits(textBuffer, &edit, 1);
+    assert(errno == 0);
+    assert(TextBufferCompactLines(textBuffer, 0, textBuffer->last_line_loc + 1, 0) > 0);
+
+    printf("Test 3 The snapshot keeps its version\n");
+    FILE* fp = tmpfile();
+    assert(fp != NULL);
+    errno = TextBufferSnapshotWrite(snapshot, 0, snapshot->line_count, fp);
+    assert(errno == 0);
+    assert(TextBufferSnapshotWrite(snapshot, 2, 2, fp) == -1);
+    rewind(fp);
+    assert(fread(contents, 1, sizeof(contents), fp) == 33);
+    assert(memcmp(contents, "aaaaaaaaaaa\naaaaaaaaaa\naaaaaaaaa\n", 33) == 0);
+    fclose(fp);
+
+    string_comp_assert(TextBufferGetLine(textBuffer, 1), "aaaaaaaa");
+    string_comp_assert(TextBufferGetLine(textBuffer, 2), "yyaaaaaaaaaa");
+    assert(textBuffer->last_line_loc == 2);
+
+    printf("Test 4 Releasing the snapshot\n");
+    DestroyTextBufferSnapshot(snapshot);
+    for (int i=0; i<=textBuffer->last_line_loc; i++){
+        assert(!GapBufferShared(textBuffer->lines[i]));
+    }
+
+    printf("Cleanup...\n");
+    DestroyTextBuffer(textBuffer);
+    BufferGetAllocStats(&stats);
+    assert(stats.bytes == bytes);
+
+    printf("TextBuffer Snapshot Tests Passed.\n");
+}
+
+
+void anchor_assert(TextBuffer* textBuffer, Anchor* anchor, int64_t row, int64_t col){
+    int64_t anchor_row, anchor_col;
+    TextBufferAnchorPosition(textBuffer, anchor, &anchor_row, &anchor_col);
+    assert(anchor_row == row && anchor_col == col);
+}
+
+
+void TestTextBufferAnchors(){
+
+    printf("\n\nTesting TextBuffer anchors\n");
+
+    TextBuffer* textBuffer = CreateTextBuffer(10, 20);
+    assert(textBuffer != NULL);
+
+    int errno;
+    char* string_holder = NULL;
+    const char* text = "hello world";
+
+    for (int i = 0; text[i] != '\0'; i++){
+        errno = TextBufferInsert(textBuffer, text[i]);
+        assert(errno == 0);
+    }
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    for (int i = 0; i < 6; i++){
+        errno = TextBufferInsert(textBuffer, "second"[i]);
+        assert(errno == 0);
+    }
+
+    printf("Test 1 Add, clamped to the buffer\n");
+    Anchor* w = TextBufferAddAnchor(textBuffer, 0, 6, 1);
+    Anchor* start = TextBufferAddAnchor(textBuffer, 0, 0, 2);
+    Anchor* second = TextBufferAddAnchor(textBuffer, 1, 3, 1);
+    Anchor* end = TextBufferAddAnchor(textBuffer, 0, 50, 1);
+    assert(w != NULL && start != NULL && second != NULL && end != NULL);
+    anchor_assert(textBuffer, end, 0, 11);
+    assert(TextBufferCountAnchors(textBuffer, 0, 0) == 3);
+    assert(TextBufferCountAnchors(textBuffer, 0, 1) == 4);
+
+    printf("Test 2 Inserts before an anchor push it right, inserts at it go after it\n");
+    TextBufferMoveCursor(textBuffer, 0, 0);
+    errno = TextBufferInsert(textBuffer, 'X');
+    assert(errno == 0);
+    anchor_assert(textBuffer, start, 0, 0);
+    anchor_assert(textBuffer, w, 0, 7);
+    anchor_assert(textBuffer, end, 0, 12);
+    anchor_assert(textBuffer, second, 1, 3);
+
+    printf("Test 3 Splitting a line takes anchors after the split down\n");
+    TextBufferMoveCursor(textBuffer, 0, 3);
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    anchor_assert(textBuffer, start, 0, 0);
+    anchor_assert(textBuffer, w, 1, 4);
+    anchor_assert(textBuffer, end, 1, 9);
+    anchor_assert(textBuffer, second, 2, 3);
+
+    printf("Test 4 Joining brings them back\n");
+    errno = TextBufferBackspace(textBuffer);
+    assert(errno == 0);
+    anchor_assert(textBuffer, w, 0, 7);
+    anchor_assert(textBuffer, end, 0, 12);
+    anchor_assert(textBuffer, second, 1, 3);
+
+    printf("Test 5 Deleted text leaves its anchors at the start of the deletion\n");
+    // "Xhello world": delete "o w"
+    errno = TextBufferDeleteRange(textBuffer, 0, 5, 0, 8);
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "Xhellorld");
+    anchor_assert(textBuffer, w, 0, 5);
+    anchor_assert(textBuffer, end, 0, 9);
+
+    // Across lines: "Xhe" + "cond"
+    errno = TextBufferDeleteRange(textBuffer, 0, 3, 1, 2);
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "Xhecond");
+    anchor_assert(textBuffer, w, 0, 3);
+    anchor_assert(textBuffer, end, 0, 3);
+    anchor_assert(textBuffer, second, 0, 4);
+    assert(textBuffer->last_line_loc == 0);
+
+    printf("Test 6 Batched edits\n");
+    TextBufferEdit edits[] = {{0, 1, 1, "ab", 2}, {0, 4, 0, "-", 1}};
+    errno = TextBufferApplyEdits(textBuffer, edits, 2);
+    assert(errno == 0);
+    string_holder = TextBufferGetLine(textBuffer, 0);
+    string_comp_assert(string_holder, "abhec-ond");
+    anchor_assert(textBuffer, start, 0, 0);
+    anchor_assert(textBuffer, w, 0, 4);
+    anchor_assert(textBuffer, second, 0, 5);
+
+    printf("Test 7 Find in order, remove\n");
+    AnchorInfo found[8];
+    assert(TextBufferFindAnchors(textBuffer, 0, 0, -1, found, 8) == 4);
+    assert(found[0].anchor == start && found[1].anchor == w && found[2].anchor == end);
+    assert(found[3].anchor == second && found[3].col == 5);
+    assert(TextBufferFindAnchors(textBuffer, 0, 0, 2, found, 8) == 1 && found[0].anchor == start);
+    assert(TextBufferFindAnchors(textBuffer, 0, 0, 1, found, 2) == 2 && found[1].anchor == end);
+
+    TextBufferRemoveAnchor(textBuffer, w);
+    TextBufferRemoveAnchor(textBuffer, end);
+    assert(TextBufferCountAnchors(textBuffer, 0, ANCHOR_END_ROW) == 2);
+
+    printf("Test 8 Whole lines\n");
+    TextBufferMoveCursor(textBuffer, 0, 9);
+    for (int i = 0; i < 4; i++){
+        errno = TextBufferNewLine(textBuffer);
+        assert(errno == 0);
+        errno = TextBufferInsert(textBuffer, 'a' + i);
+        assert(errno == 0);
+    }
+    // lines: "abhec-ond", "a", "b", "c", "d"
+    Anchor* b = TextBufferAddAnchor(textBuffer, 2, 1, 1);
+    Anchor* d = TextBufferAddAnchor(textBuffer, 4, 1, 1);
+
+    errno = TextBufferDeleteLines(textBuffer, 1, 2);
+    assert(errno == 0);
+    anchor_assert(textBuffer, b, 1, 0);
+    anchor_assert(textBuffer, d, 2, 1);
+
+    GapBuffer* spliced[] = {CreateGapBufferFromString("p", 4), CreateGapBufferFromString("q", 4)};
+    errno = TextBufferSpliceLines(textBuffer, 0, 1, spliced, 2);
+    assert(errno == 0);
+    anchor_assert(textBuffer, start, 0, 0);
+    anchor_assert(textBuffer, second, 0, 0);
+    anchor_assert(textBuffer, b, 2, 0);
+    anchor_assert(textBuffer, d, 3, 1);
+
+    // Deleting the last lines leaves their anchors at the end of the line above
+    errno = TextBufferDeleteLines(textBuffer, 3, 1);
+    assert(errno == 0);
+    anchor_assert(textBuffer, d, 2, 1);
+
+    errno = TextBufferDeleteLines(textBuffer, 0, 3);
+    assert(errno == 0);
+    anchor_assert(textBuffer, d, 0, 0);
+    assert(TextBufferCountAnchors(textBuffer, 0, 0) == 4);
+
+    printf("Test 9 Many anchors move with one edit\n");
+    for (int i = 0; i < 1000; i++){
+        errno = TextBufferNewLine(textBuffer);
+        assert(errno == 0);
+        errno = TextBufferInsert(textBuffer, 'x');
+        assert(errno == 0);
+    }
+    for (int row = 1; row <= 1000; row++){
+        for (int col = 0; col < 2; col++){
+            assert(TextBufferAddAnchor(textBuffer, row, col, 3) != NULL);
+        }
+    }
+    assert(TextBufferMemoryUsage(textBuffer) > (int64_t) sizeof(Anchor) * 2000);
+
+    TextBufferMoveCursor(textBuffer, 0, 0);
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    assert(TextBufferCountAnchors(textBuffer, 1, 1) == 0);
+    assert(TextBufferCountAnchors(textBuffer, 2, 1001) == 2000);
+    assert(TextBufferFindAnchors(textBuffer, 500, 500, 3, found, 8) == 2);
+    assert(found[0].row == 500 && found[0].col == 0 && found[1].col == 1);
+
+    printf("Cleanup...\n");
+    DestroyTextBuffer(textBuffer);
+
+    printf("TextBuffer Anchor Tests Passed.\n");
+}
+
+
+/*
+ * helper that checks a hunk
+ * */
+void hunk_assert(DiffHunk* hunk, int64_t old_row, int64_t old_count, int64_t new_row, int64_t new_count){
+    assert(hunk->old_row == old_row);
+    assert(hunk->old_count == old_count);
+    assert(hunk->new_row == new_row);
+    assert(hunk->new_count == new_count);
+}
+
+
+void TestLineDiff(){
+
+    printf("\n\nTesting line diffs\n");
+
+    DiffHunk* hunks;
+    int64_t count;
+    int err;
+
+    // Lines are stood in for by small numbers, which works as well as real hashes
+    uint64_t old[] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+    printf("Test 1 Same lines\n");
+    err = DiffLines(old, 8, old, 8, 100, &hunks, &count);
+    assert(err == 0);
+    assert(count == 0 && hunks == NULL);
+
+    printf("Test 2 Insert\n");
+    uint64_t inserted[] = {1, 2, 3, 9, 9, 4, 5, 6, 7, 8};
+    err = DiffLines(old, 8, inserted, 10, 100, &hunks, &count);
+    assert(err == 0);
+    assert(count == 1);
+    hunk_assert(&hunks[0], 3, 0, 3, 2);
+    free(hunks);
+
+    printf("Test 3 Delete\n");
+    err = DiffLines(old, 8, old + 2, 6, 100, &hunks, &count);
+    assert(err == 0);
+    assert(count == 1);
+    hunk_assert(&hunks[0], 0, 2, 0, 0);
+    free(hunks);
+
+    printf("Test 4 Changes in several places\n");
+    uint64_t changed[] = {1, 9, 3, 4, 6, 7, 10, 11, 8};
+    err = DiffLines(old, 8, changed, 9, 100, &hunks, &count);
+    assert(err == 0);
+    assert(count == 3);
+    hunk_assert(&hunks[0], 1, 1, 1, 1);
+    hunk_assert(&hunks[1], 4, 1, 4, 0);
+    hunk_assert(&hunks[2], 7, 0, 6, 2);
+    free(hunks);
+
+    printf("Test 5 Empty lists\n");
+    err = DiffLines(old, 0, old, 3, 100, &hunks, &count);
+    assert(err == 0);
+    assert(count == 1);
+    hunk_assert(&hunks[0], 0, 0, 0, 3);
+    free(hunks);
+
+    printf("Test 6 Too many changes\n");
+    uint64_t other[] = {1, 11, 12, 13, 14, 15, 16, 8};
+    err = DiffLines(old, 8, other, 8, 4, &hunks, &count);
+    assert(err == 0);
+    assert(count == 1);
+    hunk_assert(&hunks[0], 1, 6, 1, 6);
+    free(hunks);
+
+    err = DiffLines(old, 8, other, 8, 12, &hunks, &count);
+    assert(err == 0);
+    assert(count == 1);
+    hunk_assert(&hunks[0], 1, 6, 1, 6);
+    free(hunks);
+
+    printf("Line Diff Tests Passed.\n");
+}
+
+
+/*
+ * Checks a query's candidate blocks against the expected ones, and frees them
+ * */
+void blocks_assert(int64_t* blocks, int64_t count, const int64_t* expected, int64_t expected_count){
+    assert(count == expected_count);
+    for (int64_t i=0; i<count; i++){
+        assert(blocks[i] == expected[i]);
+    }
+    free(blocks);
+}
+
+void TestTrigramIndex(){
+
+    printf("\n\nTesting trigram indexes\n");
+
+    const char* text[] = {"hello world", "foo bar", "lorem ipsum", "hello there", "abc", "xyz"};
+    GapBuffer* lines[6];
+    BufferAllocStats stats;
+    int64_t* blocks;
+    int64_t count;
+    int err;
+
+    for (int i=0; i<6; i++){
+        lines[i] = CreateGapBuffer(4);
+        assert(lines[i] != NULL);
+        err = GapBufferInsertString(lines[i], text[i], (int64_t)strlen(text[i]));
+        assert(err == 0);
+    }
+
+    // Trigrams are read across the gap
+    err = GapBufferMoveGap(lines[0], 4);
+    assert(err == 0);
+
+    printf("Test 1 Building\n");
+    BufferGetAllocStats(&stats);
+    int64_t bytes = stats.bytes;
+
+    // A block is closed once it has 12 bytes, counting newlines
+    TrigramIndex* index = CreateTrigramIndex(12, 1 << 20);
+    assert(index != NULL);
+    err = TrigramIndexAddLines(index, lines, 3);
+    assert(err == 0);
+    err = TrigramIndexAddLines(index, lines + 3, 3);
+    assert(err == 0);
+
+    int64_t rows[] = {0, 1, 3, 4, 6};
+    assert(index->block_count == 4 && index->line_count == 6);
+    for (int i=0; i<5; i++){
+        assert(index->block_rows[i] == rows[i]);
+    }
+
+    BufferGetAllocStats(&stats);
+    assert(stats.bytes - bytes == TrigramIndexMemoryUsage(index));
+
+    printf("Test 2 Queries\n");
+    err = TrigramIndexQuery(index, "hello", 5, &blocks, &count);
+    assert(err == 0);
+    blocks_assert(blocks, count, (int64_t[]){0, 2}, 2);
+
+    err = TrigramIndexQuery(index, "lo wo", 5, &blocks, &count);
+    assert(err == 0);
+    blocks_assert(blocks, count, (int64_t[]){0}, 1);
+
+    err = TrigramIndexQuery(index, "ipsum", 5, &blocks, &count);
+    assert(err == 0);
+    blocks_assert(blocks, count, (int64_t[]){1}, 1);
+
+    // Every trigram of "hello bar" is in block 0 or 1, but not all in one
+    err = TrigramIndexQuery(index, "hello bar", 9, &blocks, &count);
+    assert(err == 0);
+    assert(count == 0 && blocks == NULL);
+
+    // Nor are trigrams taken across lines
+    err = TrigramIndexQuery(index, "abcxyz", 6, &blocks, &count);
+    assert(err == 0);
+    assert(count == 0 && blocks == NULL);
+
+    err = TrigramIndexQuery(index, "he", 2, &blocks, &count);
+    assert(err == TRIGRAM_ALL_BLOCKS);
+    assert(count == 0 && blocks == NULL);
+
+    DestroyTrigramIndex(index);
+    BufferGetAllocStats(&stats);
+    assert(stats.bytes == bytes);
+
+    printf("Test 3 Memory limit\n");
+    index = CreateTrigramIndex(12, 1);
+    assert(index != NULL);
+    err = TrigramIndexAddLines(index, lines, 6);
+    assert(err == TRIGRAM_FULL);
+    assert(index->line_count == 1);
+    DestroyTrigramIndex(index);
+
+    for (int i=0; i<6; i++){
+        DestroyGapBuffer(lines[i]);
+    }
+
+    printf("Test 4 Long posting lists\n");
+    GapBuffer* numbered[1000];
+    char line[16];
+
+    for (int i=0; i<1000; i++){
+        int len = snprintf(line, sizeof(line), "line %d", i);
+        numbered[i] = CreateGapBuffer(len);
+        assert(numbered[i] != NULL);
+        err = GapBufferInsertString(numbered[i], line, len);
+        assert(err == 0);
+    }
+
+    // A block a line, so gaps between blocks need more than a byte
+    index = CreateTrigramIndex(1, 1 << 20);
+    assert(index != NULL);
+    err = TrigramIndexAddLines(index, numbered, 1000);
+    assert(err == 0);
+    assert(index->block_count == 1000);
+
+    err = TrigramIndexQuery(index, "line", 4, &blocks, &count);
+    assert(err == 0);
+    assert(count == 1000 && blocks[0] == 0 && blocks[999] == 999);
+    free(blocks);
+
+    // 9, 90 to 99 and 900 to 999
+    err = TrigramIndexQuery(index, "e 9", 3, &blocks, &count);
+    assert(err == 0);
+    assert(count == 111);
+    assert(blocks[0] == 9 && blocks[1] == 90 && blocks[11] == 900 && blocks[110] == 999);
+    free(blocks);
+
+    err = TrigramIndexQuery(index, "line 5", 6, &blocks, &count);
+    assert(err == 0);
+    assert(count == 111 && blocks[0] == 5 && blocks[110] == 599);
+    free(blocks);
+
+    DestroyTrigramIndex(index);
+    for (int i=0; i<1000; i++){
+        DestroyGapBuffer(numbered[i]);
+    }
+
+    printf("Trigram Index Tests Passed.\n");
+}
+
+
+/*
+ * Allocation hooks for the tests: count the calls they see, and fail every allocation once fail is set.
+ * */
+typedef struct TestAllocator {
+    int allocs;
+    int reallocs;
+    int frees;
+    long bytes;
+    int fail;
+} TestAllocator;
+
+void* testAlloc(size_t size, void* ctx){
+    TestAllocator* counts = ctx;
+    if (counts->fail){
+        return NULL;
+    }
+    counts->allocs++;
+    counts->bytes += size;
+    return malloc(size);
+}
+
+void* testRealloc(void* ptr, size_t old_size, size_t new_size, void* ctx){
+    TestAllocator* counts = ctx;
+    if (counts->fail){
+        return NULL;
+    }
+    counts->reallocs++;
+    counts->bytes += (long)new_size - (long)old_size;
+    return realloc(ptr, new_size);
+}
+
+void testFree(void* ptr, size_t size, void* ctx){
+    TestAllocator* counts = ctx;
+    counts->frees++;
+    counts->bytes -= size;
+    free(ptr);
+}
+
+
+void TestAllocation(){
+
+    printf("\n\nTesting allocation accounting\n");
+
+    TestAllocator counts = {0};
+    BufferAllocator allocator = {testAlloc, testRealloc, testFree, &counts};
+    BufferAllocStats stats;
+    int errno;
+
+    BufferSetAllocator(&allocator);
+    BufferResetAllocStats();
+
+    printf("Test 1 Creating and destroying a GapBuffer\n");
+    GapBuffer* buffer = CreateGapBuffer(4);
+    assert(buffer != NULL);
+    BufferGetAllocStats(&stats);
+    assert(stats.allocs == 2 && stats.reallocs == 0 && stats.frees == 0);
+    assert(counts.allocs == 2);
+    assert(counts.bytes == (long)sizeof(GapBuffer) + 4);
+
+    printf("Test 2 Inserting only allocates when the gap is full\n");
+    for (int i=0; i<3; i++){
+        errno = GapBufferInsertChar(buffer, 'a');
+        assert(errno == 0);
+    }
+    BufferGetAllocStats(&stats);
+    assert(stats.allocs == 2 && stats.reallocs == 0);
+
+    errno = GapBufferInsertString(buffer, "bbbb", 4);
+    assert(errno == 0);
+    BufferGetAllocStats(&stats);
+    assert(stats.reallocs == 1);
+    assert(counts.bytes == (long)sizeof(GapBuffer) + buffer->str_len + buffer->gap_len);
+
+    DestroyGapBuffer(buffer);
+    BufferGetAllocStats(&stats);
+    assert(stats.frees == 2);
+    assert(stats.bytes == 0 && counts.bytes == 0);
+    assert(stats.peak_bytes >= (long)sizeof(GapBuffer) + 7);
+
+    printf("Test 3 TextBuffer operations\n");
+    BufferResetAllocStats();
+    counts.allocs = counts.reallocs = counts.frees = 0;
+    TextBuffer* textBuffer = CreateTextBuffer(2, 8);
+    assert(textBuffer != NULL);
+    BufferGetAllocStats(&stats);
+    assert(stats.allocs == 4);
+
+    // A new line is a new GapBuffer, and the lines array is full
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    BufferGetAllocStats(&stats);
+    assert(stats.allocs == 6 && stats.reallocs == 0);
+
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    BufferGetAllocStats(&stats);
+    assert(stats.allocs == 8 && stats.reallocs == 1);
+
+    // Typing into the gap doesn't allocate
+    errno = TextBufferInsert(textBuffer, 'x');
+    assert(errno == 0);
+    BufferGetAllocStats(&stats);
+    assert(stats.allocs == 8 && stats.reallocs == 1);
+
+    errno = TextBufferDeleteLines(textBuffer, 0, 2);
+    assert(errno == 0);
+    BufferGetAllocStats(&stats);
+    assert(stats.frees == 4);
+    assert(stats.bytes == TextBufferMemoryUsage(textBuffer));
+    assert(counts.bytes == stats.bytes);
+
+    printf("Test 4 Stats\n");
+    TextBufferStats text_stats;
+    for (int i=0; i<40; i++){
+        errno = TextBufferInsert(textBuffer, 'y');
+        assert(errno == 0);
+    }
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+
+    TextBufferGetStats(textBuffer, &text_stats);
+    assert(text_stats.lines == 2 && text_stats.lines_capacity == 4);
+    assert(text_stats.text_bytes == 41);
+    assert(text_stats.array_slack_bytes == 2 * (long)sizeof(GapBuffer*));
+    assert(text_stats.text_bytes + text_stats.gap_bytes + text_stats.array_bytes + text_stats.array_slack_bytes +
+           text_stats.struct_bytes == TextBufferMemoryUsage(textBuffer));
+    assert(text_stats.overhead_bytes > 0);
+
+    int histogram_lines = 0;
+    for (int i=0; i<STATS_CAPACITY_BUCKETS; i++){
+        histogram_lines += text_stats.capacity_histogram[i];
+    }
+    assert(histogram_lines == 2);
+    assert(text_stats.capacity_histogram[4] == 1);    // the split off line, SPLIT_GAP_LEN bytes
+
+    printf("Test 5 Failed allocations\n");
+    BufferGetAllocStats(&stats);
+    long bytes = stats.bytes;
+
+    counts.fail = 1;
+    assert(CreateGapBuffer(10) == NULL);
+    assert(CreateTextBuffer(10, 10) == NULL);
+
+    TextBufferMoveCursor(textBuffer, 1, 0);
+    while (textBuffer->lines[1]->gap_len > 1){
+        errno = TextBufferInsert(textBuffer, 'z');
+        assert(errno == 0);
+    }
+    errno = TextBufferInsert(textBuffer, 'z');
+    assert(errno == MEM_ERROR);
+
+    // Inserting lines leaves the buffer as it was when one can't be allocated
+    int64_t last_line = textBuffer->last_line_loc;
+    int64_t line_len = textBuffer->lines[1]->str_len;
+    TextBufferMoveCursor(textBuffer, 1, 1);
+    errno = TextBufferInsertText(textBuffer, "\nz", 2);
+    assert(errno == MEM_ERROR);
+    assert(textBuffer->last_line_loc == last_line && textBuffer->lines[1]->str_len == line_len);
+    assert(textBuffer->cursorRow == 1 && textBuffer->cursorCol == 1);
+
+    BufferGetAllocStats(&stats);
+    assert(stats.failures == 4);
+    assert(stats.bytes == bytes);
+    counts.fail = 0;
+
+    // Splicing in more lines than the lines array has room for leaves the buffer, and the lines, as they were
+    GapBuffer* spliced[3] = {CreateGapBuffer(4), CreateGapBuffer(4), CreateGapBuffer(4)};
+    assert(spliced[0] != NULL && spliced[1] != NULL && spliced[2] != NULL);
+    counts.fail = 1;
+    errno = TextBufferSpliceLines(textBuffer, 0, 0, spliced, 3);
+    assert(errno == MEM_ERROR);
+    assert(textBuffer->last_line_loc == last_line);
+    counts.fail = 0;
+    for (int i=0; i<3; i++){
+        DestroyGapBuffer(spliced[i]);
+    }
+
+    // Deleting across lines leaves both lines whole when the rest of the last one can't be brought over
+    TextBufferMoveCursor(textBuffer, 0, textBuffer->lines[0]->str_len);
+    while (textBuffer->lines[0]->gap_len > 1){
+        errno = TextBufferInsert(textBuffer, 'y');
+        assert(errno == 0);
+    }
+    line_len = textBuffer->lines[0]->str_len;
+    int64_t tail_len = textBuffer->lines[1]->str_len;
+    unsigned long version = textBuffer->version;
+    counts.fail = 1;
+    errno = TextBufferDeleteRange(textBuffer, 0, line_len - 1, 1, 0);
+    assert(errno == MEM_ERROR);
+    assert(textBuffer->last_line_loc == last_line && textBuffer->version == version);
+    assert(textBuffer->lines[0]->str_len == line_len && textBuffer->lines[1]->str_len == tail_len);
+    counts.fail = 0;
+
+    printf("Cleanup...\n");
+    DestroyTextBuffer(textBuffer);
+    BufferGetAllocStats(&stats);
+    assert(stats.bytes == 0 && counts.bytes == 0);
+    assert(stats.allocs == (unsigned long)counts.allocs && stats.frees == (unsigned long)counts.frees);
+
+    BufferSetAllocator(NULL);
+
+    printf("Allocation Tests Passed.\n");
+}
+
+
+/*
+ * Lines and offsets past 2^31 bytes. The line is built to its full size up front so growing it doesn't need
+ * twice the memory.
+ * */
+void TestLargeBuffers(){
+
+    printf("\n\nTesting large buffers\n");
+
+    const int64_t chunk_len = 26 * 2 * 1024 * 1024;    // a whole number of alphabets, so byte i is a + i % 26
+    const int64_t line_len = (INT64_C(1) << 31) + (INT64_C(1) << 20);
+    const int64_t far = (INT64_C(1) << 31) + 100;
+    int errno;
+    char sample[8];
+
+    char* chunk = malloc(chunk_len);
+    assert(chunk != NULL);
+    for (int64_t i=0; i<chunk_len; i++){
+        chunk[i] = (char)('a' + i % 26);
+    }
+
+    printf("Test 1 Line past 2^31 bytes\n");
+    GapBuffer* line = CreateGapBuffer(line_len + chunk_len);
+    assert(line != NULL);
+
+    for (int64_t len=0; len<line_len; len+=chunk_len){
+        int64_t n = line_len - len < chunk_len ? line_len - len : chunk_len;
+        errno = GapBufferInsertString(line, chunk, n);
+        assert(errno == 0);
+    }
+    free(chunk);
+    assert(line->str_len == line_len);
+
+    GapBufferShrink(line, 16);
+    assert(line->gap_len == 16);
+
+    errno = GapBufferMoveGap(line, far);
+    assert(errno == 0 && line->gap_loc == far);
+    errno = GapBufferInsertString(line, "XYZ", 3);
+    assert(errno == 0);
+    assert(line->str_len == line_len + 3);
+
+    assert(GapBufferCopyRange(line, far - 1, 5, sample) == 5);
+    assert(sample[0] == (char)('a' + (far - 1) % 26));
+    assert(memcmp(sample + 1, "XYZ", 3) == 0);
+    assert(sample[4] == (char)('a' + far % 26));
+    assert(GapBufferCharAt(line, line->str_len - 1) == (char)('a' + (line_len - 1) % 26));
+
+    printf("Test 2 TextBuffer offsets and writing\n");
+    TextBuffer* textBuffer = CreateTextBuffer(DEFAULT_CAPACITY, DEFAULT_GAP_BUF_CAP);
+    assert(textBuffer != NULL);
+    errno = TextBufferAppendLines(textBuffer, &line, 1);
+    assert(errno == 0);
+    errno = TextBufferDeleteLines(textBuffer, 0, 1);
+    assert(errno == 0);
+    assert(textBuffer->last_line_loc == 0);
+
+    TextBufferMoveCursor(textBuffer, 0, far + 3);
+    assert(textBuffer->cursorCol == far + 3);
+    errno = TextBufferInsert(textBuffer, '!');
+    assert(errno == 0);
+    errno = TextBufferNewLine(textBuffer);
+    assert(errno == 0);
+    assert(textBuffer->cursorRow == 1 && textBuffer->cursorCol == 0);
+    assert(textBuffer->lines[0]->str_len == far + 4);
+    assert(textBuffer->lines[1]->str_len == line_len - far);
+
+    int64_t offsets[3];
+    TextBufferLineOffsets(textBuffer, offsets);
+    assert(offsets[1] == far + 5);
+    assert(offsets[2] == line_len + 6);
+
+    FILE* fp = tmpfile();
+    assert(fp != NULL);
+    errno = TextBufferWrite(textBuffer, fp);
+    assert(errno == 0);
+    assert(fflush(fp) == 0);
+    assert(ftello(fp) == offsets[2]);
+    DestroyTextBuffer(textBuffer);
+
+    printf("Test 3 Loading from an index\n");
+    rewind(fp);
+    textBuffer = CreateTextBufferFromIndex(fp, offsets, 2);
+    assert(textBuffer != NULL);
+    assert(textBuffer->last_line_loc == 1);
+    assert(textBuffer->lines[0]->str_len == far + 4);
+    assert(textBuffer->lines[1]->str_len == line_len - far);
+
+    assert(GapBufferCopyRange(textBuffer->lines[0], far - 1, 5, sample) == 5);
+    assert(memcmp(sample + 1, "XYZ!", 4) == 0);
+    assert(GapBufferCharAt(textBuffer->lines[1], 0) == (char)('a' + far % 26));
+    assert(GapBufferCharAt(textBuffer->lines[1], line_len - far - 1) == (char)('a' + (line_len - 1) % 26));
+
+    printf("Cleanup...\n");
+    DestroyTextBuffer(textBuffer);
+    fclose(fp);
+
+    printf("Large Buffer Tests Passed.\n");
+}